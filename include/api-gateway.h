@@ -0,0 +1,586 @@
+#ifndef _API_GATEWAY_H_
+#define _API_GATEWAY_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <json-c/json.h>
+#include <db.h>
+#include <libsoup/soup.h>
+#include <glib.h>
+#include <pthread.h>
+
+#include "events-agency.h"
+#include "topic-view.h"
+#include "topic-log.h"
+#include "path-router.h"
+#include "rate-limiter.h"
+#include "load-shedder.h"
+#include "file-cache.h"
+#include "jwt-auth.h"
+#include "jwt-keyring.h"
+#include "jwt-revocation.h"
+#include "event-store.h"
+
+/**
+ * @defgroup api_gateway
+ * HTTP gateway to the events_agency
+ * @{
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * struct global_params
+ * @{
+**/
+typedef struct global_params
+{
+	void * user_data;
+	struct events_agency * eva;
+	json_object * jconfig;
+
+	GMainLoop * loop;
+	SoupServer * server;	// single-threaded mode only
+
+	int port;
+	// unix domain socket listener (co-located producers), in addition to 'port'
+	// peers are authenticated by SO_PEERCRED, (subject: "uid:<uid>")
+	struct {
+		char * path;	// NULL: disabled
+		int mode;		// file permissions of the socket
+		uid_t * allowed_uids;	// nullable, NULL: any local user
+		size_t num_allowed_uids;
+	}unix_socket;
+	int unix_listen_fd;
+	int num_workers;	// 0: single-threaded, serve on the default main loop
+	struct gateway_worker ** workers;
+	GMutex topics_mutex;	// serializes gateway_topic creation
+	struct path_router * router;	// read-only once the servers are started
+
+	DB_ENV * db_env;
+	DB * dbp;	// main db, (events: event_id --> record)
+	DB * sdbp;	// secondary db (indexed by timestamps)
+	DB * index_dbp;	// the secondary db again, not associated: bulk reads of the replays
+	DB * views_dbp;	// spilled entries of the topic views
+	int store_events;	// 0: events are not persisted
+	struct event_store * event_store;	// nullable
+	// transactional environment, events are written in batches by a single writer thread
+	struct {
+		int enabled;
+		size_t max_batch;		// events per transaction
+		size_t max_pending;		// bound of the writer queue
+		int sync;				// flush the log once per group (durable acks), 0: never flushed by the writer
+		unsigned int checkpoint_interval;	// seconds
+	}group_commit;
+
+	// streaming (SSE / WebSocket) settings
+	struct {
+		unsigned int flush_interval_ms;
+		size_t max_buffer_size;		// per-connection bound of unsent data
+		int disconnect_slow_clients;	// 0: drop events, 1: disconnect
+		gint64 ws_initial_credits;		// number of events a websocket client may receive before granting credits
+		size_t ws_max_message_size;
+
+		size_t log_capacity;			// per-topic in-memory events log (long-poll), 0: disabled
+		int64_t poll_max_events;
+		int64_t poll_max_wait_ms;
+		int replay_threads;				// concurrent replays of the event store
+	}stream;
+
+	// Content-Encoding settings
+	struct {
+		int enabled;
+		size_t min_size;	// responses smaller than this are sent uncompressed
+		int level;			// zlib compression level
+	}compression;
+
+	// bearer token authentication (Authorization: Bearer <jwt>), runs before rate limiting
+	struct {
+		int enabled;
+		int required;			// 0: anonymous requests are allowed (invalid tokens are rejected anyway)
+		char * issuer;			// nullable
+		size_t max_cached_tokens;
+		unsigned int max_cache_ttl;	// seconds
+		unsigned int leeway;		// seconds
+		int verify_threads;			// 0: verify in the server's thread, -1: one per core
+		size_t max_pending;			// distinct tokens waiting for verification, more get 503
+
+		// POST /token
+		struct {
+			int enabled;
+			char * signing_kid;		// nullable, NULL: the default key (needs a private key)
+			int64_t ttl;			// seconds
+			int64_t max_ttl;
+			char ** issuers;		// subjects allowed to request tokens on behalf of others
+			size_t num_issuers;
+		}token;
+
+		// POST /token/revoke, revoked "jti"s are rejected
+		struct {
+			int enabled;
+			char * filename;		// db file, (in the "db" home if configured)
+			size_t capacity;		// initial size of the revocation filter
+			double false_positive_rate;
+		}revocation;
+	}auth;
+	struct jwt_keyring * jwt_keyring;	// keys of the "auth" config, reloaded on SIGHUP
+	struct jwt_auth * jwt_auth;
+	struct jwt_revocation * jwt_revocation;	// nullable
+	struct gateway_auth_queue * auth_queue;	// nullable
+	GThreadPool * replay_pool;	// nullable, (event_store replays)
+
+	// per-client rate limiting
+	struct {
+		int enabled;
+		double rate;		// requests per second
+		double burst;
+		size_t max_clients;
+	}rate_limit;
+	struct rate_limiter * rate_limiter;
+
+	// admission control of ingest requests
+	struct {
+		int enabled;
+		int64_t max_inflight;
+		unsigned int target_latency_ms;	// publish latency
+		GHashTable * priorities;		// nullable, authenticated subject => (enum load_priority + 1)
+	}shedding;
+	struct load_shedder * load_shedder;
+
+	// native ingest listener settings (epoll, bypasses libsoup)
+	struct {
+		int enabled;
+		char * bind_address;	// ipv4, default: "127.0.0.1"
+		int port;
+		int binary_port;		// length-prefixed binary protocol (ingest_frame), 0: disabled
+		int num_threads;		// 0: one per core
+		size_t max_connections;	// per thread
+		size_t buffer_size;		// per connection, bounds the size of one request
+	}native;
+	struct native_ingest * native_ingest;
+
+	// fire-and-forget UDP ingest (telemetry)
+	struct {
+		int enabled;
+		int port;
+		int num_threads;
+		char * topic;				// nullable, default topic of datagrams without a topic line
+		size_t max_datagram_size;	// larger datagrams are dropped
+		size_t rcvbuf_size;			// SO_RCVBUF, 0: system default
+	}udp;
+	struct udp_ingest * udp_ingest;
+
+	// shared-memory ingest: one memfd ring per local producer, handed out over 'control_path'
+	struct {
+		int enabled;
+		char * control_path;
+		size_t ring_size;		// power of 2
+		size_t max_producers;
+		unsigned int spin_us;	// keep polling the rings for a while before sleeping, 0: disabled
+		uid_t * allowed_uids;	// nullable, NULL: any local user
+		size_t num_allowed_uids;
+	}shm;
+	struct shm_ingest * shm_ingest;
+
+	// static files (dashboard UI) served under /ui/
+	struct {
+		int enabled;
+		char * document_root;
+		char * index;			// served for directories, e.g. "index.html"
+		char * cache_control;	// nullable
+		size_t max_file_size;
+		size_t max_cache_size;
+		unsigned int revalidate_ms;
+	}static_files;
+	struct file_cache * file_cache;
+
+	// topic_views settings
+	struct {
+		int enabled;
+		char * key_field;
+		size_t max_entries;
+		int spill_to_db;
+		json_object * jtopics;	// nullable, NULL: all topics
+	}views;
+}global_params_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * struct topic_subscriber
+ * @brief a push subscriber of a gateway_topic (SSE / WebSocket connections)
+ * on_event() is called from the publishing thread with the serialized event.
+ * @{
+**/
+typedef struct topic_subscriber
+{
+	void * user_data;
+	int (* on_event)(struct topic_subscriber * sub, const char * data, size_t length);
+}topic_subscriber_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * struct gateway_topic
+ * @brief per-topic state of the gateway, (eva_topic->notify_data)
+ * @{
+**/
+typedef struct gateway_topic
+{
+	global_params_t * params;
+	struct events_topic_context * eva_topic;
+	struct topic_view * view;	// nullable
+
+	pthread_rwlock_t subscribers_lock;
+	GList * subscribers;	// list of (topic_subscriber_t *)
+
+	struct topic_log * log;	// nullable
+	GMutex waiters_mutex;
+	GList * waiters;	// parked long-poll requests
+}gateway_topic_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+**/
+gateway_topic_t * gateway_topic_get(global_params_t * params, const char * topic, int auto_create);
+int gateway_topic_publish(gateway_topic_t * gw_topic, /* const */ json_object * jevent);
+int gateway_topic_publish_raw(gateway_topic_t * gw_topic, const char * data, size_t length);
+int gateway_topic_add_subscriber(gateway_topic_t * gw_topic, topic_subscriber_t * sub);
+int gateway_topic_remove_subscriber(gateway_topic_t * gw_topic, topic_subscriber_t * sub);
+
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup gateway_router
+ * all requests are dispatched by on_gateway_request() through a precompiled path_router
+ * @{
+**/
+enum gateway_route_type
+{
+	gateway_route_type_unknown,
+	gateway_route_type_root,
+	gateway_route_type_topic_keys,
+	gateway_route_type_topic_events,
+	gateway_route_type_topic_stream,
+	gateway_route_type_topic_bulk,
+	gateway_route_type_static_files,	// GET and HEAD
+	gateway_route_type_token,
+	gateway_route_type_token_revoke,
+	gateway_route_type_topic_replay,
+};
+typedef void (* gateway_route_handler_fn)(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query);
+typedef struct gateway_route
+{
+	enum gateway_route_type type;
+	const char * path;	// route template
+	gateway_route_handler_fn on_get;
+	gateway_route_handler_fn on_post;
+}gateway_route_t;
+
+struct path_router * gateway_router_new(global_params_t * params);
+void gateway_router_free(struct path_router * router);
+// 'path' is the raw (percent-encoded) request path: the server is created with SOUP_SERVER_RAW_PATHS
+const gateway_route_t * gateway_route_lookup(global_params_t * params, const char * path, size_t length, path_router_match_t * match);
+char * gateway_route_get_param(const path_router_match_t * match, const char * name);	// return the value decoded once, need g_free()
+
+void on_gateway_request(SoupServer * server, SoupMessage * msg,
+	const char * path, GHashTable * query,
+	SoupClientContext * client, gpointer user_data);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup gateway_rate_limit
+ * requests are limited per client (and shed under overload) before their bodies are read:
+ * the client is the authenticated subject (set on the message under GATEWAY_AUTH_SUBJECT_KEY:
+ * "uid:<uid>" for unix socket peers, the "sub" claim of a bearer token), or the peer address.
+ * Limited requests get 429 with Retry-After, requests with an invalid token get 401.
+ * @{
+**/
+#define GATEWAY_AUTH_SUBJECT_KEY "gateway-auth-subject"
+#define GATEWAY_CLIENT_ID_SIZE (RATE_LIMITER_MAX_KEY_SIZE)
+
+const char * gateway_client_id(SoupMessage * msg, SoupClientContext * client, char client_id[static GATEWAY_CLIENT_ID_SIZE]);
+// return 0 if allowed, 1 if limited (*p_retry_after: seconds)
+int gateway_rate_limit_check(global_params_t * params, const char * client_id, unsigned int * p_retry_after);
+
+// priorities are configured per authenticated subject ("load_shedding.priorities"), never taken from the request
+enum load_priority gateway_subject_priority(global_params_t * params, const char * subject, enum load_priority default_priority);
+// ingest routes: return 1 if admitted, the caller must call params->load_shedder->leave() once finished
+// other routes are not subject to admission control (always admitted, not counted)
+// subject: nullable, the authenticated principal (GATEWAY_AUTH_SUBJECT_KEY)
+int gateway_admit_request(global_params_t * params, const gateway_route_t * route, const char * subject);
+
+void on_gateway_early_request(SoupServer * server, SoupMessage * msg,
+	const char * path, GHashTable * query,
+	SoupClientContext * client, gpointer user_data);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_auth
+ * Authorization: Bearer <jwt>
+ *
+ * tokens found in the jwt_auth cache are accepted in place, the others are verified on the
+ * gateway_auth_queue thread pool while the request is paused (soup_server_pause_message()),
+ * so the servers' main loops never run the signature checks.
+ * concurrent requests carrying the same token share one verification.
+ * @{
+**/
+#define GATEWAY_AUTH_NO_TOKEN (1)
+#define GATEWAY_AUTH_PENDING (2)	// the request is paused, 'on_done' will be called
+#define GATEWAY_AUTH_BUSY (3)		// too many pending verifications
+
+// called in the request's GMainContext once the token is verified, the request is unpaused on return
+typedef void (* gateway_auth_done_fn)(global_params_t * params, SoupServer * server, SoupMessage * msg, int status, void * user_data);
+
+struct gateway_auth_queue * gateway_auth_queue_new(global_params_t * params, int num_threads, size_t max_pending);
+void gateway_auth_queue_free(struct gateway_auth_queue * queue);
+
+// Authorization: Bearer <token>, return jwt_auth_status_ok, jwt_auth_status_invalid or GATEWAY_AUTH_NO_TOKEN
+int gateway_get_bearer_token(SoupMessage * msg, const char ** p_token, size_t * p_length);
+
+// return jwt_auth_status_ok (GATEWAY_AUTH_SUBJECT_KEY is set), a jwt_auth_status error,
+// or GATEWAY_AUTH_NO_TOKEN / GATEWAY_AUTH_PENDING / GATEWAY_AUTH_BUSY
+// on_done: nullable, NULL: verify synchronously
+int gateway_authenticate(global_params_t * params, SoupServer * server, SoupMessage * msg,
+	gateway_auth_done_fn on_done, void * user_data);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_token
+ * POST /token	{"sub": "<subject>", "ttl": <seconds>}, (optional)
+ *
+ * issues a token signed by auth.token.signing_kid (RS256 / ES256 / EdDSA) to the authenticated caller,
+ * or to "sub" if the caller is one of auth.token.issuers (e.g. a login service on the unix socket).
+ * a token issued to the caller itself never outlives the bearer token it was requested with,
+ * (so renewing cannot escape revocation), unix socket peers have no such token.
+ * claims: iat, exp, iss, sub, jti. jti: per-process random prefix + counter, (no uuid / syscall per token)
+ * @{
+**/
+void on_token_post(SoupServer * server, SoupMessage * msg, global_params_t * params);
+
+// POST /token/revoke	{"token": "<jwt>"} (the token's subject or an issuer), or {"jti": "...", "exp": <expiry>} (issuers)
+// 204 once the revocation is persisted, every later request carrying the token gets 401
+void on_token_revoke_post(SoupServer * server, SoupMessage * msg, global_params_t * params);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_compress
+ * Content-Encoding: gzip / deflate (zlib)
+ *
+ * a http_codec compresses or decompresses a body chunk by chunk,
+ * the output is handed to 'on_output' as soon as it is available.
+ * @{
+**/
+enum http_content_encoding
+{
+	http_content_encoding_unsupported = -1,
+	http_content_encoding_identity,
+	http_content_encoding_gzip,
+	http_content_encoding_deflate,
+};
+enum http_codec_flush
+{
+	http_codec_no_flush,
+	http_codec_sync_flush,	// (compress only) make all output so far decodable by the peer
+	http_codec_finish,
+};
+typedef int (* http_codec_output_fn)(void * user_data, const void * data, size_t length);
+typedef struct http_codec
+{
+	void * priv;	// z_stream
+	enum http_content_encoding encoding;
+	int compress;	// 1: compress, 0: decompress
+	int finished;	// end of the compressed stream
+	int err;
+
+	int (* update)(struct http_codec * codec, const void * data, size_t length, enum http_codec_flush flush,
+		http_codec_output_fn on_output, void * user_data);
+}http_codec_t;
+http_codec_t * http_codec_init(http_codec_t * codec, enum http_content_encoding encoding, int compress, int level);
+void http_codec_cleanup(http_codec_t * codec);
+
+enum http_content_encoding http_content_encoding_parse(const char * content_encoding);
+const char * http_content_encoding_to_string(enum http_content_encoding encoding);
+enum http_content_encoding http_accept_encoding_negotiate(global_params_t * params, SoupMessage * msg);
+
+// takes the ownership of 'data' (malloc'ed),
+// length >= compression.min_size: compressed if negotiated, chunk by chunk (Transfer-Encoding: chunked),
+// otherwise sent as-is with a Content-Length
+void http_response_set_body(global_params_t * params, SoupMessage * msg, const char * content_type, void * data, size_t length);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_ingest
+ * POST /topics/{topic}/events
+ * POST /topics/{topic}/bulk	(newline-delimited json)
+ *
+ * request bodies are parsed incrementally (on each "got-chunk") and never accumulated.
+ * events: the body may contain a sequence of json objects or arrays of json objects.
+ * bulk:   one json object per line, each line is validated in place and published as-is.
+ * @{
+**/
+#define HTTP_INGEST_BULK_MAX_ERRORS (1000)
+int http_ingest_init(SoupServer * server, global_params_t * params);
+void on_topic_events_post(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic);
+void on_topic_bulk_post(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic);
+
+// one-shot variants for complete bodies, fill 'jresult' and return the http status
+int http_ingest_events(gateway_topic_t * gw_topic, const char * content_encoding, const char * data, size_t length, json_object * jresult);
+int http_ingest_bulk(gateway_topic_t * gw_topic, const char * content_encoding, const char * data, size_t length, json_object * jresult);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup native_ingest
+ * a minimal HTTP/1.1 listener for POST /topics/{topic}/events and /topics/{topic}/bulk
+ *
+ * one edge-triggered epoll loop per thread, each with its own SO_REUSEPORT socket,
+ * connection buffers are preallocated, pipelined requests are parsed in place.
+ * the same loops serve the binary producer protocol (ingest-frame.h) on 'native.binary_port'.
+ * both listen on 'native.bind_address' and check bearer tokens like the gateway, (params->jwt_auth).
+ * @{
+**/
+struct native_ingest * native_ingest_start(global_params_t * params);
+void native_ingest_stop(struct native_ingest * ingest);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup udp_ingest
+ * datagram: [<topic>\n]<event>[\n<event>...], no reply
+ *
+ * each thread owns a SO_REUSEPORT socket and pulls up to 64 datagrams per recvmmsg()
+ * into preallocated buffers, the batch is then published before the next syscall.
+ * @{
+**/
+struct udp_ingest * udp_ingest_start(global_params_t * params);
+void udp_ingest_stop(struct udp_ingest * ingest);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup shm_ingest
+ * local producers connect to 'shm.control_path' (shm_ring_connect()) and receive their own ring,
+ * a single thread drains all rings into gateway_topic_publish_raw().
+ * the producer's eventfd is only written when this thread is about to sleep.
+ * @{
+**/
+struct shm_ingest * shm_ingest_start(global_params_t * params);
+void shm_ingest_stop(struct shm_ingest * ingest);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_stream
+ * GET /topics/{topic}/stream	(Server-Sent Events)
+ *
+ * events are coalesced into one chunk per 'flush_interval_ms',
+ * slow clients are dropped (or disconnected) once 'max_buffer_size' of unsent data is reached.
+ * @{
+**/
+void on_topic_stream_get(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_longpoll
+ * GET /topics/{topic}/events?from=<offset>&max=<n>&wait_ms=<t>
+ *
+ * returns up to 'max' events of the topic's log starting from 'from',
+ * or parks the request until new events arrive or 'wait_ms' expires.
+ * @{
+**/
+void on_topic_events_get(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic, GHashTable * query);
+void http_longpoll_wake(gateway_topic_t * gw_topic);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_replay
+ * GET /topics/{topic}/replay?from=<us>&to=<us>	(timestamps in microseconds, inclusive)
+ *
+ * streams the stored events of the topic in time order as newline-delimited json (chunked),
+ * the replays run on 'stream.replay_threads' threads and are paced by the client
+ * ('stream.max_buffer_size' of unsent data at most).
+ * @{
+**/
+int http_replay_init(global_params_t * params, int num_threads);
+void http_replay_cleanup(global_params_t * params);
+void on_topic_replay_get(SoupServer * server, SoupMessage * msg, global_params_t * params, const char * topic, GHashTable * query);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_static
+ * GET /ui/{path*}	(static files of the document root)
+ *
+ * files are served from an mmap'ed file_cache without being copied,
+ * responses carry an ETag, If-None-Match is answered with 304.
+ * @{
+**/
+void on_static_file_get(SoupServer * server, SoupMessage * msg, global_params_t * params, const char * path);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup api_gateway
+ * @defgroup http_websocket
+ * /ws	(publish / subscribe over one connection)
+ *
+ * pushed events are batched per topic and flush interval,
+ * and limited by the credits granted by the client ({"op": "credit", "n": N}).
+ * @{
+**/
+void on_websocket_connected(SoupServer * server, SoupWebsocketConnection * ws,
+	const char * path, SoupClientContext * client, gpointer user_data);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
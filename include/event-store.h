@@ -0,0 +1,120 @@
+#ifndef _EVENT_STORE_H_
+#define _EVENT_STORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <db.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup event_store
+ * persistent log of the events, (Berkeley DB)
+ *
+ * primary db:   event_id (uint64, big-endian) --> record
+ * secondary db: topic + '\0' + timestamp (int64 microseconds, big-endian) --> event_id, (DB_DUPSORT)
+ *
+ * all the integers of the keys are fixed-width big-endian: the B-tree order of the primary db
+ * is the order of arrival, the order of the secondary db is (topic, time, event_id).
+ * the secondary db is maintained by Berkeley DB itself (DB->associate()),
+ * its key is a slice of the record, the index costs no allocation per event.
+ *
+ * record: [uint16 topic_length][topic]['\0'][int64 timestamp][data], (integers big-endian)
+ *
+ * group commit (event_store_start_writer(), transactional environment):
+ * append() only queues the record, (the event_id is assigned in queue order), a single writer thread
+ * drains the queue: one transaction per batch of up to 'max_batch' records, committed without
+ * flushing the log, then one log flush for all the batches drained together (a group).
+ * producers asking for a durable ack wait with sync() until the group holding their events is flushed,
+ * the others never wait.
+ * without a writer, append() writes the record in place, (the environment must lock: DB_INIT_CDB).
+ *
+ * replay (time range of a topic): Berkeley DB refuses bulk reads (DB_MULTIPLE_KEY) on a secondary handle,
+ * the index is walked through 'index_dbp', a second handle of the secondary db which is not associated,
+ * (its data are the event_ids). each bulk buffer of the index yields a batch of event_ids,
+ * a dense batch is fetched with bulk reads of the primary db, a sparse one with point reads.
+ * the records of a batch are delivered once its cursors are closed, (on_record may block, and an open
+ * cursor of a concurrent data store environment blocks every writer).
+ * @{
+ * @}
+*/
+
+#define EVENT_STORE_MAX_TOPIC_LENGTH (1024)
+#define EVENT_STORE_INDEX_KEY_SIZE(cb_topic) ((cb_topic) + 1 + sizeof(int64_t))
+
+typedef struct event_record
+{
+	uint64_t event_id;
+	int64_t timestamp;	// microseconds since the epoch
+	const char * topic;	// (not nul-terminated)
+	size_t cb_topic;
+	const void * data;
+	size_t length;
+}event_record_t;
+typedef int (* event_store_on_record_fn)(void * user_data, const event_record_t * record);
+// called from the writer thread, status: 0 if the events are durable, -1 if some of them were lost
+typedef void (* event_store_on_synced_fn)(void * user_data, int status);
+
+#define EVENT_STORE_SYNC_PENDING (1)	// 'on_synced' will be called
+
+// parse a record of the primary db, return 0 on success
+int event_record_parse(const void * value, size_t size, uint64_t event_id, event_record_t * record);
+// key of the secondary db, 'key' must hold EVENT_STORE_INDEX_KEY_SIZE(cb_topic) bytes, return the key size
+size_t event_store_make_index_key(const char * topic, size_t cb_topic, int64_t timestamp, unsigned char * key);
+
+/**
+ * @ingroup event_store
+ * struct event_store
+ * @{
+**/
+typedef struct event_store
+{
+	void * priv;
+	void * user_data;
+	DB * dbp;	// primary db, (not owned)
+	DB * sdbp;	// secondary db, indexed by timestamps, (not owned)
+	DB * index_dbp;	// nullable, the secondary db without associate(), (not owned)
+
+	// public methods
+	// thread-safe, timestamp: 0: now; return the event_id (> 0), -1 on error, (errno EAGAIN: the writer queue is full)
+	int64_t (* append)(struct event_store * store, const char * topic, const void * data, size_t length, int64_t timestamp);
+	uint64_t (* get_last_event_id)(struct event_store * store);
+	// wait until every event appended so far is committed and its log flushed,
+	// status: -1 if an event appended after 'since_event_id' failed to be written, (conservative)
+	// on_synced: nullable, NULL: block; otherwise return EVENT_STORE_SYNC_PENDING, or the status if already durable
+	int (* sync)(struct event_store * store, uint64_t since_event_id, event_store_on_synced_fn on_synced, void * user_data);
+	// return 0 if found (on_record has been called), 1 if not found, -1 on error
+	int (* get)(struct event_store * store, uint64_t event_id, event_store_on_record_fn on_record, void * user_data);
+	// the events of 'topic' with from <= timestamp <= to, in (timestamp, event_id) order, (requires index_dbp)
+	// on_record returns non-zero to stop; return the number of records, -1 on error
+	ssize_t (* replay)(struct event_store * store, const char * topic, int64_t from, int64_t to,
+		event_store_on_record_fn on_record, void * user_data);
+}event_store_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup event_store
+ * associates sdbp with dbp (sdbp must have been opened with DB_DUP | DB_DUPSORT),
+ * the next event_id follows the last one of the primary db.
+ * index_dbp: nullable, another handle of the secondary db, NULL: replay() is not available
+**/
+event_store_t * event_store_init(event_store_t * store, DB * dbp, DB * sdbp, DB * index_dbp, void * user_data);
+void event_store_cleanup(event_store_t * store);	// drains the writer queue
+// db_env must be transactional (dbp / sdbp opened with DB_AUTO_COMMIT)
+// max_pending: bound of the writer queue; flush_log: 0: the commits are not flushed, (no durable ack)
+// checkpoint_interval: seconds
+int event_store_start_writer(event_store_t * store, DB_ENV * db_env, size_t max_batch, size_t max_pending,
+	int flush_log, unsigned int checkpoint_interval);
+int64_t event_store_timestamp_now(void);	// microseconds since the epoch
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
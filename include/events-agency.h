@@ -27,6 +27,7 @@ extern "C" {
 
 struct events_topic_context;
 typedef int (* events_topic_on_notify_fn)(struct events_topic_context * eva_topic, /* const */ json_object * jevents, void * notify_data);
+typedef int (* events_topic_on_notify_raw_fn)(struct events_topic_context * eva_topic, const char * data, size_t length, void * notify_data);
 
 /**
  * @ingroup topic
@@ -50,9 +51,11 @@ typedef struct events_topic_context
 	// public method
 	int (* publish)(struct events_topic_context * eva_topic, /* const */ json_object * jevent);							// push a single message
 	int (* consume)(struct events_topic_context * eva_topic, events_topic_on_notify_fn on_notify, void * notify_data);	// poll and consume a single message
+	int (* publish_raw)(struct events_topic_context * eva_topic, const char * data, size_t length);	// push a single (serialized json) message
 
 	// callback
 	events_topic_on_notify_fn on_notify; // consume messages
+	events_topic_on_notify_raw_fn on_notify_raw; // (optional) consume serialized messages, preferred over on_notify
 	void * notify_data;
 	void (* on_free_data)(void *notify_data);
 }events_topic_context;
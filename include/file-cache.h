@@ -0,0 +1,93 @@
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup file_cache
+ * read-only cache of the regular files under a document root, each file is loaded once
+ * and shared by all readers until the file changes (size / mtime / inode).
+ *
+ * the files are mmap'ed (read-only, MAP_PRIVATE), up to max_file_size they are kept in the cache,
+ * larger ones are mapped per request.
+ * accepted risk: a private mapping is not a snapshot, truncating a served file in place
+ * makes its readers fault (SIGBUS). the files must be replaced by rename(), never rewritten in place.
+ * entries are reference counted, a replaced entry stays alive until its last reader releases it.
+ * symlinks under the document root are never followed, (the root itself may be one).
+ * @{
+ * @}
+*/
+
+#define FILE_CACHE_ETAG_SIZE (64)
+
+/**
+ * @ingroup file_cache
+ * struct file_cache_entry
+ * @{
+**/
+typedef struct file_cache_entry
+{
+	int refs;
+	char * path;	// relative to the document root
+	const void * data;	// mmap'ed, NULL if size == 0
+	size_t size;
+	ino_t ino;
+	struct timespec mtime;
+	uint64_t checked_at;	// (ns, CLOCK_MONOTONIC) last stat()
+	char etag[FILE_CACHE_ETAG_SIZE];	// quoted, "<inode>-<size>-<mtime>"
+	const char * content_type;
+}file_cache_entry_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup file_cache
+ * struct file_cache
+ * @var max_file_size     larger files are mapped per request and never cached
+ * @var max_total_size    bound of the cached (mapped) bytes, uncached files are mapped per request
+ * @var revalidate_ms     min interval between two stat() of a cached file
+ * @{
+**/
+typedef struct file_cache
+{
+	void * priv;
+	void * user_data;
+
+	char * document_root;
+	size_t max_file_size;
+	size_t max_total_size;
+	unsigned int revalidate_ms;
+
+	// public method
+	// return a new reference to the entry (release it with file_cache_entry_unref()),
+	// NULL if not found (errno: ENOENT / EACCES / EINVAL / ELOOP)
+	file_cache_entry_t * (* get)(struct file_cache * cache, const char * path);
+}file_cache_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup file_cache
+**/
+file_cache_t * file_cache_init(file_cache_t * cache, const char * document_root,
+	size_t max_file_size, size_t max_total_size, unsigned int revalidate_ms, void * user_data);
+void file_cache_cleanup(file_cache_t * cache);
+void file_cache_entry_unref(file_cache_entry_t * entry);	// (GDestroyNotify compatible)
+
+const char * file_cache_guess_content_type(const char * path);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
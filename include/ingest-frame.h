@@ -0,0 +1,132 @@
+#ifndef _INGEST_FRAME_H_
+#define _INGEST_FRAME_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup ingest_frame
+ * length-prefixed binary producer protocol (native_ingest.binary_port)
+ *
+ * every frame starts with a 12-byte header, all integers are big-endian:
+ *   [uint32 length][uint32 topic_id][uint32 flags][payload: 'length' bytes]
+ *
+ * client --> server:
+ *   INGEST_FRAME_BIND:   payload is a topic name, binds 'topic_id' (1 .. INGEST_FRAME_MAX_TOPICS - 1)
+ *                        for the rest of the connection
+ *   INGEST_FRAME_BATCH:  payload is a sequence of [uint32 length][event]
+ *   INGEST_FRAME_AUTH:   payload is a bearer token (jwt), authenticates the rest of the connection,
+ *                        required before any other frame if 'auth.required'; the token is re-checked
+ *                        on every read, the connection is closed once it expired or was revoked
+ *   (none):              payload is one event (json object)
+ *
+ * frames are numbered from 1 in the order they are sent, (the sequence number is implicit).
+ * server --> client, (topic_id: 0):
+ *   INGEST_FRAME_ACK:    payload [uint64 seq], every frame up to 'seq' has been processed,
+ *                        one ack covers all the frames of a read
+ *   INGEST_FRAME_NACK:   payload [uint64 seq][uint32 code][uint32 num_rejected], sent before the ack
+ *                        covering 'seq'; the valid events of a batch are published anyway
+ * @{
+ * @}
+*/
+
+#define INGEST_FRAME_HEADER_SIZE (12)
+#define INGEST_FRAME_MAX_TOPICS (256)
+#define INGEST_FRAME_ACK_SIZE (INGEST_FRAME_HEADER_SIZE + 8)
+#define INGEST_FRAME_NACK_SIZE (INGEST_FRAME_HEADER_SIZE + 16)
+
+enum ingest_frame_flags
+{
+	INGEST_FRAME_BIND = 0x01,
+	INGEST_FRAME_BATCH = 0x02,
+	INGEST_FRAME_AUTH = 0x04,
+	INGEST_FRAME_PRIORITY_LOW = 0x10,	// load shedding
+	INGEST_FRAME_PRIORITY_HIGH = 0x20,	// ignored, (priorities are configured per subject)
+
+	INGEST_FRAME_ACK = 0x100,
+	INGEST_FRAME_NACK = 0x200,
+};
+
+enum ingest_frame_nack_code
+{
+	ingest_frame_nack_unknown_topic = 1,	// topic_id is not bound
+	ingest_frame_nack_invalid_event = 2,
+	ingest_frame_nack_rate_limited = 3,
+	ingest_frame_nack_overloaded = 4,		// num_rejected: events of the frame not stored, (0: the whole frame was shed)
+	ingest_frame_nack_too_large = 5,		// the connection is closed
+	ingest_frame_nack_bad_frame = 6,		// the connection is closed
+	ingest_frame_nack_unauthorized = 7,		// the connection is closed
+};
+
+/**
+ * @ingroup ingest_frame
+ * @{
+**/
+struct ingest_frame_header
+{
+	uint32_t length;
+	uint32_t topic_id;
+	uint32_t flags;
+};
+
+static inline uint32_t ingest_frame_get_u32(const unsigned char * p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+static inline void ingest_frame_put_u32(unsigned char * p, uint32_t value)
+{
+	p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value;
+}
+static inline uint64_t ingest_frame_get_u64(const unsigned char * p)
+{
+	return ((uint64_t)ingest_frame_get_u32(p) << 32) | ingest_frame_get_u32(p + 4);
+}
+static inline void ingest_frame_put_u64(unsigned char * p, uint64_t value)
+{
+	ingest_frame_put_u32(p, value >> 32);
+	ingest_frame_put_u32(p + 4, (uint32_t)value);
+}
+
+static inline void ingest_frame_header_decode(const unsigned char * p, struct ingest_frame_header * hdr)
+{
+	hdr->length = ingest_frame_get_u32(p);
+	hdr->topic_id = ingest_frame_get_u32(p + 4);
+	hdr->flags = ingest_frame_get_u32(p + 8);
+}
+static inline void ingest_frame_header_encode(unsigned char * p, uint32_t length, uint32_t topic_id, uint32_t flags)
+{
+	ingest_frame_put_u32(p, length);
+	ingest_frame_put_u32(p + 4, topic_id);
+	ingest_frame_put_u32(p + 8, flags);
+}
+
+// INGEST_FRAME_BATCH payload: the next [uint32 length][event] at *p_cur, (untrusted input)
+// return 1 and advance *p_cur past the event, 0 at the end of the payload,
+// -1 if the sub-frame is truncated (its header or its event runs past 'p_end')
+static inline int ingest_frame_batch_next(const unsigned char ** p_cur, const unsigned char * p_end,
+	const unsigned char ** p_event, uint32_t * p_length)
+{
+	const unsigned char * p = *p_cur;
+	if(p >= p_end) return 0;
+	if((size_t)(p_end - p) < 4) return -1;
+	uint32_t length = ingest_frame_get_u32(p);
+	p += 4;
+	if(length > (size_t)(p_end - p)) return -1;
+
+	*p_event = p;
+	*p_length = length;
+	*p_cur = p + length;
+	return 1;
+}
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,92 @@
+#ifndef _JWT_AUTH_H_
+#define _JWT_AUTH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup jwt_auth
+ * bearer token (JWT) verification with a cache of the verified tokens
+ *
+ * signatures are checked against the jwt_keyring key selected by the "kid" header,
+ * the "alg" header must match the key's algorithm.
+ *
+ * a verified token is cached under the SHA-256 of its text until min(exp, now + max_cache_ttl),
+ * the cache is sharded, each shard is a LRU list bounded by max_cached_tokens / JWT_AUTH_NUM_SHARDS.
+ * failed verifications are never cached.
+ *
+ * if a jwt_revocation is set, the "jti" of every token is checked on each request,
+ * (cache hits included): a revoked token is rejected from the next request on.
+ * @{
+ * @}
+*/
+
+#define JWT_AUTH_NUM_SHARDS (64)
+#define JWT_AUTH_MAX_TOKEN_SIZE (8192)
+#define JWT_AUTH_MAX_SUBJECT_SIZE (256)
+
+struct json_object;
+
+enum jwt_auth_status
+{
+	jwt_auth_status_ok = 0,
+	jwt_auth_status_invalid = -1,		// malformed token or bad signature
+	jwt_auth_status_expired = -2,		// exp <= now, or now < nbf
+	jwt_auth_status_rejected = -3,		// valid signature, but wrong issuer / missing claims
+	jwt_auth_status_revoked = -4,		// the "jti" was revoked
+};
+
+/**
+ * @ingroup jwt_auth
+ * struct jwt_auth
+ * @var issuer             nullable, required value of the "iss" claim
+ * @var max_cached_tokens  0: no cache
+ * @var max_cache_ttl      (seconds) bound of the lifetime of a cache entry, regardless of "exp"
+ * @var leeway             (seconds) tolerated clock skew for "exp" / "nbf"
+ * @var revocation         nullable, revoked token ids
+ * @{
+**/
+typedef struct jwt_auth
+{
+	void * priv;
+	void * user_data;
+	struct jwt_keyring * keyring;
+
+	char * issuer;
+	size_t max_cached_tokens;
+	unsigned int max_cache_ttl;
+	unsigned int leeway;
+	struct jwt_revocation * revocation;
+
+	// public methods
+	// thread-safe, return jwt_auth_status_ok and the "sub" claim (truncated to JWT_AUTH_MAX_SUBJECT_SIZE - 1) if the token is valid
+	int (* verify)(struct jwt_auth * auth, const char * token, size_t cb_token, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE]);
+	// cache only, (no signature check): return jwt_auth_status_ok if the token was verified before, 1 if not cached
+	int (* lookup)(struct jwt_auth * auth, const char * token, size_t cb_token, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE]);
+	void (* clear_cache)(struct jwt_auth * auth);	// e.g. after the keyring was reloaded
+	// signature check only, (expired and revoked tokens included), need json_object_put(*p_jclaims)
+	int (* decode)(struct jwt_auth * auth, const char * token, size_t cb_token, struct json_object ** p_jclaims);
+}jwt_auth_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup jwt_auth
+**/
+struct jwt_keyring;
+jwt_auth_t * jwt_auth_init(jwt_auth_t * auth, struct jwt_keyring * keyring,
+	const char * issuer, size_t max_cached_tokens, unsigned int max_cache_ttl, void * user_data);
+void jwt_auth_cleanup(jwt_auth_t * auth);
+const char * jwt_auth_status_to_string(enum jwt_auth_status status);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
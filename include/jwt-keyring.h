@@ -0,0 +1,106 @@
+#ifndef _JWT_KEYRING_H_
+#define _JWT_KEYRING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <json-c/json.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup jwt_keyring
+ * signing / verification keys of the JWTs, indexed by "kid"
+ *
+ * PEM files are parsed (EVP_PKEY) once, at init and on reload(), never per token.
+ * reload() builds a new key set and swaps it in, keys still in use by a verification stay valid
+ * until released, (reference counted).
+ *
+ * config ("auth" object):
+ *   "keys": [ { "kid": "...", "alg": "RS256" | "ES256" | "EdDSA",
+ *               "public_key_file": "...", "private_key_file": "..." }, ... ]
+ *   "default_kid": "..."	// key of the tokens without "kid", (default: the first key)
+ *   "public_key_file" / "private_key_file": a single key, (kid: "default"), if "keys" is missing
+ *
+ * "alg" is optional, (derived from the key type), a private key is only needed to issue tokens.
+ * @{
+ * @}
+*/
+
+#define JWT_KEYRING_MAX_KID_SIZE (128)
+#define JWT_KEYRING_MAX_SIGNATURE_SIZE (1024)	// RSA-8192
+
+enum jwt_key_alg
+{
+	jwt_key_alg_unknown = -1,
+	jwt_key_alg_rs256,
+	jwt_key_alg_es256,
+	jwt_key_alg_eddsa,
+};
+enum jwt_key_alg jwt_key_alg_parse(const char * alg);
+const char * jwt_key_alg_to_string(enum jwt_key_alg alg);	// JWS "alg" header value
+
+/**
+ * @ingroup jwt_keyring
+ * struct jwt_key
+ * @{
+**/
+typedef struct jwt_key
+{
+	int refs;
+	char * kid;
+	enum jwt_key_alg alg;
+	void * public_key;	// (EVP_PKEY *)
+	void * private_key;	// (EVP_PKEY *), nullable
+}jwt_key_t;
+void jwt_key_unref(jwt_key_t * key);
+// verify a JWS signature (raw, not base64url encoded) over 'data', return 0 if valid
+int jwt_key_verify(const jwt_key_t * key, const void * data, size_t length, const unsigned char * signature, size_t cb_signature);
+// sign 'data' with the private key, return the length of the JWS signature written to 'signature', -1 on error
+ssize_t jwt_key_sign(const jwt_key_t * key, const void * data, size_t length, unsigned char signature[static JWT_KEYRING_MAX_SIGNATURE_SIZE]);
+/**
+ * @}
+*/
+
+/**
+ * @ingroup jwt_keyring
+ * struct jwt_keyring
+ * @{
+**/
+typedef struct jwt_keyring
+{
+	void * priv;
+	void * user_data;
+	json_object * jconfig;	// ("auth" object), (ref)
+
+	// public methods
+	// return a new reference of the key (release it with jwt_key_unref()), NULL if not found
+	// kid: nullable, NULL: the default key
+	jwt_key_t * (* find)(struct jwt_keyring * keyring, const char * kid);
+	// reload the key files, keep the current keys on error; return the number of keys, -1 on error
+	ssize_t (* reload)(struct jwt_keyring * keyring);
+}jwt_keyring_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup jwt_keyring
+**/
+jwt_keyring_t * jwt_keyring_init(jwt_keyring_t * keyring, json_object * jconfig, void * user_data);
+void jwt_keyring_cleanup(jwt_keyring_t * keyring);
+
+// base64url without padding (RFC 7515)
+ssize_t jwt_base64url_decode(const char * text, size_t length, unsigned char ** p_data);	// need free()
+// 'text' must hold JWT_BASE64URL_SIZE(length) bytes, return the length of the text (nul-terminated)
+#define JWT_BASE64URL_SIZE(length) (((length) * 4 + 2) / 3 + 1)
+size_t jwt_base64url_encode(const void * data, size_t length, char * text);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
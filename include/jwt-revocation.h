@@ -0,0 +1,69 @@
+#ifndef _JWT_REVOCATION_H_
+#define _JWT_REVOCATION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <db.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup jwt_revocation
+ * revoked token ids ("jti" claim)
+ *
+ * the set is persisted in a Berkeley DB (jti --> exp, big-endian int64) and fronted by an
+ * in-memory bloom_filter: checking a jti that was never revoked reads one cache line of the filter,
+ * takes no lock and never touches the db. only the (rare) filter hits are looked up in the db.
+ *
+ * revoke() stores the jti then sets its bits in the current filter (incremental),
+ * once the filter holds more than its capacity, a larger one is built from the db and swapped in.
+ * purge() drops the revocations of expired tokens and rebuilds the filter.
+ * a replaced filter is freed as soon as no reader holds it, (readers are counted per epoch, RCU-style).
+ * @{
+ * @}
+*/
+
+#define JWT_REVOCATION_MAX_JTI_SIZE (128)
+
+/**
+ * @ingroup jwt_revocation
+ * struct jwt_revocation
+ * @{
+**/
+typedef struct jwt_revocation
+{
+	void * priv;
+	void * user_data;
+	DB * dbp;
+
+	// public methods
+	// expires_at: "exp" of the revoked token, the entry is purged afterwards; return 0 on success
+	int (* revoke)(struct jwt_revocation * revocation, const char * jti, int64_t expires_at);
+	// thread-safe, lock-free unless the filter matches; return 1 if revoked, 0 if not
+	int (* is_revoked)(struct jwt_revocation * revocation, const char * jti, size_t cb_jti);
+	// return the number of entries removed, -1 on error
+	ssize_t (* purge)(struct jwt_revocation * revocation, int64_t now);
+}jwt_revocation_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup jwt_revocation
+ * db_env: nullable, must lock (DB_INIT_CDB or DB_INIT_LOCK), NULL: 'filename' is opened in a private environment
+ * capacity: initial number of revocations the filter is sized for (grows as needed)
+ * fp_rate: false positive rate of the filter, (fraction of the checks that hit the db)
+**/
+jwt_revocation_t * jwt_revocation_init(jwt_revocation_t * revocation, DB_ENV * db_env, const char * filename,
+	size_t capacity, double fp_rate, void * user_data);
+void jwt_revocation_cleanup(jwt_revocation_t * revocation);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
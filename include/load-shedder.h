@@ -0,0 +1,70 @@
+#ifndef _LOAD_SHEDDER_H_
+#define _LOAD_SHEDDER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup load_shedder
+ * admission control based on the number of in-flight requests and the recent publish latency
+ *
+ * overloaded:          in-flight > max_inflight, or latency (EWMA) > target_latency
+ * severely overloaded: twice the limits above
+ * low priority requests are rejected when overloaded, normal ones when severely overloaded,
+ * high priority requests are always admitted.
+ * @{
+ * @}
+*/
+
+enum load_priority
+{
+	load_priority_low,
+	load_priority_normal,
+	load_priority_high,
+};
+
+/**
+ * @ingroup load_shedder
+ * struct load_shedder
+ * @var max_inflight       target number of in-flight requests
+ * @var target_latency_ns  target publish latency
+ * @var window_ns          latency samples older than this are ignored
+ * @{
+**/
+typedef struct load_shedder
+{
+	void * priv;
+	void * user_data;
+
+	int64_t max_inflight;
+	uint64_t target_latency_ns;
+	uint64_t window_ns;
+
+	// public method
+	int (* admit)(struct load_shedder * shedder, enum load_priority priority);	// return 1 if admitted (and counted as in-flight)
+	void (* leave)(struct load_shedder * shedder);	// an admitted request has finished
+	void (* record_latency)(struct load_shedder * shedder, uint64_t latency_ns);
+	int64_t (* get_inflight)(struct load_shedder * shedder);
+	uint64_t (* get_latency)(struct load_shedder * shedder);	// EWMA, 0 if stale
+}load_shedder_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup load_shedder
+**/
+load_shedder_t * load_shedder_init(load_shedder_t * shedder, int64_t max_inflight, uint64_t target_latency_ns, void * user_data);
+void load_shedder_cleanup(load_shedder_t * shedder);
+enum load_priority load_priority_parse(const char * priority, enum load_priority default_priority);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,62 @@
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup rate_limiter
+ * per-client token buckets (GCRA), kept in sharded open-addressing tables
+ *
+ * a bucket is a 64-bit hash of the client id (ids with the same hash share a bucket)
+ * and a 64-bit 'theoretical arrival time' updated with CAS,
+ * lookups are lock-free, the shard mutex is only taken when a new client is added (or takes over an idle bucket).
+ * @{
+ * @}
+*/
+
+#define RATE_LIMITER_NUM_SHARDS (64)
+#define RATE_LIMITER_MAX_KEY_SIZE (256)
+
+/**
+ * @ingroup rate_limiter
+ * struct rate_limiter
+ * @var rate         tokens per second
+ * @var burst        bucket capacity
+ * @var max_clients  max number of buckets, a new client takes over an idle bucket of its probe sequence first,
+ *                   (fail-open when none is idle and the shard is full)
+ * @{
+**/
+typedef struct rate_limiter
+{
+	void * priv;
+	void * user_data;
+
+	double rate;
+	double burst;
+	size_t max_clients;
+
+	// public method
+	// return 0 if allowed, 1 if limited (*p_retry_after_ns: time until the next token is available)
+	int (* check)(struct rate_limiter * limiter, const char * client_id, uint64_t * p_retry_after_ns);
+}rate_limiter_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup rate_limiter
+**/
+rate_limiter_t * rate_limiter_init(rate_limiter_t * limiter, double rate, double burst, size_t max_clients, void * user_data);
+void rate_limiter_cleanup(rate_limiter_t * limiter);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,58 @@
+#ifndef _TOPIC_LOG_H_
+#define _TOPIC_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup topic_log
+ * In-memory ring of the most recent (serialized) events of a topic,
+ * each event is addressed by a monotonically increasing offset.
+ * @{
+ * @}
+*/
+
+typedef int (* topic_log_on_read_fn)(void * user_data, int64_t offset, const char * data, size_t length);
+
+/**
+ * @ingroup topic_log
+ * struct topic_log
+ * @var capacity   max number of events kept in memory
+ * @{
+**/
+typedef struct topic_log
+{
+	void * priv;
+	void * user_data;
+	size_t capacity;
+
+	// public method
+	int64_t (* append)(struct topic_log * log, const char * data, size_t length);	// return the offset of the event
+	// read up to 'max_events' events starting from 'offset' (or from the first available one),
+	// return the number of events read, *p_next: the offset to read next
+	ssize_t (* read)(struct topic_log * log, int64_t offset, size_t max_events,
+		topic_log_on_read_fn on_read, void * user_data, int64_t * p_next);
+
+	int64_t (* get_first_offset)(struct topic_log * log);
+	int64_t (* get_next_offset)(struct topic_log * log);
+}topic_log_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup topic_log
+**/
+topic_log_t * topic_log_init(topic_log_t * log, size_t capacity, void * user_data);
+void topic_log_cleanup(topic_log_t * log);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,66 @@
+#ifndef _TOPIC_VIEW_H_
+#define _TOPIC_VIEW_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <json-c/json.h>
+#include <db.h>
+
+/**
+ * @defgroup topic_view
+ * Compacted (latest-value per key) view of a topic
+ *
+ * keeps the latest event of each key in memory,
+ * the least recently updated entries are spilled to the (optional) db when 'max_entries' is exceeded,
+ * or dropped if there is no db (or the spills keep failing).
+ * @{
+ * @}
+*/
+
+#define TOPIC_VIEW_MAX_KEY_SIZE (1024)
+
+/**
+ * @ingroup topic_view
+ * struct topic_view
+ * @var topic
+ * @var key_field   the name of the event field used as key, default: "key"
+ * @var max_entries max number of entries kept in memory, 0: unlimited
+ * @var spill_db    nullable
+ * @var num_dropped entries evicted without being spilled, (lost) after repeated spill failures
+ * @{
+**/
+typedef struct topic_view
+{
+	void * priv;
+	void * user_data;
+
+	char * topic;
+	char * key_field;
+	size_t max_entries;
+	DB * spill_db;
+	size_t num_dropped;	// (updated under the view's lock)
+
+	// public method
+	int (* update)(struct topic_view * view, /* const */ json_object * jevent);
+	int (* update_raw)(struct topic_view * view, const char * data, size_t length);	// serialized json event
+	ssize_t (* get)(struct topic_view * view, const char * key, char ** p_value);	// *p_value: a copy of the (json-string) event, need free()
+}topic_view_t;
+/**
+ * @}
+*/
+
+/**
+ * @ingroup topic_view
+**/
+topic_view_t * topic_view_init(topic_view_t * view, const char * topic, const char * key_field, size_t max_entries, DB * spill_db, void * user_data);
+void topic_view_cleanup(topic_view_t * view);
+/**
+ * @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,566 @@
+/*
+ * api-gateway.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include "api-gateway.h"
+#include "utils.h"
+
+/********************************************************
+* struct gateway_topic
+********************************************************/
+static int topic_view_enabled(global_params_t * params, const char * topic)
+{
+	if(!params->views.enabled) return 0;
+	if(NULL == params->views.jtopics) return 1;	// all topics
+
+	int count = json_object_array_length(params->views.jtopics);
+	for(int i = 0; i < count; ++i) {
+		const char * name = json_object_get_string(json_object_array_get_idx(params->views.jtopics, i));
+		if(name && 0 == strcmp(name, topic)) return 1;
+	}
+	return 0;
+}
+
+static gateway_topic_t * gateway_topic_new(global_params_t * params, const char * topic)
+{
+	gateway_topic_t * gw_topic = calloc(1, sizeof(*gw_topic));
+	assert(gw_topic);
+	gw_topic->params = params;
+
+	int rc = pthread_rwlock_init(&gw_topic->subscribers_lock, NULL);
+	assert(0 == rc);
+
+	if(topic_view_enabled(params, topic)) {
+		gw_topic->view = topic_view_init(NULL, topic,
+			params->views.key_field,
+			params->views.max_entries,
+			params->views.spill_to_db?params->views_dbp:NULL,
+			gw_topic);
+	}
+
+	g_mutex_init(&gw_topic->waiters_mutex);
+	if(params->stream.log_capacity > 0) {
+		gw_topic->log = topic_log_init(NULL, params->stream.log_capacity, gw_topic);
+	}
+	return gw_topic;
+}
+static void gateway_topic_free(gateway_topic_t * gw_topic)
+{
+	if(NULL == gw_topic) return;
+	if(gw_topic->view) {
+		topic_view_cleanup(gw_topic->view);
+		free(gw_topic->view);
+	}
+	if(gw_topic->log) {
+		topic_log_cleanup(gw_topic->log);
+		free(gw_topic->log);
+	}
+	g_list_free(gw_topic->waiters);
+	g_mutex_clear(&gw_topic->waiters_mutex);
+	g_list_free(gw_topic->subscribers);
+	pthread_rwlock_destroy(&gw_topic->subscribers_lock);
+	free(gw_topic);
+}
+
+static int gateway_topic_on_notify(struct events_topic_context * eva_topic, json_object * jevent, void * notify_data)
+{
+	gateway_topic_t * gw_topic = notify_data;
+	assert(gw_topic);
+
+	if(gw_topic->view) gw_topic->view->update(gw_topic->view, jevent);
+	return 0;
+}
+static int gateway_topic_on_notify_raw(struct events_topic_context * eva_topic, const char * data, size_t length, void * notify_data)
+{
+	gateway_topic_t * gw_topic = notify_data;
+	assert(gw_topic);
+
+	// persist first: subscribers are still served if the store fails, but the producer gets the error
+	int rc = 0;
+	event_store_t * store = gw_topic->params->event_store;
+	if(store && store->append(store, eva_topic->topic, data, length, 0) < 0) rc = -1;
+
+	if(gw_topic->view) gw_topic->view->update_raw(gw_topic->view, data, length);
+	if(gw_topic->log) {
+		gw_topic->log->append(gw_topic->log, data, length);
+		http_longpoll_wake(gw_topic);
+	}
+
+	pthread_rwlock_rdlock(&gw_topic->subscribers_lock);
+	for(GList * item = gw_topic->subscribers; item; item = item->next) {
+		topic_subscriber_t * sub = item->data;
+		sub->on_event(sub, data, length);
+	}
+	pthread_rwlock_unlock(&gw_topic->subscribers_lock);
+	return rc;
+}
+
+gateway_topic_t * gateway_topic_get(global_params_t * params, const char * topic, int auto_create)
+{
+	assert(params && params->eva);
+	if(NULL == topic || !topic[0]) return NULL;
+
+	struct events_agency * eva = params->eva;
+	struct events_topic_context * eva_topic = eva->find_topic(eva, NULL, topic);
+	gateway_topic_t * gw_topic = eva_topic?eva_topic->notify_data:NULL;
+	if(gw_topic && __atomic_load_n(&gw_topic->eva_topic, __ATOMIC_ACQUIRE)) return gw_topic;
+	if(NULL == gw_topic && !auto_create) return NULL;
+
+	// slow path: create the topic (or wait for its creation to finish) 
+	g_mutex_lock(&params->topics_mutex);
+	eva_topic = eva->find_topic(eva, NULL, topic);
+	if(NULL == eva_topic) {
+		gw_topic = gateway_topic_new(params, topic);
+		eva_topic = eva->subscribe(eva, NULL, topic,
+			gateway_topic_on_notify, gw_topic,
+			(void (*)(void *))gateway_topic_free);
+		assert(eva_topic);
+		eva_topic->on_notify_raw = gateway_topic_on_notify_raw;
+		__atomic_store_n(&gw_topic->eva_topic, eva_topic, __ATOMIC_RELEASE);
+	}
+	gw_topic = eva_topic->notify_data;
+	g_mutex_unlock(&params->topics_mutex);
+	return gw_topic;
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int gateway_topic_publish(gateway_topic_t * gw_topic, /* const */ json_object * jevent)
+{
+	assert(gw_topic && gw_topic->eva_topic);
+	load_shedder_t * shedder = gw_topic->params->load_shedder;
+	if(NULL == shedder) return gw_topic->eva_topic->publish(gw_topic->eva_topic, jevent);
+
+	uint64_t start = monotonic_ns();
+	int rc = gw_topic->eva_topic->publish(gw_topic->eva_topic, jevent);
+	shedder->record_latency(shedder, monotonic_ns() - start);
+	return rc;
+}
+
+int gateway_topic_publish_raw(gateway_topic_t * gw_topic, const char * data, size_t length)
+{
+	assert(gw_topic && gw_topic->eva_topic);
+	load_shedder_t * shedder = gw_topic->params->load_shedder;
+	if(NULL == shedder) return gw_topic->eva_topic->publish_raw(gw_topic->eva_topic, data, length);
+
+	uint64_t start = monotonic_ns();
+	int rc = gw_topic->eva_topic->publish_raw(gw_topic->eva_topic, data, length);
+	shedder->record_latency(shedder, monotonic_ns() - start);
+	return rc;
+}
+
+int gateway_topic_add_subscriber(gateway_topic_t * gw_topic, topic_subscriber_t * sub)
+{
+	assert(gw_topic && sub && sub->on_event);
+	pthread_rwlock_wrlock(&gw_topic->subscribers_lock);
+	gw_topic->subscribers = g_list_prepend(gw_topic->subscribers, sub);
+	pthread_rwlock_unlock(&gw_topic->subscribers_lock);
+	return 0;
+}
+
+int gateway_topic_remove_subscriber(gateway_topic_t * gw_topic, topic_subscriber_t * sub)
+{
+	assert(gw_topic && sub);
+	pthread_rwlock_wrlock(&gw_topic->subscribers_lock);
+	gw_topic->subscribers = g_list_remove(gw_topic->subscribers, sub);
+	pthread_rwlock_unlock(&gw_topic->subscribers_lock);
+	return 0;
+}
+
+/********************************************************
+* HTTP handlers: /topics/{topic}/...
+********************************************************/
+static char * uri_decode_segment(const char * segment, size_t length)
+{
+	// the only decoding of the path, (SOUP_SERVER_RAW_PATHS: libsoup leaves it as sent)
+	char * tmp = g_strndup(segment, length);
+	char * decoded = soup_uri_decode(tmp);
+	g_free(tmp);
+	return decoded;
+}
+
+char * gateway_route_get_param(const path_router_match_t * match, const char * name)
+{
+	const path_span_t * span = path_router_match_get(match, name);
+	if(NULL == span) return NULL;
+	return uri_decode_segment(span->p, span->length);
+}
+
+static gateway_topic_t * route_get_topic(global_params_t * params, const path_router_match_t * match, int auto_create)
+{
+	char * topic = gateway_route_get_param(match, "topic");
+	gateway_topic_t * gw_topic = gateway_topic_get(params, topic, auto_create);
+	g_free(topic);
+	return gw_topic;
+}
+
+static void on_route_root(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	if(params->file_cache && msg->method == SOUP_METHOD_GET) {
+		soup_message_set_redirect(msg, SOUP_STATUS_FOUND, "/ui/");
+		return;
+	}
+	soup_message_set_status(msg, SOUP_STATUS_ACCEPTED);
+}
+
+static void on_route_static_files(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	char * path = gateway_route_get_param(match, "path");	// NULL: "/ui/"
+	on_static_file_get(server, msg, params, path);
+	g_free(path);
+}
+
+static void on_route_topic_keys(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	gateway_topic_t * gw_topic = route_get_topic(params, match, 0);
+	char * key = gateway_route_get_param(match, "key");
+	if(NULL == gw_topic || NULL == gw_topic->view || NULL == key || !key[0]) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		g_free(key);
+		return;
+	}
+
+	char * value = NULL;
+	ssize_t cb_value = gw_topic->view->get(gw_topic->view, key, &value);
+	g_free(key);
+	if(cb_value < 0 || NULL == value) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	// take the ownership of 'value' to avoid an extra copy
+	http_response_set_body(gw_topic->params, msg, "application/json", value, cb_value);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+static void on_route_topic_events_get(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_topic_events_get(server, msg, route_get_topic(params, match, 1), query);
+}
+
+static void on_route_topic_events_post(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_topic_events_post(server, msg, route_get_topic(params, match, 1));
+}
+
+static void on_route_topic_stream(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_topic_stream_get(server, msg, route_get_topic(params, match, 1));
+}
+
+static void on_route_topic_replay(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	char * topic = gateway_route_get_param(match, "topic");	// (stored events, the topic may not be loaded)
+	on_topic_replay_get(server, msg, params, topic, query);
+	g_free(topic);
+}
+
+static void on_route_token(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_token_post(server, msg, params);
+}
+
+static void on_route_token_revoke(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_token_revoke_post(server, msg, params);
+}
+
+static void on_route_topic_bulk(SoupServer * server, SoupMessage * msg, global_params_t * params,
+	const path_router_match_t * match, GHashTable * query)
+{
+	on_topic_bulk_post(server, msg, route_get_topic(params, match, 1));
+}
+
+/********************************************************
+* routes
+********************************************************/
+static const gateway_route_t s_gateway_routes[] = {
+	{ gateway_route_type_root, "/", on_route_root, on_route_root },
+	{ gateway_route_type_topic_keys, "/topics/{topic}/keys/{key*}", on_route_topic_keys, NULL },
+	{ gateway_route_type_topic_events, "/topics/{topic}/events", on_route_topic_events_get, on_route_topic_events_post },
+	{ gateway_route_type_topic_stream, "/topics/{topic}/stream", on_route_topic_stream, NULL },
+	{ gateway_route_type_topic_bulk, "/topics/{topic}/bulk", NULL, on_route_topic_bulk },
+	{ gateway_route_type_topic_replay, "/topics/{topic}/replay", on_route_topic_replay, NULL },
+	{ gateway_route_type_static_files, "/ui/", on_route_static_files, NULL },
+	{ gateway_route_type_static_files, "/ui/{path*}", on_route_static_files, NULL },
+	{ gateway_route_type_token, "/token", NULL, on_route_token },
+	{ gateway_route_type_token_revoke, "/token/revoke", NULL, on_route_token_revoke },
+};
+
+path_router_t * gateway_router_new(global_params_t * params)
+{
+	path_router_t * router = path_router_init(NULL, params);
+	assert(router);
+	for(size_t i = 0; i < sizeof(s_gateway_routes) / sizeof(s_gateway_routes[0]); ++i) {
+		int rc = router->add(router, s_gateway_routes[i].path, (void *)&s_gateway_routes[i]);
+		assert(0 == rc);
+	}
+	return router;
+}
+
+void gateway_router_free(path_router_t * router)
+{
+	if(NULL == router) return;
+	path_router_cleanup(router);
+	free(router);
+}
+
+const gateway_route_t * gateway_route_lookup(global_params_t * params, const char * path, size_t length, path_router_match_t * match)
+{
+	assert(params && params->router);
+	if(!params->router->match(params->router, path, length, match)) return NULL;
+	return match->route_data;
+}
+
+void on_gateway_request(SoupServer * server, SoupMessage * msg,
+	const char * path, GHashTable * query,
+	SoupClientContext * client, gpointer user_data)
+{
+	global_params_t * params = user_data;
+	assert(params);
+
+	path_router_match_t match[1];
+	const gateway_route_t * route = gateway_route_lookup(params, path, path?strlen(path):0, match);
+	if(NULL == route) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	gateway_route_handler_fn handler = NULL;
+	if(msg->method == SOUP_METHOD_GET) handler = route->on_get;
+	else if(msg->method == SOUP_METHOD_POST) handler = route->on_post;
+	else if(msg->method == SOUP_METHOD_HEAD && route->type == gateway_route_type_static_files) handler = route->on_get;
+	if(NULL == handler) {
+		soup_message_set_status(msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+	handler(server, msg, params, match, query);
+}
+
+/********************************************************
+* rate limiting (early handler, runs before the body is read)
+********************************************************/
+const char * gateway_client_id(SoupMessage * msg, SoupClientContext * client, char client_id[static GATEWAY_CLIENT_ID_SIZE])
+{
+	const char * subject = g_object_get_data(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY);
+	if(subject) snprintf(client_id, GATEWAY_CLIENT_ID_SIZE, "sub:%s", subject);
+	else snprintf(client_id, GATEWAY_CLIENT_ID_SIZE, "ip:%s", client?soup_client_context_get_host(client):"");
+	return client_id;
+}
+
+int gateway_rate_limit_check(global_params_t * params, const char * client_id, unsigned int * p_retry_after)
+{
+	rate_limiter_t * limiter = params->rate_limiter;
+	if(NULL == limiter) return 0;
+
+	uint64_t retry_after_ns = 0;
+	int rc = limiter->check(limiter, client_id, &retry_after_ns);
+	if(rc && p_retry_after) *p_retry_after = (unsigned int)((retry_after_ns + 999999999ULL) / 1000000000ULL);
+	return rc;
+}
+
+enum load_priority gateway_subject_priority(global_params_t * params, const char * subject, enum load_priority default_priority)
+{
+	if(NULL == subject || NULL == params->shedding.priorities) return default_priority;
+	gpointer value = g_hash_table_lookup(params->shedding.priorities, subject);
+	return value?(enum load_priority)(GPOINTER_TO_INT(value) - 1):default_priority;
+}
+
+int gateway_admit_request(global_params_t * params, const gateway_route_t * route, const char * subject)
+{
+	load_shedder_t * shedder = params->load_shedder;
+	if(NULL == shedder || NULL == route) return 1;
+
+	// only ingest requests are subject to admission control, bulk loads are the first to go
+	enum load_priority default_priority;
+	switch(route->type) {
+	case gateway_route_type_topic_events: default_priority = load_priority_normal; break;
+	case gateway_route_type_topic_bulk: default_priority = load_priority_low; break;
+	default: return 1;
+	}
+	if(!shedder->admit(shedder, gateway_subject_priority(params, subject, default_priority))) return 0;
+	return 1;
+}
+
+static void on_admitted_request_finished(SoupMessage * msg, gpointer user_data)
+{
+	global_params_t * params = user_data;
+	params->load_shedder->leave(params->load_shedder);
+	g_signal_handlers_disconnect_by_func(msg, on_admitted_request_finished, user_data);
+}
+
+static void reject_early(SoupMessage * msg, guint status, unsigned int retry_after)
+{
+	char sz_retry_after[32] = "";
+	snprintf(sz_retry_after, sizeof(sz_retry_after), "%u", retry_after?retry_after:1);
+	soup_message_headers_replace(msg->response_headers, "Retry-After", sz_retry_after);
+	soup_message_set_status(msg, status);	// (the body is still read, but never ingested, see http-ingest.c)
+}
+
+/********************************************************
+* unix domain socket peers: authenticated by SO_PEERCRED
+* the result is kept on the connection's GSocket, (once per connection)
+********************************************************/
+#define GATEWAY_PEER_SUBJECT_KEY "gateway-peer-subject"
+static const char * unix_peer_subject(global_params_t * params, SoupClientContext * client)
+{
+	// return NULL if not a unix socket connection, "" if the peer is not allowed
+	GSocket * gsock = client?soup_client_context_get_gsocket(client):NULL;
+	if(NULL == gsock || g_socket_get_family(gsock) != G_SOCKET_FAMILY_UNIX) return NULL;
+
+	const char * subject = g_object_get_data(G_OBJECT(gsock), GATEWAY_PEER_SUBJECT_KEY);
+	if(subject) return subject;
+
+	struct ucred cred;
+	socklen_t cb_cred = sizeof(cred);
+	memset(&cred, 0, sizeof(cred));
+	int rc = getsockopt(g_socket_get_fd(gsock), SOL_SOCKET, SO_PEERCRED, &cred, &cb_cred);
+
+	int allowed = (0 == rc);
+	if(allowed && params->unix_socket.allowed_uids) {
+		allowed = 0;
+		for(size_t i = 0; i < params->unix_socket.num_allowed_uids; ++i) {
+			if(params->unix_socket.allowed_uids[i] == cred.uid) { allowed = 1; break; }
+		}
+	}
+
+	char * sz_subject = allowed?g_strdup_printf("uid:%u", (unsigned int)cred.uid):g_strdup("");
+	g_object_set_data_full(G_OBJECT(gsock), GATEWAY_PEER_SUBJECT_KEY, sz_subject, g_free);
+	if(!allowed) debug_printf("unix socket peer rejected: pid=%d, uid=%u", (int)cred.pid, (unsigned int)cred.uid);
+	return sz_subject;
+}
+
+/********************************************************
+* bearer tokens (Authorization: Bearer <jwt>), see http-auth.c
+********************************************************/
+static void reject_unauthorized(SoupMessage * msg, int status)
+{
+	// RFC 6750
+	char * challenge = (status == GATEWAY_AUTH_NO_TOKEN)?g_strdup("Bearer realm=\"event-streaming\""):
+		g_strdup_printf("Bearer realm=\"event-streaming\", error=\"invalid_token\", error_description=\"%s\"",
+			jwt_auth_status_to_string(status));
+	soup_message_headers_replace(msg->response_headers, "WWW-Authenticate", challenge);
+	g_free(challenge);
+	soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+}
+
+static inline int is_public_route(const gateway_route_t * route)
+{
+	return route && (route->type == gateway_route_type_root || route->type == gateway_route_type_static_files);
+}
+
+static void early_request_admit(global_params_t * params, SoupMessage * msg, SoupClientContext * client, const gateway_route_t * route)
+{
+	// client: nullable once the request was paused, (authenticated: the subject is the client id)
+	if(params->rate_limiter) {
+		char client_id[GATEWAY_CLIENT_ID_SIZE] = "";
+		unsigned int retry_after = 0;
+		if(gateway_rate_limit_check(params, gateway_client_id(msg, client, client_id), &retry_after)) {
+			reject_early(msg, SOUP_STATUS_TOO_MANY_REQUESTS, retry_after);
+			return;
+		}
+	}
+
+	if(params->load_shedder && msg->method == SOUP_METHOD_POST) {
+		if(route && (route->type == gateway_route_type_topic_events || route->type == gateway_route_type_topic_bulk)) {
+			const char * subject = g_object_get_data(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY);
+			if(!gateway_admit_request(params, route, subject)) {
+				reject_early(msg, SOUP_STATUS_SERVICE_UNAVAILABLE, 1);
+				return;
+			}
+			g_signal_connect(msg, "finished", G_CALLBACK(on_admitted_request_finished), params);
+		}
+	}
+}
+
+static int early_request_check_auth(global_params_t * params, SoupMessage * msg, const gateway_route_t * route, int status)
+{
+	// return 0 if the request may go on
+	if(status == jwt_auth_status_ok) return 0;
+	if(status == GATEWAY_AUTH_NO_TOKEN && (!params->auth.required || is_public_route(route))) return 0;
+	if(status == GATEWAY_AUTH_BUSY) reject_early(msg, SOUP_STATUS_SERVICE_UNAVAILABLE, 1);
+	else reject_unauthorized(msg, status);
+	return -1;
+}
+
+static void on_early_auth_done(global_params_t * params, SoupServer * server, SoupMessage * msg, int status, void * user_data)
+{
+	const gateway_route_t * route = user_data;
+	if(early_request_check_auth(params, msg, route, status)) return;
+	early_request_admit(params, msg, NULL, route);
+}
+
+void on_gateway_early_request(SoupServer * server, SoupMessage * msg,
+	const char * path, GHashTable * query,
+	SoupClientContext * client, gpointer user_data)
+{
+	global_params_t * params = user_data;
+	const char * subject = NULL;
+
+	if(params->unix_socket.path) {
+		subject = unix_peer_subject(params, client);
+		if(subject && !subject[0]) {
+			soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+			return;
+		}
+		if(subject) g_object_set_data_full(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY, g_strdup(subject), g_free);
+	}
+
+	path_router_match_t match[1];
+	const gateway_route_t * route = NULL;
+	if(params->jwt_auth || (params->load_shedder && msg->method == SOUP_METHOD_POST)) {
+		route = gateway_route_lookup(params, path, path?strlen(path):0, match);	// (routes are static)
+	}
+
+	if(params->jwt_auth && NULL == subject) {	// unix socket peers are already authenticated
+		int status = gateway_authenticate(params, server, msg, on_early_auth_done, (void *)route);
+		if(status == GATEWAY_AUTH_PENDING) return;	// resumed by on_early_auth_done()
+		if(early_request_check_auth(params, msg, route, status)) return;
+	}
+	early_request_admit(params, msg, client, route);
+}
@@ -0,0 +1,904 @@
+/*
+ * event-store.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "event-store.h"
+#include "utils.h"
+
+#define RECORD_HEADER_SIZE (sizeof(uint16_t))
+#define RECORD_STACK_BUFFER_SIZE (4096)
+#define WRITER_MAX_RETRIES (3)	// per batch, on DB_LOCK_DEADLOCK
+#define REPLAY_BULK_BUFFER_SIZE (1 << 20)	// (a multiple of 1KB, larger than a page)
+#define REPLAY_DENSITY (4)		// a batch is read in bulk if its event_ids span at most 4 times its size
+#define REPLAY_MAX_RETRIES (3)	// on DB_LOCK_DEADLOCK, resumed after the last record delivered
+#define REPLAY_MAX_BATCH (1024)	// index entries per pass, the cursors are closed between passes
+
+/********************************************************
+* record: [uint16 topic_length][topic]['\0'][int64 timestamp][data]
+********************************************************/
+size_t event_store_make_index_key(const char * topic, size_t cb_topic, int64_t timestamp, unsigned char * key)
+{
+	memcpy(key, topic, cb_topic);
+	key[cb_topic] = '\0';
+	uint64_t be_timestamp = htobe64((uint64_t)timestamp);
+	memcpy(key + cb_topic + 1, &be_timestamp, sizeof(be_timestamp));
+	return EVENT_STORE_INDEX_KEY_SIZE(cb_topic);
+}
+
+int event_record_parse(const void * value, size_t size, uint64_t event_id, event_record_t * record)
+{
+	const unsigned char * p = value;
+	if(NULL == p || size < RECORD_HEADER_SIZE) return -1;
+
+	uint16_t cb_topic = ((uint16_t)p[0] << 8) | p[1];
+	size_t header_size = RECORD_HEADER_SIZE + EVENT_STORE_INDEX_KEY_SIZE(cb_topic);
+	if(size < header_size || p[RECORD_HEADER_SIZE + cb_topic] != '\0') return -1;
+
+	uint64_t be_timestamp = 0;
+	memcpy(&be_timestamp, p + RECORD_HEADER_SIZE + cb_topic + 1, sizeof(be_timestamp));
+
+	record->event_id = event_id;
+	record->timestamp = (int64_t)be64toh(be_timestamp);
+	record->topic = (const char *)p + RECORD_HEADER_SIZE;
+	record->cb_topic = cb_topic;
+	record->data = p + header_size;
+	record->length = size - header_size;
+	return 0;
+}
+
+static size_t record_size(size_t cb_topic, size_t length)
+{
+	return RECORD_HEADER_SIZE + EVENT_STORE_INDEX_KEY_SIZE(cb_topic) + length;
+}
+
+static void record_build(unsigned char * record, const char * topic, size_t cb_topic, int64_t timestamp, const void * data, size_t length)
+{
+	record[0] = (unsigned char)(cb_topic >> 8);
+	record[1] = (unsigned char)cb_topic;
+	event_store_make_index_key(topic, cb_topic, timestamp, record + RECORD_HEADER_SIZE);
+	memcpy(record + RECORD_HEADER_SIZE + EVENT_STORE_INDEX_KEY_SIZE(cb_topic), data, length);
+}
+
+static int get_index_key(DB * sdbp, const DBT * pkey, const DBT * pdata, DBT * skey)
+{
+	// called by Berkeley DB for every put of the primary db: the key is a slice of the record
+	const unsigned char * p = pdata->data;
+	if(pdata->size < RECORD_HEADER_SIZE) return DB_DONOTINDEX;
+	uint16_t cb_topic = ((uint16_t)p[0] << 8) | p[1];
+	if(pdata->size < RECORD_HEADER_SIZE + EVENT_STORE_INDEX_KEY_SIZE(cb_topic)) return DB_DONOTINDEX;
+
+	skey->data = (void *)(p + RECORD_HEADER_SIZE);
+	skey->size = EVENT_STORE_INDEX_KEY_SIZE(cb_topic);
+	return 0;
+}
+
+int64_t event_store_timestamp_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/********************************************************
+* group commit
+********************************************************/
+struct pending_write
+{
+	struct pending_write * next;
+	uint64_t event_id;
+	size_t size;
+	unsigned char record[];
+};
+
+struct sync_waiter
+{
+	struct sync_waiter * next;
+	uint64_t since_event_id;
+	uint64_t target_event_id;	// the last event queued when sync() was called
+	int status;
+	int done;
+	event_store_on_synced_fn on_synced;	// NULL: a blocked thread, (the waiter is on its stack)
+	void * user_data;
+};
+
+struct event_store_writer
+{
+	struct event_store * store;
+	DB_ENV * db_env;
+	size_t max_batch;
+	size_t max_pending;
+	int flush_log;
+	unsigned int checkpoint_interval;
+
+	pthread_t th;
+	int quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;			// new writes, or quit
+	pthread_cond_t synced_cond;		// blocked sync() callers
+
+	struct pending_write * head;
+	struct pending_write ** p_tail;
+	size_t num_pending;
+	struct sync_waiter * waiters;
+	uint64_t synced_event_id;		// every event up to this id has been processed
+	uint64_t last_failed_event_id;	// the highest event_id that could not be written
+};
+
+/********************************************************
+* struct event_store_private
+********************************************************/
+struct event_store_private
+{
+	struct event_store * store;
+	uint64_t last_event_id;	// (atomic), queued under writer->mutex if there is a writer
+	struct event_store_writer * writer;	// nullable
+};
+
+static int load_last_event_id(DB * dbp, uint64_t * p_event_id)
+{
+	DBC * cursorp = NULL;
+	int rc = dbp->cursor(dbp, NULL, &cursorp, 0);
+	if(rc) {
+		dbp->err(dbp, rc, "%s(): cursor", __FUNCTION__);
+		return -1;
+	}
+
+	uint64_t be_event_id = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_event_id;
+	key.ulen = sizeof(be_event_id);
+	key.flags = DB_DBT_USERMEM;
+	value.flags = DB_DBT_PARTIAL;	// (key only)
+
+	rc = cursorp->get(cursorp, &key, &value, DB_LAST);
+	cursorp->close(cursorp);
+	if(rc == DB_NOTFOUND) {
+		*p_event_id = 0;
+		return 0;
+	}
+	if(rc || key.size != sizeof(be_event_id)) {
+		dbp->err(dbp, rc, "%s(): cursor->get(DB_LAST)", __FUNCTION__);
+		return -1;
+	}
+	*p_event_id = be64toh(be_event_id);
+	return 0;
+}
+
+/********************************************************
+* public methods
+********************************************************/
+static int64_t writer_enqueue(struct event_store_writer * writer, struct event_store_private * priv,
+	const char * topic, size_t cb_topic, int64_t timestamp, const void * data, size_t length)
+{
+	size_t size = record_size(cb_topic, length);
+	struct pending_write * write = malloc(sizeof(*write) + size);
+	assert(write);
+	write->next = NULL;
+	write->size = size;
+	record_build(write->record, topic, cb_topic, timestamp, data, length);
+
+	pthread_mutex_lock(&writer->mutex);
+	if(writer->quit || writer->num_pending >= writer->max_pending) {
+		pthread_mutex_unlock(&writer->mutex);
+		free(write);
+		errno = writer->quit?ESHUTDOWN:EAGAIN;
+		return -1;
+	}
+	uint64_t event_id = __atomic_add_fetch(&priv->last_event_id, 1, __ATOMIC_RELAXED);	// queue order == event_id order
+	write->event_id = event_id;
+	*writer->p_tail = write;
+	writer->p_tail = &write->next;
+	if(1 == ++writer->num_pending) pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	return (int64_t)event_id;	// ('write' may have been freed by the writer)
+}
+
+static int64_t event_store_append(struct event_store * store, const char * topic, const void * data, size_t length, int64_t timestamp)
+{
+	assert(store && store->priv);
+	struct event_store_private * priv = store->priv;
+	DB * dbp = store->dbp;
+
+	size_t cb_topic = topic?strlen(topic):0;
+	if(0 == cb_topic || cb_topic > EVENT_STORE_MAX_TOPIC_LENGTH) return -1;
+	if(NULL == data || 0 == length) return -1;
+	if(timestamp <= 0) timestamp = event_store_timestamp_now();
+
+	if(priv->writer) return writer_enqueue(priv->writer, priv, topic, cb_topic, timestamp, data, length);
+
+	size_t size = record_size(cb_topic, length);
+	unsigned char stack_buf[RECORD_STACK_BUFFER_SIZE];
+	unsigned char * record = (size <= sizeof(stack_buf))?stack_buf:malloc(size);
+	assert(record);
+	record_build(record, topic, cb_topic, timestamp, data, length);
+
+	uint64_t event_id = __atomic_add_fetch(&priv->last_event_id, 1, __ATOMIC_RELAXED);
+	uint64_t be_event_id = htobe64(event_id);
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_event_id;
+	key.size = sizeof(be_event_id);
+	value.data = record;
+	value.size = size;
+
+	int rc = dbp->put(dbp, NULL, &key, &value, 0);	// (updates the secondary db)
+	if(record != stack_buf) free(record);
+	if(rc) {
+		dbp->err(dbp, rc, "%s(topic=%s)", __FUNCTION__, topic);
+		return -1;
+	}
+	return (int64_t)event_id;
+}
+
+static uint64_t event_store_get_last_event_id(struct event_store * store)
+{
+	assert(store && store->priv);
+	struct event_store_private * priv = store->priv;
+	return __atomic_load_n(&priv->last_event_id, __ATOMIC_ACQUIRE);
+}
+
+static int event_store_sync(struct event_store * store, uint64_t since_event_id, event_store_on_synced_fn on_synced, void * user_data)
+{
+	assert(store && store->priv);
+	struct event_store_private * priv = store->priv;
+	struct event_store_writer * writer = priv->writer;
+	if(NULL == writer) {
+		// no log: flush the pages of both dbs
+		int rc = store->dbp->sync(store->dbp, 0);
+		if(0 == rc) rc = store->sdbp->sync(store->sdbp, 0);
+		if(rc) store->dbp->err(store->dbp, rc, "%s()", __FUNCTION__);
+		return rc?-1:0;
+	}
+
+	pthread_mutex_lock(&writer->mutex);
+	uint64_t target_event_id = priv->last_event_id;
+	int status = (writer->last_failed_event_id > since_event_id)?-1:0;
+	if(target_event_id <= writer->synced_event_id) {
+		pthread_mutex_unlock(&writer->mutex);
+		return status;
+	}
+
+	struct sync_waiter stack_waiter[1];
+	struct sync_waiter * waiter = on_synced?calloc(1, sizeof(*waiter)):stack_waiter;
+	assert(waiter);
+	memset(waiter, 0, sizeof(*waiter));
+	waiter->since_event_id = since_event_id;
+	waiter->target_event_id = target_event_id;
+	waiter->status = status;
+	waiter->on_synced = on_synced;
+	waiter->user_data = user_data;
+	waiter->next = writer->waiters;
+	writer->waiters = waiter;
+	if(on_synced) {
+		pthread_mutex_unlock(&writer->mutex);
+		return EVENT_STORE_SYNC_PENDING;
+	}
+
+	while(!waiter->done) pthread_cond_wait(&writer->synced_cond, &writer->mutex);
+	status = waiter->status;
+	pthread_mutex_unlock(&writer->mutex);
+	return status;
+}
+
+static int event_store_get(struct event_store * store, uint64_t event_id, event_store_on_record_fn on_record, void * user_data)
+{
+	assert(store && store->dbp);
+	DB * dbp = store->dbp;
+
+	uint64_t be_event_id = htobe64(event_id);
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_event_id;
+	key.size = sizeof(be_event_id);
+	value.flags = DB_DBT_MALLOC;
+
+	int rc = dbp->get(dbp, NULL, &key, &value, 0);
+	if(rc == DB_NOTFOUND) return 1;
+	if(rc) {
+		dbp->err(dbp, rc, "%s(event_id=%lu)", __FUNCTION__, (unsigned long)event_id);
+		return -1;
+	}
+
+	event_record_t record;
+	rc = event_record_parse(value.data, value.size, event_id, &record);
+	if(0 == rc && on_record) on_record(user_data, &record);
+	free(value.data);
+	return rc;
+}
+
+/********************************************************
+* replay
+********************************************************/
+struct replay_context
+{
+	struct event_store * store;
+	event_store_on_record_fn on_record;
+	void * user_data;
+
+	unsigned char to_key[EVENT_STORE_INDEX_KEY_SIZE(EVENT_STORE_MAX_TOPIC_LENGTH)];
+	size_t cb_to_key;
+	// resume point: the index entry of the last record delivered (or the 'from' key)
+	unsigned char last_key[EVENT_STORE_INDEX_KEY_SIZE(EVENT_STORE_MAX_TOPIC_LENGTH)];
+	size_t cb_last_key;
+	uint64_t last_event_id;	// 0: nothing delivered
+
+	unsigned char * index_buf;	// bulk buffer of the index
+	unsigned char * data_buf;	// bulk buffer of the primary db
+	unsigned char * record_buf;	// point reads
+	size_t record_buf_size;
+
+	uint64_t * event_ids;	// current batch, in index order
+	size_t num_event_ids;
+	size_t max_event_ids;
+	unsigned char batch_key[EVENT_STORE_INDEX_KEY_SIZE(EVENT_STORE_MAX_TOPIC_LENGTH)];	// last index entry of the batch
+	size_t cb_batch_key;
+	uint64_t batch_event_id;
+
+	// records of the current batch, emitted once the cursors are closed:
+	// on_record() may block (backpressure), and an open cursor blocks the writers of a concurrent data store
+	unsigned char * staged_buf;
+	size_t cb_staged;
+	size_t staged_size;
+	struct staged_record
+	{
+		uint64_t event_id;
+		size_t offset;
+		size_t size;
+	} * staged;
+	size_t num_staged;
+	size_t max_staged;
+
+	ssize_t num_records;
+	int stopped;	// by on_record()
+	int done;		// past the 'to' key
+};
+
+static int compare_keys(const void * a, size_t cb_a, const void * b, size_t cb_b)
+{
+	int rc = memcmp(a, b, (cb_a < cb_b)?cb_a:cb_b);
+	if(rc) return rc;
+	return (cb_a > cb_b) - (cb_a < cb_b);
+}
+
+static int replay_emit(struct replay_context * ctx, uint64_t event_id, const void * data, size_t size)
+{
+	event_record_t record;
+	if(event_record_parse(data, size, event_id, &record)) return 0;	// (skipped)
+
+	size_t cb_key = EVENT_STORE_INDEX_KEY_SIZE(record.cb_topic);
+	memcpy(ctx->last_key, (const unsigned char *)data + RECORD_HEADER_SIZE, cb_key);
+	ctx->cb_last_key = cb_key;
+	ctx->last_event_id = event_id;
+	++ctx->num_records;
+	if(ctx->on_record(ctx->user_data, &record)) ctx->stopped = 1;
+	return 0;
+}
+
+static void replay_stage(struct replay_context * ctx, uint64_t event_id, const void * data, size_t size)
+{
+	if(ctx->num_staged >= ctx->max_staged) {
+		ctx->max_staged = ctx->max_staged?(ctx->max_staged * 2):256;
+		ctx->staged = realloc(ctx->staged, ctx->max_staged * sizeof(*ctx->staged));
+		assert(ctx->staged);
+	}
+	if(ctx->cb_staged + size > ctx->staged_size) {
+		size_t new_size = ctx->staged_size?ctx->staged_size:REPLAY_BULK_BUFFER_SIZE;
+		while(new_size < ctx->cb_staged + size) new_size *= 2;
+		ctx->staged_buf = realloc(ctx->staged_buf, new_size);
+		assert(ctx->staged_buf);
+		ctx->staged_size = new_size;
+	}
+	memcpy(ctx->staged_buf + ctx->cb_staged, data, size);
+	ctx->staged[ctx->num_staged++] = (struct staged_record){ event_id, ctx->cb_staged, size };
+	ctx->cb_staged += size;
+}
+
+static void replay_emit_staged(struct replay_context * ctx)
+{
+	for(size_t i = 0; i < ctx->num_staged && !ctx->stopped; ++i) {
+		const struct staged_record * staged = &ctx->staged[i];
+		replay_emit(ctx, staged->event_id, ctx->staged_buf + staged->offset, staged->size);
+	}
+	ctx->num_staged = 0;
+	ctx->cb_staged = 0;
+}
+
+static int replay_point_read(struct replay_context * ctx, uint64_t event_id)
+{
+	DB * dbp = ctx->store->dbp;
+	uint64_t be_event_id = htobe64(event_id);
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = &be_event_id;
+	key.size = sizeof(be_event_id);
+	value.flags = DB_DBT_USERMEM;
+
+	int rc = 0;
+	while(1) {
+		value.data = ctx->record_buf;
+		value.ulen = ctx->record_buf_size;
+		rc = dbp->get(dbp, NULL, &key, &value, 0);
+		if(rc != DB_BUFFER_SMALL) break;
+		ctx->record_buf = realloc(ctx->record_buf, value.size);
+		assert(ctx->record_buf);
+		ctx->record_buf_size = value.size;
+	}
+	if(rc == DB_NOTFOUND) return 0;
+	if(rc) return rc;
+	replay_stage(ctx, event_id, value.data, value.size);
+	return 0;
+}
+
+static int replay_fetch_batch(struct replay_context * ctx, DBC * cursorp)
+{
+	// records of ctx->event_ids, delivered in index order
+	const uint64_t * event_ids = ctx->event_ids;
+	size_t count = ctx->num_event_ids;
+	size_t i = 0;
+	int rc = 0;
+
+	int ascending = 1;
+	for(size_t k = 1; ascending && k < count; ++k) ascending = (event_ids[k] > event_ids[k - 1]);
+	if(ascending && (event_ids[count - 1] - event_ids[0]) < (uint64_t)count * REPLAY_DENSITY) {
+		// dense: read the range in bulk, skip the events of the other topics
+		uint64_t be_event_id = htobe64(event_ids[0]);
+		DBT key, value;
+		memset(&key, 0, sizeof(key));
+		memset(&value, 0, sizeof(value));
+		key.data = &be_event_id;
+		key.size = sizeof(be_event_id);
+		key.ulen = sizeof(be_event_id);
+		key.flags = DB_DBT_USERMEM;
+		value.data = ctx->data_buf;
+		value.ulen = REPLAY_BULK_BUFFER_SIZE;
+		value.flags = DB_DBT_USERMEM;
+
+		uint32_t flags = DB_SET_RANGE | DB_MULTIPLE_KEY;
+		while(i < count && 0 == (rc = cursorp->get(cursorp, &key, &value, flags))) {
+			flags = DB_NEXT | DB_MULTIPLE_KEY;
+			void * p = NULL;
+			DB_MULTIPLE_INIT(p, &value);
+			while(i < count) {
+				void * p_key = NULL, * p_data = NULL;
+				uint32_t cb_key = 0, cb_data = 0;
+				DB_MULTIPLE_KEY_NEXT(p, &value, p_key, cb_key, p_data, cb_data);
+				if(NULL == p) break;
+				if(cb_key != sizeof(uint64_t)) continue;
+
+				uint64_t event_id = 0;
+				memcpy(&event_id, p_key, sizeof(event_id));
+				event_id = be64toh(event_id);
+				while(i < count && event_ids[i] < event_id) ++i;	// (deleted)
+				if(i < count && event_ids[i] == event_id) {
+					replay_stage(ctx, event_id, p_data, cb_data);
+					++i;
+				}
+			}
+		}
+		if(rc == DB_NOTFOUND) return 0;
+		if(rc && rc != DB_BUFFER_SMALL) return rc;
+		// DB_BUFFER_SMALL: a record larger than the bulk buffer, read the rest one by one
+	}
+
+	for(; i < count; ++i) {
+		rc = replay_point_read(ctx, event_ids[i]);
+		if(rc) return rc;
+	}
+	return 0;
+}
+
+static int replay_walk(struct replay_context * ctx)
+{
+	// one batch from the resume point, return a db error code (DB_LOCK_DEADLOCK: can be resumed)
+	DB * index_dbp = ctx->store->index_dbp;
+	DB * dbp = ctx->store->dbp;
+	DBC * index_cursorp = NULL;
+	DBC * cursorp = NULL;
+	int rc = index_dbp->cursor(index_dbp, NULL, &index_cursorp, 0);
+	if(0 == rc) rc = dbp->cursor(dbp, NULL, &cursorp, 0);
+	if(rc) {
+		if(index_cursorp) index_cursorp->close(index_cursorp);
+		return rc;
+	}
+
+	unsigned char start_key[sizeof(ctx->last_key)];
+	memcpy(start_key, ctx->last_key, ctx->cb_last_key);
+	size_t cb_start_key = ctx->cb_last_key;
+	uint64_t skip_event_id = ctx->last_event_id;	// (delivered by an earlier pass)
+
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = start_key;
+	key.size = cb_start_key;
+	key.ulen = sizeof(start_key);
+	key.flags = DB_DBT_USERMEM;
+	value.data = ctx->index_buf;
+	value.ulen = REPLAY_BULK_BUFFER_SIZE;
+	value.flags = DB_DBT_USERMEM;
+
+	ctx->num_event_ids = 0;
+	int end_of_batch = 0;
+	uint32_t flags = DB_SET_RANGE | DB_MULTIPLE_KEY;
+	while(!end_of_batch && 0 == (rc = index_cursorp->get(index_cursorp, &key, &value, flags))) {
+		flags = DB_NEXT | DB_MULTIPLE_KEY;
+
+		void * p = NULL;
+		DB_MULTIPLE_INIT(p, &value);
+		while(1) {
+			void * p_key = NULL, * p_data = NULL;
+			uint32_t cb_key = 0, cb_data = 0;
+			DB_MULTIPLE_KEY_NEXT(p, &value, p_key, cb_key, p_data, cb_data);
+			if(NULL == p) break;
+			if(compare_keys(p_key, cb_key, ctx->to_key, ctx->cb_to_key) > 0) {
+				ctx->done = 1;
+				end_of_batch = 1;
+				break;
+			}
+			if(cb_data != sizeof(uint64_t) || cb_key > sizeof(ctx->batch_key)) continue;
+
+			uint64_t event_id = 0;
+			memcpy(&event_id, p_data, sizeof(event_id));
+			event_id = be64toh(event_id);
+			if(skip_event_id && event_id <= skip_event_id
+				&& 0 == compare_keys(p_key, cb_key, start_key, cb_start_key)) continue;
+
+			if(ctx->num_event_ids >= ctx->max_event_ids) {
+				ctx->max_event_ids = ctx->max_event_ids?(ctx->max_event_ids * 2):4096;
+				ctx->event_ids = realloc(ctx->event_ids, ctx->max_event_ids * sizeof(*ctx->event_ids));
+				assert(ctx->event_ids);
+			}
+			ctx->event_ids[ctx->num_event_ids++] = event_id;
+			memcpy(ctx->batch_key, p_key, cb_key);
+			ctx->cb_batch_key = cb_key;
+			ctx->batch_event_id = event_id;
+			if(ctx->num_event_ids >= REPLAY_MAX_BATCH) break;
+		}
+		if(ctx->num_event_ids > 0) end_of_batch = 1;	// (at most one bulk page of the index per pass)
+	}
+	if(rc == DB_NOTFOUND) {
+		ctx->done = 1;
+		rc = 0;
+	}
+	if(0 == rc && ctx->num_event_ids > 0) rc = replay_fetch_batch(ctx, cursorp);
+	cursorp->close(cursorp);
+	index_cursorp->close(index_cursorp);
+
+	// (also the records read before a deadlock)
+	replay_emit_staged(ctx);
+	if(0 == rc && !ctx->stopped && ctx->num_event_ids > 0) {
+		// resume after the whole batch, (including the entries of deleted records)
+		memcpy(ctx->last_key, ctx->batch_key, ctx->cb_batch_key);
+		ctx->cb_last_key = ctx->cb_batch_key;
+		ctx->last_event_id = ctx->batch_event_id;
+	}
+	return rc;
+}
+
+static ssize_t event_store_replay(struct event_store * store, const char * topic, int64_t from, int64_t to,
+	event_store_on_record_fn on_record, void * user_data)
+{
+	assert(store && store->dbp && on_record);
+	if(NULL == store->index_dbp) return -1;
+	size_t cb_topic = topic?strlen(topic):0;
+	if(0 == cb_topic || cb_topic > EVENT_STORE_MAX_TOPIC_LENGTH) return -1;
+	if(from < 0) from = 0;
+	if(to < from) return 0;
+
+	struct replay_context * ctx = calloc(1, sizeof(*ctx));
+	assert(ctx);
+	ctx->store = store;
+	ctx->on_record = on_record;
+	ctx->user_data = user_data;
+	ctx->cb_to_key = event_store_make_index_key(topic, cb_topic, to, ctx->to_key);
+	ctx->cb_last_key = event_store_make_index_key(topic, cb_topic, from, ctx->last_key);
+	ctx->index_buf = malloc(REPLAY_BULK_BUFFER_SIZE);
+	ctx->data_buf = malloc(REPLAY_BULK_BUFFER_SIZE);
+	assert(ctx->index_buf && ctx->data_buf);
+
+	int rc = 0;
+	int retries = 0;
+	while(!ctx->done && !ctx->stopped) {
+		rc = replay_walk(ctx);
+		if(0 == rc) continue;
+		if(rc != DB_LOCK_DEADLOCK || ++retries > REPLAY_MAX_RETRIES) break;
+	}
+	if(ctx->stopped) rc = 0;
+	if(rc) store->dbp->err(store->dbp, rc, "%s(topic=%s)", __FUNCTION__, topic);
+
+	ssize_t num_records = rc?-1:ctx->num_records;
+	free(ctx->index_buf);
+	free(ctx->data_buf);
+	free(ctx->record_buf);
+	free(ctx->event_ids);
+	free(ctx->staged_buf);
+	free(ctx->staged);
+	free(ctx);
+	return num_records;
+}
+
+/********************************************************
+* writer thread
+********************************************************/
+static int write_batch(struct event_store_writer * writer, struct pending_write * first, size_t count)
+{
+	// one transaction, committed without a log flush: the group is flushed once by the caller
+	DB_ENV * db_env = writer->db_env;
+	DB * dbp = writer->store->dbp;
+	int rc = 0;
+	for(int retries = 0; retries <= WRITER_MAX_RETRIES; ++retries) {
+		DB_TXN * txn = NULL;
+		rc = db_env->txn_begin(db_env, NULL, &txn, 0);
+		if(rc) break;
+
+		struct pending_write * write = first;
+		for(size_t i = 0; 0 == rc && i < count; ++i, write = write->next) {
+			uint64_t be_event_id = htobe64(write->event_id);
+			DBT key, value;
+			memset(&key, 0, sizeof(key));
+			memset(&value, 0, sizeof(value));
+			key.data = &be_event_id;
+			key.size = sizeof(be_event_id);
+			value.data = write->record;
+			value.size = write->size;
+			rc = dbp->put(dbp, txn, &key, &value, 0);	// (updates the secondary db in the same txn)
+		}
+		if(rc) {
+			txn->abort(txn);
+			if(rc == DB_LOCK_DEADLOCK) continue;	// (readers of the secondary db), retry the whole batch
+			break;
+		}
+		rc = txn->commit(txn, DB_TXN_NOSYNC);
+		break;
+	}
+	if(rc) db_env->err(db_env, rc, "%s(event_id=%lu, count=%ld)", __FUNCTION__, (unsigned long)first->event_id, (long)count);
+	return rc?-1:0;
+}
+
+static void complete_waiters(struct event_store_writer * writer, uint64_t last_failed_event_id, struct sync_waiter ** p_callbacks)
+{
+	// writer->mutex is locked
+	int num_woken = 0;
+	struct sync_waiter ** p_next = &writer->waiters;
+	struct sync_waiter * waiter = NULL;
+	while((waiter = *p_next)) {
+		if(last_failed_event_id > waiter->since_event_id) waiter->status = -1;
+		if(waiter->target_event_id > writer->synced_event_id) {	// (still queued)
+			p_next = &waiter->next;
+			continue;
+		}
+		*p_next = waiter->next;
+		if(waiter->on_synced) {
+			waiter->next = *p_callbacks;
+			*p_callbacks = waiter;
+		}else {
+			waiter->done = 1;
+			++num_woken;
+		}
+	}
+	if(num_woken) pthread_cond_broadcast(&writer->synced_cond);
+}
+
+static void * writer_thread(void * user_data)
+{
+	struct event_store_writer * writer = user_data;
+	DB_ENV * db_env = writer->db_env;
+	struct timespec last_checkpoint;
+	clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+
+	pthread_mutex_lock(&writer->mutex);
+	while(1) {
+		if(NULL == writer->head) {
+			if(writer->quit) break;
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec += 1;
+			pthread_cond_timedwait(&writer->cond, &writer->mutex, &timeout);
+		}
+
+		// take every queued write: the group shares one log flush
+		struct pending_write * group = writer->head;
+		writer->head = NULL;
+		writer->p_tail = &writer->head;
+		writer->num_pending = 0;
+		pthread_mutex_unlock(&writer->mutex);
+
+		uint64_t last_event_id = 0;
+		uint64_t last_failed_event_id = 0;
+		int num_batches = 0;
+		while(group) {
+			struct pending_write * first = group;
+			size_t count = 0;
+			while(group && count < writer->max_batch) {
+				last_event_id = group->event_id;
+				group = group->next;
+				++count;
+			}
+			if(write_batch(writer, first, count)) last_failed_event_id = last_event_id;
+			++num_batches;
+
+			while(first != group) {
+				struct pending_write * write = first;
+				first = first->next;
+				free(write);
+			}
+		}
+		if(num_batches > 0 && writer->flush_log) {
+			int rc = db_env->log_flush(db_env, NULL);
+			if(rc) {
+				db_env->err(db_env, rc, "%s(): log_flush", __FUNCTION__);
+				last_failed_event_id = last_event_id;	// none of the group is known to be durable
+			}
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(writer->checkpoint_interval > 0 && (now.tv_sec - last_checkpoint.tv_sec) >= writer->checkpoint_interval) {
+			last_checkpoint = now;
+			int rc = db_env->txn_checkpoint(db_env, 0, 0, 0);	// bounds the recovery time and lets the logs be removed
+			if(rc) db_env->err(db_env, rc, "%s(): txn_checkpoint", __FUNCTION__);
+		}
+
+		struct sync_waiter * callbacks = NULL;
+		pthread_mutex_lock(&writer->mutex);
+		if(0 == num_batches) continue;
+		writer->synced_event_id = last_event_id;
+		if(last_failed_event_id) writer->last_failed_event_id = last_failed_event_id;
+		complete_waiters(writer, last_failed_event_id, &callbacks);
+		if(NULL == callbacks) continue;
+
+		pthread_mutex_unlock(&writer->mutex);
+		while(callbacks) {
+			struct sync_waiter * waiter = callbacks;
+			callbacks = callbacks->next;
+			waiter->on_synced(waiter->user_data, waiter->status);
+			free(waiter);
+		}
+		pthread_mutex_lock(&writer->mutex);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+	return NULL;
+}
+
+static void writer_stop(struct event_store_writer * writer)
+{
+	// the thread drains the queue before exiting
+	pthread_mutex_lock(&writer->mutex);
+	writer->quit = 1;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	pthread_join(writer->th, NULL);
+
+	assert(NULL == writer->head && NULL == writer->waiters);
+	pthread_cond_destroy(&writer->synced_cond);
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+	free(writer);
+}
+
+int event_store_start_writer(event_store_t * store, DB_ENV * db_env, size_t max_batch, size_t max_pending,
+	int flush_log, unsigned int checkpoint_interval)
+{
+	assert(store && store->priv && db_env);
+	struct event_store_private * priv = store->priv;
+	if(priv->writer) return 0;
+
+	struct event_store_writer * writer = calloc(1, sizeof(*writer));
+	assert(writer);
+	writer->store = store;
+	writer->db_env = db_env;
+	writer->max_batch = max_batch?max_batch:4096;
+	writer->max_pending = max_pending?max_pending:100000;
+	writer->flush_log = flush_log;
+	writer->checkpoint_interval = checkpoint_interval;
+	writer->p_tail = &writer->head;
+	writer->synced_event_id = priv->last_event_id;
+
+	int rc = pthread_mutex_init(&writer->mutex, NULL);
+	assert(0 == rc);
+	rc = pthread_cond_init(&writer->cond, NULL);
+	assert(0 == rc);
+	rc = pthread_cond_init(&writer->synced_cond, NULL);
+	assert(0 == rc);
+
+	rc = pthread_create(&writer->th, NULL, writer_thread, writer);
+	if(rc) {
+		fprintf(stderr, "[ERROR]: %s(): pthread_create: %s\n", __FUNCTION__, strerror(rc));
+		pthread_cond_destroy(&writer->synced_cond);
+		pthread_cond_destroy(&writer->cond);
+		pthread_mutex_destroy(&writer->mutex);
+		free(writer);
+		return -1;
+	}
+	priv->writer = writer;
+	debug_printf("event store writer started: max_batch=%ld, max_pending=%ld, flush_log=%d",
+		(long)writer->max_batch, (long)writer->max_pending, flush_log);
+	return 0;
+}
+
+event_store_t * event_store_init(event_store_t * store, DB * dbp, DB * sdbp, DB * index_dbp, void * user_data)
+{
+	assert(dbp && sdbp);
+	uint64_t last_event_id = 0;
+	if(load_last_event_id(dbp, &last_event_id)) return NULL;
+
+	int rc = dbp->associate(dbp, NULL, sdbp, get_index_key, 0);
+	if(rc) {
+		dbp->err(dbp, rc, "%s(): associate", __FUNCTION__);
+		return NULL;
+	}
+
+	if(NULL == store) store = calloc(1, sizeof(*store));
+	assert(store);
+	store->user_data = user_data;
+	store->dbp = dbp;
+	store->sdbp = sdbp;
+	store->index_dbp = index_dbp;
+	store->append = event_store_append;
+	store->get_last_event_id = event_store_get_last_event_id;
+	store->sync = event_store_sync;
+	store->get = event_store_get;
+	store->replay = event_store_replay;
+
+	struct event_store_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->store = store;
+	priv->last_event_id = last_event_id;
+	store->priv = priv;
+
+	debug_printf("event store opened, last event_id: %lu", (unsigned long)last_event_id);
+	return store;
+}
+
+void event_store_cleanup(event_store_t * store)
+{
+	if(NULL == store) return;
+	struct event_store_private * priv = store->priv;
+	if(priv && priv->writer) {
+		writer_stop(priv->writer);
+		priv->writer = NULL;
+	}
+	free(priv);
+	store->priv = NULL;
+	store->dbp = NULL;
+	store->sdbp = NULL;
+	store->index_dbp = NULL;
+}
@@ -68,7 +68,43 @@ static void events_topic_private_free(struct events_topic_private * priv)
 
 static int events_topic_publish(struct events_topic_context * eva_topic, /* const */ json_object * jevent) 
 {
-	return 0;
+	assert(eva_topic && eva_topic->priv);
+	struct events_topic_private * priv = eva_topic->priv;
+	if(NULL == jevent) return -1;
+	
+	// custom-backend: deliver to the local subscriber directly
+	int rc = 0;
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	if(eva_topic->on_notify_raw) {
+		size_t length = 0;
+		const char * data = json_object_to_json_string_length(jevent, JSON_C_TO_STRING_PLAIN, &length);
+		rc = data?eva_topic->on_notify_raw(eva_topic, data, length, eva_topic->notify_data):-1;
+	}else if(eva_topic->on_notify) {
+		rc = eva_topic->on_notify(eva_topic, jevent, eva_topic->notify_data);
+	}
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return rc;
+}
+static int events_topic_publish_raw(struct events_topic_context * eva_topic, const char * data, size_t length)
+{
+	assert(eva_topic && eva_topic->priv);
+	struct events_topic_private * priv = eva_topic->priv;
+	if(NULL == data || 0 == length) return -1;
+	
+	int rc = 0;
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	if(eva_topic->on_notify_raw) {
+		rc = eva_topic->on_notify_raw(eva_topic, data, length, eva_topic->notify_data);
+	}else if(eva_topic->on_notify) {
+		json_tokener * tok = json_tokener_new();
+		json_object * jevent = json_tokener_parse_ex(tok, data, length);
+		json_tokener_free(tok);
+		
+		rc = jevent?eva_topic->on_notify(eva_topic, jevent, eva_topic->notify_data):-1;
+		if(jevent) json_object_put(jevent);
+	}
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return rc;
 }
 static int events_topic_consume(struct events_topic_context * eva_topic, 
 	events_topic_on_notify_fn on_notify, 
@@ -90,6 +126,7 @@ struct events_topic_context * events_topic_context_new(struct events_agency * ev
 
 	eva_topic->publish = events_topic_publish;
 	eva_topic->consume = events_topic_consume;
+	eva_topic->publish_raw = events_topic_publish_raw;
 
 	return eva_topic;
 }
@@ -130,7 +167,7 @@ static int events_topic_compare(const void *_a, const void *_b)
 	if(a->topic || b->topic) 
 	{
 		if(NULL == a->topic) return -1;
-		if(NULL == b->topic) return -1;
+		if(NULL == b->topic) return 1;
 		cmp = strcmp(a->topic, b->topic);
 	}
 	return cmp;
@@ -177,7 +214,25 @@ static void events_agency_private_free(struct events_agency_private * priv)
 ********************************************************/
 static int events_agency_load_config(struct events_agency * eva, /* const */ json_object * jconfig)
 {
-	return -1;
+	assert(eva);
+	if(NULL == jconfig) return -1;
+	
+	if(eva->jconfig) json_object_put(eva->jconfig);
+	eva->jconfig = json_object_get(jconfig);
+	
+	json_object * jagency = NULL;
+	if(!json_object_object_get_ex(jconfig, "events_agency", &jagency) || NULL == jagency) return 0;
+	
+	json_object * jvalue = NULL;
+	if(json_object_object_get_ex(jagency, "broker", &jvalue)) {
+		if(eva->bootstap_broker_uri) free(eva->bootstap_broker_uri);
+		eva->bootstap_broker_uri = strdup(json_object_get_string(jvalue));
+	}
+	if(json_object_object_get_ex(jagency, "topic", &jvalue)) {
+		if(eva->topic) free(eva->topic);
+		eva->topic = strdup(json_object_get_string(jvalue));
+	}
+	return 0;
 }
 
 static events_topic_context * events_agency_find_topic(struct events_agency * eva, const char * broker, const char * topic)
@@ -190,9 +245,11 @@ static events_topic_context * events_agency_find_topic(struct events_agency * ev
 		.topic = (char *)topic,
 	}};
 
+	pthread_rwlock_rdlock(&priv->rw_lock);
 	void * p_node = tfind(pattern, &priv->events_root, events_topic_compare);
-	if(p_node) return *(void **)p_node;
-	return NULL;
+	struct events_topic_context * eva_topic = p_node?*(void **)p_node:NULL;
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return eva_topic;
 }
 
 static struct events_topic_context * events_agency_subscribe(struct events_agency * eva, 
@@ -223,7 +280,9 @@ static struct events_topic_context * events_agency_subscribe(struct events_agenc
 	eva_topic->notify_data = notify_data;
 	eva_topic->on_free_data = on_free_data;
 
+	pthread_rwlock_wrlock(&priv->rw_lock);
 	void * p_node = tsearch(eva_topic, &priv->events_root, events_topic_compare);
+	pthread_rwlock_unlock(&priv->rw_lock);
 	assert(p_node && *(void **)p_node == (void *)eva_topic);
 
 	return eva_topic;
@@ -237,7 +296,9 @@ static int events_agency_unscribe(struct events_agency * eva, const char * broke
 	struct events_topic_context * eva_topic = events_agency_find_topic(eva, broker, topic);
 	if(NULL == eva_topic) return -1;
 	
+	pthread_rwlock_wrlock(&priv->rw_lock);
 	tdelete(eva_topic, &priv->events_root, events_topic_compare);
+	pthread_rwlock_unlock(&priv->rw_lock);
 	events_topic_context_free(eva_topic);
 	return 0;
 }
@@ -267,5 +328,9 @@ void events_agency_cleanup(struct events_agency * eva)
 	if(NULL == eva) return;
 	events_agency_private_free(eva->priv);
 	eva->priv = NULL;
+	
+	if(eva->bootstap_broker_uri) { free(eva->bootstap_broker_uri); eva->bootstap_broker_uri = NULL; }
+	if(eva->topic) { free(eva->topic); eva->topic = NULL; }
+	if(eva->jconfig) { json_object_put(eva->jconfig); eva->jconfig = NULL; }
 	return;
 }
@@ -0,0 +1,329 @@
+/*
+ * file-cache.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+#include <glib.h>
+#include "file-cache.h"
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************
+* content types
+********************************************************/
+static const struct
+{
+	const char * ext;
+	const char * content_type;
+}s_content_types[] = {
+	{ "html", "text/html; charset=utf-8" },
+	{ "htm",  "text/html; charset=utf-8" },
+	{ "js",   "application/javascript; charset=utf-8" },
+	{ "mjs",  "application/javascript; charset=utf-8" },
+	{ "css",  "text/css; charset=utf-8" },
+	{ "json", "application/json" },
+	{ "map",  "application/json" },
+	{ "txt",  "text/plain; charset=utf-8" },
+	{ "svg",  "image/svg+xml" },
+	{ "png",  "image/png" },
+	{ "jpg",  "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif",  "image/gif" },
+	{ "ico",  "image/x-icon" },
+	{ "webp", "image/webp" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "wasm", "application/wasm" },
+};
+
+const char * file_cache_guess_content_type(const char * path)
+{
+	const char * ext = path?strrchr(path, '.'):NULL;
+	if(NULL == ext || strchr(ext, '/')) return "application/octet-stream";
+	++ext;
+	for(size_t i = 0; i < sizeof(s_content_types) / sizeof(s_content_types[0]); ++i) {
+		if(0 == strcasecmp(ext, s_content_types[i].ext)) return s_content_types[i].content_type;
+	}
+	return "application/octet-stream";
+}
+
+/********************************************************
+* struct file_cache_entry
+********************************************************/
+void file_cache_entry_unref(file_cache_entry_t * entry)
+{
+	if(NULL == entry) return;
+	if(__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	if(entry->data) munmap((void *)entry->data, entry->size);
+	free(entry->path);
+	free(entry);
+}
+
+static inline int is_same_file(const file_cache_entry_t * entry, const struct stat * st)
+{
+	return entry->ino == st->st_ino
+		&& entry->size == (size_t)st->st_size
+		&& entry->mtime.tv_sec == st->st_mtim.tv_sec
+		&& entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int open_beneath(int root_fd, const char * path)
+{
+	// one segment at a time: symlinks are never followed, (is_valid_path() has already rejected "..")
+	char * segments = strdup(path);
+	assert(segments);
+
+	int dir_fd = root_fd;
+	int fd = -1;
+	char * p = segments;
+	while(p) {
+		char * p_next = strchr(p, '/');
+		if(p_next) *p_next++ = '\0';
+
+		int flags = O_RDONLY | O_CLOEXEC | O_NOFOLLOW | (p_next?O_DIRECTORY:0);
+		fd = openat(dir_fd, p, flags);
+		if(dir_fd != root_fd) close(dir_fd);
+		if(fd < 0) break;
+
+		if(p_next) dir_fd = fd;
+		p = p_next;
+	}
+	free(segments);
+	return fd;
+}
+
+static file_cache_entry_t * file_cache_entry_load(int root_fd, const char * path)
+{
+	int fd = open_beneath(root_fd, path);
+	if(fd < 0) return NULL;
+
+	struct stat st[1];
+	memset(st, 0, sizeof(st));
+	if(fstat(fd, st) || !S_ISREG(st->st_mode)) {
+		close(fd);
+		errno = EACCES;
+		return NULL;
+	}
+
+	// MAP_PRIVATE: the pages are never written back, but they are not a snapshot either,
+	// (see file-cache.h: a file truncated in place makes its readers fault)
+	void * data = NULL;
+	size_t size = st->st_size;
+	if(size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			perror("file_cache_entry_load()::mmap()");
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);	// the mapping holds its own reference to the file
+
+	file_cache_entry_t * entry = calloc(1, sizeof(*entry));
+	assert(entry);
+	entry->refs = 1;
+	entry->path = strdup(path);
+	entry->data = data;
+	entry->size = size;
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtim;
+	entry->checked_at = monotonic_ns();
+	entry->content_type = file_cache_guess_content_type(path);
+	snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx-%lx.%lx\"",
+		(unsigned long)st->st_ino, (unsigned long)st->st_size,
+		(unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+	return entry;
+}
+
+/********************************************************
+* struct file_cache_private
+********************************************************/
+struct file_cache_private
+{
+	struct file_cache * cache;
+	int root_fd;
+
+	pthread_rwlock_t rw_lock;
+	GHashTable * entries;	// path --> (file_cache_entry_t *), key owned by the entry
+	size_t total_size;
+};
+static struct file_cache_private * file_cache_private_new(struct file_cache * cache)
+{
+	struct file_cache_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+
+	priv->root_fd = open(cache->document_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(priv->root_fd < 0) {
+		perror(cache->document_root);
+		free(priv);
+		return NULL;
+	}
+
+	int rc = pthread_rwlock_init(&priv->rw_lock, NULL);
+	assert(0 == rc);
+	priv->entries = g_hash_table_new(g_str_hash, g_str_equal);
+
+	cache->priv = priv;
+	priv->cache = cache;
+	return priv;
+}
+
+static void unref_entry(gpointer key, gpointer value, gpointer user_data)
+{
+	file_cache_entry_unref(value);
+}
+static void file_cache_private_free(struct file_cache_private * priv)
+{
+	if(NULL == priv) return;
+	g_hash_table_foreach(priv->entries, unref_entry, NULL);
+	g_hash_table_destroy(priv->entries);
+	pthread_rwlock_destroy(&priv->rw_lock);
+	if(priv->root_fd >= 0) close(priv->root_fd);
+	free(priv);
+}
+
+static void detach_entry(struct file_cache_private * priv, const char * path)
+{
+	// priv->rw_lock is locked for writing
+	file_cache_entry_t * old_entry = g_hash_table_lookup(priv->entries, path);
+	if(NULL == old_entry) return;
+
+	g_hash_table_remove(priv->entries, path);
+	priv->total_size -= old_entry->size;
+	file_cache_entry_unref(old_entry);	// the table's reference
+}
+
+static int is_valid_path(const char * path)
+{
+	// relative paths only, no "..", no hidden files
+	if(NULL == path || !path[0] || path[0] == '/') return 0;
+	const char * p = path;
+	while(*p) {
+		const char * p_end = strchr(p, '/');
+		if(NULL == p_end) p_end = p + strlen(p);
+		if(p_end == p || p[0] == '.') return 0;	// empty segment, ".", ".." or ".hidden"
+		p = *p_end?(p_end + 1):p_end;
+	}
+	return 1;
+}
+
+/********************************************************
+* struct file_cache
+********************************************************/
+static file_cache_entry_t * file_cache_get(struct file_cache * cache, const char * path)
+{
+	assert(cache && cache->priv);
+	struct file_cache_private * priv = cache->priv;
+	if(!is_valid_path(path)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	uint64_t now = monotonic_ns();
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	file_cache_entry_t * entry = g_hash_table_lookup(priv->entries, path);
+	if(entry) __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	if(entry) {
+		uint64_t checked_at = __atomic_load_n(&entry->checked_at, __ATOMIC_RELAXED);
+		if((now - checked_at) < (uint64_t)cache->revalidate_ms * 1000000ULL) return entry;
+
+		struct stat st[1];
+		if(0 == fstatat(priv->root_fd, path, st, AT_SYMLINK_NOFOLLOW) && is_same_file(entry, st)) {
+			__atomic_store_n(&entry->checked_at, now, __ATOMIC_RELAXED);
+			return entry;
+		}
+		file_cache_entry_unref(entry);	// changed or removed
+		entry = NULL;
+	}
+
+	entry = file_cache_entry_load(priv->root_fd, path);
+
+	pthread_rwlock_wrlock(&priv->rw_lock);
+	detach_entry(priv, path);
+	if(entry && entry->size <= cache->max_file_size && (priv->total_size + entry->size) <= cache->max_total_size) {
+		__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);	// the table's reference
+		g_hash_table_insert(priv->entries, entry->path, entry);
+		priv->total_size += entry->size;
+	}
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	return entry;
+}
+
+file_cache_t * file_cache_init(file_cache_t * cache, const char * document_root,
+	size_t max_file_size, size_t max_total_size, unsigned int revalidate_ms, void * user_data)
+{
+	assert(document_root && document_root[0]);
+	int auto_free = (NULL == cache);
+	if(NULL == cache) cache = calloc(1, sizeof(*cache));
+	assert(cache);
+
+	cache->user_data = user_data;
+	cache->document_root = strdup(document_root);
+	cache->max_file_size = max_file_size;
+	cache->max_total_size = max_total_size;
+	cache->revalidate_ms = revalidate_ms;
+	cache->get = file_cache_get;
+
+	struct file_cache_private * priv = file_cache_private_new(cache);
+	if(NULL == priv) {
+		free(cache->document_root);
+		cache->document_root = NULL;
+		if(auto_free) free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void file_cache_cleanup(file_cache_t * cache)
+{
+	if(NULL == cache) return;
+	file_cache_private_free(cache->priv);
+	cache->priv = NULL;
+	free(cache->document_root);
+	cache->document_root = NULL;
+}
@@ -0,0 +1,251 @@
+/*
+ * http-auth.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "utils.h"
+
+/********************************************************
+* struct auth_waiter: a paused request
+* created and released in the request's GMainContext
+********************************************************/
+struct auth_waiter
+{
+	global_params_t * params;
+	SoupServer * server;
+	SoupMessage * msg;
+	GMainContext * context;
+	gateway_auth_done_fn on_done;
+	void * user_data;
+	int finished;	// the connection was closed while verifying
+
+	int status;
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE];
+};
+
+/********************************************************
+* struct auth_request: one distinct token in flight,
+* concurrent requests carrying the same token wait for the same verification
+********************************************************/
+struct auth_request
+{
+	char * token;	// key of queue->pending
+	size_t cb_token;
+	GList * waiters;	// list of (struct auth_waiter *)
+};
+
+struct gateway_auth_queue
+{
+	global_params_t * params;
+	GThreadPool * pool;
+	size_t max_pending;
+
+	GMutex mutex;
+	GHashTable * pending;	// token --> (struct auth_request *)
+};
+
+static void on_waiter_msg_finished(SoupMessage * msg, gpointer user_data)
+{
+	struct auth_waiter * waiter = user_data;
+	waiter->finished = 1;
+}
+
+static gboolean on_waiter_done(gpointer user_data)
+{
+	// runs in the request's GMainContext
+	struct auth_waiter * waiter = user_data;
+	SoupMessage * msg = waiter->msg;
+	g_signal_handlers_disconnect_by_func(msg, on_waiter_msg_finished, waiter);
+
+	if(!waiter->finished) {
+		if(waiter->status == jwt_auth_status_ok) {
+			g_object_set_data_full(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY, g_strdup(waiter->subject), g_free);
+		}
+		waiter->on_done(waiter->params, waiter->server, msg, waiter->status, waiter->user_data);
+		soup_server_unpause_message(waiter->server, msg);
+	}
+
+	g_object_unref(msg);
+	g_main_context_unref(waiter->context);
+	free(waiter);
+	return G_SOURCE_REMOVE;
+}
+
+static void verify_worker(gpointer data, gpointer user_data)
+{
+	struct auth_request * request = data;
+	struct gateway_auth_queue * queue = user_data;
+	jwt_auth_t * auth = queue->params->jwt_auth;
+
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE] = "";
+	int status = auth->verify(auth, request->token, request->cb_token, subject);	// caches the result
+
+	// late waiters either joined this request or will find the token in the cache
+	g_mutex_lock(&queue->mutex);
+	g_hash_table_remove(queue->pending, request->token);
+	GList * waiters = request->waiters;
+	request->waiters = NULL;
+	g_mutex_unlock(&queue->mutex);
+
+	for(GList * item = waiters; item; item = item->next) {
+		struct auth_waiter * waiter = item->data;
+		waiter->status = status;
+		if(status == jwt_auth_status_ok) memcpy(waiter->subject, subject, sizeof(subject));
+		g_main_context_invoke(waiter->context, on_waiter_done, waiter);
+	}
+	g_list_free(waiters);
+	free(request->token);
+	free(request);
+}
+
+struct gateway_auth_queue * gateway_auth_queue_new(global_params_t * params, int num_threads, size_t max_pending)
+{
+	assert(params && params->jwt_auth);
+	if(num_threads < 0) num_threads = g_get_num_processors();
+	if(num_threads == 0) return NULL;	// synchronous verification
+	if(max_pending < 1) max_pending = 1;
+
+	struct gateway_auth_queue * queue = calloc(1, sizeof(*queue));
+	assert(queue);
+	queue->params = params;
+	queue->max_pending = max_pending;
+	g_mutex_init(&queue->mutex);
+	queue->pending = g_hash_table_new(g_str_hash, g_str_equal);
+
+	GError * gerr = NULL;
+	queue->pool = g_thread_pool_new(verify_worker, queue, num_threads, TRUE, &gerr);
+	if(gerr) {
+		fprintf(stderr, "[ERROR]: %s(): g_thread_pool_new: %s\n", __FUNCTION__, gerr->message);
+		g_error_free(gerr);
+	}
+	assert(queue->pool);
+	return queue;
+}
+
+void gateway_auth_queue_free(struct gateway_auth_queue * queue)
+{
+	if(NULL == queue) return;
+	g_thread_pool_free(queue->pool, FALSE, TRUE);	// finish the queued verifications
+	g_hash_table_destroy(queue->pending);
+	g_mutex_clear(&queue->mutex);
+	free(queue);
+}
+
+static int gateway_auth_queue_push(struct gateway_auth_queue * queue, SoupServer * server, SoupMessage * msg,
+	const char * token, size_t cb_token, gateway_auth_done_fn on_done, void * user_data)
+{
+	char * sz_token = strndup(token, cb_token);
+	assert(sz_token);
+
+	g_mutex_lock(&queue->mutex);
+	struct auth_request * request = g_hash_table_lookup(queue->pending, sz_token);
+	if(NULL == request && g_hash_table_size(queue->pending) >= queue->max_pending) {
+		g_mutex_unlock(&queue->mutex);
+		free(sz_token);
+		return GATEWAY_AUTH_BUSY;
+	}
+
+	struct auth_waiter * waiter = calloc(1, sizeof(*waiter));
+	assert(waiter);
+	waiter->params = queue->params;
+	waiter->server = server;
+	waiter->msg = g_object_ref(msg);
+	waiter->context = g_main_context_ref_thread_default();
+	waiter->on_done = on_done;
+	waiter->user_data = user_data;
+	g_signal_connect(msg, "finished", G_CALLBACK(on_waiter_msg_finished), waiter);
+	soup_server_pause_message(server, msg);
+
+	if(request) {
+		free(sz_token);
+		request->waiters = g_list_prepend(request->waiters, waiter);
+	}else {
+		request = calloc(1, sizeof(*request));
+		assert(request);
+		request->token = sz_token;
+		request->cb_token = cb_token;
+		request->waiters = g_list_prepend(NULL, waiter);
+		g_hash_table_insert(queue->pending, request->token, request);
+		g_thread_pool_push(queue->pool, request, NULL);
+	}
+	g_mutex_unlock(&queue->mutex);
+	return GATEWAY_AUTH_PENDING;
+}
+
+/********************************************************
+* Authorization: Bearer <token>
+********************************************************/
+int gateway_get_bearer_token(SoupMessage * msg, const char ** p_token, size_t * p_length)
+{
+	const char * authorization = soup_message_headers_get_one(msg->request_headers, "Authorization");
+	if(NULL == authorization) return GATEWAY_AUTH_NO_TOKEN;
+
+	static const char scheme[] = "Bearer";
+	while(is_white_char(*authorization)) ++authorization;
+	if(g_ascii_strncasecmp(authorization, scheme, sizeof(scheme) - 1) || !is_white_char(authorization[sizeof(scheme) - 1])) {
+		return jwt_auth_status_invalid;
+	}
+	const char * token = authorization + sizeof(scheme);
+	while(is_white_char(*token)) ++token;
+	const char * p_end = token + strlen(token);
+	while(p_end > token && is_white_char(p_end[-1])) --p_end;
+
+	*p_token = token;
+	*p_length = p_end - token;
+	return jwt_auth_status_ok;
+}
+
+int gateway_authenticate(global_params_t * params, SoupServer * server, SoupMessage * msg,
+	gateway_auth_done_fn on_done, void * user_data)
+{
+	jwt_auth_t * auth = params->jwt_auth;
+	if(NULL == auth) return GATEWAY_AUTH_NO_TOKEN;
+
+	const char * token = NULL;
+	size_t cb_token = 0;
+	int status = gateway_get_bearer_token(msg, &token, &cb_token);
+	if(status != jwt_auth_status_ok) return status;
+
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE] = "";
+	status = auth->lookup(auth, token, cb_token, subject);
+	if(status == 1) {
+		// not verified yet: off the main loop if possible
+		if(params->auth_queue && on_done) {
+			return gateway_auth_queue_push(params->auth_queue, server, msg, token, cb_token, on_done, user_data);
+		}
+		status = auth->verify(auth, token, cb_token, subject);
+	}
+	if(status == jwt_auth_status_ok) {
+		g_object_set_data_full(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY, g_strdup(subject), g_free);
+	}
+	return status;
+}
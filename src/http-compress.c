@@ -0,0 +1,254 @@
+/*
+ * http-compress.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+
+#include "api-gateway.h"
+#include "auto_buffer.h"
+#include "utils.h"
+
+#define HTTP_CODEC_BUFFER_SIZE (16384)
+#define HTTP_RESPONSE_CHUNK_SIZE (64 * 1024)	// body bytes compressed per response chunk
+
+/********************************************************
+* struct http_codec
+********************************************************/
+static int http_codec_update(struct http_codec * codec, const void * data, size_t length, enum http_codec_flush flush,
+	http_codec_output_fn on_output, void * user_data)
+{
+	assert(codec && codec->priv);
+	z_stream * zs = codec->priv;
+	if(codec->err) return -1;
+	if(codec->finished) {
+		if(length > 0) codec->err = Z_DATA_ERROR;	// trailing garbage
+		return codec->err?-1:0;
+	}
+
+	int z_flush = Z_NO_FLUSH;
+	if(codec->compress) {
+		if(flush == http_codec_sync_flush) z_flush = Z_SYNC_FLUSH;
+		else if(flush == http_codec_finish) z_flush = Z_FINISH;
+	}
+
+	unsigned char out[HTTP_CODEC_BUFFER_SIZE];
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = length;
+	while(1) {
+		zs->next_out = out;
+		zs->avail_out = sizeof(out);
+
+		int rc = codec->compress?deflate(zs, z_flush):inflate(zs, Z_NO_FLUSH);
+		if(rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			codec->err = rc;
+			return -1;
+		}
+
+		size_t cb_out = sizeof(out) - zs->avail_out;
+		if(cb_out > 0 && on_output(user_data, out, cb_out)) {
+			codec->err = Z_ERRNO;
+			return -1;
+		}
+
+		if(rc == Z_STREAM_END) {
+			if(!codec->compress && zs->avail_in > 0) {	// concatenated gzip members
+				inflateReset(zs);
+				continue;
+			}
+			codec->finished = 1;
+			break;
+		}
+		if(rc == Z_BUF_ERROR) break;	// no progress possible
+		if(zs->avail_in == 0 && zs->avail_out > 0) {
+			if(!(codec->compress && z_flush == Z_FINISH)) break;
+		}
+	}
+
+	if(!codec->compress && flush == http_codec_finish && !codec->finished) {
+		codec->err = Z_DATA_ERROR;	// truncated stream
+		return -1;
+	}
+	return 0;
+}
+
+http_codec_t * http_codec_init(http_codec_t * codec, enum http_content_encoding encoding, int compress, int level)
+{
+	assert(encoding == http_content_encoding_gzip || encoding == http_content_encoding_deflate);
+	if(NULL == codec) codec = calloc(1, sizeof(*codec));
+	assert(codec);
+
+	z_stream * zs = calloc(1, sizeof(*zs));
+	assert(zs);
+
+	int rc = 0;
+	if(compress) {
+		int window_bits = (encoding == http_content_encoding_gzip)?(15 + 16):15;
+		rc = deflateInit2(zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+	}else {
+		rc = inflateInit2(zs, 15 + 32);	// auto-detect the zlib or gzip header
+	}
+	assert(Z_OK == rc);
+
+	codec->priv = zs;
+	codec->encoding = encoding;
+	codec->compress = compress;
+	codec->update = http_codec_update;
+	return codec;
+}
+
+void http_codec_cleanup(http_codec_t * codec)
+{
+	if(NULL == codec || NULL == codec->priv) return;
+	z_stream * zs = codec->priv;
+	if(codec->compress) deflateEnd(zs);
+	else inflateEnd(zs);
+	free(zs);
+	codec->priv = NULL;
+}
+
+/********************************************************
+* negotiation
+********************************************************/
+enum http_content_encoding http_content_encoding_parse(const char * content_encoding)
+{
+	if(NULL == content_encoding || !content_encoding[0]) return http_content_encoding_identity;
+	if(0 == strcasecmp(content_encoding, "identity")) return http_content_encoding_identity;
+	if(0 == strcasecmp(content_encoding, "gzip") || 0 == strcasecmp(content_encoding, "x-gzip")) return http_content_encoding_gzip;
+	if(0 == strcasecmp(content_encoding, "deflate")) return http_content_encoding_deflate;
+	return http_content_encoding_unsupported;
+}
+
+const char * http_content_encoding_to_string(enum http_content_encoding encoding)
+{
+	switch(encoding) {
+	case http_content_encoding_gzip: return "gzip";
+	case http_content_encoding_deflate: return "deflate";
+	case http_content_encoding_identity: return "identity";
+	default: break;
+	}
+	return NULL;
+}
+
+enum http_content_encoding http_accept_encoding_negotiate(global_params_t * params, SoupMessage * msg)
+{
+	if(!params->compression.enabled) return http_content_encoding_identity;
+
+	const char * accept_encoding = soup_message_headers_get_list(msg->request_headers, "Accept-Encoding");
+	if(NULL == accept_encoding) return http_content_encoding_identity;
+
+	// sorted by qvalue, (q=0 entries are excluded)
+	enum http_content_encoding encoding = http_content_encoding_identity;
+	GSList * list = soup_header_parse_quality_list(accept_encoding, NULL);
+	for(GSList * item = list; item; item = item->next) {
+		const char * name = item->data;
+		if(0 == strcmp(name, "*")) encoding = http_content_encoding_gzip;
+		else encoding = http_content_encoding_parse(name);
+		if(encoding == http_content_encoding_gzip || encoding == http_content_encoding_deflate) break;
+		encoding = http_content_encoding_identity;
+	}
+	soup_header_free_list(list);
+	return encoding;
+}
+
+/********************************************************
+* responses
+********************************************************/
+static int on_compressed_output(void * user_data, const void * data, size_t length)
+{
+	auto_buffer_t * buf = user_data;
+	return auto_buffer_push(buf, data, length);
+}
+
+static int response_append_compressed(SoupMessageBody * body, http_codec_t * codec, const void * data, size_t length, int finish)
+{
+	// compress one chunk and append it to the (chunked) response
+	auto_buffer_t buf[1];
+	memset(buf, 0, sizeof(buf));
+	auto_buffer_init(buf, length / 2 + 64);
+	int rc = codec->update(codec, data, length, finish?http_codec_finish:http_codec_no_flush, on_compressed_output, buf);
+	if(rc || 0 == buf->length) {
+		auto_buffer_cleanup(buf);
+		return rc;
+	}
+
+	unsigned char * out = buf->data;
+	if(buf->start_pos) memmove(out, out + buf->start_pos, buf->length);
+	SoupBuffer * chunk = soup_buffer_new_with_owner(out, buf->length, out, free);
+	soup_message_body_append_buffer(body, chunk);
+	soup_buffer_free(chunk);
+	return 0;
+}
+
+void http_response_set_body(global_params_t * params, SoupMessage * msg, const char * content_type, void * data, size_t length)
+{
+	SoupMessageHeaders * headers = msg->response_headers;
+	if(params->compression.enabled) soup_message_headers_append(headers, "Vary", "Accept-Encoding");
+	if(content_type) soup_message_headers_set_content_type(headers, content_type, NULL);
+
+	// small bodies are sent as-is, with a Content-Length
+	enum http_content_encoding encoding = http_content_encoding_identity;
+	if(length >= params->compression.min_size) encoding = http_accept_encoding_negotiate(params, msg);
+
+	if(encoding != http_content_encoding_identity) {
+		// compressed: chunk by chunk, (the compressed size is not known in advance)
+		http_codec_t codec[1];
+		memset(codec, 0, sizeof(codec));
+		http_codec_init(codec, encoding, 1, params->compression.level);
+		soup_message_headers_set_encoding(headers, SOUP_ENCODING_CHUNKED);
+		soup_message_headers_replace(headers, "Content-Encoding", http_content_encoding_to_string(encoding));
+
+		int rc = 0;
+		const unsigned char * p = data;
+		const unsigned char * p_end = p + length;
+		while(0 == rc && p < p_end) {
+			size_t cb = ((size_t)(p_end - p) > HTTP_RESPONSE_CHUNK_SIZE)?HTTP_RESPONSE_CHUNK_SIZE:(size_t)(p_end - p);
+			rc = response_append_compressed(msg->response_body, codec, p, cb, (p + cb) == p_end);
+			p += cb;
+		}
+		http_codec_cleanup(codec);
+
+		if(0 == rc) {
+			soup_message_body_complete(msg->response_body);
+			free(data);
+			return;
+		}
+
+		// (not sent yet): fall back to the uncompressed body
+		soup_message_body_truncate(msg->response_body);
+		soup_message_headers_remove(headers, "Content-Encoding");
+		soup_message_headers_set_encoding(headers, SOUP_ENCODING_CONTENT_LENGTH);
+	}
+
+	// hand over the buffer to libsoup without copying
+	SoupBuffer * body = soup_buffer_new_with_owner(data, length, data, free);
+	soup_message_body_append_buffer(msg->response_body, body);
+	soup_buffer_free(body);
+}
@@ -0,0 +1,711 @@
+/*
+ * http-ingest.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "event-store.h"
+#include "auto_buffer.h"
+#include "json-span.h"
+#include "utils.h"
+
+/********************************************************
+* per-thread json_tokener pool
+*
+* a tokener keeps the parsing state of one request body,
+* so each in-flight request borrows its own tokener and returns it when finished.
+********************************************************/
+static void tokener_pool_free(gpointer data)
+{
+	GSList * pool = data;
+	for(GSList * item = pool; item; item = item->next) json_tokener_free(item->data);
+	g_slist_free(pool);
+}
+static GPrivate s_tokener_pool = G_PRIVATE_INIT(tokener_pool_free);
+
+static json_tokener * tokener_pool_acquire(void)
+{
+	GSList * pool = g_private_get(&s_tokener_pool);
+	if(NULL == pool) {
+		json_tokener * tok = json_tokener_new();
+		assert(tok);
+		return tok;
+	}
+	json_tokener * tok = pool->data;
+	g_private_set(&s_tokener_pool, g_slist_delete_link(pool, pool));
+	return tok;
+}
+static void tokener_pool_release(json_tokener * tok)
+{
+	if(NULL == tok) return;
+	json_tokener_reset(tok);
+	GSList * pool = g_private_get(&s_tokener_pool);
+	g_private_set(&s_tokener_pool, g_slist_prepend(pool, tok));
+}
+
+/********************************************************
+* Content-Encoding of request bodies
+********************************************************/
+static http_codec_t * request_codec_new(const char * content_encoding, int * p_unsupported)
+{
+	enum http_content_encoding encoding = http_content_encoding_parse(content_encoding);
+	if(encoding == http_content_encoding_unsupported) {
+		*p_unsupported = 1;
+		return NULL;
+	}
+	if(encoding == http_content_encoding_identity) return NULL;
+	return http_codec_init(NULL, encoding, 0, 0);
+}
+static void request_codec_free(http_codec_t * codec)
+{
+	if(NULL == codec) return;
+	http_codec_cleanup(codec);
+	free(codec);
+}
+
+/********************************************************
+* struct ingest_context: attached to the SoupMessage
+********************************************************/
+#define INGEST_CONTEXT_KEY "http-ingest-context"
+struct ingest_context
+{
+	global_params_t * params;
+	gateway_topic_t * gw_topic;
+	json_tokener * tok;
+
+	int pending;	// a partial json value has been fed to the tokener
+	size_t offset;	// number of bytes consumed
+
+	// a top-level array is split into its elements, each one is parsed and published as soon as it completes
+	enum {
+		ingest_array_none,		// not in a top-level array
+		ingest_array_first,		// after '[': an element or ']'
+		ingest_array_element,	// after ',': an element
+		ingest_array_separator,	// after an element: ',' or ']'
+	}array_state;
+	size_t num_accepted;
+	size_t num_rejected;
+
+	enum json_tokener_error err;
+	size_t err_offset;
+
+	http_codec_t * codec;	// nullable, decompresses the body before parsing
+	int unsupported_encoding;
+	uint64_t since_event_id;	// last event_id of the store before the body was published
+};
+static void ingest_context_free(struct ingest_context * ctx)
+{
+	if(NULL == ctx) return;
+	tokener_pool_release(ctx->tok);
+	request_codec_free(ctx->codec);
+	free(ctx);
+}
+
+static void ingest_publish(struct ingest_context * ctx, json_object * jvalue)
+{
+	// a top-level value or an element of a top-level array: only objects are events
+	if(json_object_is_type(jvalue, json_type_object)) {
+		int rc = gateway_topic_publish(ctx->gw_topic, jvalue);
+		if(0 == rc) ++ctx->num_accepted;
+		else ++ctx->num_rejected;
+		return;
+	}
+	++ctx->num_rejected;
+}
+
+static int ingest_set_error(struct ingest_context * ctx, enum json_tokener_error err, size_t offset)
+{
+	ctx->err = err;
+	ctx->err_offset = offset;
+	return -1;
+}
+
+static int ingest_feed(struct ingest_context * ctx, const char * data, size_t length)
+{
+	if(ctx->err != json_tokener_success) return -1;	// ignore the rest of a malformed body
+
+	const char * p = data;
+	const char * p_end = data + length;
+	size_t base_offset = ctx->offset;
+	while(p < p_end) {
+		if(!ctx->pending) {	// skip whitespaces between values
+			while(p < p_end && is_white_char(*p)) ++p;
+			ctx->offset = base_offset + (p - data);
+			if(p == p_end) break;
+
+			switch(ctx->array_state) {
+			case ingest_array_none:
+				if(*p == '[') {
+					ctx->array_state = ingest_array_first;
+					++p;
+					continue;
+				}
+				break;
+			case ingest_array_first:
+				if(*p == ']') {
+					ctx->array_state = ingest_array_none;
+					++p;
+					continue;
+				}
+				break;
+			case ingest_array_element:
+				if(*p == ']') return ingest_set_error(ctx, json_tokener_error_parse_unexpected, ctx->offset);
+				break;
+			case ingest_array_separator:
+				if(*p == ',') ctx->array_state = ingest_array_element;
+				else if(*p == ']') ctx->array_state = ingest_array_none;
+				else return ingest_set_error(ctx, json_tokener_error_parse_unexpected, ctx->offset);
+				++p;
+				continue;
+			}
+			ctx->pending = 1;
+		}
+
+		json_object * jvalue = json_tokener_parse_ex(ctx->tok, p, p_end - p);
+		enum json_tokener_error err = json_tokener_get_error(ctx->tok);
+		if(err == json_tokener_continue) {	// need more data
+			ctx->offset = base_offset + length;
+			return 0;
+		}
+
+		size_t consumed = ctx->tok->char_offset;
+		if(err != json_tokener_success) {
+			if(jvalue) json_object_put(jvalue);
+			return ingest_set_error(ctx, err, base_offset + (p - data) + consumed);
+		}
+
+		ctx->pending = 0;
+		p += consumed;
+		ctx->offset = base_offset + (p - data);
+		json_tokener_reset(ctx->tok);
+
+		if(ctx->array_state != ingest_array_none) ctx->array_state = ingest_array_separator;
+		ingest_publish(ctx, jvalue);
+		json_object_put(jvalue);
+	}
+	return 0;
+}
+
+static int on_ingest_decoded(void * user_data, const void * data, size_t length)
+{
+	ingest_feed(user_data, data, length);
+	return 0;
+}
+
+static int ingest_update(struct ingest_context * ctx, const char * data, size_t length)
+{
+	if(ctx->unsupported_encoding) return -1;
+	if(NULL == ctx->codec) return ingest_feed(ctx, data, length);
+	return ctx->codec->update(ctx->codec, data, length, http_codec_no_flush, on_ingest_decoded, ctx);
+}
+
+static int ingest_finish(struct ingest_context * ctx)
+{
+	if(ctx->codec && ctx->codec->update(ctx->codec, NULL, 0, http_codec_finish, on_ingest_decoded, ctx)) return -1;
+	if(ctx->err != json_tokener_success) return -1;
+	if(ctx->array_state != ingest_array_none && !ctx->pending) {	// unterminated array
+		return ingest_set_error(ctx, json_tokener_error_parse_eof, ctx->offset);
+	}
+	if(!ctx->pending) return 0;
+
+	// flush the tokener, (a trailing number has no terminator)
+	json_object * jvalue = (ctx->array_state == ingest_array_none)?json_tokener_parse_ex(ctx->tok, "", 1):NULL;
+	if(NULL == jvalue) {
+		ctx->err = json_tokener_get_error(ctx->tok);
+		if(ctx->err == json_tokener_success || ctx->err == json_tokener_continue) ctx->err = json_tokener_error_parse_eof;
+		ctx->err_offset = ctx->offset;
+		return -1;
+	}
+	ctx->pending = 0;
+	ingest_publish(ctx, jvalue);
+	json_object_put(jvalue);
+	return 0;
+}
+
+/********************************************************
+* struct bulk_context: newline-delimited json
+********************************************************/
+#define BULK_CONTEXT_KEY "http-ingest-bulk-context"
+#define BULK_MAX_LINE_SIZE (1 << 20)
+struct bulk_context
+{
+	gateway_topic_t * gw_topic;
+	auto_buffer_t carry[1];	// a partial line which spans chunks
+	int overflow;			// the current line exceeds BULK_MAX_LINE_SIZE
+
+	size_t offset;			// body offset of the next chunk
+	size_t line_offset;		// body offset of the current line
+	size_t num_lines;
+	size_t num_accepted;
+	size_t num_rejected;
+	json_object * jerrors;
+
+	http_codec_t * codec;	// nullable
+	int unsupported_encoding;
+	uint64_t since_event_id;
+};
+static void bulk_context_free(struct bulk_context * ctx)
+{
+	if(NULL == ctx) return;
+	auto_buffer_cleanup(ctx->carry);
+	request_codec_free(ctx->codec);
+	if(ctx->jerrors) json_object_put(ctx->jerrors);
+	free(ctx);
+}
+
+static void bulk_add_error(struct bulk_context * ctx, size_t offset, const char * err_msg)
+{
+	++ctx->num_rejected;
+	if(NULL == ctx->jerrors) ctx->jerrors = json_object_new_array();
+	if(json_object_array_length(ctx->jerrors) >= HTTP_INGEST_BULK_MAX_ERRORS) return;
+
+	json_object * jerror = json_object_new_object();
+	json_object_object_add(jerror, "line", json_object_new_int64(ctx->num_lines));
+	json_object_object_add(jerror, "offset", json_object_new_int64(offset));
+	json_object_object_add(jerror, "error", json_object_new_string(err_msg));
+	json_object_array_add(ctx->jerrors, jerror);
+}
+
+static void bulk_process_line(struct bulk_context * ctx, const char * line, size_t length)
+{
+	++ctx->num_lines;
+	if(ctx->overflow) {
+		ctx->overflow = 0;
+		bulk_add_error(ctx, ctx->line_offset, "line too long");
+		return;
+	}
+
+	const char * p_end = line + length;
+	trim_right(line, p_end);
+	if(p_end == line) return;	// empty line
+
+	size_t err_offset = 0;
+	int rc = json_span_validate(line, p_end - line, 1, &err_offset);
+	if(rc) {
+		bulk_add_error(ctx, ctx->line_offset + err_offset, "invalid json object");
+		return;
+	}
+
+	rc = gateway_topic_publish_raw(ctx->gw_topic, line, p_end - line);
+	if(rc) bulk_add_error(ctx, ctx->line_offset, "publish failed");
+	else ++ctx->num_accepted;
+}
+
+static void bulk_feed(struct bulk_context * ctx, const char * data, size_t length)
+{
+	const char * p = data;
+	const char * p_end = data + length;
+	while(p < p_end) {
+		const char * p_eol = memchr(p, '\n', p_end - p);	// glibc's memchr is vectorized (SSE2/AVX2)
+		if(NULL == p_eol) {
+			if(ctx->carry->length + (p_end - p) > BULK_MAX_LINE_SIZE) {
+				ctx->overflow = 1;
+				ctx->carry->length = ctx->carry->start_pos = 0;
+			}
+			if(!ctx->overflow) auto_buffer_push(ctx->carry, p, p_end - p);
+			break;
+		}
+
+		if(ctx->carry->length > 0 || ctx->overflow) {
+			if(!ctx->overflow) auto_buffer_push(ctx->carry, p, p_eol - p);
+			bulk_process_line(ctx, (const char *)auto_buffer_get_data(ctx->carry), ctx->carry->length);
+			ctx->carry->length = ctx->carry->start_pos = 0;
+		}else {
+			bulk_process_line(ctx, p, p_eol - p);	// zero-copy: the line is published from the chunk
+		}
+		p = p_eol + 1;
+		ctx->line_offset = ctx->offset + (p - data);
+	}
+	ctx->offset += length;
+}
+
+static int on_bulk_decoded(void * user_data, const void * data, size_t length)
+{
+	bulk_feed(user_data, data, length);
+	return 0;
+}
+
+static int bulk_update(struct bulk_context * ctx, const char * data, size_t length)
+{
+	if(ctx->unsupported_encoding) return -1;
+	if(NULL == ctx->codec) {
+		bulk_feed(ctx, data, length);
+		return 0;
+	}
+	return ctx->codec->update(ctx->codec, data, length, http_codec_no_flush, on_bulk_decoded, ctx);
+}
+
+static void bulk_finish(struct bulk_context * ctx)
+{
+	if(ctx->codec && ctx->codec->update(ctx->codec, NULL, 0, http_codec_finish, on_bulk_decoded, ctx)) {
+		bulk_add_error(ctx, ctx->offset, "invalid compressed body");
+	}
+	if(ctx->carry->length > 0 || ctx->overflow) {
+		bulk_process_line(ctx, (const char *)auto_buffer_get_data(ctx->carry), ctx->carry->length);
+		ctx->carry->length = ctx->carry->start_pos = 0;
+	}
+}
+
+/********************************************************
+* results: fill 'jresult' and return the http status
+********************************************************/
+static int ingest_result(struct ingest_context * ctx, json_object * jresult)
+{
+	int rc = ingest_finish(ctx);
+	json_object_object_add(jresult, "accepted", json_object_new_int64(ctx->num_accepted));
+	json_object_object_add(jresult, "rejected", json_object_new_int64(ctx->num_rejected));
+	if(rc && ctx->codec && ctx->codec->err) {
+		json_object_object_add(jresult, "error", json_object_new_string("invalid compressed body"));
+	}else if(rc) {
+		json_object_object_add(jresult, "error", json_object_new_string(json_tokener_error_desc(ctx->err)));
+		json_object_object_add(jresult, "offset", json_object_new_int64(ctx->err_offset));
+	}
+	return rc?SOUP_STATUS_BAD_REQUEST:SOUP_STATUS_ACCEPTED;
+}
+
+static int bulk_result(struct bulk_context * ctx, json_object * jresult)
+{
+	bulk_finish(ctx);
+	json_object_object_add(jresult, "lines", json_object_new_int64(ctx->num_lines));
+	json_object_object_add(jresult, "accepted", json_object_new_int64(ctx->num_accepted));
+	json_object_object_add(jresult, "rejected", json_object_new_int64(ctx->num_rejected));
+	if(ctx->jerrors) json_object_object_add(jresult, "errors", json_object_get(ctx->jerrors));
+	return (ctx->num_rejected > 0 && 0 == ctx->num_accepted)?SOUP_STATUS_BAD_REQUEST:SOUP_STATUS_ACCEPTED;
+}
+
+/********************************************************
+* durable acks: "X-Ack: durable"
+* the response is held (paused) until the event store has flushed the log holding the request's events,
+* the other producers are answered as soon as their events are queued
+********************************************************/
+#define ACK_HEADER "X-Ack"
+struct durable_ack
+{
+	SoupServer * server;
+	SoupMessage * msg;
+	GMainContext * context;
+	int finished;	// the connection was closed while syncing
+
+	int status;		// http status of the result
+	json_object * jresult;
+	int synced_status;
+};
+
+static uint64_t get_since_event_id(global_params_t * params)
+{
+	event_store_t * store = params->event_store;
+	return store?store->get_last_event_id(store):0;
+}
+
+static void set_json_response(SoupMessage * msg, int status, json_object * jresult)
+{
+	size_t cb_result = 0;
+	const char * sz_result = json_object_to_json_string_length(jresult, JSON_C_TO_STRING_PLAIN, &cb_result);
+	soup_message_set_response(msg, "application/json", SOUP_MEMORY_COPY, sz_result, cb_result);
+	soup_message_set_status(msg, status);
+}
+
+static void set_durable_response(SoupMessage * msg, int status, json_object * jresult, int synced_status)
+{
+	json_object_object_add(jresult, "durable", json_object_new_boolean(0 == synced_status));
+	set_json_response(msg, (0 == synced_status)?status:SOUP_STATUS_SERVICE_UNAVAILABLE, jresult);
+}
+
+static void on_ack_msg_finished(SoupMessage * msg, gpointer user_data)
+{
+	struct durable_ack * ack = user_data;
+	ack->finished = 1;
+}
+
+static gboolean on_ack_done(gpointer user_data)
+{
+	// runs in the request's GMainContext
+	struct durable_ack * ack = user_data;
+	SoupMessage * msg = ack->msg;
+	g_signal_handlers_disconnect_by_func(msg, on_ack_msg_finished, ack);
+
+	if(!ack->finished) {
+		set_durable_response(msg, ack->status, ack->jresult, ack->synced_status);
+		soup_server_unpause_message(ack->server, msg);
+	}
+
+	json_object_put(ack->jresult);
+	g_object_unref(msg);
+	g_main_context_unref(ack->context);
+	free(ack);
+	return G_SOURCE_REMOVE;
+}
+
+static void on_events_synced(void * user_data, int status)
+{
+	// (the writer thread of the event store)
+	struct durable_ack * ack = user_data;
+	ack->synced_status = status;
+	g_main_context_invoke(ack->context, on_ack_done, ack);
+}
+
+static void ingest_respond(SoupServer * server, SoupMessage * msg, global_params_t * params, uint64_t since_event_id,
+	int status, json_object * jresult)
+{
+	// takes the ownership of jresult
+	event_store_t * store = params->event_store;
+	const char * ack_mode = soup_message_headers_get_one(msg->request_headers, ACK_HEADER);
+	if(NULL == store || status != SOUP_STATUS_ACCEPTED || NULL == ack_mode || strcasecmp(ack_mode, "durable") != 0) {
+		set_json_response(msg, status, jresult);
+		json_object_put(jresult);
+		return;
+	}
+
+	struct durable_ack * ack = calloc(1, sizeof(*ack));
+	assert(ack);
+	ack->server = server;
+	ack->msg = msg;
+	ack->context = g_main_context_ref_thread_default();
+	ack->status = status;
+	ack->jresult = jresult;
+
+	// the callback cannot run before this handler returns: it is invoked in this thread's GMainContext
+	int rc = store->sync(store, since_event_id, on_events_synced, ack);
+	if(rc == EVENT_STORE_SYNC_PENDING) {
+		g_object_ref(msg);
+		g_signal_connect(msg, "finished", G_CALLBACK(on_ack_msg_finished), ack);
+		soup_server_pause_message(server, msg);
+		return;
+	}
+
+	set_durable_response(msg, status, jresult, rc);
+	json_object_put(jresult);
+	g_main_context_unref(ack->context);
+	free(ack);
+}
+
+/********************************************************
+* one-shot ingestion of a complete body (native_ingest listener)
+********************************************************/
+int http_ingest_events(gateway_topic_t * gw_topic, const char * content_encoding, const char * data, size_t length, json_object * jresult)
+{
+	struct ingest_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->gw_topic = gw_topic;
+	ctx->codec = request_codec_new(content_encoding, &ctx->unsupported_encoding);
+	if(ctx->unsupported_encoding) return SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE;
+
+	ctx->tok = tokener_pool_acquire();
+	ingest_update(ctx, data, length);
+	int status = ingest_result(ctx, jresult);
+
+	tokener_pool_release(ctx->tok);
+	request_codec_free(ctx->codec);
+	return status;
+}
+
+int http_ingest_bulk(gateway_topic_t * gw_topic, const char * content_encoding, const char * data, size_t length, json_object * jresult)
+{
+	struct bulk_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->gw_topic = gw_topic;
+	ctx->codec = request_codec_new(content_encoding, &ctx->unsupported_encoding);
+	if(ctx->unsupported_encoding) return SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE;
+
+	auto_buffer_init(ctx->carry, 0);
+	bulk_update(ctx, data, length);
+	int status = bulk_result(ctx, jresult);
+
+	auto_buffer_cleanup(ctx->carry);
+	if(ctx->jerrors) json_object_put(ctx->jerrors);
+	request_codec_free(ctx->codec);
+	return status;
+}
+
+/********************************************************
+* libsoup signals
+********************************************************/
+static inline int is_rejected(SoupMessage * msg)
+{
+	// rejected by on_gateway_early_request(), (401 / 403 / 429 / 503):
+	// libsoup still reads the body, which must never be published.
+	// a paused request may be rejected after its context has been attached, see on_early_auth_done()
+	return msg->status_code >= SOUP_STATUS_BAD_REQUEST;
+}
+
+static void on_bulk_got_chunk(SoupMessage * msg, SoupBuffer * chunk, gpointer user_data)
+{
+	struct bulk_context * ctx = user_data;
+	assert(ctx);
+	if(is_rejected(msg)) return;
+	bulk_update(ctx, chunk->data, chunk->length);
+}
+
+static void on_ingest_got_chunk(SoupMessage * msg, SoupBuffer * chunk, gpointer user_data)
+{
+	struct ingest_context * ctx = user_data;
+	assert(ctx);
+	if(is_rejected(msg)) return;
+	ingest_update(ctx, chunk->data, chunk->length);
+}
+
+static void on_ingest_got_headers(SoupMessage * msg, gpointer user_data)
+{
+	global_params_t * params = user_data;
+	if(msg->method != SOUP_METHOD_POST) return;
+	if(is_rejected(msg)) return;
+
+	const char * path = soup_uri_get_path(soup_message_get_uri(msg));
+	path_router_match_t match[1];
+	const gateway_route_t * route = gateway_route_lookup(params, path, path?strlen(path):0, match);
+	if(NULL == route) return;
+	if(route->type != gateway_route_type_topic_events && route->type != gateway_route_type_topic_bulk) return;
+
+	char * topic = gateway_route_get_param(match, "topic");
+	if(route->type == gateway_route_type_topic_events) {
+		struct ingest_context * ctx = calloc(1, sizeof(*ctx));
+		assert(ctx);
+		ctx->params = params;
+		ctx->since_event_id = get_since_event_id(params);
+		ctx->gw_topic = gateway_topic_get(params, topic, 1);
+		ctx->tok = tokener_pool_acquire();
+		ctx->codec = request_codec_new(soup_message_headers_get_one(msg->request_headers, "Content-Encoding"), &ctx->unsupported_encoding);
+
+		if(ctx->gw_topic) {
+			g_object_set_data_full(G_OBJECT(msg), INGEST_CONTEXT_KEY, ctx, (GDestroyNotify)ingest_context_free);
+			soup_message_body_set_accumulate(msg->request_body, FALSE);
+			g_signal_connect(msg, "got-chunk", G_CALLBACK(on_ingest_got_chunk), ctx);
+		}else {
+			ingest_context_free(ctx);
+		}
+	}else {
+		struct bulk_context * ctx = calloc(1, sizeof(*ctx));
+		assert(ctx);
+		auto_buffer_init(ctx->carry, 0);
+		ctx->since_event_id = get_since_event_id(params);
+		ctx->gw_topic = gateway_topic_get(params, topic, 1);
+		ctx->codec = request_codec_new(soup_message_headers_get_one(msg->request_headers, "Content-Encoding"), &ctx->unsupported_encoding);
+
+		if(ctx->gw_topic) {
+			g_object_set_data_full(G_OBJECT(msg), BULK_CONTEXT_KEY, ctx, (GDestroyNotify)bulk_context_free);
+			soup_message_body_set_accumulate(msg->request_body, FALSE);
+			g_signal_connect(msg, "got-chunk", G_CALLBACK(on_bulk_got_chunk), ctx);
+		}else {
+			bulk_context_free(ctx);
+		}
+	}
+	g_free(topic);
+}
+
+static void on_request_started(SoupServer * server, SoupMessage * msg, SoupClientContext * client, gpointer user_data)
+{
+	g_signal_connect(msg, "got-headers", G_CALLBACK(on_ingest_got_headers), user_data);
+}
+
+int http_ingest_init(SoupServer * server, global_params_t * params)
+{
+	assert(server && params);
+	g_signal_connect(server, "request-started", G_CALLBACK(on_request_started), params);
+	return 0;
+}
+
+/********************************************************
+* POST /topics/{topic}/events
+********************************************************/
+void on_topic_events_post(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic)
+{
+	if(NULL == gw_topic) {	// e.g. a topic name decoded to ""
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	struct ingest_context * ctx = g_object_get_data(G_OBJECT(msg), INGEST_CONTEXT_KEY);
+	struct ingest_context fallback[1];
+	if(NULL == ctx) {	// the body has been accumulated, parse it in one pass
+		memset(fallback, 0, sizeof(fallback));
+		ctx = fallback;
+		ctx->gw_topic = gw_topic;
+		ctx->since_event_id = get_since_event_id(gw_topic->params);
+		ctx->tok = tokener_pool_acquire();
+		ctx->codec = request_codec_new(soup_message_headers_get_one(msg->request_headers, "Content-Encoding"), &ctx->unsupported_encoding);
+		ingest_update(ctx, msg->request_body->data, msg->request_body->length);
+	}
+
+	if(ctx->unsupported_encoding) {
+		soup_message_set_status(msg, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE);
+		if(ctx == fallback) tokener_pool_release(ctx->tok);
+		return;
+	}
+
+	json_object * jresult = json_object_new_object();
+	int status = ingest_result(ctx, jresult);
+	ingest_respond(server, msg, gw_topic->params, ctx->since_event_id, status, jresult);
+
+	if(ctx == fallback) {
+		tokener_pool_release(ctx->tok);
+		request_codec_free(ctx->codec);
+	}
+	return;
+}
+
+/********************************************************
+* POST /topics/{topic}/bulk
+********************************************************/
+void on_topic_bulk_post(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic)
+{
+	if(NULL == gw_topic) {	// e.g. a topic name decoded to ""
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	struct bulk_context * ctx = g_object_get_data(G_OBJECT(msg), BULK_CONTEXT_KEY);
+	struct bulk_context fallback[1];
+	if(NULL == ctx) {	// the body has been accumulated
+		memset(fallback, 0, sizeof(fallback));
+		ctx = fallback;
+		auto_buffer_init(ctx->carry, 0);
+		ctx->gw_topic = gw_topic;
+		ctx->since_event_id = get_since_event_id(gw_topic->params);
+		ctx->codec = request_codec_new(soup_message_headers_get_one(msg->request_headers, "Content-Encoding"), &ctx->unsupported_encoding);
+		bulk_update(ctx, msg->request_body->data, msg->request_body->length);
+	}
+
+	if(ctx->unsupported_encoding) {
+		soup_message_set_status(msg, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE);
+		if(ctx == fallback) auto_buffer_cleanup(ctx->carry);
+		return;
+	}
+	json_object * jresult = json_object_new_object();
+	int status = bulk_result(ctx, jresult);
+	ingest_respond(server, msg, gw_topic->params, ctx->since_event_id, status, jresult);
+
+	if(ctx == fallback) {
+		auto_buffer_cleanup(ctx->carry);
+		if(ctx->jerrors) json_object_put(ctx->jerrors);
+		request_codec_free(ctx->codec);
+	}
+	return;
+}
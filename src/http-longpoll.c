@@ -0,0 +1,283 @@
+/*
+ * http-longpoll.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "api-gateway.h"
+#include "topic-log.h"
+#include "auto_buffer.h"
+#include "utils.h"
+
+/********************************************************
+* struct longpoll_waiter
+*
+* A parked GET /topics/{topic}/events request.
+* refs: one for the waiters list (or the pending wake-up), one for the timeout source,
+*       and one released on "finished".
+* complete() always runs in the waiter's GMainContext.
+********************************************************/
+struct longpoll_waiter
+{
+	gint refs;
+	gint done;
+
+	gateway_topic_t * gw_topic;
+	SoupServer * server;
+	SoupMessage * msg;
+	GMainContext * context;
+	GSource * timeout_source;
+
+	int64_t from;
+	size_t max_events;
+};
+
+static void longpoll_waiter_unref(struct longpoll_waiter * waiter)
+{
+	if(!g_atomic_int_dec_and_test(&waiter->refs)) return;
+	if(waiter->context) g_main_context_unref(waiter->context);
+	free(waiter);
+}
+
+static int longpoll_waiter_detach(struct longpoll_waiter * waiter)
+{
+	// remove the waiter from the list if a publisher did not take it yet
+	gateway_topic_t * gw_topic = waiter->gw_topic;
+	int found = 0;
+	g_mutex_lock(&gw_topic->waiters_mutex);
+	GList * item = g_list_find(gw_topic->waiters, waiter);
+	if(item) {
+		gw_topic->waiters = g_list_delete_link(gw_topic->waiters, item);
+		found = 1;
+	}
+	g_mutex_unlock(&gw_topic->waiters_mutex);
+
+	if(found) longpoll_waiter_unref(waiter);
+	return found;
+}
+
+/********************************************************
+* response: {"topic": <topic>, "offset": <first>, "next": <next>, "events": [...]}
+********************************************************/
+struct longpoll_batch
+{
+	auto_buffer_t * buf;
+	size_t count;
+};
+static int append_event(void * user_data, int64_t offset, const char * data, size_t length)
+{
+	struct longpoll_batch * batch = user_data;
+	if(batch->count++ > 0) auto_buffer_push(batch->buf, ",", 1);
+	auto_buffer_push(batch->buf, data, length);
+	return 0;
+}
+
+static void longpoll_respond(SoupMessage * msg, gateway_topic_t * gw_topic, int64_t from, size_t max_events)
+{
+	topic_log_t * log = gw_topic->log;
+	auto_buffer_t buf[1];
+	memset(buf, 0, sizeof(buf));
+	auto_buffer_init(buf, 0);
+
+	json_object * jtopic = json_object_new_string(gw_topic->eva_topic->topic);
+	const char * sz_topic = json_object_to_json_string_ext(jtopic, JSON_C_TO_STRING_PLAIN);
+
+	int64_t first = log->get_first_offset(log);
+	if(from < first) from = first;
+
+	char header[1024] = "";
+	int cb = snprintf(header, sizeof(header), "{\"topic\":%s,\"offset\":%" PRIi64 ",\"events\":[", sz_topic, from);
+	if(cb <= 0 || cb >= (int)sizeof(header)) cb = snprintf(header, sizeof(header), "{\"offset\":%" PRIi64 ",\"events\":[", from);
+	json_object_put(jtopic);
+	auto_buffer_push(buf, header, cb);
+
+	int64_t next = from;
+	struct longpoll_batch batch = { .buf = buf };
+	log->read(log, from, max_events, append_event, &batch, &next);
+
+	cb = snprintf(header, sizeof(header), "],\"next\":%" PRIi64 "}", next);
+	auto_buffer_push(buf, header, cb);
+
+	unsigned char * data = buf->data;
+	size_t length = buf->length;
+	if(buf->start_pos) memmove(data, data + buf->start_pos, length);
+
+	soup_message_headers_replace(msg->response_headers, "Cache-Control", "no-cache");
+	http_response_set_body(gw_topic->params, msg, "application/json", data, length);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+static void longpoll_complete(struct longpoll_waiter * waiter)
+{
+	if(!g_atomic_int_compare_and_exchange(&waiter->done, 0, 1)) return;
+
+	if(waiter->timeout_source) {
+		g_source_destroy(waiter->timeout_source);
+		g_source_unref(waiter->timeout_source);
+		waiter->timeout_source = NULL;
+	}
+	longpoll_respond(waiter->msg, waiter->gw_topic, waiter->from, waiter->max_events);
+	soup_server_unpause_message(waiter->server, waiter->msg);
+}
+
+static gboolean on_longpoll_wake(gpointer user_data)
+{
+	struct longpoll_waiter * waiter = user_data;
+	longpoll_complete(waiter);
+	longpoll_waiter_unref(waiter);	// the list's reference, handed over by http_longpoll_wake()
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean on_longpoll_timeout(gpointer user_data)
+{
+	struct longpoll_waiter * waiter = user_data;
+	longpoll_waiter_detach(waiter);
+	longpoll_complete(waiter);	// (empty batch)
+	return G_SOURCE_REMOVE;
+}
+
+static void on_longpoll_finished(SoupMessage * msg, gpointer user_data)
+{
+	struct longpoll_waiter * waiter = user_data;
+
+	// client disconnected before completion
+	if(g_atomic_int_compare_and_exchange(&waiter->done, 0, 1)) {
+		if(waiter->timeout_source) {
+			g_source_destroy(waiter->timeout_source);
+			g_source_unref(waiter->timeout_source);
+			waiter->timeout_source = NULL;
+		}
+	}
+	longpoll_waiter_detach(waiter);
+
+	g_signal_handlers_disconnect_by_data(msg, waiter);
+	longpoll_waiter_unref(waiter);
+}
+
+/********************************************************
+* http_longpoll_wake(): called by the publisher after appending to gw_topic->log
+********************************************************/
+void http_longpoll_wake(gateway_topic_t * gw_topic)
+{
+	// always take the mutex: a waiter checks the log and parks itself under waiters_mutex,
+	// so either it sees the new event or we see the waiter
+	topic_log_t * log = gw_topic->log;
+	GList * waiters = NULL;
+	g_mutex_lock(&gw_topic->waiters_mutex);
+	int64_t next_offset = log->get_next_offset(log);
+	for(GList * item = gw_topic->waiters; item; ) {
+		GList * next = item->next;
+		struct longpoll_waiter * waiter = item->data;
+		if(next_offset > waiter->from) {	// otherwise it waits for a later offset: stays parked
+			gw_topic->waiters = g_list_remove_link(gw_topic->waiters, item);
+			waiters = g_list_concat(item, waiters);
+		}
+		item = next;
+	}
+	g_mutex_unlock(&gw_topic->waiters_mutex);
+
+	for(GList * item = waiters; item; item = item->next) {
+		struct longpoll_waiter * waiter = item->data;
+		g_main_context_invoke(waiter->context, on_longpoll_wake, waiter);
+	}
+	g_list_free(waiters);
+}
+
+/********************************************************
+* GET /topics/{topic}/events?from=<offset>&max=<n>&wait_ms=<t>
+********************************************************/
+static int64_t query_get_int64(GHashTable * query, const char * name, int64_t default_value)
+{
+	const char * value = query?g_hash_table_lookup(query, name):NULL;
+	if(NULL == value || !value[0]) return default_value;
+
+	char * p_end = NULL;
+	long long n = strtoll(value, &p_end, 10);
+	if(p_end && *p_end) return default_value;
+	return n;
+}
+
+void on_topic_events_get(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic, GHashTable * query)
+{
+	if(NULL == gw_topic || NULL == gw_topic->log) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	global_params_t * params = gw_topic->params;
+	topic_log_t * log = gw_topic->log;
+
+	int64_t next_offset = log->get_next_offset(log);
+	int64_t from = query_get_int64(query, "from", next_offset);	// default: wait for new events
+	int64_t max_events = query_get_int64(query, "max", 100);
+	int64_t wait_ms = query_get_int64(query, "wait_ms", 0);
+
+	if(from < 0) from = 0;
+	if(max_events <= 0) max_events = 1;
+	if(max_events > params->stream.poll_max_events) max_events = params->stream.poll_max_events;
+	if(wait_ms < 0) wait_ms = 0;
+	if(wait_ms > params->stream.poll_max_wait_ms) wait_ms = params->stream.poll_max_wait_ms;
+
+	if(from < next_offset || 0 == wait_ms) {
+		longpoll_respond(msg, gw_topic, from, max_events);
+		return;
+	}
+
+	struct longpoll_waiter * waiter = calloc(1, sizeof(*waiter));
+	assert(waiter);
+	waiter->refs = 3;
+	waiter->gw_topic = gw_topic;
+	waiter->server = server;
+	waiter->msg = msg;
+	waiter->context = g_main_context_ref_thread_default();
+	waiter->from = from;
+	waiter->max_events = max_events;
+
+	// re-check under waiters_mutex: the publisher appends to the log before taking the list
+	g_mutex_lock(&gw_topic->waiters_mutex);
+	if(log->get_next_offset(log) > from) {
+		g_mutex_unlock(&gw_topic->waiters_mutex);
+		g_main_context_unref(waiter->context);
+		free(waiter);
+		longpoll_respond(msg, gw_topic, from, max_events);
+		return;
+	}
+	gw_topic->waiters = g_list_prepend(gw_topic->waiters, waiter);
+	g_mutex_unlock(&gw_topic->waiters_mutex);
+
+	GSource * source = g_timeout_source_new(wait_ms);
+	g_source_set_callback(source, on_longpoll_timeout, waiter, (GDestroyNotify)longpoll_waiter_unref);
+	waiter->timeout_source = source;	// keep a reference, released by complete() or finished()
+	g_source_attach(source, waiter->context);
+
+	g_signal_connect(msg, "finished", G_CALLBACK(on_longpoll_finished), waiter);
+	soup_server_pause_message(server, msg);
+	return;
+}
@@ -0,0 +1,318 @@
+/*
+ * http-replay.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "event-store.h"
+#include "auto_buffer.h"
+#include "utils.h"
+
+#define REPLAY_CHUNK_SIZE (64 * 1024)
+#define REPLAY_IDLE_TIMEOUT (30 * G_TIME_SPAN_SECOND)	// the client reads nothing for that long: the replay gives up
+static volatile gint s_stopping;	// set by http_replay_cleanup(): the paced replays give up
+
+/********************************************************
+* struct replay_job
+*
+* the replay runs on the replay pool and blocks while the client has
+* 'stream.max_buffer_size' of unsent data, (at most REPLAY_IDLE_TIMEOUT without progress),
+* the chunks are appended to the response in the request's GMainContext.
+********************************************************/
+struct replay_job
+{
+	gint refs;
+	global_params_t * params;
+	SoupServer * server;
+	SoupMessage * msg;
+	GMainContext * context;
+
+	char * topic;
+	int64_t from;
+	int64_t to;
+	auto_buffer_t pending[1];	// (replay thread only)
+
+	GMutex mutex;
+	GCond cond;				// unsent_bytes decreased, or closed
+	GQueue chunks;			// (SoupBuffer *), handed over, not yet appended to the response
+	size_t unsent_bytes;	// handed over, not yet written to the socket
+	int flush_scheduled;
+	int done;
+	int closed;
+	int timed_out;			// the client stopped reading, the response is ended early
+
+	GQueue chunk_sizes;		// appended, not yet written, (request's context only)
+};
+
+static void replay_job_unref(struct replay_job * job)
+{
+	if(!g_atomic_int_dec_and_test(&job->refs)) return;
+
+	SoupBuffer * chunk = NULL;
+	while((chunk = g_queue_pop_head(&job->chunks))) soup_buffer_free(chunk);
+	g_queue_clear(&job->chunk_sizes);
+	auto_buffer_cleanup(job->pending);
+	g_cond_clear(&job->cond);
+	g_mutex_clear(&job->mutex);
+	g_main_context_unref(job->context);
+	g_object_unref(job->msg);
+	free(job->topic);
+	free(job);
+}
+
+static gboolean replay_flush(gpointer user_data)
+{
+	// runs in the request's GMainContext
+	struct replay_job * job = user_data;
+	GQueue chunks = G_QUEUE_INIT;
+
+	g_mutex_lock(&job->mutex);
+	job->flush_scheduled = 0;
+	int closed = job->closed;
+	int done = job->done;
+	if(!closed) {
+		chunks = job->chunks;
+		g_queue_init(&job->chunks);
+	}
+	g_mutex_unlock(&job->mutex);
+
+	if(!closed) {
+		SoupBuffer * chunk = NULL;
+		while((chunk = g_queue_pop_head(&chunks))) {
+			g_queue_push_tail(&job->chunk_sizes, GSIZE_TO_POINTER(chunk->length));
+			soup_message_body_append_buffer(job->msg->response_body, chunk);
+			soup_buffer_free(chunk);
+		}
+		if(done) soup_message_body_complete(job->msg->response_body);
+		soup_server_unpause_message(job->server, job->msg);
+	}
+
+	replay_job_unref(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void replay_schedule_flush(struct replay_job * job)
+{
+	// job->mutex is locked
+	if(job->flush_scheduled) return;
+	job->flush_scheduled = 1;
+	g_atomic_int_inc(&job->refs);
+	g_main_context_invoke(job->context, replay_flush, job);
+}
+
+static int replay_handover(struct replay_job * job, int done)
+{
+	// hand the pending data to the request's context, wait while the client is too far behind
+	global_params_t * params = job->params;
+	size_t length = job->pending->length;
+
+	g_mutex_lock(&job->mutex);
+	size_t unsent_bytes = job->unsent_bytes;
+	gint64 deadline = g_get_monotonic_time() + REPLAY_IDLE_TIMEOUT;
+	while(!job->closed && !job->timed_out && job->unsent_bytes > 0 && job->unsent_bytes + length > params->stream.max_buffer_size) {
+		if(g_atomic_int_get(&s_stopping)) break;
+		g_cond_wait_until(&job->cond, &job->mutex, g_get_monotonic_time() + G_TIME_SPAN_SECOND);
+
+		// (the pool threads are few: a client that does not read must not hold one)
+		gint64 now = g_get_monotonic_time();
+		if(job->unsent_bytes < unsent_bytes) {
+			unsent_bytes = job->unsent_bytes;
+			deadline = now + REPLAY_IDLE_TIMEOUT;
+		}else if(now >= deadline) {
+			job->timed_out = 1;
+		}
+	}
+	if(job->closed || g_atomic_int_get(&s_stopping) || (job->timed_out && !done)) {
+		g_mutex_unlock(&job->mutex);
+		return -1;
+	}
+
+	if(length > 0) {
+		// hand over the pending buffer without copying
+		unsigned char * data = job->pending->data;
+		if(job->pending->start_pos) memmove(data, data + job->pending->start_pos, length);
+		memset(job->pending, 0, sizeof(job->pending));
+		auto_buffer_init(job->pending, REPLAY_CHUNK_SIZE);
+
+		g_queue_push_tail(&job->chunks, soup_buffer_new_with_owner(data, length, data, free));
+		job->unsent_bytes += length;
+	}
+	job->done = done;
+	if(length > 0 || done) replay_schedule_flush(job);
+	g_mutex_unlock(&job->mutex);
+	return 0;
+}
+
+static int on_replay_record(void * user_data, const event_record_t * record)
+{
+	// newline-delimited events, (the body of POST /topics/{topic}/bulk)
+	struct replay_job * job = user_data;
+	auto_buffer_push(job->pending, record->data, record->length);
+	auto_buffer_push(job->pending, "\n", 1);
+	if(job->pending->length < REPLAY_CHUNK_SIZE) return 0;
+	return replay_handover(job, 0);	// non-zero: the client is gone, stop the replay
+}
+
+static void replay_worker(gpointer data, gpointer user_data)
+{
+	struct replay_job * job = data;
+	event_store_t * store = job->params->event_store;
+
+	ssize_t num_records = store->replay(store, job->topic, job->from, job->to, on_replay_record, job);
+	if(job->timed_out) {	// (set by this thread): drop what the client would not read, end the response
+		static const char sz_error[] = "{\"error\":\"replay timed out\"}\n";
+		job->pending->start_pos = 0;
+		job->pending->length = 0;
+		auto_buffer_push(job->pending, sz_error, sizeof(sz_error) - 1);
+	}else if(num_records < 0) {
+		// the status line is gone, end with an error line the client can tell from the events
+		static const char sz_error[] = "{\"error\":\"replay failed\"}\n";
+		auto_buffer_push(job->pending, sz_error, sizeof(sz_error) - 1);
+	}
+	replay_handover(job, 1);
+	debug_printf("replay: topic=%s, [%ld, %ld], %ld records", job->topic, (long)job->from, (long)job->to, (long)num_records);
+	replay_job_unref(job);
+}
+
+static void on_replay_wrote_chunk(SoupMessage * msg, gpointer user_data)
+{
+	struct replay_job * job = user_data;
+	if(g_queue_is_empty(&job->chunk_sizes)) return;
+	size_t length = GPOINTER_TO_SIZE(g_queue_pop_head(&job->chunk_sizes));
+
+	g_mutex_lock(&job->mutex);
+	job->unsent_bytes -= length;
+	g_cond_signal(&job->cond);
+	g_mutex_unlock(&job->mutex);
+}
+
+static void on_replay_finished(SoupMessage * msg, gpointer user_data)
+{
+	struct replay_job * job = user_data;
+	g_mutex_lock(&job->mutex);
+	job->closed = 1;
+	g_cond_signal(&job->cond);
+	g_mutex_unlock(&job->mutex);
+
+	g_signal_handlers_disconnect_by_data(msg, job);
+	replay_job_unref(job);
+}
+
+/********************************************************
+* replay pool
+********************************************************/
+int http_replay_init(global_params_t * params, int num_threads)
+{
+	assert(params);
+	if(num_threads <= 0) num_threads = 2;
+
+	GError * gerr = NULL;
+	params->replay_pool = g_thread_pool_new(replay_worker, params, num_threads, TRUE, &gerr);
+	if(NULL == params->replay_pool) {
+		fprintf(stderr, "[ERROR]: %s(): g_thread_pool_new: %s\n", __FUNCTION__, gerr?gerr->message:"");
+		if(gerr) g_error_free(gerr);
+		return -1;
+	}
+	return 0;
+}
+
+void http_replay_cleanup(global_params_t * params)
+{
+	// the servers are stopped: the replays still running (or queued) end at their next chunk
+	if(NULL == params || NULL == params->replay_pool) return;
+	g_atomic_int_set(&s_stopping, 1);
+	g_thread_pool_free(params->replay_pool, FALSE, TRUE);
+	params->replay_pool = NULL;
+}
+
+/********************************************************
+* GET /topics/{topic}/replay?from=<us>&to=<us>
+********************************************************/
+static int query_get_timestamp(GHashTable * query, const char * name, int64_t default_value, int64_t * p_value)
+{
+	const char * value = query?g_hash_table_lookup(query, name):NULL;
+	*p_value = default_value;
+	if(NULL == value || !value[0]) return 0;
+
+	char * p_end = NULL;
+	long long n = strtoll(value, &p_end, 10);
+	if(p_end && *p_end) return -1;
+	*p_value = n;
+	return 0;
+}
+
+void on_topic_replay_get(SoupServer * server, SoupMessage * msg, global_params_t * params, const char * topic, GHashTable * query)
+{
+	event_store_t * store = params->event_store;
+	if(NULL == store || NULL == store->index_dbp || NULL == params->replay_pool) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	int64_t from = 0, to = INT64_MAX;
+	if(NULL == topic || !topic[0] || strlen(topic) > EVENT_STORE_MAX_TOPIC_LENGTH
+		|| query_get_timestamp(query, "from", 0, &from)
+		|| query_get_timestamp(query, "to", INT64_MAX, &to)
+		|| from < 0 || to < from)
+	{
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	struct replay_job * job = calloc(1, sizeof(*job));
+	assert(job);
+	job->refs = 2;	// released on "finished", and by the worker
+	job->params = params;
+	job->server = server;
+	job->msg = g_object_ref(msg);
+	job->context = g_main_context_ref_thread_default();
+	job->topic = strdup(topic);
+	job->from = from;
+	job->to = to;
+	auto_buffer_init(job->pending, REPLAY_CHUNK_SIZE);
+	g_mutex_init(&job->mutex);
+	g_cond_init(&job->cond);
+	g_queue_init(&job->chunks);
+	g_queue_init(&job->chunk_sizes);
+
+	SoupMessageHeaders * headers = msg->response_headers;
+	soup_message_headers_set_encoding(headers, SOUP_ENCODING_CHUNKED);
+	soup_message_headers_set_content_type(headers, "application/x-ndjson", NULL);
+	soup_message_body_set_accumulate(msg->response_body, FALSE);	// discard chunks once written
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+
+	g_signal_connect(msg, "wrote-chunk", G_CALLBACK(on_replay_wrote_chunk), job);
+	g_signal_connect(msg, "finished", G_CALLBACK(on_replay_finished), job);
+	soup_server_pause_message(server, msg);	// until the first chunk
+	g_thread_pool_push(params->replay_pool, job, NULL);
+	return;
+}
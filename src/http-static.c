@@ -0,0 +1,103 @@
+/*
+ * http-static.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "file-cache.h"
+#include "utils.h"
+
+/********************************************************
+* If-None-Match: "etag1", W/"etag2", ... | *
+********************************************************/
+static int etag_matches(SoupMessage * msg, const char * etag)
+{
+	const char * if_none_match = soup_message_headers_get_list(msg->request_headers, "If-None-Match");
+	if(NULL == if_none_match) return 0;
+
+	int matched = 0;
+	GSList * tags = soup_header_parse_list(if_none_match);
+	for(GSList * item = tags; item && !matched; item = item->next) {
+		const char * tag = item->data;
+		if(0 == strncmp(tag, "W/", 2)) tag += 2;	// weak comparison
+		matched = (0 == strcmp(tag, "*") || 0 == strcmp(tag, etag));
+	}
+	soup_header_free_list(tags);
+	return matched;
+}
+
+/********************************************************
+* GET|HEAD /ui/{path*}
+********************************************************/
+void on_static_file_get(SoupServer * server, SoupMessage * msg, global_params_t * params, const char * path)
+{
+	file_cache_t * cache = params->file_cache;
+	if(NULL == cache) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	// directory: serve its index file
+	char * index_path = NULL;
+	if(NULL == path || !path[0] || path[strlen(path) - 1] == '/') {
+		index_path = g_strconcat(path?path:"", params->static_files.index, NULL);
+		path = index_path;
+	}
+	file_cache_entry_t * entry = cache->get(cache, path);
+	g_free(index_path);
+	if(NULL == entry) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	SoupMessageHeaders * headers = msg->response_headers;
+	soup_message_headers_replace(headers, "ETag", entry->etag);
+	if(params->static_files.cache_control) {
+		soup_message_headers_replace(headers, "Cache-Control", params->static_files.cache_control);
+	}
+
+	if(etag_matches(msg, entry->etag)) {
+		file_cache_entry_unref(entry);
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		return;
+	}
+
+	soup_message_headers_replace(headers, "Content-Type", entry->content_type);
+	if(entry->size > 0) {
+		// zero-copy: libsoup writes straight from the mapped file, the buffer holds a reference to the entry
+		SoupBuffer * buffer = soup_buffer_new_with_owner(entry->data, entry->size,
+			entry, (GDestroyNotify)file_cache_entry_unref);
+		soup_message_body_append_buffer(msg->response_body, buffer);
+		soup_buffer_free(buffer);
+	}else {
+		file_cache_entry_unref(entry);
+	}
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
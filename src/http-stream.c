@@ -0,0 +1,283 @@
+/*
+ * http-stream.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "auto_buffer.h"
+#include "utils.h"
+
+/********************************************************
+* struct sse_connection
+*
+* on_event() runs in the publishing thread and only appends to 'pending',
+* the flush (one chunk per interval) runs in the connection's GMainContext.
+********************************************************/
+struct sse_connection
+{
+	topic_subscriber_t sub[1];
+	gint refs;
+
+	gateway_topic_t * gw_topic;
+	SoupServer * server;
+	SoupMessage * msg;
+	GMainContext * context;
+
+	GMutex mutex;
+	auto_buffer_t pending[1];	// coalesced events, not yet handed to libsoup
+	size_t unsent_bytes;		// handed to libsoup, not yet written to the socket
+	GQueue chunk_sizes;			// sizes of the chunks in flight
+	int flush_scheduled;
+	int closed;
+	int disconnect;
+
+	http_codec_t codec[1];	// Content-Encoding, used by the connection's context only
+	int compressed;
+
+	size_t num_dropped;
+};
+
+static void sse_connection_unref(struct sse_connection * conn)
+{
+	if(!g_atomic_int_dec_and_test(&conn->refs)) return;
+
+	auto_buffer_cleanup(conn->pending);
+	if(conn->compressed) http_codec_cleanup(conn->codec);
+	g_queue_clear(&conn->chunk_sizes);
+	g_mutex_clear(&conn->mutex);
+	if(conn->context) g_main_context_unref(conn->context);
+	free(conn);
+}
+
+static int on_encoded_output(void * user_data, const void * data, size_t length)
+{
+	return auto_buffer_push((auto_buffer_t *)user_data, data, length);
+}
+
+static unsigned char * sse_encode(struct sse_connection * conn, unsigned char * data, size_t * p_length, int finish)
+{
+	// compress one chunk, (takes the ownership of 'data')
+	auto_buffer_t buf[1];
+	memset(buf, 0, sizeof(buf));
+	auto_buffer_init(buf, *p_length / 2 + 64);
+
+	int rc = conn->codec->update(conn->codec, data, *p_length,
+		finish?http_codec_finish:http_codec_sync_flush,
+		on_encoded_output, buf);
+	free(data);
+	if(rc || 0 == buf->length) {
+		auto_buffer_cleanup(buf);
+		*p_length = 0;
+		return NULL;
+	}
+
+	data = buf->data;
+	*p_length = buf->length;
+	if(buf->start_pos) memmove(data, data + buf->start_pos, buf->length);
+	return data;
+}
+
+static gboolean sse_flush(gpointer user_data)
+{
+	struct sse_connection * conn = user_data;
+
+	g_mutex_lock(&conn->mutex);
+	conn->flush_scheduled = 0;
+	int closed = conn->closed;
+	int disconnect = conn->disconnect;
+
+	unsigned char * data = NULL;
+	size_t length = 0;
+	if(!closed && conn->pending->length > 0) {
+		// hand over the pending buffer without copying
+		length = conn->pending->length;
+		data = conn->pending->data;
+		if(conn->pending->start_pos) memmove(data, data + conn->pending->start_pos, length);
+		memset(conn->pending, 0, sizeof(conn->pending));
+		auto_buffer_init(conn->pending, 0);
+	}
+	if(disconnect) conn->closed = 1;
+	g_mutex_unlock(&conn->mutex);
+
+	if(!closed && conn->compressed && (data || disconnect)) {
+		// compress outside the lock, the codec is only used by this context
+		data = sse_encode(conn, data, &length, disconnect);
+	}
+	if(data) {
+		g_mutex_lock(&conn->mutex);
+		conn->unsent_bytes += length;
+		g_queue_push_tail(&conn->chunk_sizes, GSIZE_TO_POINTER(length));
+		g_mutex_unlock(&conn->mutex);
+	}
+
+	if(!closed) {
+		if(data) {
+			SoupBuffer * chunk = soup_buffer_new_with_owner(data, length, data, free);
+			soup_message_body_append_buffer(conn->msg->response_body, chunk);
+			soup_buffer_free(chunk);
+		}
+		if(disconnect) soup_message_body_complete(conn->msg->response_body);
+		soup_server_unpause_message(conn->server, conn->msg);
+	}
+
+	sse_connection_unref(conn);
+	return G_SOURCE_REMOVE;
+}
+
+static void sse_schedule_flush(struct sse_connection * conn, unsigned int delay_ms)
+{
+	// conn->mutex is locked
+	if(conn->flush_scheduled) return;
+	conn->flush_scheduled = 1;
+	g_atomic_int_inc(&conn->refs);
+
+	GSource * source = g_timeout_source_new(delay_ms);
+	g_source_set_callback(source, sse_flush, conn, NULL);
+	g_source_attach(source, conn->context);
+	g_source_unref(source);
+}
+
+static int sse_on_event(topic_subscriber_t * sub, const char * data, size_t length)
+{
+	struct sse_connection * conn = sub->user_data;
+	global_params_t * params = conn->gw_topic->params;
+	static const char prefix[] = "data: ";
+	static const char suffix[] = "\n\n";
+	size_t cb_frame = sizeof(prefix) - 1 + length + sizeof(suffix) - 1;
+
+	int rc = 0;
+	g_mutex_lock(&conn->mutex);
+	if(conn->closed || conn->disconnect) {
+		g_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+
+	if(conn->unsent_bytes + conn->pending->length + cb_frame > params->stream.max_buffer_size) {
+		// slow client
+		++conn->num_dropped;
+		if(params->stream.disconnect_slow_clients) {
+			conn->disconnect = 1;
+			sse_schedule_flush(conn, 0);
+		}
+		rc = -1;
+	}else {
+		auto_buffer_push(conn->pending, prefix, sizeof(prefix) - 1);
+		auto_buffer_push(conn->pending, data, length);
+		auto_buffer_push(conn->pending, suffix, sizeof(suffix) - 1);
+		sse_schedule_flush(conn, params->stream.flush_interval_ms);
+	}
+	g_mutex_unlock(&conn->mutex);
+	return rc;
+}
+
+static void on_sse_wrote_chunk(SoupMessage * msg, gpointer user_data)
+{
+	struct sse_connection * conn = user_data;
+	g_mutex_lock(&conn->mutex);
+	if(!g_queue_is_empty(&conn->chunk_sizes)) {
+		size_t length = GPOINTER_TO_SIZE(g_queue_pop_head(&conn->chunk_sizes));
+		conn->unsent_bytes -= length;
+	}
+	g_mutex_unlock(&conn->mutex);
+}
+
+static void on_sse_finished(SoupMessage * msg, gpointer user_data)
+{
+	struct sse_connection * conn = user_data;
+	g_mutex_lock(&conn->mutex);
+	conn->closed = 1;
+	g_mutex_unlock(&conn->mutex);
+
+	gateway_topic_remove_subscriber(conn->gw_topic, conn->sub);
+	debug_printf("sse connection closed: topic=%s, dropped=%ld", conn->gw_topic->eva_topic->topic, (long)conn->num_dropped);
+
+	g_signal_handlers_disconnect_by_data(msg, conn);
+	sse_connection_unref(conn);
+}
+
+/********************************************************
+* GET /topics/{topic}/stream
+********************************************************/
+void on_topic_stream_get(SoupServer * server, SoupMessage * msg, gateway_topic_t * gw_topic)
+{
+	if(NULL == gw_topic) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	struct sse_connection * conn = calloc(1, sizeof(*conn));
+	assert(conn);
+	conn->refs = 1;	// released on "finished"
+	conn->sub->user_data = conn;
+	conn->sub->on_event = sse_on_event;
+	conn->gw_topic = gw_topic;
+	conn->server = server;
+	conn->msg = msg;
+	conn->context = g_main_context_ref_thread_default();
+	g_mutex_init(&conn->mutex);
+	g_queue_init(&conn->chunk_sizes);
+	auto_buffer_init(conn->pending, 0);
+
+	SoupMessageHeaders * headers = msg->response_headers;
+	soup_message_headers_set_encoding(headers, SOUP_ENCODING_CHUNKED);
+	soup_message_headers_set_content_type(headers, "text/event-stream", NULL);
+	soup_message_headers_replace(headers, "Cache-Control", "no-cache");
+	soup_message_body_set_accumulate(msg->response_body, FALSE);	// discard chunks once written
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+
+	// streams are compressed regardless of compression.min_size, each flush is a sync point
+	enum http_content_encoding encoding = http_accept_encoding_negotiate(gw_topic->params, msg);
+	if(gw_topic->params->compression.enabled) soup_message_headers_append(headers, "Vary", "Accept-Encoding");
+	if(encoding != http_content_encoding_identity) {
+		http_codec_init(conn->codec, encoding, 1, gw_topic->params->compression.level);
+		conn->compressed = 1;
+		soup_message_headers_replace(headers, "Content-Encoding", http_content_encoding_to_string(encoding));
+	}
+
+	static const char sz_hello[] = ": connected\n\n";
+	size_t cb_hello = sizeof(sz_hello) - 1;
+	if(conn->compressed) {
+		unsigned char * hello = sse_encode(conn, (unsigned char *)strdup(sz_hello), &cb_hello, 0);
+		assert(hello);
+		SoupBuffer * chunk = soup_buffer_new_with_owner(hello, cb_hello, hello, free);
+		soup_message_body_append_buffer(msg->response_body, chunk);
+		soup_buffer_free(chunk);
+	}else {
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_STATIC, sz_hello, cb_hello);
+	}
+	conn->unsent_bytes = cb_hello;
+	g_queue_push_tail(&conn->chunk_sizes, GSIZE_TO_POINTER(cb_hello));
+
+	g_signal_connect(msg, "wrote-chunk", G_CALLBACK(on_sse_wrote_chunk), conn);
+	g_signal_connect(msg, "finished", G_CALLBACK(on_sse_finished), conn);
+	gateway_topic_add_subscriber(gw_topic, conn->sub);
+	return;
+}
@@ -0,0 +1,306 @@
+/*
+ * http-token.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "api-gateway.h"
+#include "jwt-revocation.h"
+#include "utils.h"
+
+/********************************************************
+* jti: <random per-process prefix (64 bits)><counter (64 bits)>, base64url
+* unique without a syscall or a random number per token
+********************************************************/
+#define JTI_SIZE (16)
+static uint64_t s_jti_prefix;
+static uint64_t s_jti_counter;
+static pthread_once_t s_jti_once = PTHREAD_ONCE_INIT;
+
+static void jti_init(void)
+{
+	if(getrandom(&s_jti_prefix, sizeof(s_jti_prefix), 0) != sizeof(s_jti_prefix)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		s_jti_prefix = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+	}
+}
+
+static void jti_generate(char jti[static JWT_BASE64URL_SIZE(JTI_SIZE)])
+{
+	pthread_once(&s_jti_once, jti_init);
+	uint64_t counter = __atomic_add_fetch(&s_jti_counter, 1, __ATOMIC_RELAXED);
+
+	unsigned char id[JTI_SIZE];
+	memcpy(id, &s_jti_prefix, 8);
+	for(int i = 0; i < 8; ++i) id[8 + i] = (unsigned char)(counter >> (56 - 8 * i));
+	jwt_base64url_encode(id, sizeof(id), jti);
+}
+
+/********************************************************
+* token encoding: <header>.<claims>.<signature>
+********************************************************/
+static char * token_encode(const jwt_key_t * key, json_object * jheader, json_object * jclaims)
+{
+	size_t cb_header = 0, cb_claims = 0;
+	const char * header = json_object_to_json_string_length(jheader, JSON_C_TO_STRING_PLAIN, &cb_header);
+	const char * claims = json_object_to_json_string_length(jclaims, JSON_C_TO_STRING_PLAIN, &cb_claims);
+
+	size_t max_size = JWT_BASE64URL_SIZE(cb_header) + JWT_BASE64URL_SIZE(cb_claims)
+		+ JWT_BASE64URL_SIZE(JWT_KEYRING_MAX_SIGNATURE_SIZE) + 2;
+	char * token = malloc(max_size);
+	assert(token);
+
+	char * p = token;
+	p += jwt_base64url_encode(header, cb_header, p);
+	*p++ = '.';
+	p += jwt_base64url_encode(claims, cb_claims, p);
+
+	unsigned char signature[JWT_KEYRING_MAX_SIGNATURE_SIZE];
+	ssize_t cb_signature = jwt_key_sign(key, token, p - token, signature);
+	if(cb_signature <= 0) {
+		free(token);
+		return NULL;
+	}
+	*p++ = '.';
+	jwt_base64url_encode(signature, cb_signature, p);
+	return token;
+}
+
+static int64_t get_int64_value(json_object * jobject, const char * key)
+{
+	json_object * jvalue = NULL;
+	if(!json_object_object_get_ex(jobject, key, &jvalue) || NULL == jvalue) return 0;
+	return json_object_get_int64(jvalue);
+}
+
+static int is_token_issuer(global_params_t * params, const char * subject)
+{
+	for(size_t i = 0; i < params->auth.token.num_issuers; ++i) {
+		if(0 == strcmp(params->auth.token.issuers[i], subject)) return 1;
+	}
+	return 0;
+}
+
+// return the "exp" claim of the bearer token the request was authenticated with,
+// 0 if there is none (e.g. unix socket peers), -1 on error
+static int64_t get_caller_token_expiry(global_params_t * params, SoupMessage * msg)
+{
+	const char * token = NULL;
+	size_t cb_token = 0;
+	int status = gateway_get_bearer_token(msg, &token, &cb_token);
+	if(status == GATEWAY_AUTH_NO_TOKEN) return 0;
+	if(status != jwt_auth_status_ok || NULL == params->jwt_auth) return -1;
+
+	// already verified by the gateway, only the claims are needed here
+	jwt_auth_t * auth = params->jwt_auth;
+	json_object * jclaims = NULL;
+	if(auth->decode(auth, token, cb_token, &jclaims) != jwt_auth_status_ok) return -1;
+	int64_t expires_at = get_int64_value(jclaims, "exp");
+	json_object_put(jclaims);
+	return (expires_at > 0)?expires_at:-1;
+}
+
+/********************************************************
+* POST /token
+* body (optional): {"sub": "<subject>", "ttl": <seconds>}
+********************************************************/
+void on_token_post(SoupServer * server, SoupMessage * msg, global_params_t * params)
+{
+	if(NULL == params->jwt_keyring || !params->auth.token.enabled) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	const char * caller = g_object_get_data(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY);
+	if(NULL == caller) {
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		return;
+	}
+
+	json_object * jrequest = NULL;
+	SoupMessageBody * body = msg->request_body;
+	if(body && body->length > 0) {
+		json_tokener * jtok = json_tokener_new();
+		assert(jtok);
+		jrequest = json_tokener_parse_ex(jtok, body->data, (int)body->length);
+		json_tokener_free(jtok);
+		if(NULL == jrequest || !json_object_is_type(jrequest, json_type_object)) {
+			if(jrequest) json_object_put(jrequest);
+			soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+			return;
+		}
+	}
+
+	// tokens are issued to the caller itself, or on behalf of others by the configured issuers (e.g. a login service)
+	const char * subject = jrequest?json_get_value(jrequest, string, sub):NULL;
+	if(NULL == subject || !subject[0]) subject = caller;
+	if(strcmp(subject, caller) && !is_token_issuer(params, caller)) {
+		if(jrequest) json_object_put(jrequest);
+		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		return;
+	}
+
+	int64_t ttl = jrequest?json_get_value_default(jrequest, int, ttl, params->auth.token.ttl):params->auth.token.ttl;
+	if(ttl <= 0 || ttl > params->auth.token.max_ttl) ttl = params->auth.token.max_ttl;
+
+	int64_t now = time(NULL);
+	if(0 == strcmp(subject, caller)) {
+		// renewing: never beyond the presenting token, (or a token could renew itself forever, out of reach of its revocation)
+		int64_t expires_at = get_caller_token_expiry(params, msg);
+		if(expires_at > 0 && now + ttl > expires_at) ttl = expires_at - now;
+		if(expires_at < 0 || ttl <= 0) {
+			if(jrequest) json_object_put(jrequest);
+			soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+			return;
+		}
+	}
+
+	jwt_keyring_t * keyring = params->jwt_keyring;
+	jwt_key_t * key = keyring->find(keyring, params->auth.token.signing_kid);
+	if(NULL == key || NULL == key->private_key) {
+		jwt_key_unref(key);
+		if(jrequest) json_object_put(jrequest);
+		soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	char jti[JWT_BASE64URL_SIZE(JTI_SIZE)] = "";
+	jti_generate(jti);
+
+	json_object * jheader = json_object_new_object();
+	json_object_object_add(jheader, "alg", json_object_new_string(jwt_key_alg_to_string(key->alg)));
+	json_object_object_add(jheader, "typ", json_object_new_string("JWT"));
+	json_object_object_add(jheader, "kid", json_object_new_string(key->kid));
+
+	json_object * jclaims = json_object_new_object();
+	json_object_object_add(jclaims, "iat", json_object_new_int64(now));
+	json_object_object_add(jclaims, "exp", json_object_new_int64(now + ttl));
+	json_object_object_add(jclaims, "iss", json_object_new_string(params->auth.issuer?params->auth.issuer:"event-streaming"));
+	json_object_object_add(jclaims, "sub", json_object_new_string(subject));
+	json_object_object_add(jclaims, "jti", json_object_new_string(jti));
+
+	char * token = token_encode(key, jheader, jclaims);
+	json_object_put(jheader);
+	json_object_put(jclaims);
+	jwt_key_unref(key);
+	if(jrequest) json_object_put(jrequest);
+	if(NULL == token) {
+		soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	json_object * jresult = json_object_new_object();
+	json_object_object_add(jresult, "access_token", json_object_new_string(token));
+	json_object_object_add(jresult, "token_type", json_object_new_string("Bearer"));
+	json_object_object_add(jresult, "expires_in", json_object_new_int64(ttl));
+	free(token);
+
+	size_t cb_result = 0;
+	const char * result = json_object_to_json_string_length(jresult, JSON_C_TO_STRING_PLAIN, &cb_result);
+	char * data = malloc(cb_result + 1);
+	assert(data);
+	memcpy(data, result, cb_result + 1);
+	json_object_put(jresult);
+
+	soup_message_headers_replace(msg->response_headers, "Cache-Control", "no-store");
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	http_response_set_body(params, msg, "application/json", data, cb_result);
+}
+
+/********************************************************
+* POST /token/revoke
+* body: {"token": "<jwt>"}, (the subject of the token or an issuer)
+*    or {"jti": "<token id>", "exp": <expiry>}, (issuers only)
+********************************************************/
+void on_token_revoke_post(SoupServer * server, SoupMessage * msg, global_params_t * params)
+{
+	jwt_revocation_t * revocation = params->jwt_revocation;
+	if(NULL == revocation || NULL == params->jwt_auth) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	const char * caller = g_object_get_data(G_OBJECT(msg), GATEWAY_AUTH_SUBJECT_KEY);
+	if(NULL == caller) {
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		return;
+	}
+
+	json_object * jrequest = NULL;
+	SoupMessageBody * body = msg->request_body;
+	if(body && body->length > 0) {
+		json_tokener * jtok = json_tokener_new();
+		assert(jtok);
+		jrequest = json_tokener_parse_ex(jtok, body->data, (int)body->length);
+		json_tokener_free(jtok);
+	}
+	if(NULL == jrequest || !json_object_is_type(jrequest, json_type_object)) {
+		if(jrequest) json_object_put(jrequest);
+		soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	int is_issuer = is_token_issuer(params, caller);
+	json_object * jclaims = NULL;
+	const char * token = json_get_value(jrequest, string, token);
+	const char * jti = NULL;
+	int64_t expires_at = 0;
+	guint status = SOUP_STATUS_BAD_REQUEST;
+
+	if(token) {
+		// the signature proves the token was ours, (revoking an expired token is harmless)
+		jwt_auth_t * auth = params->jwt_auth;
+		if(auth->decode(auth, token, strlen(token), &jclaims) == jwt_auth_status_ok) {
+			const char * sub = json_get_value(jclaims, string, sub);
+			jti = json_get_value(jclaims, string, jti);
+			expires_at = get_int64_value(jclaims, "exp");
+			if(!is_issuer && (NULL == sub || strcmp(sub, caller))) status = SOUP_STATUS_FORBIDDEN;
+		}
+	}else if(is_issuer) {
+		jti = json_get_value(jrequest, string, jti);
+		expires_at = get_int64_value(jrequest, "exp");
+		if(expires_at <= 0) expires_at = time(NULL) + params->auth.token.max_ttl;
+	}else {
+		status = SOUP_STATUS_FORBIDDEN;
+	}
+
+	if(status != SOUP_STATUS_FORBIDDEN && jti && jti[0] && expires_at > 0) {
+		status = (0 == revocation->revoke(revocation, jti, expires_at))?SOUP_STATUS_NO_CONTENT:SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		if(status == SOUP_STATUS_NO_CONTENT) debug_printf("token revoked by %s: jti=%s", caller, jti);
+	}
+
+	if(jclaims) json_object_put(jclaims);
+	json_object_put(jrequest);
+	soup_message_set_status(msg, status);
+}
@@ -0,0 +1,384 @@
+/*
+ * http-websocket.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api-gateway.h"
+#include "auto_buffer.h"
+#include "utils.h"
+
+/********************************************************
+* WebSocket protocol (text frames, one json object per frame)
+*
+* client --> server:
+*   {"op": "publish", "topic": "t", "events": [ {...}, ... ], "seq": 1}	--> {"op": "ack", "seq": 1, "accepted": n, "rejected": m}
+*   {"op": "subscribe", "topic": "t"}
+*   {"op": "unsubscribe", "topic": "t"}
+*   {"op": "credit", "n": 100}	// allows the server to push 100 more events
+*
+* server --> client:
+*   {"op": "events", "topic": "t", "events": [ {...}, ... ]}	// batched per flush interval, limited by credits
+*   {"op": "error", "error": "..."}
+********************************************************/
+struct ws_connection;
+struct ws_subscription
+{
+	topic_subscriber_t sub[1];
+	struct ws_connection * conn;
+	gateway_topic_t * gw_topic;
+	char * topic_json;	// the topic name as a json string
+	GQueue events;		// pending events (GBytes *)
+};
+
+struct ws_connection
+{
+	gint refs;
+	global_params_t * params;
+	SoupWebsocketConnection * ws;
+	GMainContext * context;
+
+	GMutex mutex;
+	GList * subscriptions;	// list of (struct ws_subscription *)
+	size_t pending_bytes;
+	gint64 credits;
+	int flush_scheduled;
+	int closed;
+	int disconnect;
+
+	size_t num_dropped;
+};
+
+static void ws_subscription_free(struct ws_subscription * subscription)
+{
+	if(NULL == subscription) return;
+	GBytes * event = NULL;
+	while((event = g_queue_pop_head(&subscription->events))) g_bytes_unref(event);
+	if(subscription->topic_json) free(subscription->topic_json);
+	free(subscription);
+}
+
+static void ws_connection_unref(struct ws_connection * conn)
+{
+	if(!g_atomic_int_dec_and_test(&conn->refs)) return;
+
+	assert(NULL == conn->subscriptions);
+	g_mutex_clear(&conn->mutex);
+	if(conn->ws) g_object_unref(conn->ws);
+	if(conn->context) g_main_context_unref(conn->context);
+	free(conn);
+}
+
+static void ws_send_json(struct ws_connection * conn, json_object * jmsg)
+{
+	if(soup_websocket_connection_get_state(conn->ws) != SOUP_WEBSOCKET_STATE_OPEN) return;
+	soup_websocket_connection_send_text(conn->ws, json_object_to_json_string_ext(jmsg, JSON_C_TO_STRING_PLAIN));
+}
+static void ws_send_error(struct ws_connection * conn, const char * err_msg)
+{
+	json_object * jmsg = json_object_new_object();
+	json_object_object_add(jmsg, "op", json_object_new_string("error"));
+	json_object_object_add(jmsg, "error", json_object_new_string(err_msg));
+	ws_send_json(conn, jmsg);
+	json_object_put(jmsg);
+}
+
+/********************************************************
+* outgoing: coalesce events into one frame per topic and flush interval
+********************************************************/
+static gboolean ws_flush(gpointer user_data)
+{
+	struct ws_connection * conn = user_data;
+	static const char frame_prefix[] = "{\"op\":\"events\",\"topic\":";
+	static const char events_prefix[] = ",\"events\":[";
+	static const char frame_suffix[] = "]}";
+
+	GSList * frames = NULL;
+	g_mutex_lock(&conn->mutex);
+	conn->flush_scheduled = 0;
+	int closed = conn->closed;
+	int disconnect = conn->disconnect;
+
+	for(GList * item = conn->subscriptions; item && !closed && conn->credits > 0; item = item->next) {
+		struct ws_subscription * subscription = item->data;
+		if(g_queue_is_empty(&subscription->events)) continue;
+
+		auto_buffer_t frame[1];
+		auto_buffer_init(frame, 0);
+		auto_buffer_push(frame, frame_prefix, sizeof(frame_prefix) - 1);
+		auto_buffer_push(frame, subscription->topic_json, strlen(subscription->topic_json));
+		auto_buffer_push(frame, events_prefix, sizeof(events_prefix) - 1);
+
+		int count = 0;
+		GBytes * event = NULL;
+		while(conn->credits > 0 && (event = g_queue_pop_head(&subscription->events))) {
+			gsize length = 0;
+			const char * data = g_bytes_get_data(event, &length);
+			if(count++ > 0) auto_buffer_push(frame, ",", 1);
+			auto_buffer_push(frame, data, length);
+
+			conn->pending_bytes -= length;
+			--conn->credits;
+			g_bytes_unref(event);
+		}
+		auto_buffer_push(frame, frame_suffix, sizeof(frame_suffix));	// including the '\0'
+		frames = g_slist_prepend(frames, frame->data);
+		frame->data = NULL;	// the frame data was taken
+	}
+	if(disconnect) conn->closed = 1;
+	g_mutex_unlock(&conn->mutex);
+
+	frames = g_slist_reverse(frames);
+	for(GSList * item = frames; item; item = item->next) {
+		if(!closed && soup_websocket_connection_get_state(conn->ws) == SOUP_WEBSOCKET_STATE_OPEN) {
+			soup_websocket_connection_send_text(conn->ws, item->data);
+		}
+		free(item->data);
+	}
+	g_slist_free(frames);
+
+	if(!closed && disconnect) {
+		soup_websocket_connection_close(conn->ws, SOUP_WEBSOCKET_CLOSE_POLICY_VIOLATION, "slow consumer");
+	}
+	ws_connection_unref(conn);
+	return G_SOURCE_REMOVE;
+}
+
+static void ws_schedule_flush(struct ws_connection * conn, unsigned int delay_ms)
+{
+	// conn->mutex is locked
+	if(conn->flush_scheduled) return;
+	conn->flush_scheduled = 1;
+	g_atomic_int_inc(&conn->refs);
+
+	GSource * source = g_timeout_source_new(delay_ms);
+	g_source_set_callback(source, ws_flush, conn, NULL);
+	g_source_attach(source, conn->context);
+	g_source_unref(source);
+}
+
+static int ws_on_event(topic_subscriber_t * sub, const char * data, size_t length)
+{
+	struct ws_subscription * subscription = sub->user_data;
+	struct ws_connection * conn = subscription->conn;
+	global_params_t * params = conn->params;
+
+	int rc = 0;
+	g_mutex_lock(&conn->mutex);
+	if(conn->closed || conn->disconnect) {
+		g_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+
+	if(conn->pending_bytes + length > params->stream.max_buffer_size) {
+		// the client does not grant credits fast enough
+		++conn->num_dropped;
+		if(params->stream.disconnect_slow_clients) {
+			conn->disconnect = 1;
+			ws_schedule_flush(conn, 0);
+		}
+		rc = -1;
+	}else {
+		g_queue_push_tail(&subscription->events, g_bytes_new(data, length));
+		conn->pending_bytes += length;
+		if(conn->credits > 0) ws_schedule_flush(conn, params->stream.flush_interval_ms);
+	}
+	g_mutex_unlock(&conn->mutex);
+	return rc;
+}
+
+/********************************************************
+* incoming
+********************************************************/
+static struct ws_subscription * ws_find_subscription(struct ws_connection * conn, gateway_topic_t * gw_topic)
+{
+	for(GList * item = conn->subscriptions; item; item = item->next) {
+		struct ws_subscription * subscription = item->data;
+		if(subscription->gw_topic == gw_topic) return subscription;
+	}
+	return NULL;
+}
+
+static void ws_subscribe(struct ws_connection * conn, gateway_topic_t * gw_topic)
+{
+	g_mutex_lock(&conn->mutex);
+	struct ws_subscription * subscription = ws_find_subscription(conn, gw_topic);
+	g_mutex_unlock(&conn->mutex);
+	if(subscription) return;
+
+	subscription = calloc(1, sizeof(*subscription));
+	assert(subscription);
+	subscription->sub->user_data = subscription;
+	subscription->sub->on_event = ws_on_event;
+	subscription->conn = conn;
+	subscription->gw_topic = gw_topic;
+	g_queue_init(&subscription->events);
+
+	json_object * jtopic = json_object_new_string(gw_topic->eva_topic->topic);
+	subscription->topic_json = strdup(json_object_to_json_string_ext(jtopic, JSON_C_TO_STRING_PLAIN));
+	json_object_put(jtopic);
+
+	g_mutex_lock(&conn->mutex);
+	conn->subscriptions = g_list_prepend(conn->subscriptions, subscription);
+	g_mutex_unlock(&conn->mutex);
+	gateway_topic_add_subscriber(gw_topic, subscription->sub);
+}
+
+static void ws_unsubscribe(struct ws_connection * conn, struct ws_subscription * subscription)
+{
+	// no more on_event() calls once removed from the topic
+	gateway_topic_remove_subscriber(subscription->gw_topic, subscription->sub);
+
+	g_mutex_lock(&conn->mutex);
+	conn->subscriptions = g_list_remove(conn->subscriptions, subscription);
+	for(GList * item = subscription->events.head; item; item = item->next) {
+		conn->pending_bytes -= g_bytes_get_size(item->data);
+	}
+	g_mutex_unlock(&conn->mutex);
+	ws_subscription_free(subscription);
+}
+
+static void ws_on_publish(struct ws_connection * conn, gateway_topic_t * gw_topic, json_object * jmsg)
+{
+	size_t num_accepted = 0;
+	size_t num_rejected = 0;
+
+	json_object * jevents = NULL;
+	if(json_object_object_get_ex(jmsg, "events", &jevents) && json_object_is_type(jevents, json_type_array)) {
+		size_t count = json_object_array_length(jevents);
+		for(size_t i = 0; i < count; ++i) {
+			json_object * jevent = json_object_array_get_idx(jevents, i);
+			if(json_object_is_type(jevent, json_type_object) && 0 == gateway_topic_publish(gw_topic, jevent)) ++num_accepted;
+			else ++num_rejected;
+		}
+	}else if(json_object_object_get_ex(jmsg, "event", &jevents) && json_object_is_type(jevents, json_type_object)) {
+		if(0 == gateway_topic_publish(gw_topic, jevents)) ++num_accepted;
+		else ++num_rejected;
+	}
+
+	json_object * jseq = NULL;
+	if(!json_object_object_get_ex(jmsg, "seq", &jseq)) return;	// the client did not ask for an ack
+
+	json_object * jack = json_object_new_object();
+	json_object_object_add(jack, "op", json_object_new_string("ack"));
+	json_object_object_add(jack, "seq", json_object_get(jseq));
+	json_object_object_add(jack, "accepted", json_object_new_int64(num_accepted));
+	json_object_object_add(jack, "rejected", json_object_new_int64(num_rejected));
+	ws_send_json(conn, jack);
+	json_object_put(jack);
+}
+
+static void on_ws_message(SoupWebsocketConnection * ws, gint type, GBytes * message, gpointer user_data)
+{
+	struct ws_connection * conn = user_data;
+	if(type != SOUP_WEBSOCKET_DATA_TEXT) {
+		ws_send_error(conn, "text frames expected");
+		return;
+	}
+
+	gsize length = 0;
+	const char * data = g_bytes_get_data(message, &length);
+	json_tokener * tok = json_tokener_new();
+	json_object * jmsg = json_tokener_parse_ex(tok, data, length);
+	json_tokener_free(tok);
+	if(NULL == jmsg) {
+		ws_send_error(conn, "invalid json");
+		return;
+	}
+
+	const char * op = json_get_value(jmsg, string, op);
+	const char * topic = json_get_value(jmsg, string, topic);
+	if(NULL == op) op = "";
+
+	if(0 == strcmp(op, "credit")) {
+		int n = json_get_value(jmsg, int, n);
+		if(n > 0) {
+			g_mutex_lock(&conn->mutex);
+			conn->credits += n;
+			ws_schedule_flush(conn, 0);
+			g_mutex_unlock(&conn->mutex);
+		}
+	}else if(0 == strcmp(op, "publish")) {
+		gateway_topic_t * gw_topic = gateway_topic_get(conn->params, topic, 1);
+		if(gw_topic) ws_on_publish(conn, gw_topic, jmsg);
+		else ws_send_error(conn, "invalid topic");
+	}else if(0 == strcmp(op, "subscribe")) {
+		gateway_topic_t * gw_topic = gateway_topic_get(conn->params, topic, 1);
+		if(gw_topic) ws_subscribe(conn, gw_topic);
+		else ws_send_error(conn, "invalid topic");
+	}else if(0 == strcmp(op, "unsubscribe")) {
+		gateway_topic_t * gw_topic = gateway_topic_get(conn->params, topic, 0);
+		g_mutex_lock(&conn->mutex);
+		struct ws_subscription * subscription = gw_topic?ws_find_subscription(conn, gw_topic):NULL;
+		g_mutex_unlock(&conn->mutex);
+		if(subscription) ws_unsubscribe(conn, subscription);
+	}else {
+		ws_send_error(conn, "unknown op");
+	}
+	json_object_put(jmsg);
+}
+
+static void on_ws_closed(SoupWebsocketConnection * ws, gpointer user_data)
+{
+	struct ws_connection * conn = user_data;
+
+	g_mutex_lock(&conn->mutex);
+	conn->closed = 1;
+	g_mutex_unlock(&conn->mutex);
+
+	while(conn->subscriptions) ws_unsubscribe(conn, conn->subscriptions->data);
+	debug_printf("websocket closed: dropped=%ld", (long)conn->num_dropped);
+
+	g_signal_handlers_disconnect_by_data(ws, conn);
+	ws_connection_unref(conn);
+}
+
+/********************************************************
+* /ws
+********************************************************/
+void on_websocket_connected(SoupServer * server, SoupWebsocketConnection * ws,
+	const char * path, SoupClientContext * client, gpointer user_data)
+{
+	global_params_t * params = user_data;
+	assert(params);
+
+	struct ws_connection * conn = calloc(1, sizeof(*conn));
+	assert(conn);
+	conn->refs = 1;	// released on "closed"
+	conn->params = params;
+	conn->ws = g_object_ref(ws);
+	conn->context = g_main_context_ref_thread_default();
+	conn->credits = params->stream.ws_initial_credits;
+	g_mutex_init(&conn->mutex);
+
+	soup_websocket_connection_set_max_incoming_payload_size(ws, params->stream.ws_max_message_size);
+	g_signal_connect(ws, "message", G_CALLBACK(on_ws_message), conn);
+	g_signal_connect(ws, "closed", G_CALLBACK(on_ws_closed), conn);
+}
@@ -0,0 +1,417 @@
+/*
+ * jwt-auth.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <glib.h>
+#include <json-c/json.h>
+
+#include "jwt-auth.h"
+#include "jwt-keyring.h"
+#include "jwt-revocation.h"
+#include "utils.h"
+
+#define TOKEN_DIGEST_SIZE (32)	// SHA-256
+
+/********************************************************
+* struct token_entry: a verified token
+********************************************************/
+struct token_entry
+{
+	unsigned char digest[TOKEN_DIGEST_SIZE];
+	int64_t expires_at;	// (seconds, CLOCK_REALTIME) min(exp, verified_at + max_cache_ttl)
+	GList lru_link;		// (embedded), lru_link.data = entry
+	const char * jti;	// nullable, (stored after the subject)
+	size_t cb_jti;
+	char subject[];
+};
+
+struct jwt_auth_shard
+{
+	pthread_mutex_t mutex;
+	GHashTable * entries;	// digest --> (struct token_entry *)
+	GQueue lru;				// most recently used first
+	size_t max_entries;
+}__attribute__((aligned(64)));
+
+static guint digest_hash(gconstpointer key)
+{
+	guint hash;
+	memcpy(&hash, key, sizeof(hash));	// (SHA-256: any slice is uniformly distributed)
+	return hash;
+}
+static gboolean digest_equal(gconstpointer a, gconstpointer b)
+{
+	return 0 == memcmp(a, b, TOKEN_DIGEST_SIZE);
+}
+
+/********************************************************
+* struct jwt_auth_private
+********************************************************/
+struct jwt_auth_private
+{
+	struct jwt_auth * auth;
+	struct jwt_auth_shard shards[JWT_AUTH_NUM_SHARDS];
+};
+
+static struct jwt_auth_private * jwt_auth_private_new(struct jwt_auth * auth)
+{
+	struct jwt_auth_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+
+	size_t max_entries = auth->max_cached_tokens / JWT_AUTH_NUM_SHARDS;
+	if(auth->max_cached_tokens > 0 && max_entries < 1) max_entries = 1;
+	for(int i = 0; i < JWT_AUTH_NUM_SHARDS; ++i) {
+		struct jwt_auth_shard * shard = &priv->shards[i];
+		int rc = pthread_mutex_init(&shard->mutex, NULL);
+		assert(0 == rc);
+		shard->entries = g_hash_table_new_full(digest_hash, digest_equal, NULL, free);
+		g_queue_init(&shard->lru);
+		shard->max_entries = max_entries;
+	}
+
+	auth->priv = priv;
+	priv->auth = auth;
+	return priv;
+}
+
+static void jwt_auth_private_free(struct jwt_auth_private * priv)
+{
+	if(NULL == priv) return;
+	for(int i = 0; i < JWT_AUTH_NUM_SHARDS; ++i) {
+		struct jwt_auth_shard * shard = &priv->shards[i];
+		g_hash_table_destroy(shard->entries);	// the links are embedded in the entries
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	free(priv);
+}
+
+static inline struct jwt_auth_shard * get_shard(struct jwt_auth_private * priv, const unsigned char digest[static TOKEN_DIGEST_SIZE])
+{
+	uint32_t index;
+	memcpy(&index, digest + 4, sizeof(index));	// independent of the bytes used by digest_hash()
+	return &priv->shards[index % JWT_AUTH_NUM_SHARDS];
+}
+
+static void shard_remove_entry(struct jwt_auth_shard * shard, struct token_entry * entry)
+{
+	// shard->mutex is locked
+	g_queue_unlink(&shard->lru, &entry->lru_link);
+	g_hash_table_remove(shard->entries, entry->digest);	// frees the entry
+}
+
+/********************************************************
+* cache
+********************************************************/
+static int cache_lookup(struct jwt_auth_private * priv, const unsigned char digest[static TOKEN_DIGEST_SIZE],
+	int64_t now, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE])
+{
+	// return jwt_auth_status_ok if found, jwt_auth_status_revoked, or 1 if not cached
+	struct jwt_auth_shard * shard = get_shard(priv, digest);
+	struct jwt_revocation * revocation = priv->auth->revocation;
+	int status = 1;
+
+	pthread_mutex_lock(&shard->mutex);
+	struct token_entry * entry = g_hash_table_lookup(shard->entries, digest);
+	if(entry) {
+		if(entry->expires_at <= now) {
+			shard_remove_entry(shard, entry);
+		}else if(revocation && revocation->is_revoked(revocation, entry->jti, entry->cb_jti)) {
+			// (no lock is taken and no db is read unless the jti is in the revocation filter)
+			shard_remove_entry(shard, entry);
+			status = jwt_auth_status_revoked;
+		}else {
+			if(shard->lru.head != &entry->lru_link) {
+				g_queue_unlink(&shard->lru, &entry->lru_link);
+				g_queue_push_head_link(&shard->lru, &entry->lru_link);
+			}
+			strncpy(subject, entry->subject, JWT_AUTH_MAX_SUBJECT_SIZE);
+			status = jwt_auth_status_ok;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return status;
+}
+
+static void cache_add(struct jwt_auth_private * priv, const unsigned char digest[static TOKEN_DIGEST_SIZE],
+	int64_t expires_at, const char * subject, const char * jti)
+{
+	struct jwt_auth_shard * shard = get_shard(priv, digest);
+	if(0 == shard->max_entries) return;
+
+	size_t cb_subject = strlen(subject);
+	size_t cb_jti = jti?strlen(jti):0;
+	struct token_entry * entry = calloc(1, sizeof(*entry) + cb_subject + 1 + cb_jti + 1);
+	assert(entry);
+	memcpy(entry->digest, digest, TOKEN_DIGEST_SIZE);
+	entry->expires_at = expires_at;
+	entry->lru_link.data = entry;
+	memcpy(entry->subject, subject, cb_subject);
+	if(cb_jti > 0) {
+		char * p_jti = entry->subject + cb_subject + 1;
+		memcpy(p_jti, jti, cb_jti);
+		entry->jti = p_jti;
+		entry->cb_jti = cb_jti;
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	struct token_entry * old_entry = g_hash_table_lookup(shard->entries, digest);
+	if(old_entry) shard_remove_entry(shard, old_entry);	// verified concurrently by another thread
+
+	while(shard->lru.length >= shard->max_entries) {
+		GList * tail = shard->lru.tail;
+		shard_remove_entry(shard, tail->data);
+	}
+	g_hash_table_insert(shard->entries, entry->digest, entry);
+	g_queue_push_head_link(&shard->lru, &entry->lru_link);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+static void jwt_auth_clear_cache(struct jwt_auth * auth)
+{
+	assert(auth && auth->priv);
+	struct jwt_auth_private * priv = auth->priv;
+	for(int i = 0; i < JWT_AUTH_NUM_SHARDS; ++i) {
+		struct jwt_auth_shard * shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		g_queue_init(&shard->lru);
+		g_hash_table_remove_all(shard->entries);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/********************************************************
+* verification: JWS compact serialization, <header>.<claims>.<signature>
+********************************************************/
+static json_object * decode_json_object(const char * text, size_t length)
+{
+	unsigned char * data = NULL;
+	ssize_t cb_data = jwt_base64url_decode(text, length, &data);
+	if(cb_data <= 0) {
+		free(data);
+		return NULL;
+	}
+
+	json_object * jobject = NULL;
+	if(strlen((char *)data) == (size_t)cb_data) jobject = json_tokener_parse((char *)data);
+	free(data);
+	if(jobject && !json_object_is_type(jobject, json_type_object)) {
+		json_object_put(jobject);
+		jobject = NULL;
+	}
+	return jobject;
+}
+
+static int get_time_claim(json_object * jclaims, const char * claim, int64_t * p_value)
+{
+	// return 0 if the claim exists
+	json_object * jvalue = NULL;
+	if(!json_object_object_get_ex(jclaims, claim, &jvalue) || NULL == jvalue) return -1;
+	if(!json_object_is_type(jvalue, json_type_int) && !json_object_is_type(jvalue, json_type_double)) return -1;
+	*p_value = json_object_get_int64(jvalue);
+	return 0;
+}
+
+static int verify_signature(struct jwt_auth * auth, const char * token, size_t cb_token, json_object ** p_jclaims)
+{
+	const char * p_end = token + cb_token;
+	const char * header = token;
+	const char * claims = memchr(header, '.', cb_token);
+	const char * signature = claims?memchr(claims + 1, '.', p_end - (claims + 1)):NULL;
+	if(NULL == signature || memchr(signature + 1, '.', p_end - (signature + 1))) return jwt_auth_status_invalid;
+	++claims;
+	++signature;
+
+	json_object * jheader = decode_json_object(header, claims - 1 - header);
+	if(NULL == jheader) return jwt_auth_status_invalid;
+
+	const char * alg = json_get_value(jheader, string, alg);
+	const char * kid = json_get_value(jheader, string, kid);
+	json_object * jcrit = NULL;
+	jwt_key_t * key = NULL;
+	if(!json_object_object_get_ex(jheader, "crit", &jcrit)) {	// no extensions are supported
+		key = auth->keyring->find(auth->keyring, kid);
+	}
+
+	int status = jwt_auth_status_invalid;
+	if(key && jwt_key_alg_parse(alg) == key->alg) {	// the key decides the algorithm, never the token
+		unsigned char * sig = NULL;
+		ssize_t cb_sig = jwt_base64url_decode(signature, p_end - signature, &sig);
+		if(cb_sig > 0 && 0 == jwt_key_verify(key, token, signature - 1 - token, sig, cb_sig)) {
+			*p_jclaims = decode_json_object(claims, signature - 1 - claims);
+			if(*p_jclaims) status = jwt_auth_status_ok;
+		}
+		free(sig);
+	}
+	jwt_key_unref(key);
+	json_object_put(jheader);
+	return status;
+}
+
+static int verify_token(struct jwt_auth * auth, const char * token, size_t cb_token, int64_t now,
+	int64_t * p_expires_at, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE], char jti[static JWT_REVOCATION_MAX_JTI_SIZE])
+{
+	json_object * jclaims = NULL;
+	int status = verify_signature(auth, token, cb_token, &jclaims);
+	if(status != jwt_auth_status_ok) return status;
+
+	int64_t exp = 0, nbf = 0;
+	const char * iss = NULL;
+	const char * sub = NULL;
+	const char * token_id = json_get_value(jclaims, string, jti);
+	size_t cb_token_id = token_id?strlen(token_id):0;
+
+	if(get_time_claim(jclaims, "exp", &exp)) {
+		status = jwt_auth_status_rejected;	// tokens without expiry are not accepted
+	}else if(exp + (int64_t)auth->leeway <= now) {
+		status = jwt_auth_status_expired;
+	}else if(0 == get_time_claim(jclaims, "nbf", &nbf) && nbf > now + (int64_t)auth->leeway) {
+		status = jwt_auth_status_expired;
+	}else if(auth->issuer && (NULL == (iss = json_get_value(jclaims, string, iss)) || strcmp(iss, auth->issuer))) {
+		status = jwt_auth_status_rejected;
+	}else if(NULL == (sub = json_get_value(jclaims, string, sub)) || !sub[0]) {
+		status = jwt_auth_status_rejected;
+	}else if(auth->revocation && cb_token_id >= JWT_REVOCATION_MAX_JTI_SIZE) {
+		status = jwt_auth_status_rejected;	// could not be revoked
+	}else if(auth->revocation && auth->revocation->is_revoked(auth->revocation, token_id, cb_token_id)) {
+		status = jwt_auth_status_revoked;
+	}
+
+	if(status == jwt_auth_status_ok) {
+		strncpy(subject, sub, JWT_AUTH_MAX_SUBJECT_SIZE);
+		subject[JWT_AUTH_MAX_SUBJECT_SIZE - 1] = '\0';
+		jti[0] = '\0';
+		if(cb_token_id > 0 && cb_token_id < JWT_REVOCATION_MAX_JTI_SIZE) memcpy(jti, token_id, cb_token_id + 1);
+
+		int64_t expires_at = now + auth->max_cache_ttl;
+		if(exp < expires_at) expires_at = exp;
+		*p_expires_at = expires_at;
+	}
+	json_object_put(jclaims);
+	return status;
+}
+
+static void token_digest(const char * token, size_t cb_token, unsigned char digest[static TOKEN_DIGEST_SIZE])
+{
+	gsize cb_digest = TOKEN_DIGEST_SIZE;
+	GChecksum * checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	assert(checksum);
+	g_checksum_update(checksum, (const guchar *)token, cb_token);
+	g_checksum_get_digest(checksum, digest, &cb_digest);
+	g_checksum_free(checksum);
+	assert(cb_digest == TOKEN_DIGEST_SIZE);
+}
+
+static int jwt_auth_lookup(struct jwt_auth * auth, const char * token, size_t cb_token, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE])
+{
+	assert(auth && auth->priv);
+	if(NULL == token || 0 == cb_token || cb_token > JWT_AUTH_MAX_TOKEN_SIZE) return jwt_auth_status_invalid;
+
+	unsigned char digest[TOKEN_DIGEST_SIZE];
+	token_digest(token, cb_token, digest);
+	return cache_lookup(auth->priv, digest, time(NULL), subject);
+}
+
+static int jwt_auth_verify(struct jwt_auth * auth, const char * token, size_t cb_token, char subject[static JWT_AUTH_MAX_SUBJECT_SIZE])
+{
+	assert(auth && auth->priv);
+	struct jwt_auth_private * priv = auth->priv;
+	if(NULL == token || 0 == cb_token || cb_token > JWT_AUTH_MAX_TOKEN_SIZE) return jwt_auth_status_invalid;
+
+	unsigned char digest[TOKEN_DIGEST_SIZE];
+	token_digest(token, cb_token, digest);
+
+	int64_t now = time(NULL);
+	int status = cache_lookup(priv, digest, now, subject);
+	if(status != 1) return status;
+
+	int64_t expires_at = 0;
+	char jti[JWT_REVOCATION_MAX_JTI_SIZE] = "";
+	status = verify_token(auth, token, cb_token, now, &expires_at, subject, jti);
+	if(status == jwt_auth_status_ok) cache_add(priv, digest, expires_at, subject, jti);
+	else debug_printf("jwt rejected: %s", jwt_auth_status_to_string(status));
+	return status;
+}
+
+static int jwt_auth_decode(struct jwt_auth * auth, const char * token, size_t cb_token, json_object ** p_jclaims)
+{
+	assert(auth && p_jclaims);
+	*p_jclaims = NULL;
+	if(NULL == token || 0 == cb_token || cb_token > JWT_AUTH_MAX_TOKEN_SIZE) return jwt_auth_status_invalid;
+	return verify_signature(auth, token, cb_token, p_jclaims);
+}
+
+const char * jwt_auth_status_to_string(enum jwt_auth_status status)
+{
+	switch(status) {
+	case jwt_auth_status_ok: return "ok";
+	case jwt_auth_status_invalid: return "invalid token";
+	case jwt_auth_status_expired: return "token expired";
+	case jwt_auth_status_rejected: return "token rejected";
+	case jwt_auth_status_revoked: return "token revoked";
+	default: break;
+	}
+	return "unknown";
+}
+
+jwt_auth_t * jwt_auth_init(jwt_auth_t * auth, struct jwt_keyring * keyring,
+	const char * issuer, size_t max_cached_tokens, unsigned int max_cache_ttl, void * user_data)
+{
+	assert(keyring);
+	if(NULL == auth) auth = calloc(1, sizeof(*auth));
+	assert(auth);
+
+	auth->user_data = user_data;
+	auth->keyring = keyring;
+	auth->issuer = (issuer && issuer[0])?strdup(issuer):NULL;
+	auth->max_cached_tokens = max_cached_tokens;
+	auth->max_cache_ttl = max_cache_ttl;
+	auth->verify = jwt_auth_verify;
+	auth->lookup = jwt_auth_lookup;
+	auth->clear_cache = jwt_auth_clear_cache;
+	auth->decode = jwt_auth_decode;
+
+	struct jwt_auth_private * priv = jwt_auth_private_new(auth);
+	assert(priv && auth->priv == priv);
+	return auth;
+}
+
+void jwt_auth_cleanup(jwt_auth_t * auth)
+{
+	if(NULL == auth) return;
+	jwt_auth_private_free(auth->priv);
+	auth->priv = NULL;
+	free(auth->issuer);
+	auth->issuer = NULL;
+}
@@ -0,0 +1,456 @@
+/*
+ * jwt-keyring.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <glib.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ecdsa.h>
+#include <openssl/bn.h>
+
+#include "jwt-keyring.h"
+#include "utils.h"
+
+/********************************************************
+* algorithms
+********************************************************/
+static const char * s_alg_names[] = {
+	[jwt_key_alg_rs256] = "RS256",
+	[jwt_key_alg_es256] = "ES256",
+	[jwt_key_alg_eddsa] = "EdDSA",
+};
+#define NUM_ALGS (sizeof(s_alg_names) / sizeof(s_alg_names[0]))
+
+enum jwt_key_alg jwt_key_alg_parse(const char * alg)
+{
+	if(NULL == alg) return jwt_key_alg_unknown;
+	for(size_t i = 0; i < NUM_ALGS; ++i) {
+		if(0 == strcmp(alg, s_alg_names[i])) return (enum jwt_key_alg)i;
+	}
+	return jwt_key_alg_unknown;
+}
+
+const char * jwt_key_alg_to_string(enum jwt_key_alg alg)
+{
+	if(alg < 0 || alg >= (int)NUM_ALGS) return NULL;
+	return s_alg_names[alg];
+}
+
+static enum jwt_key_alg alg_from_pkey(EVP_PKEY * pkey)
+{
+	switch(EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA: return (EVP_PKEY_bits(pkey) >= 2048)?jwt_key_alg_rs256:jwt_key_alg_unknown;
+	case EVP_PKEY_EC: return (EVP_PKEY_bits(pkey) == 256)?jwt_key_alg_es256:jwt_key_alg_unknown;	// P-256
+	case EVP_PKEY_ED25519: return jwt_key_alg_eddsa;
+	default: break;
+	}
+	return jwt_key_alg_unknown;
+}
+
+/********************************************************
+* base64url
+********************************************************/
+static inline int base64url_value(unsigned char c)
+{
+	if(c >= 'A' && c <= 'Z') return c - 'A';
+	if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if(c >= '0' && c <= '9') return c - '0' + 52;
+	if(c == '-') return 62;
+	if(c == '_') return 63;
+	return -1;
+}
+
+ssize_t jwt_base64url_decode(const char * text, size_t length, unsigned char ** p_data)
+{
+	assert(p_data);
+	if(NULL == text || (length % 4) == 1) return -1;
+
+	unsigned char * data = malloc(length * 3 / 4 + 1);
+	assert(data);
+
+	size_t cb_data = 0;
+	uint32_t bits = 0;
+	int num_bits = 0;
+	for(size_t i = 0; i < length; ++i) {
+		int value = base64url_value(text[i]);
+		if(value < 0) {
+			free(data);
+			return -1;
+		}
+		bits = (bits << 6) | value;
+		num_bits += 6;
+		if(num_bits >= 8) {
+			num_bits -= 8;
+			data[cb_data++] = (unsigned char)(bits >> num_bits);
+		}
+	}
+	data[cb_data] = '\0';	// (the header and the claims are parsed as text)
+	*p_data = data;
+	return cb_data;
+}
+
+size_t jwt_base64url_encode(const void * data, size_t length, char * text)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	const unsigned char * p = data;
+	char * dst = text;
+	size_t i = 0;
+	for(; i + 3 <= length; i += 3) {
+		uint32_t bits = ((uint32_t)p[i] << 16) | ((uint32_t)p[i + 1] << 8) | p[i + 2];
+		*dst++ = alphabet[(bits >> 18) & 0x3f];
+		*dst++ = alphabet[(bits >> 12) & 0x3f];
+		*dst++ = alphabet[(bits >> 6) & 0x3f];
+		*dst++ = alphabet[bits & 0x3f];
+	}
+	if(i < length) {	// no padding
+		uint32_t bits = (uint32_t)p[i] << 16;
+		if(i + 1 < length) bits |= (uint32_t)p[i + 1] << 8;
+		*dst++ = alphabet[(bits >> 18) & 0x3f];
+		*dst++ = alphabet[(bits >> 12) & 0x3f];
+		if(i + 1 < length) *dst++ = alphabet[(bits >> 6) & 0x3f];
+	}
+	*dst = '\0';
+	return dst - text;
+}
+
+/********************************************************
+* struct jwt_key
+********************************************************/
+void jwt_key_unref(jwt_key_t * key)
+{
+	if(NULL == key) return;
+	if(__atomic_sub_fetch(&key->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	if(key->public_key) EVP_PKEY_free(key->public_key);
+	if(key->private_key) EVP_PKEY_free(key->private_key);
+	free(key->kid);
+	free(key);
+}
+
+static void key_unref(gpointer key)
+{
+	jwt_key_unref(key);
+}
+
+static EVP_PKEY * load_pem(const char * filename, int private_key)
+{
+	FILE * fp = fopen(filename, "r");
+	if(NULL == fp) {
+		perror(filename);
+		return NULL;
+	}
+	EVP_PKEY * pkey = private_key?PEM_read_PrivateKey(fp, NULL, NULL, NULL):PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if(NULL == pkey) fprintf(stderr, "[ERROR]: %s(): invalid PEM file '%s'\n", __FUNCTION__, filename);
+	return pkey;
+}
+
+static jwt_key_t * jwt_key_load(const char * kid, const char * alg, const char * public_key_file, const char * private_key_file)
+{
+	EVP_PKEY * public_key = NULL;
+	EVP_PKEY * private_key = NULL;
+	if(public_key_file && public_key_file[0]) {
+		public_key = load_pem(public_key_file, 0);
+		if(NULL == public_key) return NULL;
+	}
+	if(private_key_file && private_key_file[0]) {
+		private_key = load_pem(private_key_file, 1);
+		if(NULL == private_key) {
+			if(public_key) EVP_PKEY_free(public_key);
+			return NULL;
+		}
+	}
+
+	if(NULL == public_key) {
+		if(NULL == private_key) return NULL;
+		EVP_PKEY_up_ref(private_key);	// a private key verifies its own signatures
+		public_key = private_key;
+	}
+
+	enum jwt_key_alg key_alg = alg_from_pkey(public_key);
+	if(key_alg == jwt_key_alg_unknown || (alg && alg[0] && jwt_key_alg_parse(alg) != key_alg)
+		|| (private_key && EVP_PKEY_base_id(private_key) != EVP_PKEY_base_id(public_key)))
+	{
+		fprintf(stderr, "[ERROR]: %s(): kid '%s': unsupported key type or alg mismatch (%s)\n", __FUNCTION__, kid, alg?alg:"");
+		EVP_PKEY_free(public_key);
+		if(private_key) EVP_PKEY_free(private_key);
+		return NULL;
+	}
+
+	jwt_key_t * key = calloc(1, sizeof(*key));
+	assert(key);
+	key->refs = 1;
+	key->kid = strdup(kid);
+	key->alg = key_alg;
+	key->public_key = public_key;
+	key->private_key = private_key;
+	return key;
+}
+
+static unsigned char * es256_signature_to_der(const unsigned char * signature, size_t cb_signature, size_t * p_length)
+{
+	// JWS: r || s (32 bytes each) --> DER encoded ECDSA_SIG
+	if(cb_signature != 64) return NULL;
+	ECDSA_SIG * sig = ECDSA_SIG_new();
+	assert(sig);
+	BIGNUM * r = BN_bin2bn(signature, 32, NULL);
+	BIGNUM * s = BN_bin2bn(signature + 32, 32, NULL);
+	assert(r && s);
+	ECDSA_SIG_set0(sig, r, s);	// takes r and s
+
+	unsigned char * der = NULL;
+	int cb_der = i2d_ECDSA_SIG(sig, &der);
+	ECDSA_SIG_free(sig);
+	if(cb_der <= 0) return NULL;
+	*p_length = cb_der;
+	return der;
+}
+
+int jwt_key_verify(const jwt_key_t * key, const void * data, size_t length, const unsigned char * signature, size_t cb_signature)
+{
+	assert(key && key->public_key);
+	if(NULL == signature || 0 == cb_signature || cb_signature > JWT_KEYRING_MAX_SIGNATURE_SIZE) return -1;
+
+	unsigned char * der = NULL;
+	if(key->alg == jwt_key_alg_es256) {
+		der = es256_signature_to_der(signature, cb_signature, &cb_signature);
+		if(NULL == der) return -1;
+		signature = der;
+	}
+
+	const EVP_MD * md = (key->alg == jwt_key_alg_eddsa)?NULL:EVP_sha256();
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+	assert(ctx);
+	int ok = EVP_DigestVerifyInit(ctx, NULL, md, NULL, key->public_key);
+	if(ok == 1) ok = EVP_DigestVerify(ctx, signature, cb_signature, data, length);
+	EVP_MD_CTX_free(ctx);
+	if(der) OPENSSL_free(der);
+	return (ok == 1)?0:-1;
+}
+
+static ssize_t es256_signature_from_der(const unsigned char * der, size_t cb_der, unsigned char signature[static 64])
+{
+	// DER encoded ECDSA_SIG --> JWS: r || s
+	ECDSA_SIG * sig = d2i_ECDSA_SIG(NULL, &der, cb_der);
+	if(NULL == sig) return -1;
+	const BIGNUM * r = NULL;
+	const BIGNUM * s = NULL;
+	ECDSA_SIG_get0(sig, &r, &s);
+	int ok = (BN_bn2binpad(r, signature, 32) == 32) && (BN_bn2binpad(s, signature + 32, 32) == 32);
+	ECDSA_SIG_free(sig);
+	return ok?64:-1;
+}
+
+ssize_t jwt_key_sign(const jwt_key_t * key, const void * data, size_t length, unsigned char signature[static JWT_KEYRING_MAX_SIGNATURE_SIZE])
+{
+	assert(key);
+	if(NULL == key->private_key) return -1;
+
+	unsigned char der[JWT_KEYRING_MAX_SIGNATURE_SIZE];
+	unsigned char * output = (key->alg == jwt_key_alg_es256)?der:signature;
+	size_t cb_signature = JWT_KEYRING_MAX_SIGNATURE_SIZE;
+
+	const EVP_MD * md = (key->alg == jwt_key_alg_eddsa)?NULL:EVP_sha256();
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+	assert(ctx);
+	int ok = EVP_DigestSignInit(ctx, NULL, md, NULL, key->private_key);
+	if(ok == 1) ok = EVP_DigestSign(ctx, NULL, &cb_signature, data, length);	// max size
+	if(ok == 1 && cb_signature > JWT_KEYRING_MAX_SIGNATURE_SIZE) ok = 0;
+	if(ok == 1) ok = EVP_DigestSign(ctx, output, &cb_signature, data, length);
+	EVP_MD_CTX_free(ctx);
+	if(ok != 1) return -1;
+
+	if(key->alg == jwt_key_alg_es256) return es256_signature_from_der(der, cb_signature, signature);
+	return cb_signature;
+}
+
+/********************************************************
+* struct jwt_keyring_private
+********************************************************/
+struct key_set
+{
+	GHashTable * keys;	// kid --> (jwt_key_t *), key owned by the value
+	jwt_key_t * default_key;
+};
+
+struct jwt_keyring_private
+{
+	struct jwt_keyring * keyring;
+	pthread_rwlock_t rw_lock;
+	struct key_set * keys;
+};
+
+static void key_set_free(struct key_set * set)
+{
+	if(NULL == set) return;
+	if(set->keys) g_hash_table_destroy(set->keys);
+	free(set);
+}
+
+static int key_set_add(struct key_set * set, json_object * jkey, const char * default_kid)
+{
+	const char * kid = json_get_value(jkey, string, kid);
+	const char * alg = json_get_value(jkey, string, alg);
+	const char * public_key_file = json_get_value(jkey, string, public_key_file);
+	const char * private_key_file = json_get_value(jkey, string, private_key_file);
+	if(NULL == kid || !kid[0]) kid = default_kid;
+	if(strlen(kid) >= JWT_KEYRING_MAX_KID_SIZE || g_hash_table_lookup(set->keys, kid)) {
+		fprintf(stderr, "[ERROR]: %s(): invalid or duplicated kid '%s'\n", __FUNCTION__, kid);
+		return -1;
+	}
+
+	jwt_key_t * key = jwt_key_load(kid, alg, public_key_file, private_key_file);
+	if(NULL == key) return -1;
+	g_hash_table_insert(set->keys, key->kid, key);
+	if(NULL == set->default_key) set->default_key = key;
+	return 0;
+}
+
+static struct key_set * key_set_load(json_object * jconfig)
+{
+	struct key_set * set = calloc(1, sizeof(*set));
+	assert(set);
+	set->keys = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, key_unref);
+
+	int rc = 0;
+	json_object * jkeys = NULL;
+	if(json_object_object_get_ex(jconfig, "keys", &jkeys) && json_object_is_type(jkeys, json_type_array)) {
+		size_t count = json_object_array_length(jkeys);
+		for(size_t i = 0; 0 == rc && i < count; ++i) {
+			rc = key_set_add(set, json_object_array_get_idx(jkeys, i), "default");
+		}
+	}else {
+		rc = key_set_add(set, jconfig, "default");	// a single key
+	}
+
+	const char * default_kid = json_get_value(jconfig, string, default_kid);
+	if(0 == rc && default_kid && default_kid[0]) {
+		set->default_key = g_hash_table_lookup(set->keys, default_kid);
+		if(NULL == set->default_key) {
+			fprintf(stderr, "[ERROR]: %s(): default_kid '%s' not found\n", __FUNCTION__, default_kid);
+			rc = -1;
+		}
+	}
+	if(rc || NULL == set->default_key) {
+		key_set_free(set);
+		return NULL;
+	}
+	return set;
+}
+
+static struct jwt_keyring_private * jwt_keyring_private_new(struct jwt_keyring * keyring)
+{
+	struct jwt_keyring_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	int rc = pthread_rwlock_init(&priv->rw_lock, NULL);
+	assert(0 == rc);
+
+	keyring->priv = priv;
+	priv->keyring = keyring;
+	return priv;
+}
+static void jwt_keyring_private_free(struct jwt_keyring_private * priv)
+{
+	if(NULL == priv) return;
+	key_set_free(priv->keys);
+	pthread_rwlock_destroy(&priv->rw_lock);
+	free(priv);
+}
+
+/********************************************************
+* struct jwt_keyring
+********************************************************/
+static jwt_key_t * jwt_keyring_find(struct jwt_keyring * keyring, const char * kid)
+{
+	assert(keyring && keyring->priv);
+	struct jwt_keyring_private * priv = keyring->priv;
+
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	jwt_key_t * key = NULL;
+	if(priv->keys) key = kid?g_hash_table_lookup(priv->keys->keys, kid):priv->keys->default_key;
+	if(key) __atomic_add_fetch(&key->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return key;
+}
+
+static ssize_t jwt_keyring_reload(struct jwt_keyring * keyring)
+{
+	assert(keyring && keyring->priv);
+	struct jwt_keyring_private * priv = keyring->priv;
+
+	struct key_set * keys = key_set_load(keyring->jconfig);
+	if(NULL == keys) return -1;
+	ssize_t num_keys = g_hash_table_size(keys->keys);
+
+	pthread_rwlock_wrlock(&priv->rw_lock);
+	struct key_set * old_keys = priv->keys;
+	priv->keys = keys;
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	key_set_free(old_keys);	// keys in use are released by their last user
+	debug_printf("jwt keyring loaded: %ld key(s), default kid: %s", (long)num_keys, keys->default_key->kid);
+	return num_keys;
+}
+
+jwt_keyring_t * jwt_keyring_init(jwt_keyring_t * keyring, json_object * jconfig, void * user_data)
+{
+	assert(jconfig);
+	int auto_free = (NULL == keyring);
+	if(NULL == keyring) keyring = calloc(1, sizeof(*keyring));
+	assert(keyring);
+
+	keyring->user_data = user_data;
+	keyring->jconfig = json_object_get(jconfig);
+	keyring->find = jwt_keyring_find;
+	keyring->reload = jwt_keyring_reload;
+
+	struct jwt_keyring_private * priv = jwt_keyring_private_new(keyring);
+	assert(priv && keyring->priv == priv);
+
+	if(keyring->reload(keyring) <= 0) {
+		jwt_keyring_cleanup(keyring);
+		if(auto_free) free(keyring);
+		return NULL;
+	}
+	return keyring;
+}
+
+void jwt_keyring_cleanup(jwt_keyring_t * keyring)
+{
+	if(NULL == keyring) return;
+	jwt_keyring_private_free(keyring->priv);
+	keyring->priv = NULL;
+	if(keyring->jconfig) json_object_put(keyring->jconfig);
+	keyring->jconfig = NULL;
+}
@@ -0,0 +1,324 @@
+/*
+ * jwt-revocation.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <endian.h>
+
+#include "jwt-revocation.h"
+#include "bloom-filter.h"
+#include "utils.h"
+
+// readers of the filter take no lock: each reader is counted in the slot of the current epoch,
+// a replaced filter is freed once both slots have drained (two epoch flips, as in userspace RCU)
+#define READER_SLOT_PADDING (64)	// (one cache line per slot)
+
+/********************************************************
+* struct jwt_revocation_private
+********************************************************/
+struct jwt_revocation_private
+{
+	struct jwt_revocation * revocation;
+	pthread_mutex_t mutex;	// serializes the writers: revoke(), purge()
+	bloom_filter_t * filter;	// current filter, (atomic pointer)
+	DB_ENV * private_env;	// nullable, opened if no db_env was given
+
+	unsigned int epoch;	// (atomic)
+	struct {
+		long count;	// (atomic) readers which entered with (epoch & 1) == slot
+		char padding[READER_SLOT_PADDING - sizeof(long)];
+	}readers[2];
+
+	size_t capacity;	// minimum capacity of the filter
+	double fp_rate;
+};
+
+static inline const bloom_filter_t * reader_enter(struct jwt_revocation_private * priv, unsigned int * p_slot)
+{
+	unsigned int slot = __atomic_load_n(&priv->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&priv->readers[slot].count, 1, __ATOMIC_SEQ_CST);
+	*p_slot = slot;
+	return __atomic_load_n(&priv->filter, __ATOMIC_SEQ_CST);	// (loaded after being counted)
+}
+
+static inline void reader_leave(struct jwt_revocation_private * priv, unsigned int slot)
+{
+	__atomic_sub_fetch(&priv->readers[slot].count, 1, __ATOMIC_RELEASE);
+}
+
+static void wait_for_readers(struct jwt_revocation_private * priv)
+{
+	// priv->mutex is locked
+	// a reader of the old filter was counted before the new one was stored, in either slot:
+	// flip the epoch and drain the slot of the previous one, twice
+	for(int i = 0; i < 2; ++i) {
+		unsigned int slot = __atomic_fetch_add(&priv->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		while(__atomic_load_n(&priv->readers[slot].count, __ATOMIC_ACQUIRE) > 0) sched_yield();
+	}
+}
+
+static void swap_filter(struct jwt_revocation_private * priv, bloom_filter_t * filter)
+{
+	// priv->mutex is locked
+	bloom_filter_t * old_filter = priv->filter;
+	__atomic_store_n(&priv->filter, filter, __ATOMIC_SEQ_CST);
+	if(NULL == old_filter) return;
+
+	wait_for_readers(priv);
+	bloom_filter_cleanup(old_filter);
+	free(old_filter);
+}
+
+static uint32_t write_cursor_flags(DB * dbp)
+{
+	// concurrent data store: a cursor that deletes must be opened as a write cursor
+	DB_ENV * db_env = dbp->get_env(dbp);
+	uint32_t env_flags = 0;
+	if(db_env && 0 == db_env->get_open_flags(db_env, &env_flags) && (env_flags & DB_INIT_CDB)) return DB_WRITECURSOR;
+	return 0;
+}
+
+static ssize_t rebuild_filter(struct jwt_revocation_private * priv, size_t capacity, int64_t now)
+{
+	// priv->mutex is locked
+	// build a new filter from the db, drop the entries expired before 'now' (if now > 0)
+	// return the number of entries removed, -1 on error
+	DB * dbp = priv->revocation->dbp;
+	if(capacity < priv->capacity) capacity = priv->capacity;
+	bloom_filter_t * filter = bloom_filter_init(NULL, capacity, priv->fp_rate);
+	assert(filter);
+
+	DBC * cursorp = NULL;
+	int rc = dbp->cursor(dbp, NULL, &cursorp, (now > 0)?write_cursor_flags(dbp):0);
+	if(rc) {
+		dbp->err(dbp, rc, "%s(): cursor", __FUNCTION__);
+		bloom_filter_cleanup(filter);
+		free(filter);
+		return -1;
+	}
+
+	char jti[JWT_REVOCATION_MAX_JTI_SIZE];
+	int64_t expires_at = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = jti;
+	key.ulen = sizeof(jti);
+	key.flags = DB_DBT_USERMEM;
+	value.data = &expires_at;
+	value.ulen = sizeof(expires_at);
+	value.flags = DB_DBT_USERMEM;
+
+	ssize_t num_removed = 0;
+	while(0 == (rc = cursorp->get(cursorp, &key, &value, DB_NEXT))) {
+		if(now > 0 && value.size == sizeof(expires_at) && (int64_t)be64toh(expires_at) <= now) {
+			rc = cursorp->del(cursorp, 0);
+			if(rc) break;
+			++num_removed;
+			continue;
+		}
+		bloom_filter_add(filter, bloom_filter_hash(jti, key.size));
+	}
+	cursorp->close(cursorp);
+	if(rc != DB_NOTFOUND) {
+		dbp->err(dbp, rc, "%s(): cursor->get", __FUNCTION__);
+		bloom_filter_cleanup(filter);
+		free(filter);
+		return -1;
+	}
+	if(num_removed > 0) dbp->sync(dbp, 0);
+
+	debug_printf("revocation filter rebuilt: %ld entries, %ld purged", (long)filter->count, (long)num_removed);
+	swap_filter(priv, filter);
+	return num_removed;
+}
+
+/********************************************************
+* public methods
+********************************************************/
+static int jwt_revocation_revoke(struct jwt_revocation * revocation, const char * jti, int64_t expires_at)
+{
+	assert(revocation && revocation->priv);
+	struct jwt_revocation_private * priv = revocation->priv;
+	DB * dbp = revocation->dbp;
+
+	size_t cb_jti = jti?strlen(jti):0;
+	if(0 == cb_jti || cb_jti >= JWT_REVOCATION_MAX_JTI_SIZE) return -1;
+
+	int64_t be_expires_at = htobe64(expires_at);
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)jti;
+	key.size = cb_jti;
+	value.data = &be_expires_at;
+	value.size = sizeof(be_expires_at);
+
+	pthread_mutex_lock(&priv->mutex);
+	int rc = dbp->put(dbp, NULL, &key, &value, 0);
+	if(0 == rc) rc = dbp->sync(dbp, 0);	// revocations are rare, make each one durable
+	if(rc) {
+		dbp->err(dbp, rc, "%s(jti=%s)", __FUNCTION__, jti);
+		pthread_mutex_unlock(&priv->mutex);
+		return -1;
+	}
+
+	// set the bits in place, (readers see the jti from now on), grow the filter once it is full
+	bloom_filter_t * filter = priv->filter;
+	bloom_filter_add(filter, bloom_filter_hash(jti, cb_jti));
+	if(filter->count > filter->capacity) rebuild_filter(priv, filter->capacity * 2, 0);
+	pthread_mutex_unlock(&priv->mutex);
+	return 0;
+}
+
+static int jwt_revocation_is_revoked(struct jwt_revocation * revocation, const char * jti, size_t cb_jti)
+{
+	assert(revocation && revocation->priv);
+	struct jwt_revocation_private * priv = revocation->priv;
+	if(NULL == jti || 0 == cb_jti) return 0;
+	if(cb_jti >= JWT_REVOCATION_MAX_JTI_SIZE) return 0;	// cannot have been revoked
+
+	unsigned int slot = 0;
+	const bloom_filter_t * filter = reader_enter(priv, &slot);
+	int maybe_revoked = bloom_filter_contains(filter, bloom_filter_hash(jti, cb_jti));
+	reader_leave(priv, slot);
+	if(!maybe_revoked) return 0;
+
+	// revoked, or a false positive
+	DB * dbp = revocation->dbp;
+	int64_t expires_at = 0;
+	DBT key, value;
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+	key.data = (void *)jti;
+	key.size = cb_jti;
+	value.data = &expires_at;
+	value.ulen = sizeof(expires_at);
+	value.flags = DB_DBT_USERMEM;
+
+	int rc = dbp->get(dbp, NULL, &key, &value, 0);
+	if(rc == DB_NOTFOUND) return 0;
+	if(rc) dbp->err(dbp, rc, "%s(jti=%.*s)", __FUNCTION__, (int)cb_jti, jti);
+	return 1;	// fail closed on db errors
+}
+
+static ssize_t jwt_revocation_purge(struct jwt_revocation * revocation, int64_t now)
+{
+	assert(revocation && revocation->priv);
+	struct jwt_revocation_private * priv = revocation->priv;
+
+	pthread_mutex_lock(&priv->mutex);
+	size_t capacity = priv->filter->count * 2;
+	ssize_t num_removed = rebuild_filter(priv, capacity, now);
+	pthread_mutex_unlock(&priv->mutex);
+	return num_removed;
+}
+
+jwt_revocation_t * jwt_revocation_init(jwt_revocation_t * revocation, DB_ENV * db_env, const char * filename,
+	size_t capacity, double fp_rate, void * user_data)
+{
+	assert(filename && filename[0]);
+	int rc = 0;
+	DB_ENV * private_env = NULL;
+	if(NULL == db_env) {
+		// a standalone db does not lock: is_revoked() reads concurrently with revoke() and purge()
+		rc = db_env_create(&private_env, 0);
+		if(0 == rc) rc = private_env->open(private_env, NULL, DB_CREATE | DB_PRIVATE | DB_INIT_CDB | DB_INIT_MPOOL | DB_THREAD, 0);
+		if(rc) {
+			fprintf(stderr, "[ERROR]: %s(): open env: %s\n", __FUNCTION__, db_strerror(rc));
+			if(private_env) private_env->close(private_env, 0);
+			return NULL;
+		}
+		db_env = private_env;
+	}
+
+	DB * dbp = NULL;
+	rc = db_create(&dbp, db_env, 0);
+	if(0 == rc) rc = dbp->open(dbp, NULL, filename, NULL, DB_BTREE, DB_CREATE | DB_THREAD, 0600);
+	if(rc) {
+		fprintf(stderr, "[ERROR]: %s(): open db(%s): %s\n", __FUNCTION__, filename, db_strerror(rc));
+		if(dbp) dbp->close(dbp, 0);
+		if(private_env) private_env->close(private_env, 0);
+		return NULL;
+	}
+
+	int auto_free = (NULL == revocation);
+	if(NULL == revocation) revocation = calloc(1, sizeof(*revocation));
+	assert(revocation);
+	revocation->user_data = user_data;
+	revocation->dbp = dbp;
+	revocation->revoke = jwt_revocation_revoke;
+	revocation->is_revoked = jwt_revocation_is_revoked;
+	revocation->purge = jwt_revocation_purge;
+
+	struct jwt_revocation_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->revocation = revocation;
+	priv->private_env = private_env;
+	priv->capacity = capacity?capacity:1024;
+	priv->fp_rate = fp_rate;
+	rc = pthread_mutex_init(&priv->mutex, NULL);
+	assert(0 == rc);
+	revocation->priv = priv;
+
+	// load the persisted revocations, (tokens expired while stopped are purged)
+	if(rebuild_filter(priv, 0, time(NULL)) < 0) {
+		jwt_revocation_cleanup(revocation);
+		if(auto_free) free(revocation);
+		return NULL;
+	}
+	return revocation;
+}
+
+void jwt_revocation_cleanup(jwt_revocation_t * revocation)
+{
+	if(NULL == revocation) return;
+	struct jwt_revocation_private * priv = revocation->priv;
+	DB_ENV * private_env = NULL;
+	if(priv) {
+		if(priv->filter) {
+			bloom_filter_cleanup(priv->filter);
+			free(priv->filter);
+		}
+		private_env = priv->private_env;
+		pthread_mutex_destroy(&priv->mutex);
+		free(priv);
+		revocation->priv = NULL;
+	}
+	if(revocation->dbp) {
+		revocation->dbp->close(revocation->dbp, 0);
+		revocation->dbp = NULL;
+	}
+	if(private_env) private_env->close(private_env, 0);
+}
@@ -0,0 +1,160 @@
+/*
+ * load-shedder.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "load-shedder.h"
+
+#define LOAD_SHEDDER_EWMA_SHIFT (4)	// alpha = 1/16
+
+/********************************************************
+* struct load_shedder_private
+********************************************************/
+struct load_shedder_private
+{
+	struct load_shedder * shedder;
+
+	int64_t inflight __attribute__((aligned(64)));
+	uint64_t latency_ewma __attribute__((aligned(64)));
+	uint64_t latency_updated_at;	// (ns, CLOCK_MONOTONIC)
+};
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************
+* struct load_shedder
+********************************************************/
+static uint64_t load_shedder_get_latency(struct load_shedder * shedder)
+{
+	struct load_shedder_private * priv = shedder->priv;
+	uint64_t updated_at = __atomic_load_n(&priv->latency_updated_at, __ATOMIC_RELAXED);
+	if(monotonic_ns() - updated_at > shedder->window_ns) return 0;	// no recent publishes
+	return __atomic_load_n(&priv->latency_ewma, __ATOMIC_RELAXED);
+}
+
+static int64_t load_shedder_get_inflight(struct load_shedder * shedder)
+{
+	struct load_shedder_private * priv = shedder->priv;
+	return __atomic_load_n(&priv->inflight, __ATOMIC_RELAXED);
+}
+
+static int load_shedder_admit(struct load_shedder * shedder, enum load_priority priority)
+{
+	struct load_shedder_private * priv = shedder->priv;
+	if(priority < load_priority_high) {
+		int64_t inflight = __atomic_load_n(&priv->inflight, __ATOMIC_RELAXED);
+		uint64_t latency = 0;
+
+		// level of overload: 0: none, 1: overloaded, 2: severely overloaded
+		int level = 0;
+		if(inflight > shedder->max_inflight * 2) level = 2;
+		else if(inflight > shedder->max_inflight) level = 1;
+		if(level < 2 && shedder->target_latency_ns > 0) {
+			latency = load_shedder_get_latency(shedder);
+			if(latency > shedder->target_latency_ns * 2) level = 2;
+			else if(latency > shedder->target_latency_ns && level < 1) level = 1;
+		}
+
+		if(level >= 2) return 0;
+		if(level == 1 && priority == load_priority_low) return 0;
+	}
+	__atomic_add_fetch(&priv->inflight, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void load_shedder_leave(struct load_shedder * shedder)
+{
+	struct load_shedder_private * priv = shedder->priv;
+	__atomic_sub_fetch(&priv->inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void load_shedder_record_latency(struct load_shedder * shedder, uint64_t latency_ns)
+{
+	struct load_shedder_private * priv = shedder->priv;
+	uint64_t now = monotonic_ns();
+	uint64_t updated_at = __atomic_load_n(&priv->latency_updated_at, __ATOMIC_RELAXED);
+	int stale = (now - updated_at > shedder->window_ns);
+
+	uint64_t ewma = __atomic_load_n(&priv->latency_ewma, __ATOMIC_RELAXED);
+	uint64_t new_ewma;
+	do {
+		if(stale) new_ewma = latency_ns;	// restart from the current sample
+		else new_ewma = ewma - (ewma >> LOAD_SHEDDER_EWMA_SHIFT) + (latency_ns >> LOAD_SHEDDER_EWMA_SHIFT);
+	}while(!__atomic_compare_exchange_n(&priv->latency_ewma, &ewma, new_ewma, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_store_n(&priv->latency_updated_at, now, __ATOMIC_RELAXED);
+}
+
+load_shedder_t * load_shedder_init(load_shedder_t * shedder, int64_t max_inflight, uint64_t target_latency_ns, void * user_data)
+{
+	if(NULL == shedder) shedder = calloc(1, sizeof(*shedder));
+	assert(shedder);
+
+	struct load_shedder_private * priv = NULL;
+	int rc = posix_memalign((void **)&priv, 64, sizeof(*priv));
+	assert(0 == rc && priv);
+	memset(priv, 0, sizeof(*priv));
+	priv->shedder = shedder;
+
+	shedder->priv = priv;
+	shedder->user_data = user_data;
+	shedder->max_inflight = (max_inflight > 0)?max_inflight:INT64_MAX / 2;
+	shedder->target_latency_ns = target_latency_ns;
+	shedder->window_ns = 1000000000ULL;	// 1 second
+
+	shedder->admit = load_shedder_admit;
+	shedder->leave = load_shedder_leave;
+	shedder->record_latency = load_shedder_record_latency;
+	shedder->get_inflight = load_shedder_get_inflight;
+	shedder->get_latency = load_shedder_get_latency;
+	return shedder;
+}
+
+void load_shedder_cleanup(load_shedder_t * shedder)
+{
+	if(NULL == shedder) return;
+	free(shedder->priv);
+	shedder->priv = NULL;
+}
+
+enum load_priority load_priority_parse(const char * priority, enum load_priority default_priority)
+{
+	if(NULL == priority || !priority[0]) return default_priority;
+	if(0 == strcasecmp(priority, "low")) return load_priority_low;
+	if(0 == strcasecmp(priority, "normal")) return load_priority_normal;
+	if(0 == strcasecmp(priority, "high") || 0 == strcasecmp(priority, "critical")) return load_priority_high;
+	return default_priority;
+}
@@ -32,35 +32,53 @@
 #include <assert.h>
 
 #include <limits.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/stat.h>
 #include <search.h>
+#include <signal.h>
 
 #include <db.h>
 #include <libsoup/soup.h>
 #include <glib.h>
+#include <glib-unix.h>
 
 #include "events-agency.h"
-typedef struct global_params
-{
-	void * user_data;
-	struct events_agency * eva;
-	
-	GMainLoop * loop;
-	SoupServer * server;
-	
-	DB * dbp;	// main db
-	DB * sdbp;	// secondary db (indexed by timestamps)
-}global_params_t;
+#include "api-gateway.h"
+#include "utils.h"
+
+static int load_views_config(global_params_t * params, json_object * jconfig);
+static int load_stream_config(global_params_t * params, json_object * jconfig);
+static int load_compression_config(global_params_t * params, json_object * jconfig);
+static int load_native_ingest_config(global_params_t * params, json_object * jconfig);
+static int load_auth_config(global_params_t * params, json_object * jconfig);
+static int load_rate_limit_config(global_params_t * params, json_object * jconfig);
+static int load_shedding_config(global_params_t * params, json_object * jconfig);
+static int load_static_files_config(global_params_t * params, json_object * jconfig);
+static int load_unix_socket_config(global_params_t * params, json_object * jgateway);
+static int load_shm_ingest_config(global_params_t * params, json_object * jconfig);
+static int load_udp_ingest_config(global_params_t * params, json_object * jconfig);
+static int create_unix_socket(const char * path, int mode);
+static int server_listen_fd(SoupServer * server, int fd);
+static int open_databases(global_params_t * params, json_object * jconfig);
+static gboolean on_reload_keys(gpointer user_data);
+static gboolean on_purge_revocations(gpointer user_data);
+static DB * open_database(DB_ENV * db_env, const char * db_file, const char * name, uint32_t flags, uint32_t open_flags);
+static void close_databases(global_params_t * params);
+
+static SoupServer * api_gateway_server_new(global_params_t * params);
+static int start_workers(global_params_t * params);
+static void stop_workers(global_params_t * params);
 
-static void on_document_root(SoupServer * server, SoupMessage *msg, 
-	const char * path, GHashTable * query, 
-	SoupClientContext * client, gpointer user_data);
 int main(int argc, char **argv)
 {
 	int rc = 0;
@@ -74,34 +92,145 @@ int main(int argc, char **argv)
 	
 	global_params_t params[1];
 	memset(params, 0, sizeof(params));
+	g_mutex_init(&params->topics_mutex);
 	
 	// starts a web server to accept direct API calls
 	GMainLoop * loop = NULL;
 	GError * gerr = NULL;
 	gboolean ok = FALSE;
-	SoupServer * server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "api-gateway", NULL);
 	
 	params->eva = eva;
-	params->server = server;
+	params->jconfig = jconfig;
+	params->port = 8088;
+	params->unix_listen_fd = -1;
+	
+	json_object * jgateway = NULL;
+	if(json_object_object_get_ex(jconfig, "gateway", &jgateway) && jgateway) {
+		params->port = json_get_value_default(jgateway, int, port, 8088);
+		params->num_workers = json_get_value(jgateway, int, workers);
+		if(params->num_workers < 0) params->num_workers = g_get_num_processors();
+		rc = load_unix_socket_config(params, jgateway);
+		assert(0 == rc);
+	}
+	if(params->unix_socket.path) {
+		params->unix_listen_fd = create_unix_socket(params->unix_socket.path, params->unix_socket.mode);
+		assert(params->unix_listen_fd >= 0);
+	}
+	
+	rc = open_databases(params, jconfig);
+	assert(0 == rc);
+	rc = load_views_config(params, jconfig);
+	assert(0 == rc);
+	rc = load_stream_config(params, jconfig);
+	assert(0 == rc);
+	if(params->event_store && params->event_store->index_dbp) {
+		rc = http_replay_init(params, params->stream.replay_threads);
+		assert(0 == rc);
+	}
+	rc = load_compression_config(params, jconfig);
+	assert(0 == rc);
+	rc = load_native_ingest_config(params, jconfig);
+	assert(0 == rc);
+	rc = load_shm_ingest_config(params, jconfig);
+	assert(0 == rc);
+	rc = load_udp_ingest_config(params, jconfig);
+	assert(0 == rc);
+	rc = load_auth_config(params, jconfig);
+	assert(0 == rc);
+	if(params->auth.enabled) {
+		json_object * jauth = NULL;
+		json_object_object_get_ex(jconfig, "auth", &jauth);
+		params->jwt_keyring = jwt_keyring_init(NULL, jauth, params);
+		if(NULL == params->jwt_keyring) {
+			fprintf(stderr, "[ERROR]: auth: failed to load the keys\n");
+			exit(1);
+		}
+		params->jwt_auth = jwt_auth_init(NULL, params->jwt_keyring, params->auth.issuer,
+			params->auth.max_cached_tokens, params->auth.max_cache_ttl, params);
+		params->jwt_auth->leeway = params->auth.leeway;
+		if(params->auth.revocation.enabled) {
+			params->jwt_revocation = jwt_revocation_init(NULL, params->db_env, params->auth.revocation.filename,
+				params->auth.revocation.capacity, params->auth.revocation.false_positive_rate, params);
+			if(NULL == params->jwt_revocation) {
+				fprintf(stderr, "[ERROR]: auth: failed to open the revocation db\n");
+				exit(1);
+			}
+			params->jwt_auth->revocation = params->jwt_revocation;
+		}
+		params->auth_queue = gateway_auth_queue_new(params, params->auth.verify_threads, params->auth.max_pending);
+	}
+	rc = load_rate_limit_config(params, jconfig);
+	assert(0 == rc);
+	if(params->rate_limit.enabled) {
+		params->rate_limiter = rate_limiter_init(NULL, params->rate_limit.rate, params->rate_limit.burst,
+			params->rate_limit.max_clients, params);
+	}
+	rc = load_shedding_config(params, jconfig);
+	assert(0 == rc);
+	if(params->shedding.enabled) {
+		params->load_shedder = load_shedder_init(NULL, params->shedding.max_inflight,
+			(uint64_t)params->shedding.target_latency_ms * 1000000ULL, params);
+	}
+	
+	rc = load_static_files_config(params, jconfig);
+	assert(0 == rc);
+	if(params->static_files.enabled) {
+		params->file_cache = file_cache_init(NULL, params->static_files.document_root,
+			params->static_files.max_file_size, params->static_files.max_cache_size,
+			params->static_files.revalidate_ms, params);
+		if(NULL == params->file_cache) {
+			fprintf(stderr, "[WARNING]: static files disabled, document_root: %s\n", params->static_files.document_root);
+		}
+	}
+	
+	params->router = gateway_router_new(params);
+	assert(params->router);
 	
 	events_agency_init(eva, params);
 	rc = eva->load_config(eva, jconfig);
 	assert(0 == rc);
-
-	soup_server_add_handler(server, "/", on_document_root, params, NULL);
-	ok = soup_server_listen_all(server, 8088, SOUP_SERVER_LISTEN_IPV4_ONLY, &gerr);
-	if(gerr) {
-		fprintf(stderr, "[ERROR]: soup_server_listen_all: %s\n", gerr->message);
-		g_error_free(gerr);
-		gerr = NULL;
+	
+	if(params->num_workers > 0) {
+		// multi-threaded mode: each worker runs its own SoupServer on a SO_REUSEPORT socket
+		rc = start_workers(params);
+		assert(0 == rc);
+	}else {
+		SoupServer * server = api_gateway_server_new(params);
+		ok = soup_server_listen_all(server, params->port, SOUP_SERVER_LISTEN_IPV4_ONLY, &gerr);
+		if(gerr) {
+			fprintf(stderr, "[ERROR]: soup_server_listen_all: %s\n", gerr->message);
+			g_error_free(gerr);
+			gerr = NULL;
+		}
+		assert(ok && NULL == gerr);
+		params->server = server;
+		
+		if(params->unix_listen_fd >= 0) {
+			rc = server_listen_fd(server, params->unix_listen_fd);
+			params->unix_listen_fd = -1;	// owned by the server
+			assert(0 == rc);
+		}
+	}
+	
+	if(params->native.enabled) {
+		params->native_ingest = native_ingest_start(params);
+		assert(params->native_ingest);
+	}
+	if(params->shm.enabled) {
+		params->shm_ingest = shm_ingest_start(params);
+		assert(params->shm_ingest);
+	}
+	if(params->udp.enabled) {
+		params->udp_ingest = udp_ingest_start(params);
+		assert(params->udp_ingest);
 	}
-	assert(ok && NULL == gerr);
 	
 	loop = g_main_loop_new(NULL, FALSE);
 	assert(loop);
+	if(params->jwt_keyring) g_unix_signal_add(SIGHUP, on_reload_keys, params);
+	if(params->jwt_revocation) g_timeout_add_seconds(3600, on_purge_revocations, params);
 	
 	params->eva = eva;
-	params->server = server;
 	params->loop = loop;
 	g_main_loop_run(loop);
 	
@@ -109,12 +238,800 @@ int main(int argc, char **argv)
 	g_main_loop_unref(loop);
 	loop = NULL;
 	
+	native_ingest_stop(params->native_ingest);
+	params->native_ingest = NULL;
+	shm_ingest_stop(params->shm_ingest);
+	params->shm_ingest = NULL;
+	udp_ingest_stop(params->udp_ingest);
+	params->udp_ingest = NULL;
+	free(params->udp.topic);
+	free(params->native.bind_address);
+	free(params->shm.control_path);
+	free(params->shm.allowed_uids);
+	stop_workers(params);
+	if(params->server) {
+		soup_server_disconnect(params->server);
+		g_object_unref(params->server);
+		params->server = NULL;
+	}
+	
 	events_agency_cleanup(eva);
+	http_replay_cleanup(params);	// (before the event store is closed)
+	gateway_auth_queue_free(params->auth_queue);
+	params->auth_queue = NULL;
+	if(params->jwt_revocation) {	// (before its db environment is closed)
+		if(params->jwt_auth) params->jwt_auth->revocation = NULL;
+		jwt_revocation_cleanup(params->jwt_revocation);
+		free(params->jwt_revocation);
+		params->jwt_revocation = NULL;
+	}
+	close_databases(params);
+	gateway_router_free(params->router);
+	params->router = NULL;
+	if(params->jwt_auth) {
+		jwt_auth_cleanup(params->jwt_auth);
+		free(params->jwt_auth);
+		params->jwt_auth = NULL;
+	}
+	if(params->jwt_keyring) {
+		jwt_keyring_cleanup(params->jwt_keyring);
+		free(params->jwt_keyring);
+		params->jwt_keyring = NULL;
+	}
+	free(params->auth.issuer);
+	free(params->auth.token.signing_kid);
+	for(size_t i = 0; i < params->auth.token.num_issuers; ++i) free(params->auth.token.issuers[i]);
+	free(params->auth.token.issuers);
+	free(params->auth.revocation.filename);
+	if(params->rate_limiter) {
+		rate_limiter_cleanup(params->rate_limiter);
+		free(params->rate_limiter);
+		params->rate_limiter = NULL;
+	}
+	if(params->load_shedder) {
+		load_shedder_cleanup(params->load_shedder);
+		free(params->load_shedder);
+		params->load_shedder = NULL;
+	}
+	if(params->shedding.priorities) {
+		g_hash_table_destroy(params->shedding.priorities);
+		params->shedding.priorities = NULL;
+	}
+	if(params->file_cache) {
+		file_cache_cleanup(params->file_cache);
+		free(params->file_cache);
+		params->file_cache = NULL;
+	}
+	free(params->static_files.document_root);
+	free(params->static_files.index);
+	free(params->static_files.cache_control);
+	
+	if(params->views.key_field) free(params->views.key_field);
+	if(params->unix_socket.path) {
+		unlink(params->unix_socket.path);
+		free(params->unix_socket.path);
+	}
+	free(params->unix_socket.allowed_uids);
+	g_mutex_clear(&params->topics_mutex);
+	json_object_put(jconfig);
 	return rc;
 }
 
-static void on_document_root(SoupServer * server, SoupMessage *msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+static SoupServer * api_gateway_server_new(global_params_t * params)
+{
+	// raw paths: routes are matched on the path as sent (like the native listener),
+	// their parameters are decoded exactly once, see gateway_route_get_param()
+	SoupServer * server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "api-gateway",
+		SOUP_SERVER_RAW_PATHS, TRUE,
+		NULL);
+	assert(server);
+	
+	soup_server_add_early_handler(server, NULL, on_gateway_early_request, params, NULL);
+	soup_server_add_handler(server, NULL, on_gateway_request, params, NULL);
+	soup_server_add_websocket_handler(server, "/ws", NULL, NULL, on_websocket_connected, params, NULL);
+	http_ingest_init(server, params);
+	return server;
+}
+
+/********************************************************
+* gateway workers: 
+*   one thread per worker, each with its own GMainContext and SoupServer,
+*   all listen on the same port (SO_REUSEPORT), the kernel balances the connections
+********************************************************/
+struct gateway_worker
+{
+	int id;
+	global_params_t * params;
+	GThread * thread;
+	
+	GMainContext * context;
+	GMainLoop * loop;
+	SoupServer * server;
+	int listen_fd;
+};
+
+static int create_reuseport_socket(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("create_reuseport_socket()::socket()");
+		return -1;
+	}
+	
+	int on = 1;
+	int rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(0 == rc) rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if(rc) {
+		perror("create_reuseport_socket()::setsockopt()");
+		close(fd);
+		return -1;
+	}
+	
+	struct sockaddr_in addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_ANY);
+	addr->sin_port = htons(port);
+	
+	rc = bind(fd, (struct sockaddr *)addr, sizeof(addr));
+	if(0 == rc) rc = listen(fd, SOMAXCONN);
+	if(rc) {
+		perror("create_reuseport_socket()::bind()/listen()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static gpointer gateway_worker_thread(gpointer user_data)
 {
-	soup_message_set_status(msg, SOUP_STATUS_ACCEPTED);
-	return;
+	struct gateway_worker * worker = user_data;
+	assert(worker && worker->context);
+	
+	// the server attaches its sources to the thread-default context
+	g_main_context_push_thread_default(worker->context);
+	
+	g_main_loop_run(worker->loop);
+	
+	soup_server_disconnect(worker->server);
+	g_main_context_pop_thread_default(worker->context);
+	return worker;
+}
+
+static int start_workers(global_params_t * params)
+{
+	int num_workers = params->num_workers;
+	struct gateway_worker ** workers = calloc(num_workers, sizeof(*workers));
+	assert(workers);
+	params->workers = workers;
+	
+	for(int i = 0; i < num_workers; ++i) {
+		struct gateway_worker * worker = calloc(1, sizeof(*worker));
+		assert(worker);
+		worker->id = i;
+		worker->params = params;
+		worker->listen_fd = -1;
+		workers[i] = worker;
+		
+		worker->listen_fd = create_reuseport_socket(params->port);
+		if(worker->listen_fd < 0) return -1;
+		
+		worker->context = g_main_context_new();
+		worker->loop = g_main_loop_new(worker->context, FALSE);
+		
+		GError * gerr = NULL;
+		g_main_context_push_thread_default(worker->context);
+		worker->server = api_gateway_server_new(params);
+		
+		GSocket * gsock = g_socket_new_from_fd(worker->listen_fd, &gerr);
+		gboolean ok = (NULL != gsock);
+		if(ok) ok = soup_server_listen_socket(worker->server, gsock, 0, &gerr);
+		g_main_context_pop_thread_default(worker->context);
+		
+		if(gsock) {
+			g_object_unref(gsock);	// the server holds its own reference
+			worker->listen_fd = -1;	// owned by the GSocket
+		}
+		if(!ok) {
+			fprintf(stderr, "[ERROR]: worker %d: soup_server_listen_socket: %s\n", i, gerr?gerr->message:"unknown error");
+			g_clear_error(&gerr);
+			return -1;
+		}
+		
+		if(params->unix_listen_fd >= 0) {
+			// all workers accept on the same unix socket, each through its own descriptor
+			int fd = dup(params->unix_listen_fd);
+			g_main_context_push_thread_default(worker->context);
+			int rc = (fd >= 0)?server_listen_fd(worker->server, fd):-1;
+			g_main_context_pop_thread_default(worker->context);
+			if(rc) {
+				fprintf(stderr, "[ERROR]: worker %d: failed to listen on %s\n", i, params->unix_socket.path);
+				return -1;
+			}
+		}
+		
+		char name[32] = "";
+		snprintf(name, sizeof(name), "gateway-%d", i);
+		worker->thread = g_thread_new(name, gateway_worker_thread, worker);
+	}
+	
+	if(params->unix_listen_fd >= 0) {
+		close(params->unix_listen_fd);	// the workers listen on their own duplicates
+		params->unix_listen_fd = -1;
+	}
+	return 0;
+}
+
+static int server_listen_fd(SoupServer * server, int fd)
+{
+	// listen on an already bound socket, the server takes the ownership of 'fd'
+	GError * gerr = NULL;
+	GSocket * gsock = g_socket_new_from_fd(fd, &gerr);
+	if(NULL == gsock) {
+		fprintf(stderr, "[ERROR]: g_socket_new_from_fd: %s\n", gerr?gerr->message:"unknown error");
+		g_clear_error(&gerr);
+		close(fd);
+		return -1;
+	}
+	
+	gboolean ok = soup_server_listen_socket(server, gsock, 0, &gerr);
+	g_object_unref(gsock);	// the server holds its own reference
+	if(!ok) {
+		fprintf(stderr, "[ERROR]: soup_server_listen_socket: %s\n", gerr?gerr->message:"unknown error");
+		g_clear_error(&gerr);
+		return -1;
+	}
+	return 0;
+}
+
+static int create_unix_socket(const char * path, int mode)
+{
+	struct sockaddr_un addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "[ERROR]: unix socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	
+	// remove the socket file left by a previous run (never unlink anything else)
+	struct stat st[1];
+	if(0 == lstat(path, st) && S_ISSOCK(st->st_mode)) unlink(path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("create_unix_socket()::socket()");
+		return -1;
+	}
+	
+	int rc = bind(fd, (struct sockaddr *)addr, sizeof(addr));
+	if(0 == rc) rc = chmod(path, mode);
+	if(0 == rc) rc = listen(fd, SOMAXCONN);
+	if(rc) {
+		perror("create_unix_socket()::bind()/chmod()/listen()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void stop_workers(global_params_t * params)
+{
+	struct gateway_worker ** workers = params->workers;
+	if(NULL == workers) return;
+	
+	for(int i = 0; i < params->num_workers; ++i) {
+		struct gateway_worker * worker = workers[i];
+		if(NULL == worker) continue;
+		if(worker->loop) g_main_loop_quit(worker->loop);
+	}
+	for(int i = 0; i < params->num_workers; ++i) {
+		struct gateway_worker * worker = workers[i];
+		if(NULL == worker) continue;
+		if(worker->thread) g_thread_join(worker->thread);
+		if(worker->server) g_object_unref(worker->server);
+		if(worker->loop) g_main_loop_unref(worker->loop);
+		if(worker->context) g_main_context_unref(worker->context);
+		if(worker->listen_fd >= 0) close(worker->listen_fd);
+		free(worker);
+	}
+	free(workers);
+	params->workers = NULL;
+}
+
+static int load_views_config(global_params_t * params, json_object * jconfig)
+{
+	json_object * jviews = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "topic_views", &jviews);
+	if(!ok || NULL == jviews) return 0;
+	
+	params->views.enabled = json_get_value_default(jviews, int, enabled, 1);
+	params->views.max_entries = json_get_value(jviews, int, max_entries);
+	params->views.spill_to_db = json_get_value(jviews, int, spill_to_db);
+	
+	const char * key_field = json_get_value(jviews, string, key_field);
+	if(key_field) params->views.key_field = strdup(key_field);
+	
+	json_object * jtopics = NULL;
+	if(json_object_object_get_ex(jviews, "topics", &jtopics) && json_object_is_type(jtopics, json_type_array)) {
+		params->views.jtopics = jtopics;
+	}
+	
+	if(params->views.spill_to_db && NULL == params->views_dbp) {
+		fprintf(stderr, "[WARNING]: %s(): spill_to_db requires the 'db' settings, disabled\n", __FUNCTION__);
+		params->views.spill_to_db = 0;
+	}
+	return 0;
+}
+
+static int load_stream_config(global_params_t * params, json_object * jconfig)
+{
+	params->stream.flush_interval_ms = 50;
+	params->stream.max_buffer_size = 1 << 20;
+	params->stream.disconnect_slow_clients = 0;
+	params->stream.ws_initial_credits = 1024;
+	params->stream.ws_max_message_size = 4 << 20;
+	params->stream.log_capacity = 10000;
+	params->stream.poll_max_events = 1000;
+	params->stream.poll_max_wait_ms = 30000;
+	params->stream.replay_threads = 2;
+	
+	json_object * jstream = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "streaming", &jstream);
+	if(!ok || NULL == jstream) return 0;
+	
+	params->stream.flush_interval_ms = json_get_value_default(jstream, int, flush_interval_ms, 50);
+	params->stream.max_buffer_size = json_get_value_default(jstream, int, max_buffer_size, 1 << 20);
+	params->stream.ws_initial_credits = json_get_value_default(jstream, int, ws_initial_credits, 1024);
+	params->stream.ws_max_message_size = json_get_value_default(jstream, int, ws_max_message_size, 4 << 20);
+	params->stream.log_capacity = json_get_value_default(jstream, int, log_capacity, 10000);
+	params->stream.poll_max_events = json_get_value_default(jstream, int, poll_max_events, 1000);
+	params->stream.poll_max_wait_ms = json_get_value_default(jstream, int, poll_max_wait_ms, 30000);
+	params->stream.replay_threads = json_get_value_default(jstream, int, replay_threads, 2);
+	
+	const char * slow_clients = json_get_value(jstream, string, slow_clients);
+	if(slow_clients && 0 == strcasecmp(slow_clients, "disconnect")) params->stream.disconnect_slow_clients = 1;
+	return 0;
+}
+
+static int load_compression_config(global_params_t * params, json_object * jconfig)
+{
+	params->compression.enabled = 1;
+	params->compression.min_size = 1024;
+	params->compression.level = 6;
+	
+	json_object * jcompression = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "compression", &jcompression);
+	if(!ok || NULL == jcompression) return 0;
+	
+	params->compression.enabled = json_get_value_default(jcompression, int, enabled, 1);
+	params->compression.min_size = json_get_value_default(jcompression, int, min_size, 1024);
+	params->compression.level = json_get_value_default(jcompression, int, level, 6);
+	if(params->compression.level < 1 || params->compression.level > 9) params->compression.level = 6;
+	return 0;
+}
+
+static int load_native_ingest_config(global_params_t * params, json_object * jconfig)
+{
+	params->native.enabled = 0;
+	params->native.bind_address = strdup("127.0.0.1");
+	params->native.port = 8089;
+	params->native.binary_port = 0;
+	params->native.num_threads = 0;
+	params->native.max_connections = 1024;
+	params->native.buffer_size = 256 * 1024;
+	
+	json_object * jnative = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "native_ingest", &jnative);
+	if(!ok || NULL == jnative) return 0;
+	
+	params->native.enabled = json_get_value(jnative, int, enabled);
+	const char * bind_address = json_get_value(jnative, string, bind_address);
+	if(bind_address && bind_address[0]) {
+		free(params->native.bind_address);
+		params->native.bind_address = strdup(bind_address);
+	}
+	params->native.port = json_get_value_default(jnative, int, port, 8089);
+	params->native.binary_port = json_get_value(jnative, int, binary_port);
+	params->native.num_threads = json_get_value(jnative, int, threads);
+	params->native.max_connections = json_get_value_default(jnative, int, max_connections, 1024);
+	params->native.buffer_size = json_get_value_default(jnative, int, buffer_size, 256 * 1024);
+	
+	if(params->native.max_connections < 1) params->native.max_connections = 1;
+	if(params->native.buffer_size < 16 * 1024) params->native.buffer_size = 16 * 1024;	// > max size of headers
+	return 0;
+}
+
+static int load_auth_config(global_params_t * params, json_object * jconfig)
+{
+	params->auth.enabled = 0;
+	params->auth.required = 1;
+	params->auth.max_cached_tokens = 100000;
+	params->auth.max_cache_ttl = 3600;
+	params->auth.leeway = 30;
+	params->auth.verify_threads = -1;
+	params->auth.max_pending = 10000;
+	params->auth.token.ttl = 3600;
+	params->auth.token.max_ttl = 86400;
+	params->auth.revocation.capacity = 100000;
+	params->auth.revocation.false_positive_rate = 0.001;
+	
+	json_object * jauth = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "auth", &jauth);
+	if(!ok || NULL == jauth) return 0;
+	
+	params->auth.enabled = json_get_value(jauth, int, enabled);
+	params->auth.required = json_get_value_default(jauth, int, required, 1);
+	params->auth.max_cached_tokens = json_get_value_default(jauth, int, max_cached_tokens, 100000);
+	params->auth.max_cache_ttl = json_get_value_default(jauth, int, max_cache_ttl, 3600);
+	params->auth.leeway = json_get_value_default(jauth, int, leeway, 30);
+	params->auth.verify_threads = json_get_value_default(jauth, int, verify_threads, -1);
+	params->auth.max_pending = json_get_value_default(jauth, int, max_pending, 10000);
+	
+	const char * issuer = json_get_value(jauth, string, issuer);
+	if(issuer && issuer[0]) params->auth.issuer = strdup(issuer);
+	
+	json_object * jtoken = NULL;
+	if(json_object_object_get_ex(jauth, "token", &jtoken) && jtoken) {
+		params->auth.token.enabled = json_get_value(jtoken, int, enabled);
+		params->auth.token.ttl = json_get_value_default(jtoken, int, ttl, 3600);
+		params->auth.token.max_ttl = json_get_value_default(jtoken, int, max_ttl, 86400);
+		if(params->auth.token.max_ttl <= 0) params->auth.token.max_ttl = 86400;
+		if(params->auth.token.ttl <= 0 || params->auth.token.ttl > params->auth.token.max_ttl) {
+			params->auth.token.ttl = params->auth.token.max_ttl;
+		}
+		
+		const char * signing_kid = json_get_value(jtoken, string, signing_kid);
+		if(signing_kid && signing_kid[0]) params->auth.token.signing_kid = strdup(signing_kid);
+		
+		json_object * jissuers = NULL;
+		int count = 0;
+		if(json_object_object_get_ex(jtoken, "issuers", &jissuers) && json_object_is_type(jissuers, json_type_array)) {
+			count = json_object_array_length(jissuers);
+		}
+		if(count > 0) {
+			params->auth.token.issuers = calloc(count, sizeof(*params->auth.token.issuers));
+			assert(params->auth.token.issuers);
+			for(int i = 0; i < count; ++i) {
+				const char * subject = json_object_get_string(json_object_array_get_idx(jissuers, i));
+				if(subject && subject[0]) params->auth.token.issuers[params->auth.token.num_issuers++] = strdup(subject);
+			}
+		}
+	}
+	
+	json_object * jrevocation = NULL;
+	if(json_object_object_get_ex(jauth, "revocation", &jrevocation) && jrevocation) {
+		params->auth.revocation.enabled = json_get_value(jrevocation, int, enabled);
+		params->auth.revocation.capacity = json_get_value_default(jrevocation, int, capacity, 100000);
+		params->auth.revocation.false_positive_rate = json_get_value_default(jrevocation, double, false_positive_rate, 0.001);
+		const char * filename = json_get_value(jrevocation, string, filename);
+		params->auth.revocation.filename = strdup((filename && filename[0])?filename:"revoked.db");
+	}
+	return 0;
+}
+
+static gboolean on_reload_keys(gpointer user_data)
+{
+	// SIGHUP: re-read the key files of the "auth" config (key rotation)
+	global_params_t * params = user_data;
+	ssize_t num_keys = params->jwt_keyring->reload(params->jwt_keyring);
+	if(num_keys < 0) {
+		fprintf(stderr, "[ERROR]: auth: failed to reload the keys, keep the current ones\n");
+		return G_SOURCE_CONTINUE;
+	}
+	params->jwt_auth->clear_cache(params->jwt_auth);	// tokens of removed keys
+	fprintf(stderr, "[INFO]: auth: %ld key(s) loaded\n", (long)num_keys);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_purge_revocations(gpointer user_data)
+{
+	// drop the revocations of tokens that expired meanwhile, (and shrink the filter)
+	global_params_t * params = user_data;
+	ssize_t num_removed = params->jwt_revocation->purge(params->jwt_revocation, time(NULL));
+	if(num_removed > 0) fprintf(stderr, "[INFO]: auth: %ld expired revocation(s) purged\n", (long)num_removed);
+	return G_SOURCE_CONTINUE;
+}
+
+static int load_rate_limit_config(global_params_t * params, json_object * jconfig)
+{
+	params->rate_limit.enabled = 0;
+	params->rate_limit.rate = 1000;
+	params->rate_limit.burst = 2000;
+	params->rate_limit.max_clients = 100000;
+	
+	json_object * jrate_limit = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "rate_limit", &jrate_limit);
+	if(!ok || NULL == jrate_limit) return 0;
+	
+	params->rate_limit.enabled = json_get_value(jrate_limit, int, enabled);
+	params->rate_limit.rate = json_get_value_default(jrate_limit, double, rate, 1000);
+	params->rate_limit.burst = json_get_value_default(jrate_limit, double, burst, 2000);
+	params->rate_limit.max_clients = json_get_value_default(jrate_limit, int, max_clients, 100000);
+	if(params->rate_limit.rate <= 0) params->rate_limit.enabled = 0;
+	return 0;
+}
+
+static int load_shedding_config(global_params_t * params, json_object * jconfig)
+{
+	params->shedding.enabled = 0;
+	params->shedding.max_inflight = 1024;
+	params->shedding.target_latency_ms = 50;
+	
+	json_object * jshedding = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "load_shedding", &jshedding);
+	if(!ok || NULL == jshedding) return 0;
+	
+	params->shedding.enabled = json_get_value(jshedding, int, enabled);
+	params->shedding.max_inflight = json_get_value_default(jshedding, int, max_inflight, 1024);
+	params->shedding.target_latency_ms = json_get_value_default(jshedding, int, target_latency_ms, 50);
+	
+	// "priorities": { "<subject>": "low" | "normal" | "high", ... }
+	// subject: "uid:<uid>" (unix socket peers) or the "sub" claim of a bearer token
+	json_object * jpriorities = NULL;
+	if(json_object_object_get_ex(jshedding, "priorities", &jpriorities)
+		&& json_object_is_type(jpriorities, json_type_object))
+	{
+		params->shedding.priorities = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		json_object_object_foreach(jpriorities, subject, jpriority) {
+			const char * sz_priority = json_object_get_string(jpriority);
+			enum load_priority priority = load_priority_parse(sz_priority, (enum load_priority)-1);
+			if(priority == (enum load_priority)-1) {
+				fprintf(stderr, "load_shedding.priorities: invalid priority '%s' for '%s'\n",
+					sz_priority?sz_priority:"(null)", subject);
+				return -1;
+			}
+			g_hash_table_replace(params->shedding.priorities, g_strdup(subject), GINT_TO_POINTER(priority + 1));
+		}
+	}
+	return 0;
+}
+
+static size_t load_uid_list(json_object * jobj, uid_t ** p_uids)
+{
+	// "allowed_uids": [ uid, ... ], empty or missing: any local user (*p_uids = NULL)
+	json_object * juids = NULL;
+	int count = 0;
+	if(json_object_object_get_ex(jobj, "allowed_uids", &juids) && json_object_is_type(juids, json_type_array)) {
+		count = json_object_array_length(juids);
+	}
+	*p_uids = NULL;
+	if(count <= 0) return 0;
+	
+	uid_t * uids = calloc(count, sizeof(*uids));
+	assert(uids);
+	for(int i = 0; i < count; ++i) {
+		uids[i] = (uid_t)json_object_get_int(json_object_array_get_idx(juids, i));
+	}
+	*p_uids = uids;
+	return count;
+}
+
+static int load_unix_socket_config(global_params_t * params, json_object * jgateway)
+{
+	json_object * junix = NULL;
+	json_bool ok = json_object_object_get_ex(jgateway, "unix_socket", &junix);
+	if(!ok || NULL == junix) return 0;
+	
+	const char * path = json_get_value(junix, string, path);
+	if(!json_get_value_default(junix, int, enabled, 1) || NULL == path || !path[0]) return 0;
+	params->unix_socket.path = strdup(path);
+	
+	params->unix_socket.mode = 0660;
+	const char * mode = json_get_value(junix, string, mode);	// octal, e.g. "0660"
+	if(mode && mode[0]) {
+		char * p_end = NULL;
+		long value = strtol(mode, &p_end, 8);
+		if(p_end && !*p_end && value > 0 && value <= 0777) params->unix_socket.mode = (int)value;
+		else fprintf(stderr, "[WARNING]: %s(): invalid mode '%s', use 0660\n", __FUNCTION__, mode);
+	}
+	
+	params->unix_socket.num_allowed_uids = load_uid_list(junix, &params->unix_socket.allowed_uids);
+	return 0;
+}
+
+static int load_shm_ingest_config(global_params_t * params, json_object * jconfig)
+{
+	params->shm.enabled = 0;
+	params->shm.ring_size = 4 << 20;
+	params->shm.max_producers = 64;
+	params->shm.spin_us = 0;
+	
+	json_object * jshm = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "shm_ingest", &jshm);
+	if(!ok || NULL == jshm) return 0;
+	
+	params->shm.enabled = json_get_value(jshm, int, enabled);
+	params->shm.ring_size = json_get_value_default(jshm, int, ring_size, 4 << 20);
+	params->shm.max_producers = json_get_value_default(jshm, int, max_producers, 64);
+	params->shm.spin_us = json_get_value(jshm, int, spin_us);
+	params->shm.num_allowed_uids = load_uid_list(jshm, &params->shm.allowed_uids);
+	
+	const char * control_path = json_get_value(jshm, string, control_path);
+	if(NULL == control_path || !control_path[0]) control_path = "/tmp/event-streaming.shm.sock";
+	params->shm.control_path = strdup(control_path);
+	
+	// round the ring size up to a power of 2
+	size_t ring_size = 4096;
+	while(ring_size < params->shm.ring_size && ring_size < ((size_t)1 << 30)) ring_size <<= 1;
+	params->shm.ring_size = ring_size;
+	if(params->shm.max_producers < 1) params->shm.max_producers = 1;
+	return 0;
+}
+
+static int load_udp_ingest_config(global_params_t * params, json_object * jconfig)
+{
+	params->udp.enabled = 0;
+	params->udp.port = 8091;
+	params->udp.num_threads = 1;
+	params->udp.max_datagram_size = 8192;
+	params->udp.rcvbuf_size = 4 << 20;
+	
+	json_object * judp = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "udp_ingest", &judp);
+	if(!ok || NULL == judp) return 0;
+	
+	params->udp.enabled = json_get_value(judp, int, enabled);
+	params->udp.port = json_get_value_default(judp, int, port, 8091);
+	params->udp.num_threads = json_get_value_default(judp, int, threads, 1);
+	params->udp.max_datagram_size = json_get_value_default(judp, int, max_datagram_size, 8192);
+	params->udp.rcvbuf_size = json_get_value_default(judp, int, rcvbuf_size, 4 << 20);
+	
+	const char * topic = json_get_value(judp, string, topic);
+	if(topic && topic[0]) params->udp.topic = strdup(topic);
+	
+	if(params->udp.max_datagram_size < 512) params->udp.max_datagram_size = 512;
+	if(params->udp.max_datagram_size > 65536) params->udp.max_datagram_size = 65536;
+	return 0;
+}
+
+static int load_static_files_config(global_params_t * params, json_object * jconfig)
+{
+	params->static_files.enabled = 0;
+	params->static_files.max_file_size = 16 << 20;
+	params->static_files.max_cache_size = 256 << 20;
+	params->static_files.revalidate_ms = 1000;
+	
+	const char * document_root = "www";
+	const char * index = "index.html";
+	const char * cache_control = "no-cache";	// always revalidate (ETag)
+	
+	json_object * jstatic = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "static_files", &jstatic);
+	if(ok && jstatic) {
+		params->static_files.enabled = json_get_value(jstatic, int, enabled);
+		params->static_files.max_file_size = json_get_value_default(jstatic, int, max_file_size, 16 << 20);
+		params->static_files.max_cache_size = json_get_value_default(jstatic, int, max_cache_size, 256 << 20);
+		params->static_files.revalidate_ms = json_get_value_default(jstatic, int, revalidate_ms, 1000);
+		
+		const char * value = json_get_value(jstatic, string, document_root);
+		if(value && value[0]) document_root = value;
+		value = json_get_value(jstatic, string, index);
+		if(value && value[0] && NULL == strchr(value, '/')) index = value;
+		
+		json_object * jcache_control = NULL;
+		if(json_object_object_get_ex(jstatic, "cache_control", &jcache_control)) {
+			cache_control = json_object_get_string(jcache_control);	// null or "": no Cache-Control header
+		}
+	}
+	
+	params->static_files.document_root = strdup(document_root);
+	params->static_files.index = strdup(index);
+	if(cache_control && cache_control[0]) params->static_files.cache_control = strdup(cache_control);
+	return 0;
+}
+
+static int open_databases(global_params_t * params, json_object * jconfig)
+{
+	json_object * jdb = NULL;
+	json_bool ok = json_object_object_get_ex(jconfig, "db", &jdb);
+	if(!ok || NULL == jdb) return 0;	// no db settings
+	
+	const char * db_home = json_get_value(jdb, string, home);
+	const char * db_file = json_get_value(jdb, string, filename);
+	if(NULL == db_home) db_home = "data";
+	if(NULL == db_file) db_file = "events.db";
+	
+	int rc = mkdir(db_home, 0775);
+	if(rc && errno != EEXIST) {
+		perror("open_databases()::mkdir()");
+		return -1;
+	}
+	
+	params->store_events = json_get_value(jdb, int, store_events);
+	json_object * jgroup_commit = NULL;
+	if(params->store_events && json_object_object_get_ex(jdb, "group_commit", &jgroup_commit) && jgroup_commit) {
+		params->group_commit.enabled = json_get_value(jgroup_commit, int, enabled);
+		params->group_commit.max_batch = json_get_value_default(jgroup_commit, int, max_batch, 4096);
+		params->group_commit.max_pending = json_get_value_default(jgroup_commit, int, max_pending, 100000);
+		params->group_commit.sync = json_get_value_default(jgroup_commit, int, sync, 1);
+		params->group_commit.checkpoint_interval = json_get_value_default(jgroup_commit, int, checkpoint_interval, 60);
+	}
+	
+	DB_ENV * db_env = NULL;
+	rc = db_env_create(&db_env, 0);
+	if(rc) {
+		fprintf(stderr, "[ERROR]: db_env_create: %s\n", db_strerror(rc));
+		return -1;
+	}
+	
+	// the handles are shared by the libsoup workers, the native / udp / shm ingest threads and the replay pool,
+	// the env must always lock: transactional with group commit, concurrent data store (single writer) otherwise
+	uint32_t env_flags = DB_CREATE | DB_INIT_MPOOL | DB_THREAD;
+	uint32_t events_open_flags = 0;
+	if(params->group_commit.enabled) {
+		env_flags |= DB_INIT_TXN | DB_INIT_LOG | DB_INIT_LOCK | DB_RECOVER;
+		events_open_flags = DB_AUTO_COMMIT;
+		db_env->set_lk_detect(db_env, DB_LOCK_DEFAULT);	// (readers of the index vs. the writer)
+		db_env->log_set_config(db_env, DB_LOG_AUTO_REMOVE, 1);
+	}else {
+		env_flags |= DB_INIT_CDB;
+		db_env->set_flags(db_env, DB_CDB_ALLDB, 1);	// (a put to "main" also updates "timestamps")
+	}
+	rc = db_env->open(db_env, db_home, env_flags, 0);
+	if(rc) {
+		db_env->err(db_env, rc, "db_env->open(%s)", db_home);
+		db_env->close(db_env, 0);
+		return -1;
+	}
+	params->db_env = db_env;
+	
+	params->dbp = open_database(db_env, db_file, "main", 0, events_open_flags);
+	params->views_dbp = open_database(db_env, db_file, "views", 0, events_open_flags);	// (the spills auto-commit)
+	if(NULL == params->dbp || NULL == params->views_dbp) {
+		close_databases(params);
+		return -1;
+	}
+	
+	// events: "main" (event_id --> record) + "timestamps" (topic + timestamp --> event_id, duplicates sorted by event_id)
+	if(params->store_events) {
+		params->sdbp = open_database(db_env, db_file, "timestamps", DB_DUP | DB_DUPSORT, events_open_flags);
+		params->index_dbp = open_database(db_env, db_file, "timestamps", DB_DUP | DB_DUPSORT, 0);
+		if(params->sdbp && params->index_dbp) {
+			params->event_store = event_store_init(NULL, params->dbp, params->sdbp, params->index_dbp, params);
+		}
+		if(params->event_store && params->group_commit.enabled) {
+			rc = event_store_start_writer(params->event_store, db_env,
+				params->group_commit.max_batch, params->group_commit.max_pending,
+				params->group_commit.sync, params->group_commit.checkpoint_interval);
+			if(rc) {
+				close_databases(params);
+				return -1;
+			}
+		}
+		if(NULL == params->event_store) {
+			close_databases(params);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static DB * open_database(DB_ENV * db_env, const char * db_file, const char * name, uint32_t flags, uint32_t open_flags)
+{
+	DB * dbp = NULL;
+	int rc = db_create(&dbp, db_env, 0);
+	if(0 == rc && flags) rc = dbp->set_flags(dbp, flags);
+	if(0 == rc) rc = dbp->open(dbp, NULL, db_file, name, DB_BTREE, DB_CREATE | DB_THREAD | open_flags, 0664);
+	if(rc) {
+		db_env->err(db_env, rc, "open db(%s:%s)", db_file, name);
+		if(dbp) dbp->close(dbp, 0);
+		return NULL;
+	}
+	return dbp;
+}
+
+static void close_databases(global_params_t * params)
+{
+	if(params->event_store) {
+		event_store_cleanup(params->event_store);
+		free(params->event_store);
+		params->event_store = NULL;
+	}
+	if(params->index_dbp) { params->index_dbp->close(params->index_dbp, 0); params->index_dbp = NULL; }
+	if(params->sdbp) { params->sdbp->close(params->sdbp, 0); params->sdbp = NULL; }	// (secondary before primary)
+	if(params->dbp) { params->dbp->close(params->dbp, 0); params->dbp = NULL; }
+	if(params->views_dbp) { params->views_dbp->close(params->views_dbp, 0); params->views_dbp = NULL; }
+	if(params->db_env) { params->db_env->close(params->db_env, 0); params->db_env = NULL; }
 }
@@ -0,0 +1,989 @@
+/*
+ * native-ingest.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+#include "api-gateway.h"
+#include "ingest-frame.h"
+#include "auto_buffer.h"
+#include "json-span.h"
+#include "utils.h"
+
+#define NATIVE_MAX_EVENTS (256)
+#define NATIVE_MAX_HEADERS_SIZE (8192)
+#define NATIVE_MAX_READS_PER_WAKEUP (16)	// per connection, then the other ready connections go first
+
+/********************************************************
+* struct native_request: spans into the connection buffer
+********************************************************/
+struct native_request
+{
+	const char * method;
+	size_t cb_method;
+	const char * path;
+	size_t cb_path;
+	int http_minor;
+	int keep_alive;
+	int chunked;
+	int too_large;
+
+	const char * content_encoding;
+	size_t cb_content_encoding;
+	const char * authorization;
+	size_t cb_authorization;
+
+	const char * body;
+	size_t content_length;
+	size_t total_size;	// headers + body
+};
+
+/********************************************************
+* struct native_connection
+********************************************************/
+struct native_connection
+{
+	int fd;
+	struct native_worker * worker;
+
+	unsigned char * buf;	// preallocated, params->native.buffer_size
+	size_t start;
+	size_t length;
+
+	auto_buffer_t out[1];	// pending responses, up to params->native.buffer_size before the input is paused
+	int close_after_write;
+	int stalled;	// the input was paused on a full 'out', resumed on EPOLLOUT
+	char client_id[GATEWAY_CLIENT_ID_SIZE];	// "ip:<peer address>" or "sub:<subject>", rate limiting key
+
+	// bearer token of the binary protocol (INGEST_FRAME_AUTH), re-checked on every read (expiry, revocation)
+	char * token;
+	size_t cb_token;
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE];	// "": anonymous
+
+	// binary protocol (ingest_frame)
+	int binary;
+	uint64_t seq;		// last frame received
+	uint64_t acked_seq;
+	gateway_topic_t ** topics;	// [INGEST_FRAME_MAX_TOPICS], bound topic ids, allocated on the first bind
+
+	struct native_connection * next_free;
+	struct native_connection * next_ready;
+	int ready;	// in the worker's ready list: the read budget was spent before EAGAIN
+};
+
+struct native_worker
+{
+	int id;
+	struct native_ingest * ingest;
+	global_params_t * params;
+	pthread_t th;
+
+	int efd;		// epoll fd
+	int listen_fd;
+	int binary_listen_fd;	// -1: binary protocol disabled
+	int quit_fd;	// eventfd
+
+	struct native_connection * connections;	// [max_connections]
+	struct native_connection * free_list;
+	struct native_connection * ready_list;	// served again after the next (non-blocking) epoll_wait
+	unsigned char * buffers;				// [max_connections][buffer_size]
+};
+
+struct native_ingest
+{
+	global_params_t * params;
+	int num_workers;
+	struct native_worker * workers;
+};
+
+static int native_listen_socket(const char * address, int port)
+{
+	struct sockaddr_in addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	if(1 != inet_pton(AF_INET, address, &addr->sin_addr)) {
+		fprintf(stderr, "[ERROR]: %s(): invalid bind address '%s'\n", __FUNCTION__, address);
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("native_listen_socket()::socket()");
+		return -1;
+	}
+
+	int on = 1;
+	int rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(0 == rc) rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if(rc) {
+		perror("native_listen_socket()::setsockopt()");
+		close(fd);
+		return -1;
+	}
+
+	rc = bind(fd, (struct sockaddr *)addr, sizeof(addr));
+	if(0 == rc) rc = listen(fd, SOMAXCONN);
+	if(rc) {
+		perror("native_listen_socket()::bind()/listen()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/********************************************************
+* connections
+********************************************************/
+static struct native_connection * native_connection_acquire(struct native_worker * worker, int fd, int binary)
+{
+	struct native_connection * conn = worker->free_list;
+	if(NULL == conn) return NULL;
+	worker->free_list = conn->next_free;
+
+	conn->next_free = NULL;
+	conn->fd = fd;
+	conn->start = 0;
+	conn->length = 0;
+	conn->out->start_pos = 0;
+	conn->out->length = 0;
+	conn->close_after_write = 0;
+	conn->stalled = 0;
+	conn->binary = binary;
+	conn->seq = 0;
+	conn->acked_seq = 0;
+	conn->subject[0] = '\0';
+	if(conn->topics) memset(conn->topics, 0, INGEST_FRAME_MAX_TOPICS * sizeof(*conn->topics));
+	return conn;
+}
+
+static void native_connection_close(struct native_connection * conn)
+{
+	struct native_worker * worker = conn->worker;
+	if(conn->fd < 0) return;
+
+	epoll_ctl(worker->efd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	free(conn->token);
+	conn->token = NULL;
+	conn->cb_token = 0;
+
+	// keep the output buffer for the next connection unless it grew too large
+	if(conn->out->size > worker->params->native.buffer_size) {
+		auto_buffer_cleanup(conn->out);
+		auto_buffer_init(conn->out, 0);
+	}
+	conn->next_free = worker->free_list;
+	worker->free_list = conn;
+}
+
+static inline int native_connection_output_full(const struct native_connection * conn)
+{
+	return conn->out->length >= conn->worker->params->native.buffer_size;
+}
+
+static void native_reply_ex(struct native_connection * conn, struct native_request * req,
+	int status, const char * extra_headers, const char * body, size_t cb_body)
+{
+	if(!req->keep_alive) conn->close_after_write = 1;
+
+	char header[512] = "";
+	int cb = snprintf(header, sizeof(header),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %lu\r\n"
+		"%s%s"
+		"\r\n",
+		status, soup_status_get_phrase(status),
+		(unsigned long)cb_body,
+		extra_headers?extra_headers:"",
+		conn->close_after_write?"Connection: close\r\n":"");
+	assert(cb > 0 && cb < (int)sizeof(header));
+	auto_buffer_push(conn->out, header, cb);
+	if(cb_body > 0) auto_buffer_push(conn->out, body, cb_body);
+}
+#define native_reply(conn, req, status, body, cb_body) native_reply_ex(conn, req, status, NULL, body, cb_body)
+
+static inline int span_equals(const char * p, size_t length, const char * sz)
+{
+	size_t cb = strlen(sz);
+	return (cb == length && 0 == strncasecmp(p, sz, cb));
+}
+
+/********************************************************
+* authentication: bearer tokens, verified with params->jwt_auth
+* (synchronously: the epoll threads are the workers, the verified tokens are cached)
+* return jwt_auth_status_ok (subject: "" if anonymous), a jwt_auth status or GATEWAY_AUTH_NO_TOKEN
+********************************************************/
+static int native_authenticate(global_params_t * params, const char * token, size_t cb_token,
+	char subject[static JWT_AUTH_MAX_SUBJECT_SIZE])
+{
+	subject[0] = '\0';
+	jwt_auth_t * auth = params->jwt_auth;
+	if(NULL == auth) return jwt_auth_status_ok;
+	if(0 == cb_token) return params->auth.required?GATEWAY_AUTH_NO_TOKEN:jwt_auth_status_ok;
+
+	int status = auth->verify(auth, token, cb_token, subject);
+	if(status != jwt_auth_status_ok) subject[0] = '\0';
+	return status;
+}
+
+static int get_bearer_token(const char * authorization, size_t length, const char ** p_token, size_t * p_length)
+{
+	// Authorization: Bearer <token>
+	static const char scheme[] = "Bearer";
+	if(length <= sizeof(scheme) || strncasecmp(authorization, scheme, sizeof(scheme) - 1)
+		|| !is_white_char(authorization[sizeof(scheme) - 1])) return -1;
+
+	const char * token = authorization + sizeof(scheme);
+	const char * p_end = authorization + length;
+	while(token < p_end && is_white_char(*token)) ++token;
+	*p_token = token;
+	*p_length = p_end - token;
+	return 0;
+}
+
+static void native_reply_unauthorized(struct native_connection * conn, struct native_request * req, int status)
+{
+	// RFC 6750
+	char extra_headers[256] = "";
+	if(status == GATEWAY_AUTH_NO_TOKEN) {
+		snprintf(extra_headers, sizeof(extra_headers), "WWW-Authenticate: Bearer realm=\"event-streaming\"\r\n");
+	}else {
+		snprintf(extra_headers, sizeof(extra_headers),
+			"WWW-Authenticate: Bearer realm=\"event-streaming\", error=\"invalid_token\", error_description=\"%s\"\r\n",
+			jwt_auth_status_to_string(status));
+	}
+	native_reply_ex(conn, req, SOUP_STATUS_UNAUTHORIZED, extra_headers, NULL, 0);
+}
+
+/********************************************************
+* request parsing
+* return: 1: a complete request, 0: need more data, -1: bad request
+********************************************************/
+static int native_parse_request(const char * data, size_t length, size_t max_size, struct native_request * req)
+{
+	memset(req, 0, sizeof(*req));
+	const char * p_hdr_end = memmem(data, length, "\r\n\r\n", 4);
+	if(NULL == p_hdr_end) return (length > NATIVE_MAX_HEADERS_SIZE)?-1:0;
+
+	// request line: METHOD SP path SP HTTP/1.x
+	const char * p = data;
+	const char * p_eol = memchr(p, '\r', p_hdr_end + 2 - p);
+	const char * sp1 = memchr(p, ' ', p_eol - p);
+	if(NULL == sp1) return -1;
+	const char * sp2 = memchr(sp1 + 1, ' ', p_eol - (sp1 + 1));
+	if(NULL == sp2) return -1;
+	if((p_eol - (sp2 + 1)) != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) return -1;
+
+	req->method = p;
+	req->cb_method = sp1 - p;
+	req->path = sp1 + 1;
+	req->cb_path = sp2 - (sp1 + 1);
+	req->http_minor = sp2[8] - '0';
+	req->keep_alive = (req->http_minor >= 1);
+
+	// headers
+	int has_length = 0;
+	p = p_eol + 2;
+	while(p < p_hdr_end + 2) {
+		p_eol = memchr(p, '\r', p_hdr_end + 2 - p);
+		if(NULL == p_eol || p_eol[1] != '\n') return -1;
+
+		const char * colon = memchr(p, ':', p_eol - p);
+		if(NULL == colon) return -1;
+		const char * name = p;
+		size_t cb_name = colon - p;
+		const char * value = colon + 1;
+		const char * value_end = p_eol;
+		while(value < value_end && is_white_char(*value)) ++value;
+		trim_right(value, value_end);
+		size_t cb_value = value_end - value;
+
+		if(span_equals(name, cb_name, "Content-Length")) {
+			size_t content_length = 0;
+			if(0 == cb_value) return -1;
+			for(size_t i = 0; i < cb_value; ++i) {
+				if(value[i] < '0' || value[i] > '9') return -1;
+				if(content_length > (SIZE_MAX / 10 - 1)) return -1;
+				content_length = content_length * 10 + (value[i] - '0');
+			}
+			req->content_length = content_length;
+			has_length = 1;
+		}else if(span_equals(name, cb_name, "Transfer-Encoding")) {
+			if(!span_equals(value, cb_value, "identity")) req->chunked = 1;
+		}else if(span_equals(name, cb_name, "Connection")) {
+			if(span_equals(value, cb_value, "close")) req->keep_alive = 0;
+			else if(span_equals(value, cb_value, "keep-alive")) req->keep_alive = 1;
+		}else if(span_equals(name, cb_name, "Content-Encoding")) {
+			req->content_encoding = value;
+			req->cb_content_encoding = cb_value;
+		}else if(span_equals(name, cb_name, "Authorization")) {
+			req->authorization = value;
+			req->cb_authorization = cb_value;
+		}
+		p = p_eol + 2;
+	}
+	if(req->chunked && has_length) return -1;
+
+	size_t cb_headers = p_hdr_end + 4 - data;
+	req->body = p_hdr_end + 4;
+	req->total_size = cb_headers + req->content_length;
+	if(req->chunked) return 1;	// rejected by the caller, (411)
+
+	if(req->content_length > max_size || req->total_size > max_size) {
+		req->too_large = 1;
+		return 1;
+	}
+	if(length < req->total_size) return 0;
+	return 1;
+}
+
+static void native_handle_request(struct native_connection * conn, struct native_request * req)
+{
+	global_params_t * params = conn->worker->params;
+
+	if(req->chunked) {
+		req->keep_alive = 0;
+		native_reply(conn, req, SOUP_STATUS_LENGTH_REQUIRED, NULL, 0);
+		return;
+	}
+	if(req->too_large) {
+		req->keep_alive = 0;
+		native_reply(conn, req, SOUP_STATUS_REQUEST_ENTITY_TOO_LARGE, NULL, 0);
+		return;
+	}
+	if(!span_equals(req->method, req->cb_method, "POST")) {
+		native_reply(conn, req, SOUP_STATUS_METHOD_NOT_ALLOWED, NULL, 0);
+		return;
+	}
+
+	const char * token = NULL;
+	size_t cb_token = 0;
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE] = "";
+	if(req->authorization && get_bearer_token(req->authorization, req->cb_authorization, &token, &cb_token)) {
+		native_reply_unauthorized(conn, req, jwt_auth_status_invalid);
+		return;
+	}
+	int status = native_authenticate(params, token, cb_token, subject);
+	if(status != jwt_auth_status_ok) {
+		native_reply_unauthorized(conn, req, status);
+		return;
+	}
+
+	// authenticated: the subject is the client id
+	char client_id[GATEWAY_CLIENT_ID_SIZE] = "";
+	if(subject[0]) snprintf(client_id, sizeof(client_id), "sub:%s", subject);
+	else memcpy(client_id, conn->client_id, sizeof(client_id));
+
+	unsigned int retry_after = 0;
+	if(gateway_rate_limit_check(params, client_id, &retry_after)) {
+		char extra_headers[64] = "";
+		snprintf(extra_headers, sizeof(extra_headers), "Retry-After: %u\r\n", retry_after?retry_after:1);
+		native_reply_ex(conn, req, SOUP_STATUS_TOO_MANY_REQUESTS, extra_headers, NULL, 0);
+		return;
+	}
+
+	// path: /topics/{topic}/{events|bulk}[?query], matched in place
+	const char * p_query = memchr(req->path, '?', req->cb_path);
+	size_t cb_path = p_query?(size_t)(p_query - req->path):req->cb_path;
+
+	path_router_match_t match[1];
+	const gateway_route_t * route = gateway_route_lookup(params, req->path, cb_path, match);
+	int is_events = route && route->type == gateway_route_type_topic_events;
+	int is_bulk = route && route->type == gateway_route_type_topic_bulk;
+	if(!is_events && !is_bulk) {
+		native_reply(conn, req, SOUP_STATUS_NOT_FOUND, NULL, 0);
+		return;
+	}
+
+	if(!gateway_admit_request(params, route, subject[0]?subject:NULL)) {
+		native_reply_ex(conn, req, SOUP_STATUS_SERVICE_UNAVAILABLE, "Retry-After: 1\r\n", NULL, 0);
+		return;
+	}
+
+	char * topic = gateway_route_get_param(match, "topic");
+	gateway_topic_t * gw_topic = gateway_topic_get(params, topic, 1);
+	g_free(topic);
+	if(NULL == gw_topic) {
+		native_reply(conn, req, SOUP_STATUS_NOT_FOUND, NULL, 0);
+		if(params->load_shedder) params->load_shedder->leave(params->load_shedder);
+		return;
+	}
+
+	char content_encoding[64] = "";
+	if(req->cb_content_encoding > 0) {
+		if(req->cb_content_encoding >= sizeof(content_encoding)) {
+			native_reply(conn, req, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE, NULL, 0);
+			if(params->load_shedder) params->load_shedder->leave(params->load_shedder);
+			return;
+		}
+		memcpy(content_encoding, req->content_encoding, req->cb_content_encoding);
+		content_encoding[req->cb_content_encoding] = '\0';
+	}
+
+	json_object * jresult = json_object_new_object();
+	status = is_events?
+		http_ingest_events(gw_topic, content_encoding, req->body, req->content_length, jresult):
+		http_ingest_bulk(gw_topic, content_encoding, req->body, req->content_length, jresult);
+
+	size_t cb_result = 0;
+	const char * sz_result = json_object_to_json_string_length(jresult, JSON_C_TO_STRING_PLAIN, &cb_result);
+	native_reply(conn, req, status, sz_result, cb_result);
+	json_object_put(jresult);
+	if(params->load_shedder) params->load_shedder->leave(params->load_shedder);
+}
+
+static void native_process_requests(struct native_connection * conn)
+{
+	global_params_t * params = conn->worker->params;
+	size_t max_size = params->native.buffer_size;
+	while(conn->length > 0 && !conn->close_after_write && !native_connection_output_full(conn)) {
+		struct native_request req[1];
+		int rc = native_parse_request((const char *)conn->buf + conn->start, conn->length, max_size, req);
+		if(0 == rc) break;
+		if(rc < 0) {
+			req->keep_alive = 0;
+			native_reply(conn, req, SOUP_STATUS_BAD_REQUEST, NULL, 0);
+			break;
+		}
+
+		native_handle_request(conn, req);
+		if(conn->close_after_write) break;
+
+		conn->start += req->total_size;
+		conn->length -= req->total_size;
+	}
+	if(0 == conn->length) conn->start = 0;
+}
+
+/********************************************************
+* binary protocol (ingest_frame)
+********************************************************/
+static void native_frame_reply(struct native_connection * conn, uint32_t flags, uint64_t seq, uint32_t code, uint32_t num_rejected)
+{
+	unsigned char frame[INGEST_FRAME_NACK_SIZE];
+	size_t cb_frame = (flags == INGEST_FRAME_ACK)?INGEST_FRAME_ACK_SIZE:INGEST_FRAME_NACK_SIZE;
+	ingest_frame_header_encode(frame, cb_frame - INGEST_FRAME_HEADER_SIZE, 0, flags);
+	ingest_frame_put_u64(frame + INGEST_FRAME_HEADER_SIZE, seq);
+	if(flags == INGEST_FRAME_NACK) {
+		ingest_frame_put_u32(frame + INGEST_FRAME_HEADER_SIZE + 8, code);
+		ingest_frame_put_u32(frame + INGEST_FRAME_HEADER_SIZE + 12, num_rejected);
+	}
+	auto_buffer_push(conn->out, frame, cb_frame);
+}
+#define native_frame_nack(conn, code, num_rejected) native_frame_reply(conn, INGEST_FRAME_NACK, conn->seq, code, num_rejected)
+
+static void native_frame_bind(struct native_connection * conn, const struct ingest_frame_header * hdr, const unsigned char * payload)
+{
+	if(0 == hdr->topic_id || hdr->topic_id >= INGEST_FRAME_MAX_TOPICS || 0 == hdr->length || hdr->length > 255
+		|| memchr(payload, '\0', hdr->length)) {
+		native_frame_nack(conn, ingest_frame_nack_bad_frame, 0);
+		conn->close_after_write = 1;
+		return;
+	}
+
+	char topic[256] = "";
+	memcpy(topic, payload, hdr->length);
+	topic[hdr->length] = '\0';
+
+	if(NULL == conn->topics) {
+		conn->topics = calloc(INGEST_FRAME_MAX_TOPICS, sizeof(*conn->topics));
+		assert(conn->topics);
+	}
+	conn->topics[hdr->topic_id] = gateway_topic_get(conn->worker->params, topic, 1);
+	if(NULL == conn->topics[hdr->topic_id]) native_frame_nack(conn, ingest_frame_nack_unknown_topic, 0);
+}
+
+static int native_frame_check_auth(struct native_connection * conn)
+{
+	// return 0 if the connection may go on, otherwise the next frame is rejected and the connection closed
+	global_params_t * params = conn->worker->params;
+	if(NULL == params->jwt_auth) return 0;
+	char subject[JWT_AUTH_MAX_SUBJECT_SIZE] = "";
+	if(0 == native_authenticate(params, conn->token, conn->cb_token, subject) && 0 == strcmp(subject, conn->subject)) return 0;
+
+	native_frame_reply(conn, INGEST_FRAME_NACK, conn->seq + 1, ingest_frame_nack_unauthorized, 0);
+	conn->close_after_write = 1;
+	return -1;
+}
+
+static void native_frame_auth(struct native_connection * conn, const struct ingest_frame_header * hdr, const unsigned char * payload)
+{
+	global_params_t * params = conn->worker->params;
+	free(conn->token);
+	conn->token = NULL;
+	conn->cb_token = 0;
+	conn->subject[0] = '\0';
+	if(hdr->length > 0) {
+		conn->token = malloc(hdr->length);
+		assert(conn->token);
+		memcpy(conn->token, payload, hdr->length);
+		conn->cb_token = hdr->length;
+	}
+
+	int status = native_authenticate(params, conn->token, conn->cb_token, conn->subject);
+	if(status != jwt_auth_status_ok || (params->jwt_auth && !conn->subject[0])) {
+		native_frame_nack(conn, ingest_frame_nack_unauthorized, 0);
+		conn->close_after_write = 1;
+		return;
+	}
+	if(conn->subject[0]) snprintf(conn->client_id, sizeof(conn->client_id), "sub:%s", conn->subject);
+}
+
+static void native_handle_frame(struct native_connection * conn, const struct ingest_frame_header * hdr, const unsigned char * payload)
+{
+	global_params_t * params = conn->worker->params;
+	if(hdr->flags & INGEST_FRAME_AUTH) {
+		native_frame_auth(conn, hdr, payload);
+		return;
+	}
+	if(params->jwt_auth && params->auth.required && !conn->subject[0]) {
+		native_frame_nack(conn, ingest_frame_nack_unauthorized, 0);
+		conn->close_after_write = 1;
+		return;
+	}
+	if(hdr->flags & INGEST_FRAME_BIND) {
+		native_frame_bind(conn, hdr, payload);
+		return;
+	}
+
+	gateway_topic_t * gw_topic = (conn->topics && hdr->topic_id < INGEST_FRAME_MAX_TOPICS)?conn->topics[hdr->topic_id]:NULL;
+	if(NULL == gw_topic) {
+		native_frame_nack(conn, ingest_frame_nack_unknown_topic, 0);
+		return;
+	}
+	if(gateway_rate_limit_check(params, conn->client_id, NULL)) {
+		native_frame_nack(conn, ingest_frame_nack_rate_limited, 0);
+		return;
+	}
+
+	load_shedder_t * shedder = params->load_shedder;
+	if(shedder) {
+		// a client may lower the priority of its own frames, never raise it
+		enum load_priority priority = (hdr->flags & (INGEST_FRAME_BATCH | INGEST_FRAME_PRIORITY_LOW))?load_priority_low:load_priority_normal;
+		if(!(hdr->flags & INGEST_FRAME_PRIORITY_LOW)) priority = gateway_subject_priority(params, conn->subject[0]?conn->subject:NULL, priority);
+		if(!shedder->admit(shedder, priority)) {
+			native_frame_nack(conn, ingest_frame_nack_overloaded, 0);
+			return;
+		}
+	}
+
+	uint32_t num_rejected = 0;
+	uint32_t num_failed = 0;	// valid, but not published (e.g. the store queue is full): may be retried
+	if(hdr->flags & INGEST_FRAME_BATCH) {
+		const unsigned char * p = payload;
+		const unsigned char * p_end = payload + hdr->length;
+		const unsigned char * event = NULL;
+		uint32_t length = 0;
+		int rc = 0;
+		while((rc = ingest_frame_batch_next(&p, p_end, &event, &length)) > 0) {
+			if(json_span_validate((const char *)event, length, 1, NULL)) ++num_rejected;
+			else if(gateway_topic_publish_raw(gw_topic, (const char *)event, length)) ++num_failed;
+		}
+		if(rc < 0) {
+			native_frame_nack(conn, ingest_frame_nack_bad_frame, 0);
+			conn->close_after_write = 1;
+		}
+	}else {
+		if(json_span_validate((const char *)payload, hdr->length, 1, NULL)) ++num_rejected;
+		else if(gateway_topic_publish_raw(gw_topic, (const char *)payload, hdr->length)) ++num_failed;
+	}
+	if(!conn->close_after_write) {
+		if(num_rejected) native_frame_nack(conn, ingest_frame_nack_invalid_event, num_rejected);
+		if(num_failed) native_frame_nack(conn, ingest_frame_nack_overloaded, num_failed);
+	}
+	if(shedder) shedder->leave(shedder);
+}
+
+static void native_process_frames(struct native_connection * conn)
+{
+	size_t max_length = conn->worker->params->native.buffer_size - INGEST_FRAME_HEADER_SIZE;
+
+	// the token of an authenticated connection may have expired or been revoked since the last read
+	if(conn->token && conn->length >= INGEST_FRAME_HEADER_SIZE) {
+		if(native_frame_check_auth(conn)) {
+			conn->length = 0;
+			return;
+		}
+	}
+	while(conn->length >= INGEST_FRAME_HEADER_SIZE && !conn->close_after_write && !native_connection_output_full(conn)) {
+		const unsigned char * p = conn->buf + conn->start;
+		struct ingest_frame_header hdr[1];
+		ingest_frame_header_decode(p, hdr);
+		if(hdr->length > max_length) {
+			++conn->seq;
+			native_frame_nack(conn, ingest_frame_nack_too_large, 0);
+			conn->close_after_write = 1;
+			break;
+		}
+		size_t cb_frame = INGEST_FRAME_HEADER_SIZE + hdr->length;
+		if(conn->length < cb_frame) break;
+
+		++conn->seq;
+		native_handle_frame(conn, hdr, p + INGEST_FRAME_HEADER_SIZE);
+		conn->start += cb_frame;
+		conn->length -= cb_frame;
+	}
+	if(0 == conn->length) conn->start = 0;
+
+	// one cumulative ack per read
+	if(conn->seq != conn->acked_seq) {
+		native_frame_reply(conn, INGEST_FRAME_ACK, conn->seq, 0, 0);
+		conn->acked_seq = conn->seq;
+	}
+}
+
+/********************************************************
+* io
+* return: 0: ok, -1: the connection has been closed
+********************************************************/
+static int native_connection_flush(struct native_connection * conn)
+{
+	auto_buffer_t * out = conn->out;
+	while(out->length > 0) {
+		ssize_t cb = write(conn->fd, out->data + out->start_pos, out->length);
+		if(cb < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;	// wait for EPOLLOUT
+			native_connection_close(conn);
+			return -1;
+		}
+		out->start_pos += cb;
+		out->length -= cb;
+	}
+	out->start_pos = 0;
+
+	if(conn->close_after_write) {
+		native_connection_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+static int native_connection_on_readable(struct native_connection * conn)
+{
+	struct native_worker * worker = conn->worker;
+	size_t buffer_size = worker->params->native.buffer_size;
+	int peer_closed = 0;
+	int num_reads = 0;
+
+	// edge-triggered: read until EAGAIN,
+	// unless the client does not read its responses (resumed on EPOLLOUT)
+	// or the read budget is spent (resumed from the ready list)
+	while(!conn->close_after_write) {
+		if(native_connection_output_full(conn)) {
+			conn->stalled = 1;
+			if(native_connection_flush(conn)) return -1;
+			if(native_connection_output_full(conn)) return 0;
+		}
+		if(conn->stalled) {	// complete the requests left in the buffer first
+			conn->stalled = 0;
+			if(conn->binary) native_process_frames(conn);
+			else native_process_requests(conn);
+			continue;
+		}
+		if(num_reads >= NATIVE_MAX_READS_PER_WAKEUP) {
+			if(!conn->ready) {
+				conn->ready = 1;
+				conn->next_ready = worker->ready_list;
+				worker->ready_list = conn;
+			}
+			break;
+		}
+
+		if(conn->start > 0 && (conn->start + conn->length) == buffer_size) {
+			memmove(conn->buf, conn->buf + conn->start, conn->length);
+			conn->start = 0;
+		}
+		size_t space = buffer_size - (conn->start + conn->length);
+		if(0 == space) break;	// (not reachable: too large requests are rejected by the parser)
+
+		ssize_t cb = read(conn->fd, conn->buf + conn->start + conn->length, space);
+		if(cb > 0) {
+			conn->length += cb;
+			++num_reads;
+			if(conn->binary) native_process_frames(conn);
+			else native_process_requests(conn);
+			continue;
+		}
+		if(cb == 0) {
+			peer_closed = 1;
+			break;
+		}
+		if(errno == EINTR) continue;
+		if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+		native_connection_close(conn);
+		return -1;
+	}
+
+	if(peer_closed) conn->close_after_write = 1;
+	return native_connection_flush(conn);
+}
+
+static void native_on_accept(struct native_worker * worker, int listen_fd, int binary)
+{
+	while(1) {
+		struct sockaddr_in addr[1];
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept4(listen_fd, (struct sockaddr *)addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) perror("native_on_accept()::accept4()");
+			return;
+		}
+
+		struct native_connection * conn = native_connection_acquire(worker, fd, binary);
+		if(NULL == conn) {	// max_connections reached
+			close(fd);
+			continue;
+		}
+
+		char sz_addr[INET_ADDRSTRLEN] = "";
+		inet_ntop(AF_INET, &addr->sin_addr, sz_addr, sizeof(sz_addr));
+		snprintf(conn->client_id, sizeof(conn->client_id), "ip:%s", sz_addr);
+
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn,
+		};
+		if(epoll_ctl(worker->efd, EPOLL_CTL_ADD, fd, &ev)) {
+			perror("native_on_accept()::epoll_ctl()");
+			native_connection_close(conn);
+		}
+	}
+}
+
+static void * native_worker_thread(void * user_data)
+{
+	struct native_worker * worker = user_data;
+	struct epoll_event events[NATIVE_MAX_EVENTS];
+
+	int quit = 0;
+	while(!quit) {
+		int n = epoll_wait(worker->efd, events, NATIVE_MAX_EVENTS, worker->ready_list?0:-1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("native_worker_thread()::epoll_wait()");
+			break;
+		}
+
+		for(int i = 0; i < n; ++i) {
+			void * ptr = events[i].data.ptr;
+			uint32_t flags = events[i].events;
+			if(ptr == &worker->listen_fd) {
+				native_on_accept(worker, worker->listen_fd, 0);
+				continue;
+			}
+			if(ptr == &worker->binary_listen_fd) {
+				native_on_accept(worker, worker->binary_listen_fd, 1);
+				continue;
+			}
+			if(ptr == &worker->quit_fd) {
+				quit = 1;
+				continue;
+			}
+
+			struct native_connection * conn = ptr;
+			if(conn->fd < 0) continue;	// closed by an earlier event of this batch
+			if(flags & EPOLLERR) {
+				native_connection_close(conn);
+				continue;
+			}
+			if(flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+				if(native_connection_on_readable(conn)) continue;
+			}
+			if(flags & EPOLLOUT) {
+				if(native_connection_flush(conn)) continue;
+				if(conn->stalled && !native_connection_output_full(conn)) native_connection_on_readable(conn);
+			}
+		}
+
+		// the connections that still had data to read when their budget was spent
+		struct native_connection * ready = worker->ready_list;
+		worker->ready_list = NULL;
+		while(ready) {
+			struct native_connection * conn = ready;
+			ready = conn->next_ready;
+			conn->next_ready = NULL;
+			conn->ready = 0;
+			if(conn->fd >= 0 && !conn->stalled) native_connection_on_readable(conn);
+		}
+	}
+
+	for(size_t i = 0; i < worker->params->native.max_connections; ++i) {
+		native_connection_close(&worker->connections[i]);
+	}
+	return worker;
+}
+
+/********************************************************
+* struct native_worker
+********************************************************/
+static int native_worker_init(struct native_worker * worker, struct native_ingest * ingest, int id)
+{
+	global_params_t * params = ingest->params;
+	size_t max_connections = params->native.max_connections;
+	size_t buffer_size = params->native.buffer_size;
+
+	worker->id = id;
+	worker->ingest = ingest;
+	worker->params = params;
+	worker->efd = -1;
+	worker->quit_fd = -1;
+	worker->binary_listen_fd = -1;
+
+	worker->listen_fd = native_listen_socket(params->native.bind_address, params->native.port);
+	if(worker->listen_fd < 0) return -1;
+	if(params->native.binary_port > 0) {
+		worker->binary_listen_fd = native_listen_socket(params->native.bind_address, params->native.binary_port);
+		if(worker->binary_listen_fd < 0) return -1;
+	}
+
+	worker->efd = epoll_create1(EPOLL_CLOEXEC);
+	worker->quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(worker->efd >= 0 && worker->quit_fd >= 0);
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &worker->listen_fd };
+	int rc = epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->listen_fd, &ev);
+	assert(0 == rc);
+	ev.data.ptr = &worker->quit_fd;
+	rc = epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->quit_fd, &ev);
+	assert(0 == rc);
+	if(worker->binary_listen_fd >= 0) {
+		ev.data.ptr = &worker->binary_listen_fd;
+		rc = epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->binary_listen_fd, &ev);
+		assert(0 == rc);
+	}
+
+	// preallocate all connections and their input buffers
+	worker->connections = calloc(max_connections, sizeof(*worker->connections));
+	worker->buffers = malloc(max_connections * buffer_size);
+	assert(worker->connections && worker->buffers);
+	for(size_t i = max_connections; i > 0; --i) {
+		struct native_connection * conn = &worker->connections[i - 1];
+		conn->fd = -1;
+		conn->worker = worker;
+		conn->buf = worker->buffers + (i - 1) * buffer_size;
+		auto_buffer_init(conn->out, 0);
+
+		conn->next_free = worker->free_list;
+		worker->free_list = conn;
+	}
+
+	rc = pthread_create(&worker->th, NULL, native_worker_thread, worker);
+	assert(0 == rc);
+	return 0;
+}
+
+static void native_worker_cleanup(struct native_worker * worker)
+{
+	if(worker->th) {
+		uint64_t value = 1;
+		ssize_t cb = write(worker->quit_fd, &value, sizeof(value));
+		assert(cb == sizeof(value));
+		pthread_join(worker->th, NULL);
+		worker->th = (pthread_t)0;
+	}
+
+	if(worker->connections) {
+		for(size_t i = 0; i < worker->params->native.max_connections; ++i) {
+			auto_buffer_cleanup(worker->connections[i].out);
+			free(worker->connections[i].topics);
+		}
+		free(worker->connections);
+		worker->connections = NULL;
+	}
+	free(worker->buffers);
+	worker->buffers = NULL;
+
+	if(worker->listen_fd >= 0) close(worker->listen_fd);
+	if(worker->binary_listen_fd >= 0) close(worker->binary_listen_fd);
+	if(worker->quit_fd >= 0) close(worker->quit_fd);
+	if(worker->efd >= 0) close(worker->efd);
+	worker->listen_fd = worker->binary_listen_fd = worker->quit_fd = worker->efd = -1;
+}
+
+/********************************************************
+* struct native_ingest
+********************************************************/
+struct native_ingest * native_ingest_start(global_params_t * params)
+{
+	assert(params);
+	if(!params->native.enabled) return NULL;
+
+	struct native_ingest * ingest = calloc(1, sizeof(*ingest));
+	assert(ingest);
+	ingest->params = params;
+	ingest->num_workers = params->native.num_threads;
+	if(ingest->num_workers <= 0) ingest->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ingest->num_workers <= 0) ingest->num_workers = 1;
+
+	ingest->workers = calloc(ingest->num_workers, sizeof(*ingest->workers));
+	assert(ingest->workers);
+	for(int i = 0; i < ingest->num_workers; ++i) {
+		int rc = native_worker_init(&ingest->workers[i], ingest, i);
+		if(rc) {
+			ingest->num_workers = i + 1;
+			native_ingest_stop(ingest);
+			return NULL;
+		}
+	}
+	debug_printf("native ingest listener: port=%d, binary_port=%d, threads=%d",
+		params->native.port, params->native.binary_port, ingest->num_workers);
+	return ingest;
+}
+
+void native_ingest_stop(struct native_ingest * ingest)
+{
+	if(NULL == ingest) return;
+	for(int i = 0; i < ingest->num_workers; ++i) {
+		native_worker_cleanup(&ingest->workers[i]);
+	}
+	free(ingest->workers);
+	free(ingest);
+}
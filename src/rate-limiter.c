@@ -0,0 +1,228 @@
+/*
+ * rate-limiter.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <pthread.h>
+#include "rate-limiter.h"
+
+/********************************************************
+* struct client_bucket: a slot of the shard's table (linear probing)
+*
+* a slot is never emptied again: an idle bucket is taken over by a new client in place,
+* so the probe sequences stay valid for the lock-free readers.
+* (a reader racing with the takeover may charge one token to the new client)
+********************************************************/
+struct client_bucket
+{
+	uint64_t key;	// client_id_hash(), 0: empty
+	uint64_t tat;	// theoretical arrival time (ns, CLOCK_MONOTONIC)
+};
+
+struct rate_limiter_shard
+{
+	pthread_mutex_t mutex;	// writers only
+	struct client_bucket * buckets;	// [mask + 1], at most half full
+	size_t mask;
+	size_t num_buckets;
+	size_t max_buckets;
+}__attribute__((aligned(64)));
+
+/********************************************************
+* struct rate_limiter_private
+********************************************************/
+struct rate_limiter_private
+{
+	struct rate_limiter * limiter;
+	uint64_t interval_ns;	// emission interval: 1 / rate
+	uint64_t tolerance_ns;	// burst tolerance: burst * interval
+	struct rate_limiter_shard shards[RATE_LIMITER_NUM_SHARDS];
+};
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct rate_limiter_private * rate_limiter_private_new(struct rate_limiter * limiter)
+{
+	struct rate_limiter_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+
+	priv->interval_ns = (uint64_t)(1000000000.0 / limiter->rate);
+	if(0 == priv->interval_ns) priv->interval_ns = 1;
+	priv->tolerance_ns = (uint64_t)(limiter->burst * priv->interval_ns);
+
+	size_t max_buckets = limiter->max_clients / RATE_LIMITER_NUM_SHARDS;
+	if(max_buckets < 1) max_buckets = 1;
+	size_t size = 2;
+	while(size < max_buckets * 2) size <<= 1;
+	for(int i = 0; i < RATE_LIMITER_NUM_SHARDS; ++i) {
+		struct rate_limiter_shard * shard = &priv->shards[i];
+		int rc = pthread_mutex_init(&shard->mutex, NULL);
+		assert(0 == rc);
+		shard->buckets = calloc(size, sizeof(*shard->buckets));
+		assert(shard->buckets);
+		shard->mask = size - 1;
+		shard->max_buckets = max_buckets;
+	}
+
+	limiter->priv = priv;
+	priv->limiter = limiter;
+	return priv;
+}
+static void rate_limiter_private_free(struct rate_limiter_private * priv)
+{
+	if(NULL == priv) return;
+	for(int i = 0; i < RATE_LIMITER_NUM_SHARDS; ++i) {
+		struct rate_limiter_shard * shard = &priv->shards[i];
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	free(priv);
+}
+
+/********************************************************
+* GCRA: a request is conforming if max(tat, now) + interval - now <= tolerance
+********************************************************/
+static int bucket_take(struct rate_limiter_private * priv, struct client_bucket * bucket, uint64_t now, uint64_t * p_retry_after_ns)
+{
+	uint64_t tat = __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED);
+	while(1) {
+		uint64_t new_tat = ((tat > now)?tat:now) + priv->interval_ns;
+		uint64_t backlog = new_tat - now;
+		if(backlog > priv->tolerance_ns) {
+			if(p_retry_after_ns) *p_retry_after_ns = backlog - priv->tolerance_ns;
+			return 1;
+		}
+		if(__atomic_compare_exchange_n(&bucket->tat, &tat, new_tat, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 0;
+		// tat reloaded by the failed CAS
+	}
+}
+
+static inline uint64_t client_id_hash(const char * client_id, size_t length)
+{
+	// FNV-1a, (0 marks an empty slot)
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char)client_id[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash?hash:1;
+}
+
+static struct client_bucket * shard_lookup(struct rate_limiter_shard * shard, uint64_t key)
+{
+	// lock-free, (the table is never full: an empty slot ends the probe sequence)
+	for(size_t i = key / RATE_LIMITER_NUM_SHARDS; ; ++i) {
+		struct client_bucket * bucket = &shard->buckets[i & shard->mask];
+		uint64_t bucket_key = __atomic_load_n(&bucket->key, __ATOMIC_ACQUIRE);
+		if(bucket_key == key) return bucket;
+		if(0 == bucket_key) return NULL;
+	}
+}
+
+static struct client_bucket * shard_insert(struct rate_limiter_shard * shard, uint64_t key, uint64_t now)
+{
+	// shard->mutex is locked
+	struct client_bucket * idle_bucket = NULL;
+	struct client_bucket * bucket = NULL;
+	for(size_t i = key / RATE_LIMITER_NUM_SHARDS; ; ++i) {
+		bucket = &shard->buckets[i & shard->mask];
+		uint64_t bucket_key = __atomic_load_n(&bucket->key, __ATOMIC_RELAXED);
+		if(bucket_key == key) return bucket;	// added meanwhile
+		if(0 == bucket_key) break;
+		if(NULL == idle_bucket && __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED) <= now) {
+			idle_bucket = bucket;	// full bucket, equivalent to a new one
+		}
+	}
+
+	if(idle_bucket) bucket = idle_bucket;
+	else if(shard->num_buckets < shard->max_buckets) ++shard->num_buckets;
+	else return NULL;
+
+	__atomic_store_n(&bucket->tat, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->key, key, __ATOMIC_RELEASE);	// published
+	return bucket;
+}
+
+static int rate_limiter_check(struct rate_limiter * limiter, const char * client_id, uint64_t * p_retry_after_ns)
+{
+	assert(limiter && limiter->priv);
+	struct rate_limiter_private * priv = limiter->priv;
+	if(NULL == client_id || !client_id[0]) return 0;
+
+	size_t cb_id = strnlen(client_id, RATE_LIMITER_MAX_KEY_SIZE - 1);	// (longer ids are truncated)
+	uint64_t key = client_id_hash(client_id, cb_id);
+	uint64_t now = monotonic_ns();
+	struct rate_limiter_shard * shard = &priv->shards[key % RATE_LIMITER_NUM_SHARDS];
+
+	// fast path: existing client, no lock
+	struct client_bucket * bucket = shard_lookup(shard, key);
+	if(bucket) return bucket_take(priv, bucket, now, p_retry_after_ns);
+
+	// slow path: add the client
+	pthread_mutex_lock(&shard->mutex);
+	bucket = shard_insert(shard, key, now);
+	pthread_mutex_unlock(&shard->mutex);
+	if(NULL == bucket) return 0;	// too many active clients, fail open
+	return bucket_take(priv, bucket, now, p_retry_after_ns);
+}
+
+rate_limiter_t * rate_limiter_init(rate_limiter_t * limiter, double rate, double burst, size_t max_clients, void * user_data)
+{
+	assert(rate > 0);
+	if(NULL == limiter) limiter = calloc(1, sizeof(*limiter));
+	assert(limiter);
+
+	if(burst < 1) burst = 1;
+	if(max_clients < 1) max_clients = 1;
+
+	limiter->user_data = user_data;
+	limiter->rate = rate;
+	limiter->burst = burst;
+	limiter->max_clients = max_clients;
+	limiter->check = rate_limiter_check;
+
+	struct rate_limiter_private * priv = rate_limiter_private_new(limiter);
+	assert(priv && limiter->priv == priv);
+	return limiter;
+}
+
+void rate_limiter_cleanup(rate_limiter_t * limiter)
+{
+	if(NULL == limiter) return;
+	rate_limiter_private_free(limiter->priv);
+	limiter->priv = NULL;
+}
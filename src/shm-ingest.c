@@ -0,0 +1,417 @@
+/*
+ * shm-ingest.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+#include "api-gateway.h"
+#include "shm-ring.h"
+#include "json-span.h"
+#include "utils.h"
+
+#define SHM_INGEST_MAX_EVENTS (64)
+#define SHM_INGEST_DRAIN_BATCH (256)	// records per ring and pass, keeps the rings fair
+#define SHM_INGEST_MAX_BUSY_PASSES (64)	// per wakeup, then back to epoll (accept, detach, quit)
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************
+* struct shm_producer: one ring per connected producer
+********************************************************/
+enum shm_watch_type
+{
+	shm_watch_type_control,	// producer's control connection, closed on detach
+	shm_watch_type_event,	// ring's eventfd
+};
+struct shm_watch
+{
+	enum shm_watch_type type;
+	struct shm_producer * producer;
+};
+
+struct shm_producer
+{
+	struct shm_ingest * ingest;
+	int index;	// in ingest->producers
+	int control_fd;
+	shm_ring_t ring[1];
+	struct shm_watch control_watch;
+	struct shm_watch event_watch;
+
+	uid_t uid;
+	pid_t pid;
+	uint64_t num_events;
+	uint64_t num_rejected;
+
+	// last topic, most producers write to one or a few topics
+	char topic[SHM_RING_MAX_TOPIC_LENGTH + 1];
+	size_t cb_topic;
+	gateway_topic_t * gw_topic;
+
+	// private copy of the current record: the producer can still write to its ring
+	char * record;
+	size_t record_size;
+};
+
+struct shm_ingest
+{
+	global_params_t * params;
+	pthread_t th;
+	int efd;
+	int listen_fd;
+	int quit_fd;
+
+	int num_producers;
+	struct shm_producer ** producers;	// [params->shm.max_producers]
+};
+
+static void shm_producer_close(struct shm_producer * producer)
+{
+	struct shm_ingest * ingest = producer->ingest;
+	debug_printf("shm producer detached: pid=%d, uid=%u, events=%lu, rejected=%lu",
+		(int)producer->pid, (unsigned int)producer->uid,
+		(unsigned long)producer->num_events, (unsigned long)producer->num_rejected);
+
+	// closing the descriptors removes them from the epoll set
+	if(producer->control_fd >= 0) close(producer->control_fd);
+	shm_ring_cleanup(producer->ring);
+
+	int last = --ingest->num_producers;
+	if(producer->index != last) {
+		ingest->producers[producer->index] = ingest->producers[last];
+		ingest->producers[producer->index]->index = producer->index;
+	}
+	ingest->producers[last] = NULL;
+	free(producer->record);
+	free(producer);
+}
+
+static int on_shm_record(void * user_data, const char * topic, size_t cb_topic, const void * data, size_t length)
+{
+	struct shm_producer * producer = user_data;
+	global_params_t * params = producer->ingest->params;
+
+	if(cb_topic != producer->cb_topic || memcmp(topic, producer->topic, cb_topic) != 0) {
+		memcpy(producer->topic, topic, cb_topic);
+		producer->topic[cb_topic] = '\0';
+		producer->cb_topic = cb_topic;
+		producer->gw_topic = (strlen(producer->topic) == cb_topic)?gateway_topic_get(params, producer->topic, 1):NULL;
+	}
+
+	// validate and publish a copy: the ring is shared, the bytes could change after the validation
+	const char * record = NULL;
+	if(producer->gw_topic) {
+		if(length > producer->record_size) {
+			size_t new_size = (length + 4095) & ~(size_t)4095;
+			producer->record = realloc(producer->record, new_size);
+			assert(producer->record);
+			producer->record_size = new_size;
+		}
+		memcpy(producer->record, data, length);
+		record = producer->record;
+	}
+
+	if(NULL == record || json_span_validate(record, length, 1, NULL)
+		|| gateway_topic_publish_raw(producer->gw_topic, record, length))	// (e.g. the store queue is full)
+	{
+		++producer->num_rejected;
+		__atomic_store_n(&producer->ring->hdr->num_rejected, producer->num_rejected, __ATOMIC_RELAXED);
+		return 0;
+	}
+	++producer->num_events;
+	return 0;
+}
+
+/********************************************************
+* drain all rings until they are idle (or for 'spin_us' more),
+* then announce the sleep to every producer
+* return: 1 asleep, 0 still busy after SHM_INGEST_MAX_BUSY_PASSES
+********************************************************/
+static int shm_ingest_drain(struct shm_ingest * ingest)
+{
+	uint64_t spin_ns = (uint64_t)ingest->params->shm.spin_us * 1000ULL;
+	uint64_t idle_since = 0;
+	if(spin_ns) {
+		for(int i = 0; i < ingest->num_producers; ++i) shm_ring_cancel_wait(ingest->producers[i]->ring);
+		idle_since = monotonic_ns();
+	}
+
+	int num_busy_passes = 0;
+	while(1) {
+		int busy = 0;
+		for(int i = 0; i < ingest->num_producers; ) {
+			struct shm_producer * producer = ingest->producers[i];
+			ssize_t count = shm_ring_drain(producer->ring, SHM_INGEST_DRAIN_BATCH, on_shm_record, producer);
+			if(count < 0) {
+				fprintf(stderr, "[ERROR]: shm ring of pid %d is corrupted, detached\n", (int)producer->pid);
+				shm_producer_close(producer);	// (the last producer moves to index i)
+				continue;
+			}
+			if(count > 0) busy = 1;
+			++i;
+		}
+		if(busy) {
+			if(++num_busy_passes >= SHM_INGEST_MAX_BUSY_PASSES) return 0;	// (the rings are not armed)
+			if(spin_ns) idle_since = monotonic_ns();
+			continue;
+		}
+		if(spin_ns && (monotonic_ns() - idle_since) < spin_ns) continue;
+
+		int can_sleep = 1;
+		for(int i = 0; i < ingest->num_producers; ++i) {
+			if(!shm_ring_prepare_wait(ingest->producers[i]->ring)) can_sleep = 0;
+		}
+		if(can_sleep) break;
+	}
+	return 1;
+}
+
+static int shm_peer_allowed(global_params_t * params, uid_t uid)
+{
+	if(NULL == params->shm.allowed_uids) return 1;
+	for(size_t i = 0; i < params->shm.num_allowed_uids; ++i) {
+		if(params->shm.allowed_uids[i] == uid) return 1;
+	}
+	return 0;
+}
+
+static void shm_on_accept(struct shm_ingest * ingest)
+{
+	global_params_t * params = ingest->params;
+	while(1) {
+		int fd = accept4(ingest->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) perror("shm_on_accept()::accept4()");
+			return;
+		}
+
+		struct ucred cred;
+		socklen_t cb_cred = sizeof(cred);
+		memset(&cred, 0, sizeof(cred));
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cb_cred) || !shm_peer_allowed(params, cred.uid)
+			|| ingest->num_producers >= (int)params->shm.max_producers) {
+			debug_printf("shm producer rejected: pid=%d, uid=%u", (int)cred.pid, (unsigned int)cred.uid);
+			close(fd);
+			continue;
+		}
+
+		struct shm_producer * producer = calloc(1, sizeof(*producer));
+		assert(producer);
+		producer->ingest = ingest;
+		producer->control_fd = fd;
+		producer->uid = cred.uid;
+		producer->pid = cred.pid;
+		producer->control_watch = (struct shm_watch){ shm_watch_type_control, producer };
+		producer->event_watch = (struct shm_watch){ shm_watch_type_event, producer };
+		producer->index = ingest->num_producers;
+		ingest->producers[ingest->num_producers++] = producer;
+
+		if(NULL == shm_ring_create(producer->ring, params->shm.ring_size)) {
+			producer->ring->mem_fd = producer->ring->event_fd = producer->ring->control_fd = -1;
+			shm_producer_close(producer);
+			continue;
+		}
+		shm_ring_prepare_wait(producer->ring);	// empty: the first record wakes us up
+
+		struct epoll_event ev = { .events = EPOLLRDHUP, .data.ptr = &producer->control_watch };
+		int rc = epoll_ctl(ingest->efd, EPOLL_CTL_ADD, fd, &ev);
+		if(0 == rc) {
+			ev = (struct epoll_event){ .events = EPOLLIN, .data.ptr = &producer->event_watch };
+			rc = epoll_ctl(ingest->efd, EPOLL_CTL_ADD, producer->ring->event_fd, &ev);
+		}
+		if(0 == rc) rc = shm_ring_send_fds(fd, producer->ring);
+		if(rc) {
+			perror("shm_on_accept()");
+			shm_producer_close(producer);
+			continue;
+		}
+		debug_printf("shm producer attached: pid=%d, uid=%u, ring_size=%lu",
+			(int)cred.pid, (unsigned int)cred.uid, (unsigned long)params->shm.ring_size);
+	}
+}
+
+static void * shm_ingest_thread(void * user_data)
+{
+	struct shm_ingest * ingest = user_data;
+	struct epoll_event events[SHM_INGEST_MAX_EVENTS];
+
+	int quit = 0;
+	int asleep = 1;
+	while(!quit) {
+		// a busy producer does not write to the eventfd: only poll epoll until the rings are drained
+		int n = epoll_wait(ingest->efd, events, SHM_INGEST_MAX_EVENTS, asleep?-1:0);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("shm_ingest_thread()::epoll_wait()");
+			break;
+		}
+
+		// detach the producers that closed their control connection after a final drain
+		int num_closed = 0;
+		struct shm_producer * closed[SHM_INGEST_MAX_EVENTS];
+		for(int i = 0; i < n; ++i) {
+			void * ptr = events[i].data.ptr;
+			if(ptr == &ingest->listen_fd) {
+				shm_on_accept(ingest);
+				continue;
+			}
+			if(ptr == &ingest->quit_fd) {
+				quit = 1;
+				continue;
+			}
+
+			struct shm_watch * watch = ptr;
+			if(watch->type == shm_watch_type_event) {
+				uint64_t value = 0;
+				ssize_t cb = read(watch->producer->ring->event_fd, &value, sizeof(value));
+				(void)cb;
+			}else {
+				closed[num_closed++] = watch->producer;
+			}
+		}
+
+		asleep = shm_ingest_drain(ingest);
+		for(int i = 0; i < num_closed; ++i) {
+			// (a corrupted ring may have been closed by the drain already)
+			for(int j = 0; j < ingest->num_producers; ++j) {
+				if(ingest->producers[j] == closed[i]) { shm_producer_close(closed[i]); break; }
+			}
+		}
+	}
+
+	while(ingest->num_producers > 0) shm_producer_close(ingest->producers[ingest->num_producers - 1]);
+	return ingest;
+}
+
+/********************************************************
+* struct shm_ingest
+********************************************************/
+static int shm_listen_socket(const char * path)
+{
+	struct sockaddr_un addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "[ERROR]: shm control path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	struct stat st[1];
+	if(0 == lstat(path, st) && S_ISSOCK(st->st_mode)) unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("shm_listen_socket()::socket()");
+		return -1;
+	}
+	int rc = bind(fd, (struct sockaddr *)addr, sizeof(addr));
+	if(0 == rc) rc = chmod(path, 0660);
+	if(0 == rc) rc = listen(fd, SOMAXCONN);
+	if(rc) {
+		perror("shm_listen_socket()::bind()/chmod()/listen()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct shm_ingest * shm_ingest_start(global_params_t * params)
+{
+	assert(params);
+	if(!params->shm.enabled || NULL == params->shm.control_path) return NULL;
+
+	struct shm_ingest * ingest = calloc(1, sizeof(*ingest));
+	assert(ingest);
+	ingest->params = params;
+	ingest->quit_fd = -1;
+	ingest->efd = -1;
+	ingest->listen_fd = shm_listen_socket(params->shm.control_path);
+	if(ingest->listen_fd < 0) {
+		free(ingest);
+		return NULL;
+	}
+
+	ingest->producers = calloc(params->shm.max_producers, sizeof(*ingest->producers));
+	assert(ingest->producers);
+
+	ingest->efd = epoll_create1(EPOLL_CLOEXEC);
+	ingest->quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(ingest->efd >= 0 && ingest->quit_fd >= 0);
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &ingest->listen_fd };
+	int rc = epoll_ctl(ingest->efd, EPOLL_CTL_ADD, ingest->listen_fd, &ev);
+	assert(0 == rc);
+	ev.data.ptr = &ingest->quit_fd;
+	rc = epoll_ctl(ingest->efd, EPOLL_CTL_ADD, ingest->quit_fd, &ev);
+	assert(0 == rc);
+
+	rc = pthread_create(&ingest->th, NULL, shm_ingest_thread, ingest);
+	assert(0 == rc);
+	debug_printf("shm ingest: control_path=%s, ring_size=%lu", params->shm.control_path, (unsigned long)params->shm.ring_size);
+	return ingest;
+}
+
+void shm_ingest_stop(struct shm_ingest * ingest)
+{
+	if(NULL == ingest) return;
+	if(ingest->th) {
+		uint64_t value = 1;
+		ssize_t cb = write(ingest->quit_fd, &value, sizeof(value));
+		assert(cb == sizeof(value));
+		pthread_join(ingest->th, NULL);
+	}
+
+	if(ingest->listen_fd >= 0) {
+		close(ingest->listen_fd);
+		unlink(ingest->params->shm.control_path);
+	}
+	if(ingest->quit_fd >= 0) close(ingest->quit_fd);
+	if(ingest->efd >= 0) close(ingest->efd);
+	free(ingest->producers);
+	free(ingest);
+}
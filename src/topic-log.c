@@ -0,0 +1,174 @@
+/*
+ * topic-log.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+#include "topic-log.h"
+
+struct log_entry
+{
+	char * data;
+	size_t length;
+};
+
+/********************************************************
+* struct topic_log_private
+********************************************************/
+struct topic_log_private
+{
+	struct topic_log * log;
+	pthread_rwlock_t rw_lock;
+
+	struct log_entry * entries;	// ring buffer, entries[offset % capacity]
+	int64_t first_offset;
+	int64_t next_offset;
+};
+static struct topic_log_private * topic_log_private_new(struct topic_log * log)
+{
+	assert(log && log->capacity > 0);
+	struct topic_log_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+
+	int rc = pthread_rwlock_init(&priv->rw_lock, NULL);
+	assert(0 == rc);
+
+	priv->entries = calloc(log->capacity, sizeof(*priv->entries));
+	assert(priv->entries);
+
+	log->priv = priv;
+	priv->log = log;
+	return priv;
+}
+static void topic_log_private_free(struct topic_log_private * priv)
+{
+	if(NULL == priv) return;
+	if(priv->entries) {
+		for(size_t i = 0; i < priv->log->capacity; ++i) {
+			if(priv->entries[i].data) free(priv->entries[i].data);
+		}
+		free(priv->entries);
+	}
+	pthread_rwlock_destroy(&priv->rw_lock);
+	free(priv);
+}
+
+/********************************************************
+* struct topic_log
+********************************************************/
+static int64_t topic_log_append(struct topic_log * log, const char * data, size_t length)
+{
+	assert(log && log->priv);
+	struct topic_log_private * priv = log->priv;
+
+	char * copy = malloc(length + 1);
+	assert(copy);
+	memcpy(copy, data, length);
+	copy[length] = '\0';
+
+	pthread_rwlock_wrlock(&priv->rw_lock);
+	int64_t offset = priv->next_offset++;
+	struct log_entry * entry = &priv->entries[offset % log->capacity];
+	char * old_data = entry->data;
+	entry->data = copy;
+	entry->length = length;
+	if((priv->next_offset - priv->first_offset) > (int64_t)log->capacity) ++priv->first_offset;
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	if(old_data) free(old_data);
+	return offset;
+}
+
+static ssize_t topic_log_read(struct topic_log * log, int64_t offset, size_t max_events,
+	topic_log_on_read_fn on_read, void * user_data, int64_t * p_next)
+{
+	assert(log && log->priv);
+	struct topic_log_private * priv = log->priv;
+
+	ssize_t count = 0;
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	if(offset < priv->first_offset) offset = priv->first_offset;
+	while(offset < priv->next_offset && (size_t)count < max_events) {
+		struct log_entry * entry = &priv->entries[offset % log->capacity];
+		if(on_read && on_read(user_data, offset, entry->data, entry->length)) break;
+		++offset;
+		++count;
+	}
+	if(offset > priv->next_offset) offset = priv->next_offset;
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	if(p_next) *p_next = offset;
+	return count;
+}
+
+static int64_t topic_log_get_first_offset(struct topic_log * log)
+{
+	struct topic_log_private * priv = log->priv;
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	int64_t offset = priv->first_offset;
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return offset;
+}
+
+static int64_t topic_log_get_next_offset(struct topic_log * log)
+{
+	struct topic_log_private * priv = log->priv;
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	int64_t offset = priv->next_offset;
+	pthread_rwlock_unlock(&priv->rw_lock);
+	return offset;
+}
+
+topic_log_t * topic_log_init(topic_log_t * log, size_t capacity, void * user_data)
+{
+	assert(capacity > 0);
+	if(NULL == log) log = calloc(1, sizeof(*log));
+	assert(log);
+
+	log->user_data = user_data;
+	log->capacity = capacity;
+	log->append = topic_log_append;
+	log->read = topic_log_read;
+	log->get_first_offset = topic_log_get_first_offset;
+	log->get_next_offset = topic_log_get_next_offset;
+
+	struct topic_log_private * priv = topic_log_private_new(log);
+	assert(priv && log->priv == priv);
+	return log;
+}
+
+void topic_log_cleanup(topic_log_t * log)
+{
+	if(NULL == log) return;
+	topic_log_private_free(log->priv);
+	log->priv = NULL;
+}
@@ -0,0 +1,358 @@
+/*
+ * topic-view.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include <pthread.h>
+#include "topic-view.h"
+#include "avl_tree.h"
+#include "json-span.h"
+#include "utils.h"
+
+#define SPILL_MAX_RETRIES (3)	// on DB_LOCK_DEADLOCK, (a non-transactional handle of a transactional environment)
+#define SPILL_MAX_FAILURES (3)	// consecutive failed spills kept in memory, then the evicted entries are dropped
+
+/********************************************************
+* struct view_entry
+********************************************************/
+struct view_entry
+{
+	char * key;
+	char * value;	// json string
+	size_t cb_value;
+
+	// lru list, head: most recently updated
+	struct view_entry * prev;
+	struct view_entry * next;
+};
+static struct view_entry * view_entry_new(const char * key)
+{
+	struct view_entry * entry = calloc(1, sizeof(*entry));
+	assert(entry);
+	entry->key = strdup(key);
+	return entry;
+}
+static void view_entry_free(struct view_entry * entry)
+{
+	if(NULL == entry) return;
+	if(entry->key) free(entry->key);
+	if(entry->value) free(entry->value);
+	free(entry);
+}
+static int view_entry_compare(const void * _a, const void * _b)
+{
+	const struct view_entry * a = _a;
+	const struct view_entry * b = _b;
+	assert(a && b && a->key && b->key);
+	return strcmp(a->key, b->key);
+}
+
+/********************************************************
+* struct topic_view_private
+********************************************************/
+struct topic_view_private
+{
+	struct topic_view * view;
+	pthread_rwlock_t rw_lock;
+
+	avl_tree_t entries[1];
+	struct view_entry * head;
+	struct view_entry * tail;
+
+	int spill_failures;	// consecutive
+};
+static struct topic_view_private * topic_view_private_new(struct topic_view * view)
+{
+	assert(view);
+	struct topic_view_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+
+	int rc = pthread_rwlock_init(&priv->rw_lock, NULL);
+	assert(0 == rc);
+
+	avl_tree_init(priv->entries, priv);
+	priv->entries->on_free_data = (void (*)(void *))view_entry_free;
+
+	view->priv = priv;
+	priv->view = view;
+	return priv;
+}
+static void topic_view_private_free(struct topic_view_private * priv)
+{
+	if(NULL == priv) return;
+	avl_tree_cleanup(priv->entries);
+	pthread_rwlock_destroy(&priv->rw_lock);
+	free(priv);
+}
+
+static void lru_unlink(struct topic_view_private * priv, struct view_entry * entry)
+{
+	if(entry->prev) entry->prev->next = entry->next;
+	else priv->head = entry->next;
+	if(entry->next) entry->next->prev = entry->prev;
+	else priv->tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+static void lru_push_front(struct topic_view_private * priv, struct view_entry * entry)
+{
+	entry->prev = NULL;
+	entry->next = priv->head;
+	if(priv->head) priv->head->prev = entry;
+	else priv->tail = entry;
+	priv->head = entry;
+}
+
+/********************************************************
+* spill db, key format: topic + '\0' + key
+********************************************************/
+static int make_spill_key(const char * topic, const char * key, char ** p_buf, DBT * dbt_key)
+{
+	size_t cb_topic = strlen(topic);
+	size_t cb_key = strlen(key);
+	char * buf = malloc(cb_topic + 1 + cb_key);
+	assert(buf);
+	memcpy(buf, topic, cb_topic + 1);
+	memcpy(buf + cb_topic + 1, key, cb_key);
+
+	memset(dbt_key, 0, sizeof(*dbt_key));
+	dbt_key->data = buf;
+	dbt_key->size = cb_topic + 1 + cb_key;
+	*p_buf = buf;
+	return 0;
+}
+
+static int spill_entry(struct topic_view * view, struct view_entry * entry)
+{
+	DB * dbp = view->spill_db;
+	assert(dbp);
+
+	char * buf = NULL;
+	DBT key, value;
+	make_spill_key(view->topic, entry->key, &buf, &key);
+	memset(&value, 0, sizeof(value));
+	value.data = entry->value;
+	value.size = entry->cb_value;
+
+	int rc = 0;
+	for(int retries = 0; retries <= SPILL_MAX_RETRIES; ++retries) {
+		rc = dbp->put(dbp, NULL, &key, &value, 0);
+		if(rc != DB_LOCK_DEADLOCK) break;
+	}
+	if(rc) dbp->err(dbp, rc, "%s(topic=%s, key=%s)", __FUNCTION__, view->topic, entry->key);
+	free(buf);
+	return rc;
+}
+
+static ssize_t load_spilled_entry(struct topic_view * view, const char * key, char ** p_value)
+{
+	DB * dbp = view->spill_db;
+	assert(dbp);
+
+	char * buf = NULL;
+	DBT dbt_key, value;
+	make_spill_key(view->topic, key, &buf, &dbt_key);
+	memset(&value, 0, sizeof(value));
+	value.flags = DB_DBT_MALLOC;
+
+	ssize_t cb = -1;
+	int rc = dbp->get(dbp, NULL, &dbt_key, &value, 0);
+	if(0 == rc) {
+		char * data = realloc(value.data, value.size + 1);
+		assert(data);
+		data[value.size] = '\0';
+		*p_value = data;
+		cb = value.size;
+	}else if(rc != DB_NOTFOUND) {
+		dbp->err(dbp, rc, "%s(topic=%s, key=%s)", __FUNCTION__, view->topic, key);
+	}
+	free(buf);
+	return cb;
+}
+
+/********************************************************
+* struct topic_view
+********************************************************/
+// takes the ownership of 'value'
+static int topic_view_put(struct topic_view * view, const char * key, char * value, size_t cb_value)
+{
+	struct topic_view_private * priv = view->priv;
+	struct view_entry pattern[1] = {{ .key = (char *)key }};
+	struct view_entry * evicted = NULL;
+
+	pthread_rwlock_wrlock(&priv->rw_lock);
+	struct view_entry * entry = NULL;
+	void * p_node = avl_tree_find(priv->entries, pattern, view_entry_compare);
+	if(p_node) {
+		entry = avl_node_get_data(p_node);
+		lru_unlink(priv, entry);
+	}else {
+		entry = view_entry_new(key);
+		p_node = avl_tree_add(priv->entries, entry, view_entry_compare);
+		assert(p_node && avl_node_get_data(p_node) == entry);
+	}
+	if(entry->value) free(entry->value);
+	entry->value = value;
+	entry->cb_value = cb_value;
+	lru_push_front(priv, entry);
+
+	while(view->max_entries > 0 && priv->entries->count > view->max_entries) {
+		// without a spill db the least recently updated entry is dropped,
+		// otherwise it is spilled before unlock, so that readers never miss the entry.
+		// a failed spill keeps the entry, up to SPILL_MAX_FAILURES in a row: the memory stays bounded
+		entry = priv->tail;
+		if(view->spill_db) {
+			if(spill_entry(view, entry)) {
+				if(++priv->spill_failures <= SPILL_MAX_FAILURES) break;
+				++view->num_dropped;
+				fprintf(stderr, "[ERROR]: %s(topic=%s): spill failed, key '%s' dropped\n", __FUNCTION__, view->topic, entry->key);
+			}else {
+				priv->spill_failures = 0;
+			}
+		}
+		lru_unlink(priv, entry);
+		avl_tree_del(priv->entries, entry, view_entry_compare);
+		entry->next = evicted;	// (freed after unlock)
+		evicted = entry;
+	}
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	while(evicted) {
+		entry = evicted;
+		evicted = entry->next;
+		view_entry_free(entry);
+	}
+	return 0;
+}
+
+static int topic_view_update(struct topic_view * view, /* const */ json_object * jevent)
+{
+	assert(view && view->priv);
+
+	json_object * jkey = NULL;
+	if(!json_object_object_get_ex(jevent, view->key_field, &jkey) || NULL == jkey) return -1;
+	const char * key = json_object_get_string(jkey);
+	if(NULL == key) return -1;
+
+	size_t cb_value = 0;
+	const char * sz_event = json_object_to_json_string_length(jevent, JSON_C_TO_STRING_PLAIN, &cb_value);
+	if(NULL == sz_event) return -1;
+
+	char * value = malloc(cb_value + 1);
+	assert(value);
+	memcpy(value, sz_event, cb_value + 1);
+	return topic_view_put(view, key, value, cb_value);
+}
+
+static int topic_view_update_raw(struct topic_view * view, const char * data, size_t length)
+{
+	assert(view && view->priv);
+
+	char key[TOPIC_VIEW_MAX_KEY_SIZE] = "";
+	ssize_t cb_key = json_span_get_string(data, length, view->key_field, key, sizeof(key));
+	if(cb_key < 0) {
+		// an integer key is indexed by its decimal text, as update() does (json_object_get_string())
+		int64_t int_key = 0;
+		if(json_span_get_int64(data, length, view->key_field, &int_key)) return -1;
+		snprintf(key, sizeof(key), "%" PRId64, int_key);
+	}
+
+	char * value = malloc(length + 1);
+	assert(value);
+	memcpy(value, data, length);
+	value[length] = '\0';
+	return topic_view_put(view, key, value, length);
+}
+
+static ssize_t topic_view_get(struct topic_view * view, const char * key, char ** p_value)
+{
+	assert(view && view->priv);
+	struct topic_view_private * priv = view->priv;
+	if(NULL == key || NULL == p_value) return -1;
+
+	ssize_t cb = -1;
+	struct view_entry pattern[1] = {{ .key = (char *)key }};
+
+	pthread_rwlock_rdlock(&priv->rw_lock);
+	void * p_node = avl_tree_find(priv->entries, pattern, view_entry_compare);
+	if(p_node) {
+		struct view_entry * entry = avl_node_get_data(p_node);
+		char * value = malloc(entry->cb_value + 1);
+		assert(value);
+		memcpy(value, entry->value, entry->cb_value + 1);
+		*p_value = value;
+		cb = entry->cb_value;
+	}
+	pthread_rwlock_unlock(&priv->rw_lock);
+
+	if(cb < 0 && view->spill_db) cb = load_spilled_entry(view, key, p_value);
+	return cb;
+}
+
+topic_view_t * topic_view_init(topic_view_t * view, const char * topic, const char * key_field, size_t max_entries, DB * spill_db, void * user_data)
+{
+	assert(topic);
+	if(NULL == view) view = calloc(1, sizeof(*view));
+	assert(view);
+
+	if(NULL == key_field) key_field = "key";
+	view->user_data = user_data;
+	view->topic = strdup(topic);
+	view->key_field = strdup(key_field);
+	view->max_entries = max_entries;
+	view->spill_db = spill_db;
+
+	view->update = topic_view_update;
+	view->update_raw = topic_view_update_raw;
+	view->get = topic_view_get;
+
+	struct topic_view_private * priv = topic_view_private_new(view);
+	assert(priv && view->priv == priv);
+
+	return view;
+}
+
+void topic_view_cleanup(topic_view_t * view)
+{
+	if(NULL == view) return;
+	struct topic_view_private * priv = view->priv;
+
+	// flush in-memory entries, the spilled db always holds the latest values
+	if(priv && view->spill_db) {
+		for(struct view_entry * entry = priv->head; entry; entry = entry->next) spill_entry(view, entry);
+	}
+	topic_view_private_free(priv);
+	view->priv = NULL;
+
+	if(view->topic) { free(view->topic); view->topic = NULL; }
+	if(view->key_field) { free(view->key_field); view->key_field = NULL; }
+	return;
+}
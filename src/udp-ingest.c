@@ -0,0 +1,340 @@
+/*
+ * udp-ingest.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+#include "api-gateway.h"
+#include "json-span.h"
+#include "utils.h"
+
+#define UDP_INGEST_BATCH_SIZE (64)	// datagrams per recvmmsg()
+#define UDP_INGEST_MAX_TOPIC_LENGTH (255)
+
+/********************************************************
+* struct udp_worker: one SO_REUSEPORT socket per thread,
+* all buffers are allocated once
+********************************************************/
+struct udp_worker
+{
+	int id;
+	global_params_t * params;
+	pthread_t th;
+	int fd;
+	int quit_fd;
+
+	struct mmsghdr msgs[UDP_INGEST_BATCH_SIZE];
+	struct iovec iovs[UDP_INGEST_BATCH_SIZE];
+	struct sockaddr_in addrs[UDP_INGEST_BATCH_SIZE];
+	unsigned char * buffers;	// [UDP_INGEST_BATCH_SIZE][max_datagram_size]
+
+	// last topic
+	char topic[UDP_INGEST_MAX_TOPIC_LENGTH + 1];
+	gateway_topic_t * gw_topic;
+
+	uint64_t num_datagrams;
+	uint64_t num_events;
+	uint64_t num_dropped;	// datagrams: truncated, limited, shed or without a topic; events: not published
+	uint64_t num_invalid;	// events
+};
+
+struct udp_ingest
+{
+	global_params_t * params;
+	int num_workers;
+	struct udp_worker * workers;
+};
+
+static int udp_listen_socket(int port, size_t rcvbuf_size)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("udp_listen_socket()::socket()");
+		return -1;
+	}
+
+	int on = 1;
+	int rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(0 == rc) rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if(0 == rc && rcvbuf_size > 0) {
+		int size = (int)rcvbuf_size;
+		if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) perror("udp_listen_socket()::SO_RCVBUF");
+	}
+	if(rc) {
+		perror("udp_listen_socket()::setsockopt()");
+		close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_ANY);
+	addr->sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)addr, sizeof(addr))) {
+		perror("udp_listen_socket()::bind()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * datagrams are unauthenticated: only the configured topic (udp.topic) is created on demand,
+ * any other topic must exist already
+ */
+static gateway_topic_t * udp_worker_get_topic(struct udp_worker * worker, const char * topic, size_t cb_topic)
+{
+	if(0 == cb_topic || cb_topic > UDP_INGEST_MAX_TOPIC_LENGTH || memchr(topic, '\0', cb_topic)) return NULL;
+	if(worker->gw_topic && 0 == strncmp(worker->topic, topic, cb_topic) && worker->topic[cb_topic] == '\0') {
+		return worker->gw_topic;
+	}
+
+	const char * configured = worker->params->udp.topic;
+	int auto_create = (configured && strlen(configured) == cb_topic && 0 == memcmp(configured, topic, cb_topic));
+	memcpy(worker->topic, topic, cb_topic);
+	worker->topic[cb_topic] = '\0';
+	worker->gw_topic = gateway_topic_get(worker->params, worker->topic, auto_create);
+	return worker->gw_topic;
+}
+
+/********************************************************
+* datagram: [<topic>\n]<event>[\n<event>...]
+* the first line names an existing topic unless it is a json object, (default: udp.topic)
+********************************************************/
+static void udp_worker_process(struct udp_worker * worker, const char * data, size_t length)
+{
+	global_params_t * params = worker->params;
+	const char * p = data;
+	const char * p_end = data + length;
+	while(p < p_end && is_white_char(*p)) ++p;
+
+	gateway_topic_t * gw_topic = NULL;
+	if(p < p_end && *p != '{') {
+		const char * p_eol = memchr(p, '\n', p_end - p);
+		if(NULL == p_eol) p_eol = p_end;
+		const char * topic_end = p_eol;
+		trim_right(p, topic_end);
+		gw_topic = udp_worker_get_topic(worker, p, topic_end - p);
+		p = p_eol;
+	}else if(params->udp.topic) {
+		gw_topic = udp_worker_get_topic(worker, params->udp.topic, strlen(params->udp.topic));
+	}
+	if(NULL == gw_topic) {
+		++worker->num_dropped;
+		return;
+	}
+
+	while(p < p_end) {
+		const char * p_eol = memchr(p, '\n', p_end - p);
+		if(NULL == p_eol) p_eol = p_end;
+		const char * line = p;
+		const char * line_end = p_eol;
+		p = p_eol + 1;
+
+		while(line < line_end && is_white_char(*line)) ++line;
+		trim_right(line, line_end);
+		if(line == line_end) continue;
+
+		if(json_span_validate(line, line_end - line, 1, NULL)) {
+			++worker->num_invalid;
+			continue;
+		}
+		if(gateway_topic_publish_raw(gw_topic, line, line_end - line)) {	// (e.g. the store queue is full)
+			++worker->num_dropped;
+			continue;
+		}
+		++worker->num_events;
+	}
+}
+
+static void udp_worker_receive(struct udp_worker * worker)
+{
+	global_params_t * params = worker->params;
+	load_shedder_t * shedder = params->load_shedder;
+	size_t max_size = params->udp.max_datagram_size;
+
+	while(1) {
+		for(int i = 0; i < UDP_INGEST_BATCH_SIZE; ++i) {
+			worker->msgs[i].msg_hdr.msg_namelen = sizeof(worker->addrs[i]);
+			worker->msgs[i].msg_hdr.msg_flags = 0;
+			worker->iovs[i].iov_len = max_size;
+		}
+
+		int n = recvmmsg(worker->fd, worker->msgs, UDP_INGEST_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) perror("udp_worker_receive()::recvmmsg()");
+			return;
+		}
+		worker->num_datagrams += n;
+
+		// the whole batch is admitted (or shed) at once
+		if(shedder && !shedder->admit(shedder, load_priority_low)) {
+			worker->num_dropped += n;
+			continue;
+		}
+		for(int i = 0; i < n; ++i) {
+			struct mmsghdr * msg = &worker->msgs[i];
+			if(msg->msg_hdr.msg_flags & MSG_TRUNC) {
+				++worker->num_dropped;
+				continue;
+			}
+			if(params->rate_limiter) {
+				char client_id[64] = "ip:";
+				inet_ntop(AF_INET, &worker->addrs[i].sin_addr, client_id + 3, sizeof(client_id) - 3);
+				if(gateway_rate_limit_check(params, client_id, NULL)) {
+					++worker->num_dropped;
+					continue;
+				}
+			}
+			udp_worker_process(worker, (const char *)worker->iovs[i].iov_base, msg->msg_len);
+		}
+		if(shedder) shedder->leave(shedder);
+		if(n < UDP_INGEST_BATCH_SIZE) return;	// drained
+	}
+}
+
+static void * udp_worker_thread(void * user_data)
+{
+	struct udp_worker * worker = user_data;
+	struct pollfd pfds[2] = {
+		{ .fd = worker->fd, .events = POLLIN },
+		{ .fd = worker->quit_fd, .events = POLLIN },
+	};
+
+	while(1) {
+		int n = poll(pfds, 2, -1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("udp_worker_thread()::poll()");
+			break;
+		}
+		if(pfds[1].revents) break;
+		if(pfds[0].revents & POLLIN) udp_worker_receive(worker);
+	}
+
+	debug_printf("udp worker %d: datagrams=%lu, events=%lu, dropped=%lu, invalid=%lu", worker->id,
+		(unsigned long)worker->num_datagrams, (unsigned long)worker->num_events,
+		(unsigned long)worker->num_dropped, (unsigned long)worker->num_invalid);
+	return worker;
+}
+
+static int udp_worker_init(struct udp_worker * worker, global_params_t * params, int id)
+{
+	size_t max_size = params->udp.max_datagram_size;
+	worker->id = id;
+	worker->params = params;
+	worker->quit_fd = -1;
+	worker->fd = udp_listen_socket(params->udp.port, params->udp.rcvbuf_size);
+	if(worker->fd < 0) return -1;
+
+	worker->quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(worker->quit_fd >= 0);
+
+	worker->buffers = malloc(UDP_INGEST_BATCH_SIZE * max_size);
+	assert(worker->buffers);
+	for(int i = 0; i < UDP_INGEST_BATCH_SIZE; ++i) {
+		worker->iovs[i].iov_base = worker->buffers + i * max_size;
+		worker->iovs[i].iov_len = max_size;
+		worker->msgs[i].msg_hdr.msg_iov = &worker->iovs[i];
+		worker->msgs[i].msg_hdr.msg_iovlen = 1;
+		worker->msgs[i].msg_hdr.msg_name = &worker->addrs[i];
+		worker->msgs[i].msg_hdr.msg_namelen = sizeof(worker->addrs[i]);
+	}
+
+	int rc = pthread_create(&worker->th, NULL, udp_worker_thread, worker);
+	assert(0 == rc);
+	return 0;
+}
+
+static void udp_worker_cleanup(struct udp_worker * worker)
+{
+	if(worker->th) {
+		uint64_t value = 1;
+		ssize_t cb = write(worker->quit_fd, &value, sizeof(value));
+		assert(cb == sizeof(value));
+		pthread_join(worker->th, NULL);
+		worker->th = (pthread_t)0;
+	}
+	free(worker->buffers);
+	worker->buffers = NULL;
+	if(worker->fd >= 0) close(worker->fd);
+	if(worker->quit_fd >= 0) close(worker->quit_fd);
+	worker->fd = worker->quit_fd = -1;
+}
+
+/********************************************************
+* struct udp_ingest
+********************************************************/
+struct udp_ingest * udp_ingest_start(global_params_t * params)
+{
+	assert(params);
+	if(!params->udp.enabled) return NULL;
+
+	struct udp_ingest * ingest = calloc(1, sizeof(*ingest));
+	assert(ingest);
+	ingest->params = params;
+	ingest->num_workers = params->udp.num_threads;
+	if(ingest->num_workers <= 0) ingest->num_workers = 1;
+
+	ingest->workers = calloc(ingest->num_workers, sizeof(*ingest->workers));
+	assert(ingest->workers);
+	for(int i = 0; i < ingest->num_workers; ++i) {
+		int rc = udp_worker_init(&ingest->workers[i], params, i);
+		if(rc) {
+			ingest->num_workers = i + 1;
+			udp_ingest_stop(ingest);
+			return NULL;
+		}
+	}
+	debug_printf("udp ingest listener: port=%d, threads=%d", params->udp.port, ingest->num_workers);
+	return ingest;
+}
+
+void udp_ingest_stop(struct udp_ingest * ingest)
+{
+	if(NULL == ingest) return;
+	for(int i = 0; i < ingest->num_workers; ++i) {
+		udp_worker_cleanup(&ingest->workers[i]);
+	}
+	free(ingest->workers);
+	free(ingest);
+}
@@ -0,0 +1,531 @@
+#ifndef _TESTS_MOCK_DB_H_
+#define _TESTS_MOCK_DB_H_
+/*
+ * mock-db.h
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <db.h>
+
+/**
+ * @defgroup mock_db
+ * in-memory stand-in of the Berkeley DB handles used by the event store, (tests only, no libdb):
+ * sorted btree semantics (memcmp order, duplicates sorted by data), secondary dbs maintained by put(),
+ * cursors (DB_FIRST / DB_LAST / DB_NEXT / DB_SET_RANGE, with or without DB_MULTIPLE_KEY),
+ * transactions whose abort() undoes their inserts.
+ *
+ * faults are injected the way they would be with a real handle: by replacing its method pointers.
+ * not thread-safe, (the event store's writer thread is the only writer).
+ * @{
+ * @}
+*/
+
+/**
+ * @ingroup mock_db
+ * @{
+**/
+struct mock_record
+{
+	void * key;
+	uint32_t cb_key;
+	void * data;
+	uint32_t cb_data;
+};
+
+struct mock_table
+{
+	int refs;		// shared by the handles of the same db
+	int dup;		// DB_DUP | DB_DUPSORT
+	struct mock_record * records;	// sorted by (key, data)
+	size_t count;
+	size_t max_count;
+};
+
+struct mock_db
+{
+	DB dbp[1];	// (first member)
+	struct mock_table * table;
+	DB * secondary;
+	int (* get_index_key)(DB *, const DBT *, const DBT *, DBT *);
+	long num_gets;		// point reads
+	long num_cursor_gets;
+};
+
+struct mock_cursor
+{
+	DBC dbc[1];	// (first member)
+	struct mock_db * db;
+	int positioned;
+	struct mock_record current;	// a copy: the cursor survives inserts
+};
+
+struct mock_undo
+{
+	struct mock_table * table;
+	struct mock_record record;
+};
+
+struct mock_env
+{
+	DB_ENV db_env[1];	// (first member)
+	long num_commits;
+	long num_aborts;
+	long num_flushes;
+	long num_checkpoints;
+};
+
+struct mock_txn
+{
+	DB_TXN txn[1];	// (first member)
+	struct mock_env * env;
+	struct mock_undo * undo;
+	size_t num_undo;
+	size_t max_undo;
+};
+/**
+ * @}
+*/
+
+static inline int mock_compare(const void * a, uint32_t cb_a, const void * b, uint32_t cb_b)
+{
+	int rc = memcmp(a, b, (cb_a < cb_b)?cb_a:cb_b);
+	if(rc) return rc;
+	return (cb_a < cb_b)?-1:(cb_a > cb_b);
+}
+
+static inline int mock_record_compare(const struct mock_table * table, const struct mock_record * record,
+	const void * key, uint32_t cb_key, const void * data, uint32_t cb_data)
+{
+	int rc = mock_compare(record->key, record->cb_key, key, cb_key);
+	if(rc || !table->dup || NULL == data) return rc;
+	return mock_compare(record->data, record->cb_data, data, cb_data);
+}
+
+// index of the first record >= (key, data), or > if 'after'; data: NULL: any duplicate
+static inline size_t mock_table_find(const struct mock_table * table, const void * key, uint32_t cb_key,
+	const void * data, uint32_t cb_data, int after)
+{
+	size_t lo = 0, hi = table->count;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int rc = mock_record_compare(table, &table->records[mid], key, cb_key, data, cb_data);
+		if(rc < 0 || (after && 0 == rc)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static inline void * mock_memdup(const void * data, size_t size)
+{
+	void * p = malloc(size?size:1);
+	assert(p);
+	if(size) memcpy(p, data, size);
+	return p;
+}
+
+// return 1 if inserted, 0 if replaced
+static inline int mock_table_put(struct mock_table * table, const void * key, uint32_t cb_key, const void * data, uint32_t cb_data)
+{
+	size_t pos = mock_table_find(table, key, cb_key, table->dup?data:NULL, cb_data, 0);
+	struct mock_record * record = NULL;
+	if(pos < table->count && 0 == mock_record_compare(table, &table->records[pos], key, cb_key, table->dup?data:NULL, cb_data)) {
+		record = &table->records[pos];
+		free(record->data);
+		record->data = mock_memdup(data, cb_data);
+		record->cb_data = cb_data;
+		return 0;
+	}
+
+	if(table->count >= table->max_count) {
+		size_t new_size = table->max_count?(table->max_count * 2):1024;
+		table->records = realloc(table->records, new_size * sizeof(*table->records));
+		assert(table->records);
+		table->max_count = new_size;
+	}
+	record = &table->records[pos];
+	memmove(record + 1, record, (table->count - pos) * sizeof(*record));
+	record->key = mock_memdup(key, cb_key);
+	record->cb_key = cb_key;
+	record->data = mock_memdup(data, cb_data);
+	record->cb_data = cb_data;
+	++table->count;
+	return 1;
+}
+
+static inline void mock_table_del(struct mock_table * table, const struct mock_record * match)
+{
+	size_t pos = mock_table_find(table, match->key, match->cb_key, match->data, match->cb_data, 0);
+	if(pos >= table->count) return;
+	struct mock_record * record = &table->records[pos];
+	if(mock_record_compare(table, record, match->key, match->cb_key, table->dup?match->data:NULL, match->cb_data)) return;
+
+	free(record->key);
+	free(record->data);
+	memmove(record, record + 1, (table->count - pos - 1) * sizeof(*record));
+	--table->count;
+}
+
+static inline void mock_table_unref(struct mock_table * table)
+{
+	if(NULL == table || --table->refs > 0) return;
+	for(size_t i = 0; i < table->count; ++i) {
+		free(table->records[i].key);
+		free(table->records[i].data);
+	}
+	free(table->records);
+	free(table);
+}
+
+static inline int mock_dbt_copy(DBT * dbt, const void * data, uint32_t size)
+{
+	if(dbt->flags & DB_DBT_PARTIAL) {
+		uint32_t offset = (dbt->doff < size)?dbt->doff:size;
+		data = (const char *)data + offset;
+		size -= offset;
+		if(size > dbt->dlen) size = dbt->dlen;
+	}
+	if(dbt->flags & DB_DBT_USERMEM) {
+		dbt->size = size;
+		if(size > dbt->ulen) return DB_BUFFER_SMALL;
+		if(size) memcpy(dbt->data, data, size);
+		return 0;
+	}
+	if(dbt->flags & DB_DBT_MALLOC) dbt->data = mock_memdup(data, size);
+	else dbt->data = (void *)data;	// (owned by the db, like a real handle without DB_THREAD)
+	dbt->size = size;
+	return 0;
+}
+
+static inline void mock_txn_add_undo(DB_TXN * txn, struct mock_table * table, const void * key, uint32_t cb_key,
+	const void * data, uint32_t cb_data)
+{
+	struct mock_txn * mtxn = (struct mock_txn *)txn;
+	if(mtxn->num_undo >= mtxn->max_undo) {
+		size_t new_size = mtxn->max_undo?(mtxn->max_undo * 2):64;
+		mtxn->undo = realloc(mtxn->undo, new_size * sizeof(*mtxn->undo));
+		assert(mtxn->undo);
+		mtxn->max_undo = new_size;
+	}
+	struct mock_undo * undo = &mtxn->undo[mtxn->num_undo++];
+	undo->table = table;
+	undo->record.key = mock_memdup(key, cb_key);
+	undo->record.cb_key = cb_key;
+	undo->record.data = mock_memdup(data, cb_data);
+	undo->record.cb_data = cb_data;
+}
+
+static inline void mock_txn_free(struct mock_txn * mtxn)
+{
+	for(size_t i = 0; i < mtxn->num_undo; ++i) {
+		free(mtxn->undo[i].record.key);
+		free(mtxn->undo[i].record.data);
+	}
+	free(mtxn->undo);
+	free(mtxn);
+}
+
+/********************************************************
+* DB_TXN / DB_ENV
+********************************************************/
+static inline int mock_txn_commit(DB_TXN * txn, u_int32_t flags)
+{
+	struct mock_txn * mtxn = (struct mock_txn *)txn;
+	__atomic_add_fetch(&mtxn->env->num_commits, 1, __ATOMIC_RELAXED);
+	mock_txn_free(mtxn);
+	return 0;
+}
+
+static inline int mock_txn_abort(DB_TXN * txn)
+{
+	struct mock_txn * mtxn = (struct mock_txn *)txn;
+	// only inserts are undone, (the event store never replaces a record)
+	for(size_t i = mtxn->num_undo; i > 0; --i) {
+		struct mock_undo * undo = &mtxn->undo[i - 1];
+		mock_table_del(undo->table, &undo->record);
+	}
+	__atomic_add_fetch(&mtxn->env->num_aborts, 1, __ATOMIC_RELAXED);
+	mock_txn_free(mtxn);
+	return 0;
+}
+
+static inline int mock_env_txn_begin(DB_ENV * db_env, DB_TXN * parent, DB_TXN ** p_txn, u_int32_t flags)
+{
+	struct mock_txn * mtxn = calloc(1, sizeof(*mtxn));
+	assert(mtxn);
+	mtxn->env = (struct mock_env *)db_env;
+	mtxn->txn->commit = mock_txn_commit;
+	mtxn->txn->abort = mock_txn_abort;
+	*p_txn = mtxn->txn;
+	return 0;
+}
+
+static inline int mock_env_log_flush(DB_ENV * db_env, const DB_LSN * lsn)
+{
+	struct mock_env * env = (struct mock_env *)db_env;
+	__atomic_add_fetch(&env->num_flushes, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static inline int mock_env_txn_checkpoint(DB_ENV * db_env, u_int32_t kbyte, u_int32_t min, u_int32_t flags)
+{
+	struct mock_env * env = (struct mock_env *)db_env;
+	__atomic_add_fetch(&env->num_checkpoints, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static inline void mock_env_err(const DB_ENV * db_env, int rc, const char * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "[mock-env] rc=%d: ", rc);
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+static inline DB_ENV * mock_env_new(void)
+{
+	struct mock_env * env = calloc(1, sizeof(*env));
+	assert(env);
+	DB_ENV * db_env = env->db_env;
+	db_env->txn_begin = mock_env_txn_begin;
+	db_env->log_flush = mock_env_log_flush;
+	db_env->txn_checkpoint = mock_env_txn_checkpoint;
+	db_env->err = mock_env_err;
+	return db_env;
+}
+
+static inline void mock_env_free(DB_ENV * db_env)
+{
+	free(db_env);
+}
+
+/********************************************************
+* DBC
+********************************************************/
+static inline int mock_cursor_fill_bulk(struct mock_cursor * cursor, size_t * p_pos, DBT * value)
+{
+	// DB_MULTIPLE_KEY layout: keys and data from the start of the buffer,
+	// (offset, length) pairs from its end, terminated by (uint32_t)-1
+	struct mock_table * table = cursor->db->table;
+	unsigned char * buf = value->data;
+	uint32_t * p_offsets = (uint32_t *)(buf + value->ulen) - 1;
+	size_t cb_used = 0;
+	size_t pos = *p_pos;
+	for(; pos < table->count; ++pos) {
+		const struct mock_record * record = &table->records[pos];
+		size_t cb_needed = record->cb_key + record->cb_data + 4 * sizeof(uint32_t);
+		if(cb_used + cb_needed + sizeof(uint32_t) > value->ulen) break;
+
+		memcpy(buf + cb_used, record->key, record->cb_key);
+		p_offsets[0] = cb_used;
+		p_offsets[-1] = record->cb_key;
+		cb_used += record->cb_key;
+		memcpy(buf + cb_used, record->data, record->cb_data);
+		p_offsets[-2] = cb_used;
+		p_offsets[-3] = record->cb_data;
+		cb_used += record->cb_data;
+		p_offsets -= 4;
+	}
+	if(pos == *p_pos) {	// not even one record fits
+		const struct mock_record * record = &table->records[pos];
+		value->size = record->cb_key + record->cb_data + 5 * sizeof(uint32_t);
+		return DB_BUFFER_SMALL;
+	}
+	*p_offsets = (uint32_t)-1;
+	value->size = value->ulen;
+	*p_pos = pos - 1;	// the cursor is left on the last record returned
+	return 0;
+}
+
+static inline int mock_cursor_get(DBC * dbc, DBT * key, DBT * value, u_int32_t flags)
+{
+	struct mock_cursor * cursor = (struct mock_cursor *)dbc;
+	struct mock_table * table = cursor->db->table;
+	++cursor->db->num_cursor_gets;
+
+	size_t pos = 0;
+	switch(flags & ~(DB_MULTIPLE_KEY)) {
+	case DB_FIRST: pos = 0; break;
+	case DB_LAST: pos = table->count?(table->count - 1):0; break;
+	case DB_SET_RANGE: pos = mock_table_find(table, key->data, key->size, NULL, 0, 0); break;
+	case DB_NEXT:
+		if(!cursor->positioned) pos = 0;
+		else pos = mock_table_find(table, cursor->current.key, cursor->current.cb_key,
+			cursor->current.data, cursor->current.cb_data, 1);
+		break;
+	default:
+		return EINVAL;
+	}
+	if(pos >= table->count) return DB_NOTFOUND;
+
+	if(flags & DB_MULTIPLE_KEY) {
+		int rc = mock_cursor_fill_bulk(cursor, &pos, value);
+		if(rc) return rc;
+	}else {
+		const struct mock_record * record = &table->records[pos];
+		int rc = mock_dbt_copy(key, record->key, record->cb_key);
+		if(0 == rc) rc = mock_dbt_copy(value, record->data, record->cb_data);
+		if(rc) return rc;
+	}
+
+	const struct mock_record * record = &table->records[pos];
+	free(cursor->current.key);
+	free(cursor->current.data);
+	cursor->current.key = mock_memdup(record->key, record->cb_key);
+	cursor->current.cb_key = record->cb_key;
+	cursor->current.data = mock_memdup(record->data, record->cb_data);
+	cursor->current.cb_data = record->cb_data;
+	cursor->positioned = 1;
+	return 0;
+}
+
+static inline int mock_cursor_close(DBC * dbc)
+{
+	struct mock_cursor * cursor = (struct mock_cursor *)dbc;
+	free(cursor->current.key);
+	free(cursor->current.data);
+	free(cursor);
+	return 0;
+}
+
+/********************************************************
+* DB
+********************************************************/
+static inline int mock_db_put(DB * dbp, DB_TXN * txn, DBT * key, DBT * value, u_int32_t flags)
+{
+	struct mock_db * db = (struct mock_db *)dbp;
+	int inserted = mock_table_put(db->table, key->data, key->size, value->data, value->size);
+	if(txn && inserted) mock_txn_add_undo(txn, db->table, key->data, key->size, value->data, value->size);
+
+	if(db->secondary) {
+		DBT skey;
+		memset(&skey, 0, sizeof(skey));
+		if(0 == db->get_index_key(db->secondary, key, value, &skey)) {
+			// secondary record: (index key, primary key)
+			struct mock_table * table = ((struct mock_db *)db->secondary)->table;
+			inserted = mock_table_put(table, skey.data, skey.size, key->data, key->size);
+			if(txn && inserted) mock_txn_add_undo(txn, table, skey.data, skey.size, key->data, key->size);
+		}
+	}
+	return 0;
+}
+
+static inline int mock_db_get(DB * dbp, DB_TXN * txn, DBT * key, DBT * value, u_int32_t flags)
+{
+	struct mock_db * db = (struct mock_db *)dbp;
+	struct mock_table * table = db->table;
+	++db->num_gets;
+
+	size_t pos = mock_table_find(table, key->data, key->size, NULL, 0, 0);
+	if(pos >= table->count || mock_compare(table->records[pos].key, table->records[pos].cb_key, key->data, key->size)) {
+		return DB_NOTFOUND;
+	}
+	return mock_dbt_copy(value, table->records[pos].data, table->records[pos].cb_data);
+}
+
+static inline int mock_db_cursor(DB * dbp, DB_TXN * txn, DBC ** p_dbc, u_int32_t flags)
+{
+	struct mock_cursor * cursor = calloc(1, sizeof(*cursor));
+	assert(cursor);
+	cursor->db = (struct mock_db *)dbp;
+	cursor->dbc->get = mock_cursor_get;
+	cursor->dbc->close = mock_cursor_close;
+	*p_dbc = cursor->dbc;
+	return 0;
+}
+
+static inline int mock_db_associate(DB * dbp, DB_TXN * txn, DB * sdbp,
+	int (* get_index_key)(DB *, const DBT *, const DBT *, DBT *), u_int32_t flags)
+{
+	struct mock_db * db = (struct mock_db *)dbp;
+	db->secondary = sdbp;
+	db->get_index_key = get_index_key;
+	return 0;
+}
+
+static inline int mock_db_sync(DB * dbp, u_int32_t flags)
+{
+	return 0;
+}
+
+static inline void mock_db_err(DB * dbp, int rc, const char * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "[mock-db] rc=%d: ", rc);
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+/**
+ * @ingroup mock_db
+ * dup: 1 for the secondary db, (DB_DUP | DB_DUPSORT)
+ * shared_dbp: nullable, another handle of the same db, (e.g. the event store's index_dbp)
+**/
+static inline DB * mock_db_new(int dup, DB * shared_dbp)
+{
+	struct mock_db * db = calloc(1, sizeof(*db));
+	assert(db);
+	if(shared_dbp) {
+		db->table = ((struct mock_db *)shared_dbp)->table;
+	}else {
+		db->table = calloc(1, sizeof(*db->table));
+		assert(db->table);
+		db->table->dup = dup;
+	}
+	++db->table->refs;
+
+	DB * dbp = db->dbp;
+	dbp->put = mock_db_put;
+	dbp->get = mock_db_get;
+	dbp->cursor = mock_db_cursor;
+	dbp->associate = mock_db_associate;
+	dbp->sync = mock_db_sync;
+	dbp->err = mock_db_err;
+	return dbp;
+}
+
+static inline void mock_db_free(DB * dbp)
+{
+	if(NULL == dbp) return;
+	struct mock_db * db = (struct mock_db *)dbp;
+	mock_table_unref(db->table);
+	free(db);
+}
+
+static inline size_t mock_db_count(DB * dbp)
+{
+	return ((struct mock_db *)dbp)->table->count;
+}
+
+#endif
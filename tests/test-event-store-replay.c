@@ -0,0 +1,273 @@
+/*
+ * test-event-store-replay.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * time-range replay of the event store (event_store->replay()), against tests/mock-db.h:
+ *   - dense topics are read in bulk (DB_MULTIPLE_KEY), sparse ones with point reads,
+ *     records larger than the bulk buffer included
+ *   - (timestamp, event_id) order, exact range bounds, topics sharing a prefix are not mixed
+ *   - no cursor is open while on_record() runs
+ *   - DB_LOCK_DEADLOCK anywhere in the walk: resumed without duplicates or gaps, up to the retry limit
+ *
+ * build & run:
+ * $ make test-event-store-replay
+ * $ tests/test-event-store-replay
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+
+#include "event-store.h"
+#include "mock-db.h"
+
+#if defined(_TEST_EVENT_STORE_REPLAY) && defined(_STAND_ALONE)
+
+#define NUM_EVENTS (20000)
+#define LARGE_RECORD_SIZE (1536 * 1024)		// larger than the bulk buffer
+
+/********************************************************
+* fault injection
+********************************************************/
+static int s_num_open_cursors;
+static long s_num_calls;
+static long s_deadlock_every;	// 0: never
+static int s_deadlocks_left;
+
+static int (* s_cursor_get)(DBC *, DBT *, DBT *, u_int32_t);
+static int (* s_cursor_close)(DBC *);
+static int (* s_get)(DB *, DB_TXN *, DBT *, DBT *, u_int32_t);
+static int (* s_cursor)(DB *, DB_TXN *, DBC **, u_int32_t);
+
+static int inject_deadlock(void)
+{
+	++s_num_calls;
+	if(0 == s_deadlock_every || s_deadlocks_left <= 0 || (s_num_calls % s_deadlock_every)) return 0;
+	--s_deadlocks_left;
+	return 1;
+}
+
+static int faulty_cursor_get(DBC * dbc, DBT * key, DBT * value, u_int32_t flags)
+{
+	if(inject_deadlock()) return DB_LOCK_DEADLOCK;
+	return s_cursor_get(dbc, key, value, flags);
+}
+
+static int counted_cursor_close(DBC * dbc)
+{
+	--s_num_open_cursors;
+	return s_cursor_close(dbc);
+}
+
+static int faulty_cursor(DB * dbp, DB_TXN * txn, DBC ** p_dbc, u_int32_t flags)
+{
+	int rc = s_cursor(dbp, txn, p_dbc, flags);
+	if(rc) return rc;
+	DBC * dbc = *p_dbc;
+	s_cursor_get = dbc->get;
+	s_cursor_close = dbc->close;
+	dbc->get = faulty_cursor_get;
+	dbc->close = counted_cursor_close;
+	++s_num_open_cursors;
+	return 0;
+}
+
+static int faulty_get(DB * dbp, DB_TXN * txn, DBT * key, DBT * value, u_int32_t flags)
+{
+	if(inject_deadlock()) return DB_LOCK_DEADLOCK;
+	return s_get(dbp, txn, key, value, flags);
+}
+
+/********************************************************
+* dataset: topic "a" dense, "b" sparse (1 in 50), "ab" shares a prefix with "a",
+* 3 events per timestamp
+********************************************************/
+static const char * topic_of(long i)
+{
+	if(0 == (i % 50)) return "b";
+	if(1 == (i % 50)) return "ab";
+	return "a";
+}
+static inline int64_t timestamp_of(long i)	{ return 1000 + i / 3; }
+static inline uint64_t event_id_of(long i)	{ return i + 1; }
+static inline long large_record_index(void)	{ return NUM_EVENTS / 2 + 2; }	// (topic "a")
+
+struct replay_result
+{
+	const char * topic;
+	int64_t from;
+	int64_t to;
+	long stop_after;	// 0: all
+
+	long count;
+	uint64_t sum_event_ids;
+	int64_t last_timestamp;
+	uint64_t last_event_id;
+};
+
+static int on_record(void * user_data, const event_record_t * record)
+{
+	struct replay_result * result = user_data;
+	assert(0 == s_num_open_cursors);	// on_record may block: the walk must not hold any cursor
+	assert(record->cb_topic == strlen(result->topic) && 0 == memcmp(record->topic, result->topic, record->cb_topic));
+	assert(record->timestamp >= result->from && record->timestamp <= result->to);
+	assert(record->timestamp > result->last_timestamp
+		|| (record->timestamp == result->last_timestamp && record->event_id > result->last_event_id));	// (no duplicates)
+
+	long i = (long)record->event_id - 1;
+	assert(record->timestamp == timestamp_of(i));
+	if(i == large_record_index()) assert(record->length == LARGE_RECORD_SIZE);
+	else assert(record->length > 0 && ((const char *)record->data)[0] == '{');
+
+	result->last_timestamp = record->timestamp;
+	result->last_event_id = record->event_id;
+	result->sum_event_ids += record->event_id;
+	++result->count;
+	return (result->stop_after && result->count >= result->stop_after);
+}
+
+static void expected_result(struct replay_result * expected, const char * topic, int64_t from, int64_t to)
+{
+	memset(expected, 0, sizeof(*expected));
+	for(long i = 0; i < NUM_EVENTS; ++i) {
+		if(strcmp(topic_of(i), topic) || timestamp_of(i) < from || timestamp_of(i) > to) continue;
+		++expected->count;
+		expected->sum_event_ids += event_id_of(i);
+	}
+}
+
+static ssize_t replay(event_store_t * store, struct replay_result * result, const char * topic, int64_t from, int64_t to)
+{
+	long stop_after = result->stop_after;
+	memset(result, 0, sizeof(*result));
+	result->topic = topic;
+	result->from = from;
+	result->to = to;
+	result->stop_after = stop_after;
+	return store->replay(store, topic, from, to, on_record, result);
+}
+
+int main(int argc, char **argv)
+{
+	DB * dbp = mock_db_new(0, NULL);
+	DB * sdbp = mock_db_new(1, NULL);
+	DB * index_dbp = mock_db_new(1, sdbp);	// the secondary db, not associated
+
+	event_store_t store[1];
+	memset(store, 0, sizeof(store));
+	assert(event_store_init(store, dbp, sdbp, index_dbp, NULL));
+
+	char * large_data = malloc(LARGE_RECORD_SIZE);
+	assert(large_data);
+	memset(large_data, 'x', LARGE_RECORD_SIZE);
+	large_data[0] = '{';
+	char data[64];
+	for(long i = 0; i < NUM_EVENTS; ++i) {
+		int64_t event_id = 0;
+		if(i == large_record_index()) {
+			event_id = store->append(store, topic_of(i), large_data, LARGE_RECORD_SIZE, timestamp_of(i));
+		}else {
+			int cb = snprintf(data, sizeof(data), "{\"i\":%ld}", i);
+			event_id = store->append(store, topic_of(i), data, cb, timestamp_of(i));
+		}
+		assert(event_id == (int64_t)event_id_of(i));
+	}
+	free(large_data);
+
+	s_cursor = dbp->cursor;
+	dbp->cursor = faulty_cursor;
+	index_dbp->cursor = faulty_cursor;
+	s_get = dbp->get;
+	dbp->get = faulty_get;
+
+	// 1. dense topic, in bulk, (the large record included)
+	struct replay_result result, expected;
+	int64_t from = timestamp_of(1000), to = timestamp_of(NUM_EVENTS - 1000);
+	expected_result(&expected, "a", from, to);
+	long num_gets = ((struct mock_db *)dbp)->num_gets;
+	ssize_t count = replay(store, &result, "a", from, to);
+	printf("dense: %ld records (expected %ld), %ld point reads\n",
+		(long)count, expected.count, ((struct mock_db *)dbp)->num_gets - num_gets);
+	assert(count == expected.count && result.count == expected.count);
+	assert(result.sum_event_ids == expected.sum_event_ids);
+
+	// 2. sparse topic, point reads
+	expected_result(&expected, "b", from, to);
+	num_gets = ((struct mock_db *)dbp)->num_gets;
+	count = replay(store, &result, "b", from, to);
+	printf("sparse: %ld records (expected %ld), %ld point reads\n",
+		(long)count, expected.count, ((struct mock_db *)dbp)->num_gets - num_gets);
+	assert(count == expected.count && result.sum_event_ids == expected.sum_event_ids);
+	assert(((struct mock_db *)dbp)->num_gets - num_gets >= expected.count);
+
+	// 3. exact bounds: a single timestamp (3 events per timestamp, 1 in 50 are not "a")
+	expected_result(&expected, "a", timestamp_of(300), timestamp_of(300));
+	count = replay(store, &result, "a", timestamp_of(300), timestamp_of(300));
+	assert(count == expected.count && result.sum_event_ids == expected.sum_event_ids);
+
+	// 4. stopped by on_record
+	result.stop_after = 10;
+	assert(10 == replay(store, &result, "a", 0, INT64_MAX));
+	result.stop_after = 0;
+
+	// 5. deadlocks in the index walk, the bulk reads and the point reads: resumed
+	const char * topics[] = { "a", "b" };
+	for(size_t t = 0; t < sizeof(topics) / sizeof(topics[0]); ++t) {
+		expected_result(&expected, topics[t], 0, INT64_MAX);
+		s_num_calls = 0;
+		s_deadlock_every = 5;
+		s_deadlocks_left = 3;	// (REPLAY_MAX_RETRIES)
+		count = replay(store, &result, topics[t], 0, INT64_MAX);
+		printf("'%s' with deadlocks: %ld records (expected %ld)\n", topics[t], (long)count, expected.count);
+		assert(0 == s_deadlocks_left);
+		assert(count == expected.count && result.count == expected.count);
+		assert(result.sum_event_ids == expected.sum_event_ids);
+	}
+
+	// 6. persistent deadlock: gives up
+	s_deadlock_every = 1;
+	s_deadlocks_left = INT_MAX;
+	assert(-1 == replay(store, &result, "a", 0, INT64_MAX));
+	s_deadlock_every = 0;
+	assert(0 == s_num_open_cursors);
+
+	// 7. empty ranges, unknown topics
+	assert(0 == replay(store, &result, "zz", 0, INT64_MAX));
+	assert(0 == replay(store, &result, "a", 10, 5));
+	assert(0 == replay(store, &result, "a", 0, timestamp_of(0) - 1));
+	assert(-1 == store->replay(store, "", 0, INT64_MAX, on_record, &result));
+
+	event_store_cleanup(store);
+	mock_db_free(index_dbp);
+	mock_db_free(sdbp);
+	mock_db_free(dbp);
+	printf("ok\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,304 @@
+/*
+ * test-event-store-writer.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * group commit of the event store (event_store_start_writer()), against tests/mock-db.h:
+ *   - concurrent producers waiting for a durable ack share the log flushes, every waiter is woken up
+ *   - asynchronous waiters (on_synced) are called once their group is flushed
+ *   - a full writer queue rejects append() with EAGAIN, invalid records are rejected
+ *   - a deadlocked batch is retried as a whole, a failed batch is rolled back and reported
+ *
+ * build & run:
+ * $ make test-event-store-writer
+ * $ tests/test-event-store-writer
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "event-store.h"
+#include "mock-db.h"
+
+#if defined(_TEST_EVENT_STORE_WRITER) && defined(_STAND_ALONE)
+
+#define NUM_PRODUCERS (8)
+#define NUM_EVENTS_PER_PRODUCER (200)
+#define MAX_PENDING (64)
+
+/********************************************************
+* fault injection
+********************************************************/
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int closed;		// the writer blocks in log_flush() while the gate is closed
+	int blocked;
+}s_gate = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int (* s_log_flush)(DB_ENV *, const DB_LSN *);
+static int gated_log_flush(DB_ENV * db_env, const DB_LSN * lsn)
+{
+	pthread_mutex_lock(&s_gate.mutex);
+	while(s_gate.closed) {
+		s_gate.blocked = 1;
+		pthread_cond_broadcast(&s_gate.cond);
+		pthread_cond_wait(&s_gate.cond, &s_gate.mutex);
+	}
+	s_gate.blocked = 0;
+	pthread_mutex_unlock(&s_gate.mutex);
+
+	usleep(2000);	// ~ one fsync
+	return s_log_flush(db_env, lsn);
+}
+
+static void gate_close(void)
+{
+	pthread_mutex_lock(&s_gate.mutex);
+	s_gate.closed = 1;
+	pthread_mutex_unlock(&s_gate.mutex);
+}
+
+static void gate_wait_blocked(void)
+{
+	pthread_mutex_lock(&s_gate.mutex);
+	while(!s_gate.blocked) pthread_cond_wait(&s_gate.cond, &s_gate.mutex);
+	pthread_mutex_unlock(&s_gate.mutex);
+}
+
+static void gate_open(void)
+{
+	pthread_mutex_lock(&s_gate.mutex);
+	s_gate.closed = 0;
+	pthread_cond_broadcast(&s_gate.cond);
+	pthread_mutex_unlock(&s_gate.mutex);
+}
+
+static int s_deadlocks_left;		// txn put()s fail with DB_LOCK_DEADLOCK while > 0
+static uint64_t s_fail_event_id;	// put() of this event fails
+static int (* s_put)(DB *, DB_TXN *, DBT *, DBT *, u_int32_t);
+static int faulty_put(DB * dbp, DB_TXN * txn, DBT * key, DBT * value, u_int32_t flags)
+{
+	if(txn && s_deadlocks_left > 0) {
+		--s_deadlocks_left;
+		return DB_LOCK_DEADLOCK;
+	}
+	uint64_t be_event_id = 0;
+	memcpy(&be_event_id, key->data, sizeof(be_event_id));
+	if(s_fail_event_id && be64toh(be_event_id) == s_fail_event_id) return EIO;
+	return s_put(dbp, txn, key, value, flags);
+}
+
+/********************************************************
+* waiters
+********************************************************/
+struct sync_result
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int called;
+	int status;
+};
+
+static void on_synced(void * user_data, int status)
+{
+	struct sync_result * result = user_data;
+	pthread_mutex_lock(&result->mutex);
+	result->status = status;
+	++result->called;
+	pthread_cond_signal(&result->cond);
+	pthread_mutex_unlock(&result->mutex);
+}
+
+static int sync_async(event_store_t * store, uint64_t since_event_id)
+{
+	struct sync_result result = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int rc = store->sync(store, since_event_id, on_synced, &result);
+	if(rc != EVENT_STORE_SYNC_PENDING) return rc;
+
+	pthread_mutex_lock(&result.mutex);
+	while(!result.called) pthread_cond_wait(&result.cond, &result.mutex);
+	pthread_mutex_unlock(&result.mutex);
+	assert(1 == result.called);
+	return result.status;
+}
+
+static int on_record_found(void * user_data, const event_record_t * record)
+{
+	return 0;
+}
+
+/********************************************************
+* producers: one durable ack per event, (X-Ack: durable)
+********************************************************/
+static void * producer_thread(void * user_data)
+{
+	event_store_t * store = user_data;
+	char data[64];
+	for(int i = 0; i < NUM_EVENTS_PER_PRODUCER; ++i) {
+		int cb = snprintf(data, sizeof(data), "{\"i\":%d}", i);
+		uint64_t since = store->get_last_event_id(store);
+		int64_t event_id = store->append(store, "producers", data, cb, 0);
+		assert(event_id > 0);
+		int rc = store->sync(store, since, NULL, NULL);	// blocked until the group is flushed
+		assert(0 == rc);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	DB * dbp = mock_db_new(0, NULL);
+	DB * sdbp = mock_db_new(1, NULL);
+	DB_ENV * db_env = mock_env_new();
+	struct mock_env * env = (struct mock_env *)db_env;
+	s_log_flush = db_env->log_flush;
+	db_env->log_flush = gated_log_flush;
+	s_put = dbp->put;
+	dbp->put = faulty_put;
+
+	event_store_t store[1];
+	memset(store, 0, sizeof(store));
+	assert(event_store_init(store, dbp, sdbp, NULL, NULL));
+
+	// invalid records are rejected before being queued
+	assert(-1 == store->append(store, "", "x", 1, 0));
+	assert(-1 == store->append(store, "t", NULL, 0, 0));
+	char long_topic[EVENT_STORE_MAX_TOPIC_LENGTH + 2];
+	memset(long_topic, 't', sizeof(long_topic) - 1);
+	long_topic[sizeof(long_topic) - 1] = '\0';
+	assert(-1 == store->append(store, long_topic, "x", 1, 0));
+
+	// no writer: written in place
+	assert(1 == store->append(store, "t", "x", 1, 0));
+	assert(0 == store->sync(store, 0, NULL, NULL));
+	assert(1 == mock_db_count(dbp) && 1 == mock_db_count(sdbp));
+
+	int rc = event_store_start_writer(store, db_env, 16, MAX_PENDING, 1, 0);
+	assert(0 == rc);
+
+	// 1. concurrent durable producers share the flushes, and are all woken up
+	pthread_t threads[NUM_PRODUCERS];
+	for(int i = 0; i < NUM_PRODUCERS; ++i) {
+		rc = pthread_create(&threads[i], NULL, producer_thread, store);
+		assert(0 == rc);
+	}
+	for(int i = 0; i < NUM_PRODUCERS; ++i) pthread_join(threads[i], NULL);
+
+	long num_events = NUM_PRODUCERS * NUM_EVENTS_PER_PRODUCER;
+	long num_flushes = __atomic_load_n(&env->num_flushes, __ATOMIC_RELAXED);
+	printf("group commit: %ld durable events, %ld log flushes, %ld txns\n",
+		num_events, num_flushes, (long)__atomic_load_n(&env->num_commits, __ATOMIC_RELAXED));
+	assert(store->get_last_event_id(store) == (uint64_t)(1 + num_events));
+	assert(mock_db_count(dbp) == (size_t)(1 + num_events));
+	assert(num_flushes > 0 && num_flushes <= num_events / 2);
+
+	// 2. an asynchronous waiter is called once its group is flushed
+	struct sync_result result = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	uint64_t since = store->get_last_event_id(store);
+	assert(0 == store->sync(store, since, on_synced, &result));	// nothing pending: status in place
+	assert(0 == result.called);
+
+	gate_close();
+	int64_t event_id = store->append(store, "t", "a", 1, 0);
+	assert(event_id > 0);
+	gate_wait_blocked();	// the writer holds the group of 'event_id'
+	assert(EVENT_STORE_SYNC_PENDING == store->sync(store, since, on_synced, &result));
+	usleep(10000);
+	assert(0 == result.called);
+
+	// 3. the writer queue is bounded: EAGAIN while the writer is stuck
+	int num_queued = 0;
+	while((event_id = store->append(store, "t", "b", 1, 0)) > 0) ++num_queued;
+	assert(-1 == event_id && errno == EAGAIN);
+	assert(num_queued == MAX_PENDING);
+	printf("queue bound: %d queued, then EAGAIN\n", num_queued);
+
+	gate_open();
+	pthread_mutex_lock(&result.mutex);
+	while(!result.called) pthread_cond_wait(&result.cond, &result.mutex);
+	pthread_mutex_unlock(&result.mutex);
+	assert(1 == result.called && 0 == result.status);
+
+	assert(0 == store->sync(store, since, NULL, NULL));
+	assert(store->append(store, "t", "c", 1, 0) > 0);	// accepted again
+	assert(0 == sync_async(store, since));
+
+	// 4. a deadlocked batch is retried as a whole
+	long num_aborts = __atomic_load_n(&env->num_aborts, __ATOMIC_RELAXED);
+	since = store->get_last_event_id(store);
+	s_deadlocks_left = 2;
+	event_id = store->append(store, "t", "d", 1, 0);
+	assert(event_id > 0);
+	assert(0 == sync_async(store, since));
+	assert(__atomic_load_n(&env->num_aborts, __ATOMIC_RELAXED) == num_aborts + 2);
+	assert(0 == store->get(store, event_id, on_record_found, NULL));
+
+	// 5. a failed batch is rolled back and reported to the waiters of its events only
+	since = store->get_last_event_id(store);
+	gate_close();
+	assert(store->append(store, "t", "g", 1, 0) > 0);
+	gate_wait_blocked();
+	int64_t first_id = store->append(store, "t", "h", 1, 0);	// (the same batch)
+	event_id = store->append(store, "t", "i", 1, 0);
+	assert(first_id > 0 && event_id == first_id + 1);
+	s_fail_event_id = event_id;
+	gate_open();
+	assert(-1 == sync_async(store, since));
+	assert(1 == store->get(store, first_id, on_record_found, NULL));
+	assert(1 == store->get(store, event_id, on_record_found, NULL));
+	assert(mock_db_count(dbp) == mock_db_count(sdbp));	// (no index entry left behind)
+	s_fail_event_id = 0;
+
+	uint64_t since_failure = store->get_last_event_id(store);
+	assert(store->append(store, "t", "f", 1, 0) > 0);
+	assert(0 == store->sync(store, since_failure, NULL, NULL));
+	assert(-1 == store->sync(store, since, NULL, NULL));	// (conservative)
+
+	event_store_cleanup(store);
+	mock_db_free(sdbp);
+	mock_db_free(dbp);
+	mock_env_free(db_env);
+	printf("ok\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,109 @@
+/*
+ * test-ingest-frame.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * INGEST_FRAME_BATCH payloads (include/ingest-frame.h), untrusted input:
+ *   - well-formed batches, empty events and empty payloads
+ *   - truncated sub-frames: a trailing partial length prefix (1-3 bytes), a length past the payload
+ *
+ * build & run:
+ * $ make test-ingest-frame
+ * $ tests/test-ingest-frame
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ingest-frame.h"
+
+#if defined(_TEST_INGEST_FRAME) && defined(_STAND_ALONE)
+
+static size_t append_event(unsigned char * p, const char * event)
+{
+	size_t length = strlen(event);
+	ingest_frame_put_u32(p, length);
+	memcpy(p + 4, event, length);
+	return 4 + length;
+}
+
+// return the number of events, -1 if the batch is malformed
+static int walk_batch(const unsigned char * payload, size_t length)
+{
+	const unsigned char * p = payload;
+	const unsigned char * p_end = payload + length;
+	const unsigned char * event = NULL;
+	uint32_t cb_event = 0;
+	int num_events = 0;
+	int rc = 0;
+	while((rc = ingest_frame_batch_next(&p, p_end, &event, &cb_event)) > 0) {
+		assert(event >= payload && event + cb_event <= p_end);
+		++num_events;
+	}
+	if(rc < 0) return -1;
+	assert(p == p_end);
+	return num_events;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char payload[256];
+	size_t length = 0;
+	length += append_event(payload + length, "{\"a\":1}");
+	length += append_event(payload + length, "");
+	length += append_event(payload + length, "{\"b\":2}");
+
+	assert(0 == walk_batch(payload, 0));
+	assert(3 == walk_batch(payload, length));
+
+	// a trailing partial length prefix: 1 to 3 bytes, (whatever their value)
+	for(size_t extra = 1; extra < 4; ++extra) {
+		memset(payload + length, 0xff, extra);
+		assert(-1 == walk_batch(payload, length + extra));
+		memset(payload + length, 0, extra);
+		assert(-1 == walk_batch(payload, length + extra));
+	}
+
+	// the last event is cut short
+	for(size_t cut = 1; cut <= 7; ++cut) {
+		assert(-1 == walk_batch(payload, length - cut));
+	}
+
+	// a length larger than the payload, (and one that would wrap a 32-bit offset)
+	size_t cb = append_event(payload, "{}");
+	ingest_frame_put_u32(payload, 3);
+	assert(-1 == walk_batch(payload, cb));
+	ingest_frame_put_u32(payload, UINT32_MAX);
+	assert(-1 == walk_batch(payload, cb));
+	ingest_frame_put_u32(payload, 2);
+	assert(1 == walk_batch(payload, cb));
+
+	printf("ok\n");
+	return 0;
+}
+#endif
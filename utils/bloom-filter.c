@@ -0,0 +1,215 @@
+/*
+ * bloom-filter.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "bloom-filter.h"
+
+#define BLOCK_WORDS (BLOOM_FILTER_BLOCK_BITS / 64)
+
+static inline uint64_t mix64(uint64_t x)
+{
+	// splitmix64 finalizer
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+uint64_t bloom_filter_hash(const void * data, size_t length)
+{
+	const unsigned char * p = data;
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+	while(length >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		hash = mix64(hash ^ word);
+		p += 8;
+		length -= 8;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, p, length);
+	return mix64(hash ^ tail);
+}
+
+bloom_filter_t * bloom_filter_init(bloom_filter_t * bf, size_t capacity, double fp_rate)
+{
+	if(capacity < 1) capacity = 1;
+	if(fp_rate <= 0 || fp_rate >= 1) fp_rate = 0.001;
+	if(NULL == bf) bf = calloc(1, sizeof(*bf));
+	assert(bf);
+
+	// m = -n * ln(p) / ln(2)^2, k = -log2(p); the block count is rounded up to a power of 2
+	double num_bits = -(double)capacity * log(fp_rate) / (M_LN2 * M_LN2);
+	size_t num_blocks = 1;
+	while((double)num_blocks * BLOOM_FILTER_BLOCK_BITS < num_bits) num_blocks <<= 1;
+
+	int num_hashes = (int)lround(-log2(fp_rate));
+	if(num_hashes < 1) num_hashes = 1;
+	if(num_hashes > BLOOM_FILTER_MAX_HASHES) num_hashes = BLOOM_FILTER_MAX_HASHES;
+
+	bf->blocks = aligned_alloc(64, num_blocks * BLOCK_WORDS * sizeof(uint64_t));
+	assert(bf->blocks);
+	memset(bf->blocks, 0, num_blocks * BLOCK_WORDS * sizeof(uint64_t));
+	bf->num_blocks = num_blocks;
+	bf->num_hashes = num_hashes;
+	bf->capacity = capacity;
+	bf->count = 0;
+	return bf;
+}
+
+void bloom_filter_cleanup(bloom_filter_t * bf)
+{
+	if(NULL == bf) return;
+	free(bf->blocks);
+	bf->blocks = NULL;
+	bf->num_blocks = 0;
+	bf->count = 0;
+}
+
+static inline uint64_t * get_block(const bloom_filter_t * bf, uint64_t hash, uint64_t masks[static BLOCK_WORDS])
+{
+	// the upper half selects the block, the bits are taken 9 at a time from rehashes of the key's hash
+	uint64_t * block = bf->blocks + ((hash >> 32) & (bf->num_blocks - 1)) * BLOCK_WORDS;
+	memset(masks, 0, BLOCK_WORDS * sizeof(uint64_t));
+
+	uint64_t bits = hash;
+	for(unsigned int i = 0; i < bf->num_hashes; ++i) {
+		if(0 == (i % 7)) bits = mix64(bits + i + 1);
+		unsigned int pos = bits & (BLOOM_FILTER_BLOCK_BITS - 1);
+		bits >>= 9;
+		masks[pos >> 6] |= (uint64_t)1 << (pos & 63);
+	}
+	return block;
+}
+
+void bloom_filter_add(bloom_filter_t * bf, uint64_t hash)
+{
+	assert(bf && bf->blocks);
+	uint64_t masks[BLOCK_WORDS];
+	uint64_t * block = get_block(bf, hash, masks);
+	for(int i = 0; i < BLOCK_WORDS; ++i) {
+		if(masks[i] && (__atomic_load_n(&block[i], __ATOMIC_RELAXED) & masks[i]) != masks[i]) {
+			__atomic_fetch_or(&block[i], masks[i], __ATOMIC_RELEASE);
+		}
+	}
+	++bf->count;
+}
+
+int bloom_filter_contains(const bloom_filter_t * bf, uint64_t hash)
+{
+	assert(bf && bf->blocks);
+	uint64_t masks[BLOCK_WORDS];
+	uint64_t * block = get_block(bf, hash, masks);
+	for(int i = 0; i < BLOCK_WORDS; ++i) {
+		if((__atomic_load_n(&block[i], __ATOMIC_ACQUIRE) & masks[i]) != masks[i]) return 0;
+	}
+	return 1;
+}
+
+
+#if defined(_TEST_BLOOM_FILTER) && defined(_STAND_ALONE)
+#include <time.h>
+#include <pthread.h>
+
+#define NUM_KEYS (100000)
+static int make_key(char key[static 32], long i)
+{
+	return snprintf(key, 32, "jti-%016lx", i);
+}
+
+struct reader_context
+{
+	bloom_filter_t * bf;
+	volatile long * p_num_added;
+	long errors;
+};
+static void * reader_thread(void * user_data)
+{
+	// every key already added must be found while the writer keeps adding
+	struct reader_context * ctx = user_data;
+	char key[32];
+	long num_added = 0;
+	while((num_added = __atomic_load_n(ctx->p_num_added, __ATOMIC_ACQUIRE)) < NUM_KEYS) {
+		for(long i = 0; i < num_added; i += 97) {
+			int cb = make_key(key, i);
+			if(!bloom_filter_contains(ctx->bf, bloom_filter_hash(key, cb))) ++ctx->errors;
+		}
+	}
+	return ctx;
+}
+
+int main(int argc, char **argv)
+{
+	const double fp_rate = 0.001;
+	bloom_filter_t bf[1];
+	assert(bloom_filter_init(bf, NUM_KEYS, fp_rate));
+	printf("blocks: %ld (%ld KiB), hashes: %u\n", (long)bf->num_blocks, (long)(bf->num_blocks * 64 / 1024), bf->num_hashes);
+
+	volatile long num_added = 0;
+	struct reader_context ctx = { .bf = bf, .p_num_added = &num_added };
+	pthread_t th;
+	pthread_create(&th, NULL, reader_thread, &ctx);
+
+	char key[32];
+	for(long i = 0; i < NUM_KEYS; ++i) {
+		int cb = make_key(key, i);
+		bloom_filter_add(bf, bloom_filter_hash(key, cb));
+		__atomic_store_n(&num_added, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_join(th, NULL);
+	assert(0 == ctx.errors && bf->count == NUM_KEYS);
+
+	// no false negatives
+	for(long i = 0; i < NUM_KEYS; ++i) {
+		int cb = make_key(key, i);
+		assert(bloom_filter_contains(bf, bloom_filter_hash(key, cb)));
+	}
+
+	// false positives of keys never added
+	long num_queries = 1000000, num_fp = 0;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(long i = 0; i < num_queries; ++i) {
+		int cb = make_key(key, NUM_KEYS + i);
+		num_fp += bloom_filter_contains(bf, bloom_filter_hash(key, cb));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / num_queries;
+	printf("false positives: %ld / %ld (%.5f, target: %.5f), %.1f ns/query\n",
+		num_fp, num_queries, (double)num_fp / num_queries, fp_rate, ns);
+	assert((double)num_fp / num_queries < fp_rate * 2);
+
+	bloom_filter_cleanup(bf);
+	return 0;
+}
+#endif
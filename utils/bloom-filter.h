@@ -0,0 +1,45 @@
+#ifndef CHLIB_BLOOM_FILTER_H_
+#define CHLIB_BLOOM_FILTER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * bloom_filter: blocked Bloom filter,
+ * all the bits of a key are in one 64-byte block, a query reads a single cache line.
+ *
+ * bloom_filter_add() and bloom_filter_contains() may run concurrently without a lock,
+ * (bits are only ever set, with atomic or), adds must be serialized by the caller
+ * only to keep 'count' exact.
+ * keys cannot be removed: rebuild a new filter instead.
+ */
+#define BLOOM_FILTER_BLOCK_BITS (512)
+#define BLOOM_FILTER_MAX_HASHES (16)
+
+typedef struct bloom_filter
+{
+	uint64_t * blocks;	// num_blocks * (BLOOM_FILTER_BLOCK_BITS / 64) words, 64-byte aligned
+	size_t num_blocks;	// power of 2
+	unsigned int num_hashes;
+
+	size_t capacity;	// number of keys the filter was sized for
+	size_t count;		// number of keys added
+}bloom_filter_t;
+
+// fp_rate: target false positive rate at 'capacity' keys, e.g. 0.001
+bloom_filter_t * bloom_filter_init(bloom_filter_t * bf, size_t capacity, double fp_rate);
+void bloom_filter_cleanup(bloom_filter_t * bf);
+
+uint64_t bloom_filter_hash(const void * data, size_t length);
+void bloom_filter_add(bloom_filter_t * bf, uint64_t hash);
+// return 0 if the key was never added, 1 if it may have been
+int bloom_filter_contains(const bloom_filter_t * bf, uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,340 @@
+/*
+ * json-span.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+
+#include "json-span.h"
+#include "utils.h"
+
+static const char * skip_white(const char * p, const char * p_end)
+{
+	while(p < p_end && is_white_char(*p)) ++p;
+	return p;
+}
+
+// return the end of the string (the position after the closing quote), or NULL
+static const char * skip_string(const char * p, const char * p_end)
+{
+	assert(*p == '"');
+	++p;
+	while(p < p_end) {
+		unsigned char c = *p++;
+		if(c == '"') return p;
+		if(c < 0x20) return NULL;	// control characters must be escaped
+		if(c != '\\') continue;
+
+		if(p >= p_end) return NULL;
+		c = *p++;
+		switch(c) {
+		case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+			break;
+		case 'u':
+			if((p_end - p) < 4) return NULL;
+			for(int i = 0; i < 4; ++i, ++p) {
+				if(!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F'))) return NULL;
+			}
+			break;
+		default:
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+static const char * skip_number(const char * p, const char * p_end)
+{
+	#define is_digit(c) ((c) >= '0' && (c) <= '9')
+	if(p < p_end && *p == '-') ++p;
+	if(p >= p_end) return NULL;
+	if(*p == '0') ++p;
+	else if(is_digit(*p)) { while(p < p_end && is_digit(*p)) ++p; }
+	else return NULL;
+
+	if(p < p_end && *p == '.') {
+		++p;
+		if(p >= p_end || !is_digit(*p)) return NULL;
+		while(p < p_end && is_digit(*p)) ++p;
+	}
+	if(p < p_end && (*p == 'e' || *p == 'E')) {
+		++p;
+		if(p < p_end && (*p == '+' || *p == '-')) ++p;
+		if(p >= p_end || !is_digit(*p)) return NULL;
+		while(p < p_end && is_digit(*p)) ++p;
+	}
+	#undef is_digit
+	return p;
+}
+
+static const char * skip_literal(const char * p, const char * p_end, const char * literal, size_t cb_literal)
+{
+	if((size_t)(p_end - p) < cb_literal || memcmp(p, literal, cb_literal) != 0) return NULL;
+	return p + cb_literal;
+}
+
+// return the end of the value, or NULL (*p_err: the error position)
+static const char * skip_value(const char * p, const char * p_end, int depth, const char ** p_err)
+{
+	const char * p_next = NULL;
+	p = skip_white(p, p_end);
+	*p_err = p;
+	if(p >= p_end) return NULL;
+	if(depth > JSON_SPAN_MAX_DEPTH) return NULL;
+
+	switch(*p) {
+	case '"': return skip_string(p, p_end);
+	case 't': return skip_literal(p, p_end, "true", 4);
+	case 'f': return skip_literal(p, p_end, "false", 5);
+	case 'n': return skip_literal(p, p_end, "null", 4);
+	case '{':
+		p = skip_white(p + 1, p_end);
+		*p_err = p;
+		if(p < p_end && *p == '}') return p + 1;
+		while(p < p_end) {
+			*p_err = p;
+			if(*p != '"' || NULL == (p = skip_string(p, p_end))) return NULL;
+			p = skip_white(p, p_end);
+			*p_err = p;
+			if(p >= p_end || *p != ':') return NULL;
+
+			p_next = skip_value(p + 1, p_end, depth + 1, p_err);
+			if(NULL == p_next) return NULL;
+			p = skip_white(p_next, p_end);
+			*p_err = p;
+			if(p >= p_end) return NULL;
+			if(*p == '}') return p + 1;
+			if(*p != ',') return NULL;
+			p = skip_white(p + 1, p_end);
+		}
+		return NULL;
+	case '[':
+		p = skip_white(p + 1, p_end);
+		*p_err = p;
+		if(p < p_end && *p == ']') return p + 1;
+		while(p < p_end) {
+			p_next = skip_value(p, p_end, depth + 1, p_err);
+			if(NULL == p_next) return NULL;
+			p = skip_white(p_next, p_end);
+			*p_err = p;
+			if(p >= p_end) return NULL;
+			if(*p == ']') return p + 1;
+			if(*p != ',') return NULL;
+			++p;
+		}
+		return NULL;
+	default:
+		break;
+	}
+	return skip_number(p, p_end);
+}
+
+int json_span_validate(const char * data, size_t length, int require_object, size_t * p_err_offset)
+{
+	assert(data);
+	const char * p_end = data + length;
+	const char * p_err = data;
+	const char * p = skip_white(data, p_end);
+
+	if(require_object && (p >= p_end || *p != '{')) {
+		if(p_err_offset) *p_err_offset = p - data;
+		return -1;
+	}
+
+	p = skip_value(p, p_end, 0, &p_err);
+	if(p) {
+		p_err = p = skip_white(p, p_end);
+		if(p == p_end) return 0;
+	}
+	if(p_err_offset) *p_err_offset = p_err - data;
+	return -1;
+}
+
+static int hex_value(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return c - 'A' + 10;
+}
+
+// unescape a (validated) json string, return the length of the unescaped value
+static ssize_t unescape_string(const char * p, const char * p_end, char * value, size_t max_size)
+{
+	size_t length = 0;
+	#define append_char(c) do { if(length + 1 >= max_size) return -1; value[length++] = (c); } while(0)
+	while(p < p_end) {
+		char c = *p++;
+		if(c != '\\') { append_char(c); continue; }
+
+		c = *p++;
+		switch(c) {
+		case 'b': append_char('\b'); break;
+		case 'f': append_char('\f'); break;
+		case 'n': append_char('\n'); break;
+		case 'r': append_char('\r'); break;
+		case 't': append_char('\t'); break;
+		case 'u': {
+			unsigned int code = 0;
+			for(int i = 0; i < 4; ++i) code = (code << 4) | hex_value(*p++);
+			if(code >= 0xD800 && code <= 0xDBFF && (p_end - p) >= 6 && p[0] == '\\' && p[1] == 'u') {	// surrogate pair
+				unsigned int low = 0;
+				for(int i = 2; i < 6; ++i) low = (low << 4) | hex_value(p[i]);
+				if(low >= 0xDC00 && low <= 0xDFFF) {
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					p += 6;
+				}
+			}
+			if(code < 0x80) append_char(code);
+			else if(code < 0x800) { append_char(0xC0 | (code >> 6)); append_char(0x80 | (code & 0x3F)); }
+			else if(code < 0x10000) {
+				append_char(0xE0 | (code >> 12));
+				append_char(0x80 | ((code >> 6) & 0x3F));
+				append_char(0x80 | (code & 0x3F));
+			}else {
+				append_char(0xF0 | (code >> 18));
+				append_char(0x80 | ((code >> 12) & 0x3F));
+				append_char(0x80 | ((code >> 6) & 0x3F));
+				append_char(0x80 | (code & 0x3F));
+			}
+			break;
+		}
+		default: append_char(c); break;
+		}
+	}
+	#undef append_char
+	if(max_size > 0) value[length] = '\0';
+	return length;
+}
+
+// return the start of the value of a top-level field, or NULL
+static const char * find_field(const char * data, const char * p_end, const char * field)
+{
+	const char * p_err = NULL;
+	const char * p = skip_white(data, p_end);
+	if(p >= p_end || *p != '{') return NULL;
+
+	size_t cb_field = strlen(field);
+	p = skip_white(p + 1, p_end);
+	while(p < p_end && *p == '"') {
+		const char * name = p + 1;
+		p = skip_string(p, p_end);
+		if(NULL == p) return NULL;
+		size_t cb_name = p - 1 - name;
+
+		p = skip_white(p, p_end);
+		if(p >= p_end || *p != ':') return NULL;
+		p = skip_white(p + 1, p_end);
+
+		if(cb_name == cb_field && 0 == memcmp(name, field, cb_field)) return (p < p_end)?p:NULL;
+
+		p = skip_value(p, p_end, 1, &p_err);
+		if(NULL == p) return NULL;
+		p = skip_white(p, p_end);
+		if(p >= p_end || *p != ',') return NULL;
+		p = skip_white(p + 1, p_end);
+	}
+	return NULL;
+}
+
+ssize_t json_span_get_string(const char * data, size_t length, const char * field, char * value, size_t max_size)
+{
+	assert(data && field && value);
+	const char * p_end = data + length;
+	const char * p = find_field(data, p_end, field);
+	if(NULL == p || *p != '"') return -1;
+
+	const char * str = p + 1;
+	p = skip_string(p, p_end);
+	if(NULL == p) return -1;
+	return unescape_string(str, p - 1, value, max_size);
+}
+
+int json_span_get_int64(const char * data, size_t length, const char * field, int64_t * p_value)
+{
+	assert(data && field && p_value);
+	const char * p_end = data + length;
+	const char * p = find_field(data, p_end, field);
+	if(NULL == p) return -1;
+	const char * p_number_end = skip_number(p, p_end);
+	if(NULL == p_number_end) return -1;
+
+	int negative = (*p == '-');
+	if(negative) ++p;
+	uint64_t value = 0;
+	for(; p < p_number_end; ++p) {
+		if(*p < '0' || *p > '9') return -1;	// fraction or exponent
+		if(value > (UINT64_MAX - 9) / 10) return -1;
+		value = value * 10 + (*p - '0');
+	}
+	if(value > (uint64_t)INT64_MAX + negative) return -1;
+	*p_value = negative?(int64_t)(0 - value):(int64_t)value;
+	return 0;
+}
+
+#if defined(_TEST_JSON_SPAN) && defined(_STAND_ALONE)
+int main(int argc, char **argv)
+{
+	static const char * valid_values[] = {
+		"{}", " { \"a\" : 1 } ", "[1, 2.5, -3e10, true, false, null]",
+		"{\"a\":{\"b\":[{\"c\":\"\\u00e9\\n\"}]}}", "\"text\"", "0",
+	};
+	static const char * invalid_values[] = {
+		"", "{", "{\"a\"}", "{\"a\":1,}", "[1,]", "01", "tru", "\"\\x\"", "{} {}",
+	};
+
+	size_t err_offset = 0;
+	for(size_t i = 0; i < sizeof(valid_values) / sizeof(valid_values[0]); ++i) {
+		int rc = json_span_validate(valid_values[i], strlen(valid_values[i]), 0, &err_offset);
+		printf("valid[%d]: '%s' --> rc=%d\n", (int)i, valid_values[i], rc);
+		assert(0 == rc);
+	}
+	for(size_t i = 0; i < sizeof(invalid_values) / sizeof(invalid_values[0]); ++i) {
+		int rc = json_span_validate(invalid_values[i], strlen(invalid_values[i]), 0, &err_offset);
+		printf("invalid[%d]: '%s' --> rc=%d, err_offset=%d\n", (int)i, invalid_values[i], rc, (int)err_offset);
+		assert(rc);
+	}
+
+	const char * event = "{\"id\": 1, \"data\": {\"key\": \"nested\"}, \"key\": \"dev\\\"1\\u00e9\"}";
+	char key[100] = "";
+	ssize_t cb_key = json_span_get_string(event, strlen(event), "key", key, sizeof(key));
+	printf("key: [%s], cb_key=%d\n", key, (int)cb_key);
+	assert(cb_key == 7 && 0 == strcmp(key, "dev\"1\xc3\xa9"));
+	assert(json_span_get_string(event, strlen(event), "id", key, sizeof(key)) == -1);
+
+	int64_t id = 0;
+	assert(0 == json_span_get_int64(event, strlen(event), "id", &id) && id == 1);
+	assert(-1 == json_span_get_int64(event, strlen(event), "key", &id));
+	assert(0 == json_span_get_int64("{\"n\":-9223372036854775808}", 26, "n", &id) && id == INT64_MIN);
+	assert(-1 == json_span_get_int64("{\"n\":9223372036854775808}", 25, "n", &id));
+	assert(-1 == json_span_get_int64("{\"n\":1.5}", 9, "n", &id));
+	assert(-1 == json_span_get_int64("{\"n\":1e3}", 9, "n", &id));
+	return 0;
+}
+#endif
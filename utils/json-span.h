@@ -0,0 +1,30 @@
+#ifndef CHLIB_JSON_SPAN_H_
+#define CHLIB_JSON_SPAN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * json_span: validate / inspect a serialized json value in place,
+ * without building a DOM (json_object).
+ */
+#define JSON_SPAN_MAX_DEPTH (32)
+
+// return 0 if [data, data + length) is a single valid json value (surrounded by optional whitespaces)
+int json_span_validate(const char * data, size_t length, int require_object, size_t * p_err_offset);
+
+// find a top-level string field of a json object and copy its (unescaped) value into 'value'
+// return the length of the value, or -1 if not found (or not a string)
+ssize_t json_span_get_string(const char * data, size_t length, const char * field, char * value, size_t max_size);
+
+// find a top-level integer field of a json object, (no fraction, no exponent, in the int64 range)
+// return 0 if found, otherwise -1
+int json_span_get_int64(const char * data, size_t length, const char * field, int64_t * p_value);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,333 @@
+/*
+ * path-router.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "path-router.h"
+
+/********************************************************
+* struct radix_node
+********************************************************/
+struct radix_node
+{
+	char * prefix;	// static label of the edge leading to this node
+	size_t cb_prefix;
+
+	struct radix_node ** children;	// static children, distinct first chars
+	size_t num_children;
+
+	struct radix_node * param_child;	// "{name}"
+	char * param_name;
+
+	void * catch_all_data;	// "{name*}"
+	char * catch_all_name;
+	int has_catch_all;
+
+	void * route_data;
+	int has_route;
+};
+
+static struct radix_node * radix_node_new(const char * prefix, size_t cb_prefix)
+{
+	struct radix_node * node = calloc(1, sizeof(*node));
+	assert(node);
+	if(cb_prefix > 0) {
+		node->prefix = malloc(cb_prefix + 1);
+		assert(node->prefix);
+		memcpy(node->prefix, prefix, cb_prefix);
+		node->prefix[cb_prefix] = '\0';
+		node->cb_prefix = cb_prefix;
+	}
+	return node;
+}
+
+static void radix_node_free(struct radix_node * node)
+{
+	if(NULL == node) return;
+	for(size_t i = 0; i < node->num_children; ++i) radix_node_free(node->children[i]);
+	free(node->children);
+	radix_node_free(node->param_child);
+	free(node->param_name);
+	free(node->catch_all_name);
+	free(node->prefix);
+	free(node);
+}
+
+static void radix_node_add_child(struct radix_node * node, struct radix_node * child)
+{
+	struct radix_node ** children = realloc(node->children, (node->num_children + 1) * sizeof(*children));
+	assert(children);
+	children[node->num_children++] = child;
+	node->children = children;
+}
+
+// insert static text below 'node', return the node at the end of the text
+static struct radix_node * radix_insert_static(struct radix_node * node, const char * text, size_t length)
+{
+	while(length > 0) {
+		struct radix_node * child = NULL;
+		for(size_t i = 0; i < node->num_children; ++i) {
+			if(node->children[i]->prefix[0] == text[0]) {
+				child = node->children[i];
+				break;
+			}
+		}
+		if(NULL == child) {
+			child = radix_node_new(text, length);
+			radix_node_add_child(node, child);
+			return child;
+		}
+
+		size_t common = 0;
+		while(common < child->cb_prefix && common < length && child->prefix[common] == text[common]) ++common;
+
+		if(common < child->cb_prefix) {
+			// split the edge: node --> mid(prefix[0, common)) --> child(prefix[common, ...))
+			struct radix_node * mid = radix_node_new(child->prefix, common);
+			memmove(child->prefix, child->prefix + common, child->cb_prefix - common + 1);
+			child->cb_prefix -= common;
+			radix_node_add_child(mid, child);
+			for(size_t i = 0; i < node->num_children; ++i) {
+				if(node->children[i] == child) {
+					node->children[i] = mid;
+					break;
+				}
+			}
+			child = mid;
+		}
+		node = child;
+		text += common;
+		length -= common;
+	}
+	return node;
+}
+
+static int radix_match(const struct radix_node * node, const char * p, const char * p_end, path_router_match_t * match)
+{
+	// the label of 'node' has been consumed
+	if(p == p_end) {
+		if(!node->has_route) return 0;
+		match->route_data = node->route_data;
+		return 1;
+	}
+
+	for(size_t i = 0; i < node->num_children; ++i) {
+		const struct radix_node * child = node->children[i];
+		if(child->prefix[0] != p[0]) continue;
+		if(child->cb_prefix <= (size_t)(p_end - p) && 0 == memcmp(child->prefix, p, child->cb_prefix)) {
+			if(radix_match(child, p + child->cb_prefix, p_end, match)) return 1;
+		}
+		break;	// at most one child starts with p[0]
+	}
+
+	int index = match->num_params;
+	if(index >= PATH_ROUTER_MAX_PARAMS) return 0;
+
+	if(node->param_child) {
+		const char * p_seg_end = memchr(p, '/', p_end - p);
+		if(NULL == p_seg_end) p_seg_end = p_end;
+		if(p_seg_end > p) {
+			match->names[index] = node->param_name;
+			match->params[index].p = p;
+			match->params[index].length = p_seg_end - p;
+			match->num_params = index + 1;
+			if(radix_match(node->param_child, p_seg_end, p_end, match)) return 1;
+			match->num_params = index;	// backtrack
+		}
+	}
+
+	if(node->has_catch_all) {
+		match->names[index] = node->catch_all_name;
+		match->params[index].p = p;
+		match->params[index].length = p_end - p;
+		match->num_params = index + 1;
+		match->route_data = node->catch_all_data;
+		return 1;
+	}
+	return 0;
+}
+
+/********************************************************
+* struct path_router
+********************************************************/
+struct path_router_private
+{
+	struct path_router * router;
+	struct radix_node * root;
+};
+
+static int path_router_add(struct path_router * router, const char * route_template, void * route_data)
+{
+	assert(router && router->priv && route_template);
+	struct path_router_private * priv = router->priv;
+	struct radix_node * node = priv->root;
+
+	const char * p = route_template;
+	if(p[0] != '/') return -1;
+	while(*p) {
+		const char * p_param = strchr(p, '{');
+		if(NULL == p_param) {
+			node = radix_insert_static(node, p, strlen(p));
+			break;
+		}
+
+		// a parameter must span a whole segment
+		if(p_param == route_template || p_param[-1] != '/') return -1;
+		const char * p_close = strchr(p_param, '}');
+		if(NULL == p_close || p_close == p_param + 1) return -1;
+		if(p_close[1] != '\0' && p_close[1] != '/') return -1;
+
+		node = radix_insert_static(node, p, p_param - p);
+
+		const char * name = p_param + 1;
+		size_t cb_name = p_close - name;
+		int catch_all = (name[cb_name - 1] == '*');
+		if(catch_all) {
+			if(p_close[1] != '\0' || cb_name < 2) return -1;
+			if(node->has_catch_all) return -1;
+			node->catch_all_name = strndup(name, cb_name - 1);
+			node->catch_all_data = route_data;
+			node->has_catch_all = 1;
+			return 0;
+		}
+
+		if(NULL == node->param_child) {
+			node->param_child = radix_node_new(NULL, 0);
+			node->param_name = strndup(name, cb_name);
+		}else if(strlen(node->param_name) != cb_name || strncmp(node->param_name, name, cb_name) != 0) {
+			return -1;	// conflicting parameter names at the same position
+		}
+		node = node->param_child;
+		p = p_close + 1;
+	}
+
+	if(node->has_route) return -1;
+	node->route_data = route_data;
+	node->has_route = 1;
+	return 0;
+}
+
+static int path_router_match(struct path_router * router, const char * path, size_t length, path_router_match_t * match)
+{
+	assert(router && router->priv && match);
+	struct path_router_private * priv = router->priv;
+	match->route_data = NULL;
+	match->num_params = 0;
+	if(NULL == path || 0 == length) return 0;
+	return radix_match(priv->root, path, path + length, match);
+}
+
+path_router_t * path_router_init(path_router_t * router, void * user_data)
+{
+	if(NULL == router) router = calloc(1, sizeof(*router));
+	assert(router);
+
+	struct path_router_private * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->router = router;
+	priv->root = radix_node_new(NULL, 0);
+
+	router->priv = priv;
+	router->user_data = user_data;
+	router->add = path_router_add;
+	router->match = path_router_match;
+	return router;
+}
+
+void path_router_cleanup(path_router_t * router)
+{
+	if(NULL == router || NULL == router->priv) return;
+	struct path_router_private * priv = router->priv;
+	radix_node_free(priv->root);
+	free(priv);
+	router->priv = NULL;
+}
+
+const path_span_t * path_router_match_get(const path_router_match_t * match, const char * name)
+{
+	for(int i = 0; i < match->num_params; ++i) {
+		if(0 == strcmp(match->names[i], name)) return &match->params[i];
+	}
+	return NULL;
+}
+
+#if defined(_TEST_PATH_ROUTER) && defined(_STAND_ALONE)
+static int test_match(path_router_t * router, const char * path, path_router_match_t * match)
+{
+	int rc = router->match(router, path, strlen(path), match);
+	printf("%-32s --> %s", path, rc?(const char *)match->route_data:"(none)");
+	for(int i = 0; rc && i < match->num_params; ++i) {
+		printf(", %s=[%.*s]", match->names[i], (int)match->params[i].length, match->params[i].p);
+	}
+	printf("\n");
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	path_router_t router[1];
+	memset(router, 0, sizeof(router));
+	path_router_init(router, NULL);
+
+	int rc = 0;
+	rc = router->add(router, "/topics/{topic}/events", "events");	assert(0 == rc);
+	rc = router->add(router, "/topics/{topic}/bulk", "bulk");		assert(0 == rc);
+	rc = router->add(router, "/topics/{topic}/stream", "stream");	assert(0 == rc);
+	rc = router->add(router, "/topics/{topic}/keys/{key*}", "keys");	assert(0 == rc);
+	rc = router->add(router, "/topics/stats", "stats");			assert(0 == rc);
+	rc = router->add(router, "/metrics", "metrics");				assert(0 == rc);
+	rc = router->add(router, "/", "root");						assert(0 == rc);
+
+	assert(router->add(router, "/metrics", "dup") == -1);
+	assert(router->add(router, "/topics/{name}/x", "conflict") == -1);
+	assert(router->add(router, "/topics/a{b}", "invalid") == -1);
+
+	path_router_match_t match[1];
+	assert(test_match(router, "/topics/t1/events", match) && 0 == strcmp(match->route_data, "events"));
+	const path_span_t * topic = path_router_match_get(match, "topic");
+	assert(topic && topic->length == 2 && 0 == strncmp(topic->p, "t1", 2));
+
+	assert(test_match(router, "/topics/t1/bulk", match) && 0 == strcmp(match->route_data, "bulk"));
+	assert(test_match(router, "/topics/stats", match) && 0 == strcmp(match->route_data, "stats"));
+	assert(test_match(router, "/topics/stats/events", match) && 0 == strcmp(match->route_data, "events"));	// backtracking
+	assert(test_match(router, "/topics/t1/keys/a/b", match) && 0 == strcmp(match->route_data, "keys") && match->num_params == 2);
+	assert(test_match(router, "/metrics", match) && 0 == strcmp(match->route_data, "metrics"));
+	assert(test_match(router, "/", match) && 0 == strcmp(match->route_data, "root"));
+
+	assert(!test_match(router, "/topics//events", match));
+	assert(!test_match(router, "/topics/t1/keys/", match));
+	assert(!test_match(router, "/topics/t1/events/x", match));
+	assert(!test_match(router, "/metric", match));
+
+	path_router_cleanup(router);
+	return 0;
+}
+#endif
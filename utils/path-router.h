@@ -0,0 +1,52 @@
+#ifndef CHLIB_PATH_ROUTER_H_
+#define CHLIB_PATH_ROUTER_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * path_router: route templates compiled into a radix trie.
+ *   static text:  "/topics/"
+ *   parameter:    "{name}"   matches one non-empty path segment
+ *   catch-all:    "{name*}"  matches the (non-empty) rest of the path, must be the last element
+ * static edges take precedence over parameters, match() does not allocate memory.
+ */
+#define PATH_ROUTER_MAX_PARAMS (8)
+
+typedef struct path_span
+{
+	const char * p;
+	size_t length;
+}path_span_t;
+
+typedef struct path_router_match
+{
+	void * route_data;
+	int num_params;
+	const char * names[PATH_ROUTER_MAX_PARAMS];
+	path_span_t params[PATH_ROUTER_MAX_PARAMS];
+}path_router_match_t;
+
+typedef struct path_router
+{
+	void * priv;
+	void * user_data;
+
+	// return 0 on success, -1 if the template is invalid or already registered
+	int (* add)(struct path_router * router, const char * route_template, void * route_data);
+	// return 1 if matched, 0 otherwise
+	int (* match)(struct path_router * router, const char * path, size_t length, path_router_match_t * match);
+}path_router_t;
+
+path_router_t * path_router_init(path_router_t * router, void * user_data);
+void path_router_cleanup(path_router_t * router);
+
+// return the span of the named parameter, or NULL if not found
+const path_span_t * path_router_match_get(const path_router_match_t * match, const char * name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,438 @@
+/*
+ * shm-ring.c
+ *
+ * Copyright 2021 chehw <hongwei.che@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to
+ * do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "shm-ring.h"
+
+#define SHM_RING_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+#define SHM_RING_RECORD_PADDING (0x1)
+
+struct shm_ring_record
+{
+	uint32_t length;
+	uint16_t topic_length;
+	uint16_t flags;
+};
+
+struct shm_ring_hello
+{
+	uint32_t magic;
+	uint32_t version;
+};
+
+static shm_ring_t * shm_ring_map(shm_ring_t * ring, int mem_fd, size_t map_size)
+{
+	void * addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if(addr == MAP_FAILED) {
+		perror("shm_ring_map()::mmap()");
+		return NULL;
+	}
+	ring->hdr = addr;
+	ring->data = (unsigned char *)addr + SHM_RING_HEADER_SIZE;
+	ring->map_size = map_size;
+	return ring;
+}
+
+/********************************************************
+* consumer
+********************************************************/
+shm_ring_t * shm_ring_create(shm_ring_t * ring, size_t capacity)
+{
+	if(capacity < 4096 || (capacity & (capacity - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	int auto_free = (NULL == ring);
+	if(NULL == ring) ring = calloc(1, sizeof(*ring));
+	assert(ring);
+	memset(ring, 0, sizeof(*ring));
+	ring->mem_fd = -1;
+	ring->event_fd = -1;
+	ring->control_fd = -1;
+
+	// sealed: the producer can neither shrink (SIGBUS in the consumer) nor grow the ring
+	size_t map_size = SHM_RING_HEADER_SIZE + capacity;
+	ring->mem_fd = memfd_create("shm-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	int rc = (ring->mem_fd < 0)?-1:0;
+	if(0 == rc) rc = ftruncate(ring->mem_fd, map_size);
+	if(0 == rc) rc = fcntl(ring->mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+	if(0 == rc) {
+		ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(ring->event_fd < 0) rc = -1;
+	}
+	if(rc || NULL == shm_ring_map(ring, ring->mem_fd, map_size)) {
+		perror("shm_ring_create()");
+		shm_ring_cleanup(ring);
+		if(auto_free) free(ring);
+		return NULL;
+	}
+
+	ring->capacity = capacity;
+	ring->hdr->capacity = capacity;
+	ring->hdr->version = SHM_RING_VERSION;
+	__atomic_store_n(&ring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+ssize_t shm_ring_drain(shm_ring_t * ring, size_t max_records, shm_ring_on_record_fn on_record, void * user_data)
+{
+	const uint64_t capacity = ring->capacity;
+	uint64_t tail = ring->pos;
+	uint64_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+	if((head - tail) > capacity || (head & 7)) return -1;
+
+	ssize_t count = 0;
+	while(tail != head && (size_t)count < max_records) {
+		// the producer may be hostile: copy the record header once, then check it against the ring bounds
+		uint64_t offset = tail & (capacity - 1);
+		uint64_t room = capacity - offset;
+		struct shm_ring_record rec;
+		memcpy(&rec, ring->data + offset, sizeof(rec));
+
+		if(rec.flags & SHM_RING_RECORD_PADDING) {
+			if((head - tail) < room) return -1;
+			tail += room;
+			continue;
+		}
+
+		uint64_t cb_record = SHM_RING_ALIGN(sizeof(rec) + (uint64_t)rec.topic_length + rec.length);
+		if(cb_record > room || cb_record > (head - tail)) return -1;
+
+		const char * topic = (const char *)ring->data + offset + sizeof(rec);
+		if(on_record) on_record(user_data, topic, rec.topic_length, topic + rec.topic_length, rec.length);
+		tail += cb_record;
+		++count;
+	}
+
+	ring->pos = tail;
+	__atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_RELEASE);
+	return count;
+}
+
+int shm_ring_prepare_wait(shm_ring_t * ring)
+{
+	// pairs with shm_ring_push(): (store head; fence; load consumer_waiting)
+	__atomic_store_n(&ring->hdr->consumer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE) == ring->pos) return 1;
+
+	__atomic_store_n(&ring->hdr->consumer_waiting, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void shm_ring_cancel_wait(shm_ring_t * ring)
+{
+	if(__atomic_load_n(&ring->hdr->consumer_waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->hdr->consumer_waiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+int shm_ring_send_fds(int sock, const shm_ring_t * ring)
+{
+	struct shm_ring_hello hello = { .magic = SHM_RING_MAGIC, .version = SHM_RING_VERSION };
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+
+	int fds[2] = { ring->mem_fd, ring->event_fd };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	}control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t cb = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	return (cb == (ssize_t)sizeof(hello))?0:-1;
+}
+
+/********************************************************
+* producer
+********************************************************/
+shm_ring_t * shm_ring_attach(shm_ring_t * ring, int mem_fd, int event_fd)
+{
+	struct stat st[1];
+	if(fstat(mem_fd, st) || st->st_size <= SHM_RING_HEADER_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int auto_free = (NULL == ring);
+	if(NULL == ring) ring = calloc(1, sizeof(*ring));
+	assert(ring);
+	memset(ring, 0, sizeof(*ring));
+	ring->control_fd = -1;
+
+	if(NULL == shm_ring_map(ring, mem_fd, st->st_size)) {
+		if(auto_free) free(ring);
+		return NULL;
+	}
+
+	struct shm_ring_header * hdr = ring->hdr;
+	uint64_t capacity = hdr->capacity;
+	if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION
+		|| capacity != (uint64_t)(st->st_size - SHM_RING_HEADER_SIZE)) {
+		munmap(hdr, ring->map_size);
+		if(auto_free) free(ring);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	ring->capacity = capacity;
+	ring->mem_fd = mem_fd;
+	ring->event_fd = event_fd;
+	ring->pos = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	return ring;
+}
+
+shm_ring_t * shm_ring_connect(shm_ring_t * ring, const char * control_path)
+{
+	struct sockaddr_un addr[1];
+	memset(addr, 0, sizeof(addr));
+	addr->sun_family = AF_UNIX;
+	if(NULL == control_path || strlen(control_path) >= sizeof(addr->sun_path)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	strcpy(addr->sun_path, control_path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0) return NULL;
+	if(connect(sock, (struct sockaddr *)addr, sizeof(addr))) {
+		close(sock);
+		return NULL;
+	}
+
+	struct shm_ring_hello hello;
+	memset(&hello, 0, sizeof(hello));
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+	}control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t cb = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	int fds[2] = { -1, -1 };
+	struct cmsghdr * cmsg = (cb > 0)?CMSG_FIRSTHDR(&msg):NULL;
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	}
+	if(cb != (ssize_t)sizeof(hello) || hello.magic != SHM_RING_MAGIC || fds[0] < 0 || fds[1] < 0) {
+		if(fds[0] >= 0) close(fds[0]);
+		if(fds[1] >= 0) close(fds[1]);
+		close(sock);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	shm_ring_t * result = shm_ring_attach(ring, fds[0], fds[1]);
+	if(NULL == result) {
+		close(fds[0]);
+		close(fds[1]);
+		close(sock);
+		return NULL;
+	}
+	result->control_fd = sock;
+	return result;
+}
+
+int shm_ring_push(shm_ring_t * ring, const char * topic, const void * data, size_t length)
+{
+	size_t cb_topic = topic?strlen(topic):0;
+	if(0 == cb_topic || cb_topic > SHM_RING_MAX_TOPIC_LENGTH || (NULL == data && length > 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const uint64_t capacity = ring->capacity;
+	uint64_t cb_record = SHM_RING_ALIGN(sizeof(struct shm_ring_record) + cb_topic + length);
+	if(length > UINT32_MAX || cb_record > capacity / 4) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	uint64_t head = ring->pos;
+	uint64_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+	uint64_t offset = head & (capacity - 1);
+	uint64_t room = capacity - offset;
+	uint64_t cb_needed = (room < cb_record)?(room + cb_record):cb_record;
+	if((head + cb_needed - tail) > capacity) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct shm_ring_record rec;
+	if(room < cb_record) {
+		// fill the end of the ring, (room is a multiple of 8, >= sizeof(rec))
+		memset(&rec, 0, sizeof(rec));
+		rec.flags = SHM_RING_RECORD_PADDING;
+		memcpy(ring->data + offset, &rec, sizeof(rec));
+		head += room;
+		offset = 0;
+	}
+
+	rec.length = (uint32_t)length;
+	rec.topic_length = (uint16_t)cb_topic;
+	rec.flags = 0;
+	unsigned char * p = ring->data + offset;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), topic, cb_topic);
+	if(length > 0) memcpy(p + sizeof(rec) + cb_topic, data, length);
+	head += cb_record;
+
+	ring->pos = head;
+	__atomic_store_n(&ring->hdr->head, head, __ATOMIC_RELEASE);
+
+	// pairs with shm_ring_prepare_wait(): wake the consumer only if it is (going to be) asleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->hdr->consumer_waiting, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(&ring->hdr->consumer_waiting, 0, __ATOMIC_RELAXED)) {
+		uint64_t n = 1;
+		ssize_t cb = write(ring->event_fd, &n, sizeof(n));
+		(void)cb;
+	}
+	return 0;
+}
+
+void shm_ring_cleanup(shm_ring_t * ring)
+{
+	if(NULL == ring) return;
+	if(ring->hdr) munmap(ring->hdr, ring->map_size);
+	ring->hdr = NULL;
+	ring->data = NULL;
+	if(ring->mem_fd >= 0) close(ring->mem_fd);
+	if(ring->event_fd >= 0) close(ring->event_fd);
+	if(ring->control_fd >= 0) close(ring->control_fd);
+	ring->mem_fd = -1;
+	ring->event_fd = -1;
+	ring->control_fd = -1;
+}
+
+
+#if defined(_TEST_SHM_RING) && defined(_STAND_ALONE)
+#include <pthread.h>
+#include <poll.h>
+
+#define NUM_EVENTS (1000000)
+struct consumer_context
+{
+	shm_ring_t * ring;
+	long count;
+	long errors;
+};
+
+static int on_record(void * user_data, const char * topic, size_t cb_topic, const void * data, size_t length)
+{
+	struct consumer_context * ctx = user_data;
+	long seq = -1;
+	if(cb_topic != 4 || memcmp(topic, "test", 4) != 0 || length != sizeof(seq)) ++ctx->errors;
+	else memcpy(&seq, data, sizeof(seq));
+	if(seq != ctx->count) ++ctx->errors;
+	++ctx->count;
+	return 0;
+}
+
+static void * consumer_thread(void * user_data)
+{
+	struct consumer_context * ctx = user_data;
+	shm_ring_t * ring = ctx->ring;
+	while(ctx->count < NUM_EVENTS) {
+		uint64_t n = 0;
+		ssize_t cb = read(ring->event_fd, &n, sizeof(n));
+		(void)cb;
+		ssize_t rc = shm_ring_drain(ring, 1024, on_record, ctx);
+		assert(rc >= 0);
+		if(rc > 0 || !shm_ring_prepare_wait(ring)) continue;
+
+		struct pollfd pfd = { .fd = ring->event_fd, .events = POLLIN };
+		poll(&pfd, 1, 1000);
+	}
+	return ctx;
+}
+
+int main(int argc, char **argv)
+{
+	shm_ring_t consumer[1], producer[1];
+	assert(shm_ring_create(consumer, 1 << 16));
+	assert(shm_ring_attach(producer, dup(consumer->mem_fd), dup(consumer->event_fd)));
+
+	// single-threaded: wrap-around and padding records
+	char payload[1000];
+	memset(payload, 'x', sizeof(payload));
+	for(int i = 0; i < 1000; ++i) {
+		assert(0 == shm_ring_push(producer, "t1", payload, 1 + (i * 7) % sizeof(payload)));
+		assert(1 == shm_ring_drain(consumer, 16, NULL, NULL));
+	}
+	int num_pushed = 0;
+	while(0 == shm_ring_push(producer, "t1", payload, sizeof(payload))) ++num_pushed;
+	assert(errno == EAGAIN && num_pushed > 0);
+	assert(num_pushed == shm_ring_drain(consumer, NUM_EVENTS, NULL, NULL));
+	assert(shm_ring_push(producer, "t1", payload, 1 << 15) == -1 && errno == EMSGSIZE);
+	assert(shm_ring_prepare_wait(consumer) == 1);
+
+	// spsc across threads
+	struct consumer_context ctx = { .ring = consumer };
+	pthread_t th;
+	pthread_create(&th, NULL, consumer_thread, &ctx);
+	for(long seq = 0; seq < NUM_EVENTS; ) {
+		if(0 == shm_ring_push(producer, "test", &seq, sizeof(seq))) ++seq;
+	}
+	pthread_join(th, NULL);
+	printf("consumed: %ld, errors: %ld\n", ctx.count, ctx.errors);
+	assert(ctx.count == NUM_EVENTS && 0 == ctx.errors);
+
+	shm_ring_cleanup(producer);
+	shm_ring_cleanup(consumer);
+	return 0;
+}
+#endif
@@ -0,0 +1,83 @@
+#ifndef CHLIB_SHM_RING_H_
+#define CHLIB_SHM_RING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * shm_ring: single-producer / single-consumer ring of variable-length records
+ * in a sealed memfd, shared between two processes.
+ *
+ * the consumer creates the ring and hands (mem_fd, event_fd) to the producer
+ * over a unix socket (SCM_RIGHTS), see shm_ring_send_fds() / shm_ring_connect().
+ * the producer writes the eventfd only when the consumer announced it is going to sleep,
+ * i.e. after the consumer drained the ring. a busy ring costs no syscall at all.
+ *
+ * record: [uint32 length][uint16 topic_length][uint16 flags][topic][data], padded to 8 bytes,
+ * a record never wraps: a padding record fills the end of the ring instead.
+ */
+#define SHM_RING_MAGIC (0x474e5253)	// "SRNG"
+#define SHM_RING_VERSION (1)
+#define SHM_RING_HEADER_SIZE (4096)
+#define SHM_RING_MAX_TOPIC_LENGTH (255)
+
+struct shm_ring_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;	// size of the data area, power of 2
+
+	// written by the producer
+	uint64_t head __attribute__((aligned(64)));
+
+	// written by the consumer
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t consumer_waiting;	// 1: the producer must signal event_fd
+	uint32_t reserved;
+	uint64_t num_rejected;		// records the consumer could not accept (invalid topic / data)
+};
+
+typedef struct shm_ring
+{
+	struct shm_ring_header * hdr;
+	unsigned char * data;
+	uint64_t capacity;
+	size_t map_size;
+
+	int mem_fd;
+	int event_fd;
+	int control_fd;	// producer: connection to the consumer, closing it detaches the ring
+
+	uint64_t pos;	// private copy of head (producer) or tail (consumer), never read back from shared memory
+}shm_ring_t;
+
+typedef int (* shm_ring_on_record_fn)(void * user_data,
+	const char * topic, size_t cb_topic,
+	const void * data, size_t length);
+
+// consumer
+shm_ring_t * shm_ring_create(shm_ring_t * ring, size_t capacity);
+// return the number of records consumed, -1 if the ring is corrupted
+ssize_t shm_ring_drain(shm_ring_t * ring, size_t max_records, shm_ring_on_record_fn on_record, void * user_data);
+// announce the consumer is going to sleep on event_fd,
+// return 1 if the ring is (still) empty, 0 if new records arrived meanwhile (keep draining)
+int shm_ring_prepare_wait(shm_ring_t * ring);
+void shm_ring_cancel_wait(shm_ring_t * ring);	// the consumer is polling, no need to signal
+int shm_ring_send_fds(int sock, const shm_ring_t * ring);
+
+// producer
+shm_ring_t * shm_ring_attach(shm_ring_t * ring, int mem_fd, int event_fd);
+shm_ring_t * shm_ring_connect(shm_ring_t * ring, const char * control_path);
+// return 0 on success, -1 on error: EAGAIN (ring full), EMSGSIZE (record larger than capacity / 4), EINVAL
+int shm_ring_push(shm_ring_t * ring, const char * topic, const void * data, size_t length);
+
+void shm_ring_cleanup(shm_ring_t * ring);
+
+#ifdef __cplusplus
+}
+#endif
+#endif